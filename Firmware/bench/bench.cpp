@@ -0,0 +1,1691 @@
+// bench.cpp - Micro-benchmarks for the FBus parser and encoder hot paths.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  Build on Linux:
+//    g++ -O2 -pthread -I../host -I../nokia-phone-arduino-shield -o bench bench.cpp ../host/HostSerial.cpp ../nokia-phone-arduino-shield/FBus.cpp ../nokia-phone-arduino-shield/FBusGSM.cpp
+//
+//  Run:
+//    ./bench                   all benchmarks, one JSON object per line
+//    ./bench --quick           shorter runs
+//    ./bench --file rx.bin     also parse a recorded raw RX stream
+//    ./bench --check           only the self-checks
+//    ./bench --sizes           only the RAM report
+//
+//  The self-checks run first every time: the receive ring fed by a thread
+//  standing in for the RX interrupt, the codec packing and unpacking
+//  against a bit by bit reference and translating every character of the
+//  alphabet there and back, number packing, the SMS composer, handler
+//  dispatch, recovery from line faults and alerts from a template, with
+//  the default FBus and again with a small FBusSized, then numbers and the
+//  composer with frames too small for the submit header, some of them
+//  sized so the user data length starts a frame.  It exits with 1 when
+//  anything differs.
+//
+//  The RAM report has a line for each of a few FBusSized configurations:
+//  the frame storage, the whole object and the FBusCore part of it.  The
+//  code is FBusCore's whatever the size, a configuration adds no flash but
+//  its constructor.  Built for AVR it reports the target's sizes.
+//
+//  The _direct lines run the same through FBusOn<FBusSerialPort<MemSerial> >,
+//  the transport's per-byte calls inlined rather than made through
+//  Stream, see FBusPort.h.
+//
+//  Add -DFBUS_ENABLE_STATS to time the library with its link statistics
+//  compiled in.  With -DFBUS_ENABLE_RX_RING only the ring check runs, its
+//  thread then feeds frames through ReceiveByteISR() to process().
+//
+//  Each line has the bytes handled per run, bytes/sec, nanoseconds and
+//  cycles per byte, and the heap allocations made while timing.
+//
+//  On AVR build this file into a sketch together with the library, it
+//  then prints cycles per byte over Serial using Timer1, see cycles.h.
+
+#include "Arduino.h"
+#include "FBus.h"
+#include "cycles.h"
+
+#ifndef __AVR__
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+#endif
+
+// Benchmarks reach the private hot paths through this friend of FBusCore
+class FBusBench {
+    public:
+        static void parse(FBusCore & fb, const uint8_t * buf, size_t len, packet_t * pkt, unsigned long * frames)
+        {
+            for(size_t x=0;x<len;x++)
+            {
+                fb.processIncomingByte(buf[x],pkt);
+                if(fb.m_rx.input_state == 0 && pkt->packet_state != PACKET_STATE_RECEIVING)
+                {
+                    if(pkt->packet_state == PACKET_STATE_NEW) (*frames)++;
+                    pkt->packet_state = PACKET_STATE_EMPTY;
+                }
+            }
+        }
+        static void parseSpans(FBusCore & fb, const uint8_t * buf, size_t len, packet_t * pkt, unsigned long * frames)
+        {
+            while(len)
+            {
+                size_t n = fb.rxWant(pkt);
+                if(n > len) n = len;
+                fb.processIncoming(buf,n,pkt);
+                buf += n;
+                len -= n;
+                if(fb.m_rx.input_state == 0 && pkt->packet_state != PACKET_STATE_RECEIVING)
+                {
+                    if(pkt->packet_state == PACKET_STATE_NEW) (*frames)++;
+                    pkt->packet_state = PACKET_STATE_EMPTY;
+                }
+            }
+        }
+        static void send(FBusCore & fb, const packet_t * pkt)
+        {
+            fb.packetSend(pkt,0x40);
+        }
+        static void octetPack(FBusCore & fb, const char * num, fbus_number_t * out)
+        {
+            fb.octetPack(num,NUMTYPE_UNKNOWN,out);
+        }
+        static uint16_t numberHash(FBusCore & fb, const char * num)
+        {
+            return fb.numberHash(num);
+        }
+        static uint16_t numberHash(FBusCore & fb, const fbus_number_t * num)
+        {
+            return fb.numberHash(num);
+        }
+        // A queued frame, 0 the oldest
+        static const fbus_tx_slot_t & txSlot(FBusCore & fb, uint8_t x)
+        {
+            return *fb.txSlot((fb.m_tx_head+x)%fb.m_tx_slots);
+        }
+        // Put the oldest queued frame on the wire again, as a resend does
+        static void txResend(FBusCore & fb)
+        {
+            fb.slotSend(fb.txSlot(fb.m_tx_head));
+        }
+        #ifdef FBUS_ENABLE_RX_RING
+        // The receive ring has no room, the producer side of it
+        static bool ringFull(FBusCore & fb)
+        {
+            return fb.m_rx_ring.full();
+        }
+        #endif
+        // Forget every queued frame, so send calls can be timed back to back
+        static void txDrop(FBusCore & fb)
+        {
+            for(uint8_t x=0;x<fb.m_tx_slots;x++) fb.txSlot(x)->state = 0;
+            fb.m_tx_head = 0;
+            fb.m_tx_count = 0;
+        }
+};
+
+// The byte at a time packer the GSM codec replaced, kept as the baseline.
+// It reads buffer[length] and does not translate to the GSM alphabet.
+static uint8_t legacy_bitpack(uint8_t * buffer, uint8_t length)
+{
+    uint8_t holder;
+    uint8_t bucket;
+    uint8_t x=0,shifted=0,i;
+
+    for(i = 0; i < length; i++ )
+    {
+        holder = buffer[i] & 0x7f;
+        holder >>= shifted;
+        bucket = buffer[i+1] & 0x7f;
+        bucket <<= (7-shifted);
+        shifted += 1;
+        holder = holder | bucket;
+        if (shifted >= 7) {
+            shifted = 0;
+            i++;
+        }
+        buffer[x] = holder;
+        x++;
+    }
+
+    return x;
+}
+
+// Build one frame from the phone with a block of 'block' bytes, returns
+// the wire length.  The block starts with the usual 0x00 0x01 header.
+static size_t bench_frame(uint8_t * wire, uint8_t type, size_t block, uint8_t seq, bool corrupt,
+                          uint8_t togo = 1)
+{
+    size_t n = 0;
+    size_t flen = block + 2;
+    uint8_t even = 0, odd = 0;
+    wire[n++] = 0x1E;
+    wire[n++] = 0x0C;
+    wire[n++] = 0x00;
+    wire[n++] = type;
+    wire[n++] = flen >> 8;
+    wire[n++] = flen & 0xFF;
+    for(size_t x=0;x<block;x++) wire[n++] = x < 2 ? x : (uint8_t)(x*37+11);
+    wire[n++] = togo;
+    wire[n++] = seq;
+    if(flen&1) wire[n++] = 0x00;
+    for(size_t x=0;x<n;x++)
+    {
+        if(x&1) odd ^= wire[x];
+        else even ^= wire[x];
+    }
+    wire[n++] = even;
+    wire[n++] = corrupt ? odd ^ 0xFF : odd;
+    return n;
+}
+
+#ifndef __AVR__
+
+// Allocation counting, everything goes through malloc in the end
+static unsigned long g_allocs = 0;
+extern "C" void * __libc_malloc(size_t);
+extern "C" void * __libc_calloc(size_t,size_t);
+extern "C" void * __libc_realloc(void*,size_t);
+extern "C" void __libc_free(void*);
+extern "C" void * malloc(size_t n) { g_allocs++; return __libc_malloc(n); }
+extern "C" void * calloc(size_t c, size_t n) { g_allocs++; return __libc_calloc(c,n); }
+extern "C" void * realloc(void * p, size_t n) { g_allocs++; return __libc_realloc(p,n); }
+extern "C" void free(void * p) { __libc_free(p); }
+
+// A serial port reading from memory and counting what is written
+static uint64_t now_ns();
+
+class MemSerial : public HardwareSerial {
+    public:
+        MemSerial() : written(0), watch(false), first_ns(0), last_len(0), m_buf(NULL), m_len(0), m_pos(0) {}
+        void load(const uint8_t * buf, size_t len) { m_buf = buf; m_len = len; m_pos = 0; }
+        virtual int available() { return (int)(m_len - m_pos); }
+        virtual int read() { return m_pos < m_len ? m_buf[m_pos++] : -1; }
+        virtual int peek() { return m_pos < m_len ? m_buf[m_pos] : -1; }
+        virtual size_t write(uint8_t b) { (void)b; written++; return 1; }
+        virtual size_t write(const uint8_t * buf, size_t len)
+        {
+            written += len;
+            if(watch)
+            {
+                if(first_ns == 0) first_ns = now_ns();
+                last_len = len < sizeof(last) ? len : sizeof(last);
+                memcpy(last,buf,last_len);
+            }
+            return len;
+        }
+        using HardwareSerial::write;
+        unsigned long written;
+        // With watch set, the time of the first write since first_ns was
+        // cleared and the start of the last one
+        bool watch;
+        uint64_t first_ns;
+        uint8_t last[FBUS_TX_FRAME_MAX];
+        size_t last_len;
+    private:
+        const uint8_t * m_buf;
+        size_t m_len;
+        size_t m_pos;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned g_min_ms = 200;
+
+// Time fn() until at least g_min_ms passed and print one JSON line.
+// 'bytes' is how many input bytes one call of fn() handles.
+template<typename F>
+static void bench_run(const char * name, size_t bytes, F fn)
+{
+    unsigned long iters = 0;
+    fn();   // Warm up
+    unsigned long allocs = g_allocs;
+    uint64_t t0 = now_ns();
+    bench_cycles_t c0 = bench_cycles();
+    uint64_t t1;
+    do {
+        for(int x=0;x<16;x++) fn();
+        iters += 16;
+        t1 = now_ns();
+    } while(t1 - t0 < (uint64_t)g_min_ms*1000000ULL);
+    bench_cycles_t c1 = bench_cycles();
+    allocs = g_allocs - allocs;
+
+    double total = (double)bytes*iters;
+    printf("{\"bench\":\"%s\",\"bytes\":%zu,\"iters\":%lu,\"bytes_per_s\":%.0f,"
+           "\"ns_per_byte\":%.3f,\"cycles_per_byte\":%.3f,\"allocs\":%lu}\n",
+           name,bytes,iters,total*1e9/(t1-t0),(t1-t0)/total,(c1-c0)/total,allocs);
+    fflush(stdout);
+    return;
+}
+
+enum { STREAM_VALID, STREAM_CORRUPT, STREAM_RESYNC };
+static const char * const stream_names[] = { "valid", "corrupt", "resync" };
+
+// About 'target' bytes of frames with 'block' byte blocks.  Resync streams
+// put noise, stray FrameIDs and cut off frames between the good ones.
+static std::vector<uint8_t> bench_stream(int kind, size_t block, size_t target)
+{
+    std::vector<uint8_t> out;
+    uint8_t wire[512];
+    unsigned seed = 7;
+    uint8_t seq = 0;
+    while(out.size() < target)
+    {
+        size_t n = bench_frame(wire,0x02,block,0x40|(seq++&7),kind == STREAM_CORRUPT);
+        if(kind == STREAM_RESYNC)
+        {
+            seed = seed*1103515245u + 12345u;
+            unsigned noise = (seed >> 16) % 17;
+            for(unsigned x=0;x<noise;x++) out.push_back(x == 3 ? 0x1E : (uint8_t)(seed >> (x&7)));
+            if(((seed >> 20) & 3) == 0) n /= 2;
+        }
+        out.insert(out.end(),wire,wire+n);
+    }
+    return out;
+}
+
+// Extension table codes, the septet after the escape
+static const uint8_t gsm7_ext[] = { 0x0A, 0x14, 0x28, 0x29, 0x2F, 0x3C, 0x3D, 0x3E, 0x40, 0x65 };
+
+// Random septets of a valid text, escapes always followed by a code of
+// the extension table
+static size_t gsm7_random(uint8_t * out, size_t n, unsigned * seed)
+{
+    size_t x = 0;
+    while(x < n)
+    {
+        *seed = *seed*1103515245u + 12345u;
+        uint8_t c = (*seed >> 16) & 0x7F;
+        if(c == 0x1B)
+        {
+            if(x+2 > n) continue;
+            out[x++] = c;
+            c = gsm7_ext[(*seed >> 24) % sizeof(gsm7_ext)];
+        }
+        out[x++] = c;
+    }
+    return x;
+}
+
+// Septet x of a packed buffer, one bit at a time
+static uint8_t gsm7_ref_get(const uint8_t * in, size_t x, unsigned fill)
+{
+    uint8_t c = 0;
+    for(unsigned b=0;b<7;b++)
+    {
+        size_t bit = fill + x*7 + b;
+        c |= ((in[bit/8] >> (bit%8)) & 1) << b;
+    }
+    return c;
+}
+
+// Numbers packed by the compiler
+static_assert(FBUS_NUMBER("1234",NUMTYPE_UNKNOWN).bcd[0] == 0x21 &&
+              FBUS_NUMBER("1234",NUMTYPE_UNKNOWN).bcd[2] == 0x00 &&
+              FBUS_NUMBER("+1 2-345",NUMTYPE_UNKNOWN).bcd[2] == 0xF5 &&
+              FBUS_NUMBER("+1 2-345",NUMTYPE_UNKNOWN).digits == 5,"FBUS_NUMBER");
+
+// Number packing and recipient directory self-check, returns the number
+// of failures
+static unsigned number_check(FBusCore & fb)
+{
+    static const struct {
+        const char * text;
+        fbus_number_t packed;
+    }numbers[] = {
+        { "15622834051", FBUS_NUMBER("15622834051",NUMTYPE_UNKNOWN) },
+        { "+86 130 1088 8500", FBUS_NUMBER("+86 130 1088 8500",NUMTYPE_UNKNOWN) },
+        { "", FBUS_NUMBER("",NUMTYPE_UNKNOWN) },
+        { "7", FBUS_NUMBER("7",NUMTYPE_UNKNOWN) },
+        { "12345678901234567890123", FBUS_NUMBER("12345678901234567890123",NUMTYPE_UNKNOWN) },
+    };
+    unsigned cases = 0, failed = 0;
+    fbus_number_t num;
+    char text[32];
+
+    // The compiler packs numbers exactly as octetPack()
+    for(size_t x=0;x<sizeof(numbers)/sizeof(numbers[0]);x++)
+    {
+        FBusBench::octetPack(fb,numbers[x].text,&num);
+        cases++;
+        if(memcmp(&num,&numbers[x].packed,sizeof(num)) ||
+           FBusBench::numberHash(fb,numbers[x].text) != FBusBench::numberHash(fb,&num))
+        {
+            failed++;
+            fprintf(stderr,"numbers: packing %s\n",numbers[x].text);
+        }
+    }
+
+    // Fill the directory, every number finds its own handle
+    fbus_recipient_t to[FBUS_DIR_SIZE];
+    for(unsigned x=0;x<FBUS_DIR_SIZE;x++)
+    {
+        snprintf(text,sizeof(text),"+1 562 283 40%02u",x);
+        to[x] = fb.AddRecipient(text,NUMTYPE_INTERNATIONAL);
+    }
+    for(unsigned x=0;x<FBUS_DIR_SIZE;x++)
+    {
+        snprintf(text,sizeof(text),"1562283 40%02u",x);
+        cases++;
+        if(to[x] == FBUS_RECIPIENT_NONE || fb.FindRecipient(text) != to[x] ||
+           fb.AddRecipient(text,NUMTYPE_INTERNATIONAL) != to[x])
+        {
+            failed++;
+            fprintf(stderr,"numbers: directory %u\n",x);
+        }
+    }
+    cases++;
+    if(fb.AddRecipient(numbers[0].packed) != FBUS_RECIPIENT_NONE ||
+       fb.FindRecipient("15622834") != FBUS_RECIPIENT_NONE)
+    {
+        failed++;
+        fprintf(stderr,"numbers: full directory\n");
+    }
+    for(unsigned x=0;x<FBUS_DIR_SIZE;x++) fb.RemoveRecipient(to[x]);
+
+    printf("{\"check\":\"numbers\",\"cases\":%u,\"failed\":%u}\n",cases,failed);
+    fflush(stdout);
+    return failed;
+}
+
+// The submit of the queued frames put back together, from the 0x00 0x01
+// the first frame gets on the wire, as the phone sees it
+static size_t compose_block(FBusCore & fb, uint8_t * block)
+{
+    size_t len = 2;
+    block[0] = 0x00;
+    block[1] = 0x01;
+    for(uint8_t x=0;x<fb.TxPending();x++)
+    {
+        const fbus_tx_slot_t & slot = FBusBench::txSlot(fb,x);
+        memcpy(&block[len],slot.pkt.data,slot.pkt.FrameLength);
+        len += slot.pkt.FrameLength;
+    }
+    return len;
+}
+
+// The composer builds the same frames from any split of the text as
+// SendSMS() does from the whole, with the SMSC and the user data length
+// where they belong however small the frames, and the checksum lanes it
+// keeps match the data.  Returns the number of failures.
+static unsigned compose_check(FBusCore & fb)
+{
+    static const char * const pieces[] = { "Pump ", "4 ", "{low}", " \xE2\x82\xAC", "12", "\xC3\xA9t\xC3\xA9", "~", "x" };
+    unsigned cases = 0, failed = 0;
+    unsigned seed = 7;
+    fbus_recipient_t to = fb.AddRecipient("15622834051",NUMTYPE_UNKNOWN);
+    static uint8_t want[2+7*FBUS_PAYLOAD_MAX], got[2+7*FBUS_PAYLOAD_MAX];
+    static uint16_t want_lanes[7];
+    size_t want_len = 0, got_len = 0;
+    char text[400];
+
+    fb.SetSMSC("8613010888500",NUMTYPE_NATIONAL);
+    for(unsigned round=0;round<400;round++)
+    {
+        size_t len = 0;
+        size_t cut[64];
+        unsigned ncut = 0;
+        bool ok;
+
+        // Random text, under and over 160 septets
+        text[0] = 0;
+        while(len < 10 + round%200 && ncut < 64)
+        {
+            const char * p = pieces[(seed = seed*1103515245u + 12345u) >> 16 & 7];
+            cut[ncut++] = len;
+            strcpy(&text[len],p);
+            len += strlen(p);
+        }
+
+        FBusBench::txDrop(fb);
+        ok = fb.SendSMS(to,text);
+        if(ok)
+        {
+            want_len = compose_block(fb,want);
+            for(uint8_t x=0;x<fb.TxPending();x++) want_lanes[x] = FBusBench::txSlot(fb,x).lanes;
+        }
+        FBusBench::txDrop(fb);
+
+        // Same text in pieces, each split point a character boundary, the
+        // last piece up to the NUL
+        bool composed = fb.SMSBegin(to);
+        size_t start = 0;
+        for(unsigned x=1;x<ncut;x++)
+        {
+            if(((seed = seed*1103515245u + 12345u) >> 16) & 1) continue;
+            composed &= fb.SMSWrite(&text[start],cut[x]-start);
+            start = cut[x];
+        }
+        composed &= fb.SMSWrite(&text[start]);
+        composed &= fb.SMSEnd();
+
+        cases++;
+        bool same = composed == ok;
+        if(ok && same)
+        {
+            got_len = compose_block(fb,got);
+            same = got_len == want_len && !memcmp(got,want,got_len) &&
+                   got[FBUS_SUBMIT_SMSC] == 8 && got[FBUS_SUBMIT_UDL] == gsm7Length(text,len);
+            for(uint8_t x=0;x<fb.TxPending();x++)
+            {
+                const fbus_tx_slot_t & slot = FBusBench::txSlot(fb,x);
+                uint16_t lanes = 0;
+                for(uint16_t k=0;k<slot.pkt.FrameLength;k++)
+                    lanes ^= slot.pkt.data[k] << ((k & 1) << 3);
+                if(slot.lanes != lanes || slot.lanes != want_lanes[x]) same = false;
+            }
+        }
+        if(!same)
+        {
+            failed++;
+            fprintf(stderr,"compose: round %u\n",round);
+        }
+    }
+    FBusBench::txDrop(fb);
+    fb.RemoveRecipient(to);
+
+    printf("{\"check\":\"compose\",\"cases\":%u,\"failed\":%u}\n",cases,failed);
+    fflush(stdout);
+    return failed;
+}
+
+// Codec self-check, returns the number of failures
+static unsigned gsm7_check()
+{
+    unsigned seed = 11, cases = 0, failed = 0;
+    uint8_t sep[320], back[320], packed[300], stream[300], legacy[322];
+    char text[1024];
+
+    // Packing against the bit by bit reference, in one go and in pieces
+    for(size_t n=0;n<=300;n++)
+    {
+        for(unsigned fill=0;fill<8;fill++)
+        {
+            gsm7_random(sep,n,&seed);
+            memset(packed,0xEE,sizeof(packed));
+            size_t c = gsm7Pack(sep,n,packed,fill);
+            bool ok = c == (fill + n*7 + 7)/8;
+            for(unsigned b=0;b<fill && ok;b++) ok = !((packed[0] >> b) & 1);
+            for(size_t x=0;x<n && ok;x++) ok = gsm7_ref_get(packed,x,fill) == sep[x];
+
+            gsm7_pack_t st;
+            size_t s = 0, w = 0;
+            gsm7PackBegin(&st,fill);
+            while(s < n)
+            {
+                seed = seed*1103515245u + 12345u;
+                size_t k = (seed >> 16) % 21;
+                if(k > n-s) k = n-s;
+                w += gsm7PackWrite(&st,&sep[s],k,&stream[w]);
+                s += k;
+            }
+            w += gsm7PackEnd(&st,&stream[w]);
+            ok = ok && w == c && !memcmp(stream,packed,c);
+
+            memset(back,0xEE,sizeof(back));
+            gsm7Unpack(packed,n,back,fill);
+            ok = ok && !memcmp(back,sep,n) && back[n] == 0xEE;
+            cases++;
+            if(!ok)
+            {
+                failed++;
+                fprintf(stderr,"gsm7: pack n=%zu fill=%u\n",n,fill);
+            }
+        }
+    }
+
+    // The old packer agrees on plain letters and digits
+    for(size_t n=1;n<=160;n++)
+    {
+        for(size_t x=0;x<n;x++) legacy[x] = "abcdefghijklmnopqrstuvwxyz0123456789"[(x*7+n)%36];
+        legacy[n] = 0;
+        uint16_t k;
+        gsm7Encode((const char*)legacy,n,sep,sizeof(sep),&k);
+        size_t c = gsm7Pack(sep,k,packed,0);
+        cases++;
+        if(legacy_bitpack(legacy,n) != c || memcmp(legacy,packed,c))
+        {
+            failed++;
+            fprintf(stderr,"gsm7: legacy n=%zu\n",n);
+        }
+    }
+
+    // Every septet and escape to UTF-8 and back
+    for(unsigned r=0;r<2000;r++)
+    {
+        size_t n = gsm7_random(sep,1+r%200,&seed);
+        uint16_t t = gsm7Decode(sep,n,text,sizeof(text));
+        uint16_t k = 0;
+        uint16_t used = gsm7Encode(text,t,back,sizeof(back),&k);
+        cases++;
+        if(t >= sizeof(text) || text[t] != 0 || used != t || k != n || memcmp(back,sep,n) ||
+           gsm7Length(text,t) != n)
+        {
+            failed++;
+            fprintf(stderr,"gsm7: round trip r=%u\n",r);
+        }
+    }
+
+    // Characters outside the alphabet, and an escape never split
+    {
+        static const struct {
+            const char * text;
+            uint16_t max;
+            uint16_t used;
+            const char * septets;
+        }cases_fixed[] = {
+            { "a`b", 10, 3, "a?b" },
+            { "\xE2\x82\xAC", 10, 3, "\x1B\x65" },
+            { "ab{", 3, 2, "ab" },
+            { "\xC3\xA9\xFF", 10, 3, "\x05?" },
+            { "\xCE\xA9x", 10, 3, "\x15x" },
+            { "\xC3", 10, 1, "?" },
+        };
+        for(size_t x=0;x<sizeof(cases_fixed)/sizeof(cases_fixed[0]);x++)
+        {
+            uint16_t k;
+            uint16_t len = strlen(cases_fixed[x].text);
+            uint16_t used = gsm7Encode(cases_fixed[x].text,len,sep,cases_fixed[x].max,&k);
+            cases++;
+            if(used != cases_fixed[x].used || k != strlen(cases_fixed[x].septets) ||
+               memcmp(sep,cases_fixed[x].septets,k))
+            {
+                failed++;
+                fprintf(stderr,"gsm7: fixed case %zu\n",x);
+            }
+        }
+    }
+
+    printf("{\"check\":\"gsm7\",\"cases\":%u,\"failed\":%u}\n",cases,failed);
+    fflush(stdout);
+    return failed;
+}
+
+// Handler tables for the dispatch check and benchmark.  Each handler
+// counts into the bench_rx_t passed as the context.
+typedef struct {
+    unsigned calls[256];
+    unsigned fallback;
+    unsigned bytes;
+}bench_rx_t;
+
+static void bench_on(void * ctx, const fbus_msg_t * msg)
+{
+    bench_rx_t * rx = (bench_rx_t*)ctx;
+    rx->calls[msg->MsgType]++;
+    rx->bytes += msg->length;
+}
+
+static void bench_on_other(void * ctx, const fbus_msg_t * /*msg*/)
+{
+    ((bench_rx_t*)ctx)->fallback++;
+}
+
+#define BENCH_ON8(t) FBUS_ON((t),bench_on), FBUS_ON((t)+1,bench_on), FBUS_ON((t)+2,bench_on), \
+    FBUS_ON((t)+3,bench_on), FBUS_ON((t)+4,bench_on), FBUS_ON((t)+5,bench_on), \
+    FBUS_ON((t)+6,bench_on), FBUS_ON((t)+7,bench_on)
+
+FBUS_HANDLERS(bench_handlers_1,bench_on_other,
+    FBUS_ON(0x10,bench_on));
+FBUS_HANDLERS(bench_handlers_64,bench_on_other,
+    BENCH_ON8(0x10), BENCH_ON8(0x18), BENCH_ON8(0x20), BENCH_ON8(0x28),
+    BENCH_ON8(0x30), BENCH_ON8(0x38), BENCH_ON8(0x40), BENCH_ON8(0x48));
+FBUS_HANDLERS(bench_handlers_fifo,NULL,
+    FBUS_ON(0x10,bench_on), FBUS_ON(0x02,bench_on));
+
+static_assert(bench_handlers_64.fn[0x4F] == bench_on && bench_handlers_64.fn[0x50] == bench_on_other &&
+              bench_handlers_fifo.fn[0x11] == NULL,"FBUS_HANDLERS");
+
+// One frame of each of 64 MsgTypes, 0x10 to 0x4F, with 'block' byte blocks
+static std::vector<uint8_t> bench_types(size_t block, size_t target)
+{
+    std::vector<uint8_t> out;
+    uint8_t wire[512];
+    uint8_t seq = 0;
+    while(out.size() < target)
+    {
+        size_t n = bench_frame(wire,0x10+(seq*37)%64,block,0x40|(seq&7),false);
+        seq++;
+        out.insert(out.end(),wire,wire+n);
+    }
+    return out;
+}
+
+// Handler dispatch from process(): every frame reaches the handler of its
+// type or the fallback, types without either stay on the FIFO, and a
+// multi-frame message is handed over once, whole.  Returns the number of
+// failures.
+static unsigned dispatch_check(FBusCore & fb, MemSerial & mem)
+{
+    static bench_rx_t rx;
+    unsigned cases = 0, failed = 0;
+    std::vector<uint8_t> s = bench_types(16,4096);
+    size_t frames = s.size()/(6+16+2+2);
+    uint8_t wire[512];
+    size_t n = 0;
+    fbus_msg_t msg;
+
+    // Every type listed
+    memset(&rx,0,sizeof(rx));
+    fb.initialize();
+    fb.SetHandlers(&bench_handlers_64,&rx);
+    mem.load(s.data(),s.size());
+    while(mem.available()) fb.process();
+    cases++;
+    unsigned total = 0;
+    for(unsigned t=0x10;t<0x50;t++) total += rx.calls[t];
+    if(total != frames || rx.fallback || rx.bytes != frames*16 || fb.PacketsWaiting())
+    {
+        failed++;
+        fprintf(stderr,"dispatch: 64 types, %u of %zu\n",total,frames);
+    }
+
+    // One listed, the rest to the fallback
+    memset(&rx,0,sizeof(rx));
+    fb.SetHandlers(&bench_handlers_1,&rx);
+    mem.load(s.data(),s.size());
+    while(mem.available()) fb.process();
+    cases++;
+    if(rx.calls[0x10] + rx.fallback != frames || rx.calls[0x10] == 0 || fb.PacketsWaiting())
+    {
+        failed++;
+        fprintf(stderr,"dispatch: fallback\n");
+    }
+
+    // No fallback, a three frame message and a frame nobody handles; the
+    // last comes out of PopMessage()
+    memset(&rx,0,sizeof(rx));
+    fb.SetHandlers(&bench_handlers_fifo,&rx);
+    n = bench_frame(wire,0x10,40,0x40,false,3);
+    n += bench_frame(&wire[n],0x10,40,0x01,false,2);
+    n += bench_frame(&wire[n],0x10,40,0x02,false,1);
+    n += bench_frame(&wire[n],0x11,16,0x43,false);
+    mem.load(wire,n);
+    while(mem.available()) fb.process();
+    cases++;
+    if(rx.calls[0x10] != 1 || rx.bytes != 120 || !fb.PopMessage(&msg) || msg.MsgType != 0x11 ||
+       fb.PacketsWaiting())
+    {
+        failed++;
+        fprintf(stderr,"dispatch: message and FIFO\n");
+    }
+    fb.SetHandlers(NULL,NULL);
+
+    printf("{\"check\":\"dispatch\",\"cases\":%u,\"failed\":%u}\n",cases,failed);
+    fflush(stdout);
+    return failed;
+}
+
+// Frames of the resync check, where each came out
+typedef struct {
+    std::vector<size_t> got;
+    MemSerial * mem;
+    size_t len;
+}bench_resync_t;
+
+static void bench_on_resync(void * ctx, const fbus_msg_t * msg)
+{
+    bench_resync_t * rx = (bench_resync_t*)ctx;
+    unsigned id = (msg->data[2] << 8) | msg->data[3];
+    if(msg->length >= 4 && id < rx->got.size()) rx->got[id] = rx->len - rx->mem->available();
+}
+
+FBUS_HANDLERS(bench_handlers_resync,NULL,
+    FBUS_ON(0x10,bench_on_resync));
+
+// Recovery from faults on the line, through process().  Frames numbered
+// in their block, a fault in front of about one in three: a frame cut
+// short, a header with a bad length, or noise full of header bytes.
+// Counts the good frames lost and the time from the end of a fault to
+// the next frame out at 115200 baud, 86.8 us a byte.  The ideal is the
+// length of the frame after the fault.  Cut frames and bad lengths must
+// cost no good frame.  Then a frame cut short, a quiet line, and a frame
+// that must arrive whole.  Returns the number of failures.
+static unsigned resync_check(FBusCore & fb, MemSerial & mem)
+{
+    static bench_resync_t rx;
+    unsigned cases = 0, failed = 0;
+    uint8_t wire[512];
+    fbus_msg_t msg;
+    size_t n;
+
+    for(int noise=0;noise<2;noise++)
+    {
+        std::vector<uint8_t> s;
+        std::vector<size_t> fault_end, frame_end;
+        const unsigned frames = 2048;
+        unsigned seed = 11 + noise;
+        for(unsigned i=0;i<frames;i++)
+        {
+            seed = seed*1103515245u + 12345u;
+            unsigned kind = (seed >> 16) % 6;
+            if(kind == 0)
+            {
+                n = bench_frame(wire,0x70,(seed >> 8) % 120,0x40,false);
+                s.insert(s.end(),wire,wire + 1 + (seed >> 4) % (n-1));
+            }else if(kind == 1)
+            {
+                static const uint8_t bad[] = { 0x1E, 0x0C, 0x00, 0x70, 0x7F, 0xFF };
+                s.insert(s.end(),bad,bad+sizeof(bad));
+            }else if(kind == 2 && noise)
+            {
+                static const uint8_t hdr[] = { 0x1E, 0x0C, 0x00, 0x70, 0x00 };
+                for(unsigned x=0;x<1+(seed >> 8)%24;x++)
+                {
+                    seed = seed*1103515245u + 12345u;
+                    s.push_back(((seed >> 16) & 3) ? hdr[(seed >> 18) % sizeof(hdr)] : seed >> 24);
+                }
+            }
+            if(kind < 2 || (kind == 2 && noise)) fault_end.push_back(s.size());
+
+            // The number goes in block bytes 2 and 3
+            n = bench_frame(wire,0x10,4 + (seed >> 20) % 61,0x40|(i & 7),false);
+            wire[n-2] ^= wire[8] ^ (i >> 8);
+            wire[n-1] ^= wire[9] ^ (i & 0xFF);
+            wire[8] = i >> 8;
+            wire[9] = i & 0xFF;
+            s.insert(s.end(),wire,wire+n);
+            frame_end.push_back(s.size());
+        }
+
+        fb.initialize();
+        fb.SetHandlers(&bench_handlers_resync,&rx);
+        rx.got.assign(frames,0);
+        rx.mem = &mem;
+        rx.len = s.size();
+        mem.load(s.data(),s.size());
+        while(mem.available()) fb.process();
+        fb.process();
+        fb.SetHandlers(NULL,NULL);
+
+        // From each fault to the first frame out after it
+        std::vector<size_t> ends;
+        unsigned lost = 0;
+        for(unsigned i=0;i<frames;i++)
+        {
+            if(rx.got[i]) ends.push_back(rx.got[i]);
+            else lost++;
+        }
+        std::sort(ends.begin(),ends.end());
+        double sum = 0, ideal = 0, worst = 0;
+        size_t e = 0, g = 0, counted = 0;
+        for(size_t f=0;f<fault_end.size();f++)
+        {
+            while(e < ends.size() && ends[e] <= fault_end[f]) e++;
+            while(g < frame_end.size() && frame_end[g] <= fault_end[f]) g++;
+            if(e == ends.size() || g == frame_end.size()) break;
+            double us = (ends[e] - fault_end[f])*1e6/11520;
+            sum += us;
+            ideal += (frame_end[g] - fault_end[f])*1e6/11520;
+            if(us > worst) worst = us;
+            counted++;
+        }
+        cases++;
+        if(!noise && lost)
+        {
+            failed++;
+            fprintf(stderr,"resync: %u frames lost to cut frames and bad lengths\n",lost);
+        }
+        printf("{\"check\":\"resync\",\"stream\":\"%s\",\"frames\":%u,\"faults\":%zu,\"lost\":%u,"
+               "\"resyncs\":%u,\"recover_us_avg\":%.0f,\"recover_us_ideal\":%.0f,\"recover_us_max\":%.0f}\n",
+               noise ? "noise" : "cut",frames,fault_end.size(),lost,fb.GetRXStats()->resyncs,
+               counted ? sum/counted : 0.0,counted ? ideal/counted : 0.0,worst);
+    }
+
+    // Half a frame, a quiet line and then a whole one
+    fb.initialize();
+    n = bench_frame(wire,0x10,40,0x41,false);
+    mem.load(wire,n/2);
+    while(mem.available()) fb.process();
+    for(unsigned x=0;x<3;x++)
+    {
+        delay(FBUS_RX_GAP_MS);
+        fb.process();
+    }
+    n = bench_frame(wire,0x11,40,0x42,false);
+    mem.load(wire,n);
+    while(mem.available()) fb.process();
+    cases++;
+    if(fb.GetRXStats()->timeouts != 1 || !fb.PopMessage(&msg) || msg.MsgType != 0x11)
+    {
+        failed++;
+        fprintf(stderr,"resync: quiet line\n");
+    }
+
+    printf("{\"check\":\"resync\",\"cases\":%u,\"failed\":%u}\n",cases,failed);
+    fflush(stdout);
+    return failed;
+}
+
+// ACKs come from the template with the right checksums, and a frame the
+// phone sends again is ACKed again but handed up once.  Returns the
+// number of failures.
+static unsigned ack_check(FBusCore & fb, MemSerial & mem)
+{
+    static bench_rx_t rx;
+    unsigned cases = 0, failed = 0;
+    uint8_t wire[128];
+    uint8_t type, even, odd;
+    size_t n;
+
+    memset(&rx,0,sizeof(rx));
+    fb.initialize();
+    while(!fb.LinkReady()) fb.process();
+    fb.SetHandlers(&bench_handlers_64,&rx);
+    mem.watch = true;
+    for(unsigned seq=0;seq<64;seq++)
+    {
+        type = 0x10 + (seq*5)%64;
+        n = bench_frame(wire,type,16,0x40|(seq&7),false);
+        mem.load(wire,n);
+        mem.last_len = 0;
+        fb.process();
+        even = odd = 0;
+        for(unsigned x=0;x<8;x++)
+        {
+            if(x&1) odd ^= mem.last[x];
+            else even ^= mem.last[x];
+        }
+        cases++;
+        if(mem.last_len != FBUS_ACK_BYTES || mem.last[0] != 0x1E || mem.last[1] != 0x00 ||
+           mem.last[2] != 0x0C || mem.last[3] != FBUSTYPE_ACK_MSG || mem.last[4] != 0x00 ||
+           mem.last[5] != 0x02 || mem.last[6] != type || mem.last[7] != (seq&7) ||
+           mem.last[8] != even || mem.last[9] != odd)
+        {
+            failed++;
+            fprintf(stderr,"ack: type 0x%02X seq %u\n",type,seq&7);
+        }
+    }
+
+    // The same frame twice, its ACK was lost
+    n = bench_frame(wire,0x20,16,0x45,false);
+    n += bench_frame(&wire[n],0x20,16,0x45,false);
+    rx.calls[0x20] = 0;
+    mem.written = 0;
+    mem.load(wire,n);
+    while(mem.available()) fb.process();
+    cases++;
+    if(rx.calls[0x20] != 1 || mem.written != 2*FBUS_ACK_BYTES || fb.GetRXStats()->dups != 1)
+    {
+        failed++;
+        fprintf(stderr,"ack: resend handed up %u times, %lu bytes sent\n",rx.calls[0x20],mem.written);
+    }
+    mem.watch = false;
+    fb.SetHandlers(NULL,NULL);
+
+    printf("{\"check\":\"ack\",\"cases\":%u,\"failed\":%u}\n",cases,failed);
+    fflush(stdout);
+    return failed;
+}
+
+// Last frame written, false if the port saw none
+static bool bench_sent(MemSerial & mem, uint8_t * wire, size_t * len)
+{
+    if(mem.last_len < 10 || mem.last[0] != 0x1E) return false;
+    memcpy(wire,mem.last,mem.last_len);
+    *len = mem.last_len;
+    return true;
+}
+
+// An alert from a template is the frame SendSMS() makes of the same text
+// with the digits filled in, all but the SeqNo, with checksums that add
+// up and the same bytes when sent again.  The template is captured from a
+// fresh FBus as fbuspack template makes it.  Returns the number of
+// failures.
+static unsigned alert_check(FBusCore & fb, MemSerial & mem)
+{
+    static const char * const numbers[2] = { "15622834051", "+4915112345678" };
+    static const uint32_t values[4] = { 0, 7, 42, 999 };
+    static MemSerial tmem;
+    static FBus maker(tmem);
+    static uint8_t tpl[FBUS_TX_FRAME_MAX];
+    uint8_t alert_wire[FBUS_TX_FRAME_MAX], sms_wire[FBUS_TX_FRAME_MAX];
+    unsigned cases = 0, failed = 0;
+    uint8_t even, odd;
+    size_t tlen, alen, slen = 0, seq;
+    char text[32];
+    fbus_recipient_t to;
+
+    maker.initialize();
+    while(!maker.LinkReady()) maker.process();
+    tmem.watch = true;
+    tmem.last_len = 0;
+    snprintf(text,sizeof(text),"Pump 4 pressure ### kPa");
+    maker.SendSMS(text);
+    if(!bench_sent(tmem,tpl,&tlen))
+    {
+        fprintf(stderr,"alert: no template\n");
+        return 1;
+    }
+    const fbus_alert_t alert = { tpl, (uint8_t)tlen, 16, 3 };
+    seq = 6 + ((tpl[4] << 8) | tpl[5]) - 1;
+
+    fb.initialize();
+    while(!fb.LinkReady()) fb.process();
+    mem.watch = true;
+    for(unsigned smsc=0;smsc<2;smsc++)
+    {
+        if(smsc) fb.SetSMSC("",NUMTYPE_UNKNOWN);
+        else fb.SetSMSC("8613010888500",NUMTYPE_NATIONAL);
+        for(unsigned n=0;n<2;n++)
+        {
+            to = fb.AddRecipient(numbers[n],n ? NUMTYPE_INTERNATIONAL : NUMTYPE_UNKNOWN);
+            for(unsigned v=0;v<4;v++)
+            {
+                cases++;
+                mem.last_len = 0;
+                if(!fb.SendAlert(&alert,to,values[v]) || !bench_sent(mem,alert_wire,&alen))
+                {
+                    failed++;
+                    fprintf(stderr,"alert: %s %u not sent\n",numbers[n],values[v]);
+                    FBusBench::txDrop(fb);
+                    continue;
+                }
+                mem.last_len = 0;
+                FBusBench::txResend(fb);
+                cases++;
+                if(mem.last_len != alen || memcmp(mem.last,alert_wire,alen))
+                {
+                    failed++;
+                    fprintf(stderr,"alert: %s %u sent again differs\n",numbers[n],values[v]);
+                }
+                FBusBench::txDrop(fb);
+
+                snprintf(text,sizeof(text),"Pump 4 pressure %03u kPa",(unsigned)values[v]);
+                mem.last_len = 0;
+                fb.SendSMS(to,text);
+                bench_sent(mem,sms_wire,&slen);
+                FBusBench::txDrop(fb);
+
+                even = odd = 0;
+                for(size_t x=0;x<alen-2;x++)
+                {
+                    if(x&1) odd ^= alert_wire[x];
+                    else even ^= alert_wire[x];
+                }
+                cases++;
+                if(slen != alen || alert_wire[alen-2] != even || alert_wire[alen-1] != odd ||
+                   (alert_wire[seq] & 0xF8) != 0x40 || memcmp(alert_wire,sms_wire,seq) ||
+                   memcmp(&alert_wire[seq+1],&sms_wire[seq+1],alen-seq-3))
+                {
+                    failed++;
+                    fprintf(stderr,"alert: %s %u differs from the SMS\n",numbers[n],values[v]);
+                }
+            }
+        }
+    }
+
+    // Too many digits for the slot, and no such recipient
+    cases++;
+    if(fb.SendAlert(&alert,to,1000) || fb.SendAlert(&alert,FBUS_DIR_SIZE,1) || fb.TxPending())
+    {
+        failed++;
+        fprintf(stderr,"alert: bad value or recipient queued\n");
+    }
+    mem.watch = false;
+    tmem.watch = false;
+
+    printf("{\"check\":\"alert\",\"cases\":%u,\"failed\":%u}\n",cases,failed);
+    fflush(stdout);
+    return failed;
+}
+
+// What a producer thread standing in for the RX interrupt puts in a ring
+typedef struct {
+    FBusRing<64> * ring;        // Bytes straight into a ring, or
+    FBusCore * fb;              // through its ReceiveByteISR()
+    const uint8_t * buf;        // Bytes for fb
+    unsigned long len;          // Bytes, for ring a counting sequence
+    unsigned long refused;      // Pushes the full ring refused
+}bench_isr_t;
+
+static void * bench_isr(void * ctx)
+{
+    bench_isr_t * isr = (bench_isr_t*)ctx;
+    for(unsigned long x=0;x<isr->len;x++)
+    {
+        if(isr->ring)
+        {
+            while(!isr->ring->push((uint8_t)(x ^ x >> 8)))
+            {
+                isr->refused++;
+                sched_yield();
+            }
+        }
+        #ifdef FBUS_ENABLE_RX_RING
+        else
+        {
+            // A UART holds the byte in its own buffer meanwhile
+            while(FBusBench::ringFull(*isr->fb)) sched_yield();
+            isr->fb->ReceiveByteISR(isr->buf[x]);
+        }
+        #endif
+    }
+    return NULL;
+}
+
+// The receive ring with a thread pushing as the RX interrupt does and this
+// one taking the bytes out: every byte comes out in order and refused
+// pushes are counted up to 255.  Built with FBUS_ENABLE_RX_RING, frames
+// go through ReceiveByteISR() and process() the same way.  Returns the
+// number of failures.
+static unsigned ring_check(FBusCore & fb, unsigned long bytes)
+{
+    static FBusRing<64> ring;
+    bench_isr_t isr;
+    pthread_t thread;
+    unsigned cases = 0, failed = 0;
+    unsigned long got = 0, wrong = 0, refused;
+    uint8_t buf[64];
+    uint8_t n;
+    int c;
+
+    memset(&isr,0,sizeof(isr));
+    isr.ring = &ring;
+    isr.len = bytes;
+    pthread_create(&thread,NULL,bench_isr,&isr);
+    while(got < bytes)
+    {
+        // Spans as rxReadSpan() takes them, and single bytes
+        if(got & 0x100)
+        {
+            if((n = ring.read(buf,sizeof(buf))) == 0) sched_yield();
+            for(uint8_t x=0;x<n;x++,got++)
+                if(buf[x] != (uint8_t)(got ^ got >> 8)) wrong++;
+        }else if((c = ring.pop()) >= 0)
+        {
+            if(c != (uint8_t)(got ^ got >> 8)) wrong++;
+            got++;
+        }else
+        {
+            sched_yield();
+        }
+    }
+    pthread_join(thread,NULL);
+    refused = isr.refused;
+    cases++;
+    if(wrong || ring.available() ||
+       ring.overflows() != (isr.refused < 0xFF ? isr.refused : 0xFF))
+    {
+        failed++;
+        fprintf(stderr,"ring: %lu of %lu bytes wrong, %u overflows for %lu refused\n",
+                wrong,bytes,ring.overflows(),isr.refused);
+    }
+
+    #ifdef FBUS_ENABLE_RX_RING
+    static bench_rx_t rx;
+    std::vector<uint8_t> wire(2048*32);
+    size_t len = 0;
+    unsigned frames = 0;
+    uint64_t until;
+
+    memset(&rx,0,sizeof(rx));
+    for(unsigned x=0;x<2048;x++,frames++)
+        len += bench_frame(&wire[len],0x10 + x%64,16,0x40|(x&7),false);
+    fb.initialize();
+    while(!fb.LinkReady()) fb.process();
+    fb.SetHandlers(&bench_handlers_64,&rx);
+    memset(&isr,0,sizeof(isr));
+    isr.fb = &fb;
+    isr.buf = wire.data();
+    isr.len = len;
+    until = now_ns() + 5000000000ULL;
+    pthread_create(&thread,NULL,bench_isr,&isr);
+    while(rx.bytes < frames*16 && now_ns() < until)
+    {
+        fb.process();
+        sched_yield();
+    }
+    pthread_join(thread,NULL);
+    cases++;
+    if(rx.bytes != frames*16 || rx.fallback || fb.GetRXStats()->ring_overflow)
+    {
+        failed++;
+        fprintf(stderr,"ring: %u of %u frame bytes through process()\n",rx.bytes,frames*16);
+    }
+
+    // Nobody reads, what does not fit is lost and counted
+    fb.initialize();
+    for(unsigned x=0;x<FBUS_RX_RING_SIZE+300;x++) fb.ReceiveByteISR(0x55);
+    cases++;
+    if(fb.GetRXStats()->ring_overflow != 255)
+    {
+        failed++;
+        fprintf(stderr,"ring: %u overflows\n",fb.GetRXStats()->ring_overflow);
+    }
+    fb.initialize();
+    fb.SetHandlers(NULL,NULL);
+    #else
+    (void)fb;
+    #endif
+
+    printf("{\"check\":\"ring\",\"cases\":%u,\"failed\":%u,\"bytes\":%lu,\"refused\":%lu}\n",
+           cases,failed,bytes,refused);
+    fflush(stdout);
+    return failed;
+}
+
+static void bench_on_ready(void * ctx)
+{
+    (*(unsigned*)ctx)++;
+}
+
+// The bus sync runs from process(): no call writes more than a chunk of
+// 0x55, frames queued meanwhile go out after the last one, and a run of
+// bad frames from the phone starts a sync by itself unless a good frame
+// breaks it.  Returns the number of failures.
+static unsigned link_check(FBusCore & fb, MemSerial & mem)
+{
+    unsigned cases = 0, failed = 0;
+    unsigned calls = 0, ready = 0;
+    unsigned long most = 0, before;
+    uint8_t wire[64*(FBUS_SYNC_AFTER_BAD+1)];
+    size_t n = 0;
+
+    fb.initialize();
+    fb.SetLinkReadyHandler(bench_on_ready,&ready);
+    mem.load(NULL,0);
+    mem.written = 0;
+    fb.RequestHWSW(FBUS_HWSW_TIMEOUT_MS,NULL,NULL);
+    cases++;
+    if(mem.written != 0 || fb.LinkState() != FBUS_LINK_SYNCING)
+    {
+        failed++;
+        fprintf(stderr,"link: frame sent before the sync\n");
+    }
+    while(!fb.LinkReady() && calls < 1000)
+    {
+        before = mem.written;
+        fb.process();
+        if(mem.written - before > most) most = mem.written - before;
+        calls++;
+    }
+    cases++;
+    if(calls != (FBUS_SYNC_BYTES + FBUS_SYNC_CHUNK - 1)/FBUS_SYNC_CHUNK || ready != 1 ||
+       mem.written <= FBUS_SYNC_BYTES || fb.GetTXStats()->frames != 1)
+    {
+        failed++;
+        fprintf(stderr,"link: sync took %u calls, %lu bytes\n",calls,mem.written);
+    }
+
+    #if FBUS_SYNC_AFTER_BAD
+    // One short of the run, a good frame, one short again: no sync
+    for(unsigned x=0;x<FBUS_SYNC_AFTER_BAD-1;x++)
+        n += bench_frame(&wire[n],0x10,16,0x40|(x&7),true);
+    n += bench_frame(&wire[n],0x10,16,0x47,false);
+    for(unsigned x=0;x<FBUS_SYNC_AFTER_BAD-1;x++)
+        n += bench_frame(&wire[n],0x10,16,0x40|(x&7),true);
+    mem.load(wire,n);
+    while(mem.available())
+    {
+        fb.process();
+        while(fb.PopPacket() != NULL) {}
+    }
+    fb.process();
+    cases++;
+    if(!fb.LinkReady() || fb.GetTXStats()->auto_syncs != 0)
+    {
+        failed++;
+        fprintf(stderr,"link: synced with good frames coming\n");
+    }
+
+    // The whole run
+    n = 0;
+    for(unsigned x=0;x<FBUS_SYNC_AFTER_BAD;x++)
+        n += bench_frame(&wire[n],0x10,16,0x40|(x&7),true);
+    before = mem.written;
+    mem.load(wire,n);
+    while(mem.available()) fb.process();
+    cases++;
+    if(fb.GetTXStats()->auto_syncs != 1 || fb.LinkReady())
+    {
+        failed++;
+        fprintf(stderr,"link: no sync after %u bad frames\n",FBUS_SYNC_AFTER_BAD);
+    }
+    while(!fb.LinkReady()) fb.process();
+    cases++;
+    if(ready != 2 || mem.written - before < FBUS_SYNC_BYTES)
+    {
+        failed++;
+        fprintf(stderr,"link: second sync\n");
+    }
+    #endif
+    fb.SetLinkReadyHandler(NULL,NULL);
+    fb.initialize();
+
+    printf("{\"check\":\"link\",\"cases\":%u,\"failed\":%u,\"sync_calls\":%u,\"call_bytes_max\":%lu}\n",
+           cases,failed,calls,most);
+    fflush(stdout);
+    return failed;
+}
+
+// RAM of one FBusSized configuration
+template<uint8_t PAYLOAD, uint8_t RX_SLOTS, uint8_t TX_SLOTS>
+static void size_line()
+{
+    printf("{\"sizes\":\"FBusSized<%u,%u,%u>\",\"frame_bytes\":%u,\"object_bytes\":%zu,\"core_bytes\":%zu}\n",
+           PAYLOAD,RX_SLOTS,TX_SLOTS,(unsigned)FBusSized<PAYLOAD,RX_SLOTS,TX_SLOTS>::RAM_BYTES,
+           sizeof(FBusSized<PAYLOAD,RX_SLOTS,TX_SLOTS>),sizeof(FBusCore));
+}
+
+static void sizes_report()
+{
+    size_line<FBUS_PAYLOAD_MAX,FBUS_RX_SLOTS,FBUS_TX_SLOTS>();     // FBus
+    size_line<FBUS_PAYLOAD_MAX,1,2>();
+    size_line<64,1,3>();                                        // A 160 character SMS fits
+    size_line<48,1,4>();
+    size_line<FBUS_PAYLOAD_MAX,4,7>();                          // Window of 7
+    fflush(stdout);
+}
+
+int main(int argc, char ** argv)
+{
+    const char * file = NULL;
+    bool check_only = false, sizes_only = false;
+    static const size_t blocks[] = { 0, 16, 64, 120 };
+    MemSerial mem;
+    FBus fb(mem);
+    static FBusSized<64,1,3> small(mem);
+    static FBusSized<16,1,7> tiny(mem);    // The submit header spans frames
+    static FBusSized<11,1,7> tiny11(mem);  // and its user data length starts
+    static FBusSized<22,1,7> tiny22(mem);  // the second or third frame
+    static FBusOn<FBusSerialPort<MemSerial> > direct(mem);
+    char name[64];
+
+    for(int x=1;x<argc;x++)
+    {
+        if(!strcmp(argv[x],"--quick")) g_min_ms = 20;
+        else if(!strcmp(argv[x],"--file") && x+1 < argc) file = argv[++x];
+        else if(!strcmp(argv[x],"--check")) check_only = true;
+        else if(!strcmp(argv[x],"--sizes")) sizes_only = true;
+        else
+        {
+            fprintf(stderr,"usage: %s [--quick] [--check] [--sizes] [--file raw_rx_stream]\n",argv[0]);
+            return 1;
+        }
+    }
+    sizes_report();
+    if(sizes_only) return 0;
+    fb.initialize();
+    small.initialize();
+    tiny.initialize();
+    tiny11.initialize();
+    tiny22.initialize();
+    #ifdef FBUS_ENABLE_RX_RING
+    // The checks and timings below feed the serial port, which the ring
+    // takes the place of
+    return ring_check(fb,check_only ? 20000000 : 4000000) ? 1 : 0;
+    #endif
+    if(ring_check(fb,check_only ? 20000000 : 4000000) + gsm7_check() + number_check(fb) + compose_check(fb) + dispatch_check(fb,mem) +
+       resync_check(fb,mem) + link_check(fb,mem) + ack_check(fb,mem) + alert_check(fb,mem)) return 1;
+    if(number_check(small) + compose_check(small) + dispatch_check(small,mem) +
+       resync_check(small,mem) + link_check(small,mem) + ack_check(small,mem) +
+       alert_check(small,mem)) return 1;
+    if(number_check(tiny) + compose_check(tiny) + compose_check(tiny11) +
+       compose_check(tiny22)) return 1;
+    if(check_only) return 0;
+    bench_cycles_init();
+    fb.initialize();
+
+    // Parser alone, byte by byte and in spans as process() feeds it
+    for(int kind=STREAM_VALID;kind<=STREAM_RESYNC;kind++)
+    {
+        for(size_t b=0;b<sizeof(blocks)/sizeof(blocks[0]);b++)
+        {
+            std::vector<uint8_t> s = bench_stream(kind,blocks[b],16384);
+            packet_t pkt;
+            unsigned long frames = 0;
+            memset(&pkt,0,sizeof(pkt));
+            snprintf(name,sizeof(name),"rx_parse_%s_%zu",stream_names[kind],blocks[b]);
+            bench_run(name,s.size(),[&]{ FBusBench::parse(fb,s.data(),s.size(),&pkt,&frames); });
+            snprintf(name,sizeof(name),"rx_span_%s_%zu",stream_names[kind],blocks[b]);
+            bench_run(name,s.size(),[&]{ FBusBench::parseSpans(fb,s.data(),s.size(),&pkt,&frames); });
+        }
+    }
+
+    // process(), with the RX slots, FIFO and ACKs.  _direct reads the
+    // port through FBusSerialPort, its per-byte calls inlined, the others
+    // through Stream as FBus does.
+    direct.initialize();
+    for(int kind=STREAM_VALID;kind<=STREAM_RESYNC;kind++)
+    {
+        std::vector<uint8_t> s = bench_stream(kind,64,16384);
+        snprintf(name,sizeof(name),"rx_process_%s_64",stream_names[kind]);
+        bench_run(name,s.size(),[&]{
+            mem.load(s.data(),s.size());
+            while(mem.available())
+            {
+                fb.process();
+                while(fb.PopPacket() != NULL) {}
+            }
+        });
+        snprintf(name,sizeof(name),"rx_process_direct_%s_64",stream_names[kind]);
+        bench_run(name,s.size(),[&]{
+            mem.load(s.data(),s.size());
+            while(mem.available())
+            {
+                direct.process();
+                while(direct.PopPacket() != NULL) {}
+            }
+        });
+    }
+
+    // Frames of 64 MsgTypes through process() to a handler table with one
+    // or all of them listed, and the PopMessage() loop with an if-chain a
+    // sketch would otherwise write.  Bytes are wire bytes.
+    {
+        static bench_rx_t rx;
+        std::vector<uint8_t> s = bench_types(16,16384);
+        fb.SetHandlers(&bench_handlers_1,&rx);
+        bench_run("rx_dispatch_table_1_16",s.size(),[&]{
+            mem.load(s.data(),s.size());
+            while(mem.available()) fb.process();
+        });
+        fb.SetHandlers(&bench_handlers_64,&rx);
+        bench_run("rx_dispatch_table_64_16",s.size(),[&]{
+            mem.load(s.data(),s.size());
+            while(mem.available()) fb.process();
+        });
+        fb.SetHandlers(NULL,NULL);
+        volatile uint8_t types[64];
+        for(unsigned x=0;x<64;x++) types[x] = 0x10+x;
+        bench_run("rx_dispatch_chain_64_16",s.size(),[&]{
+            fbus_msg_t msg;
+            mem.load(s.data(),s.size());
+            while(mem.available())
+            {
+                fb.process();
+                while(fb.PopMessage(&msg))
+                {
+                    for(unsigned x=0;x<64;x++)
+                        if(msg.MsgType == types[x]) { bench_on(&rx,&msg); break; }
+                }
+            }
+        });
+    }
+
+    // A frame in to its ACK handed to the port, through process().  The
+    // time includes reading and parsing the frame, one frame a call.
+    {
+        static bench_rx_t rx;
+        fb.initialize();
+        while(!fb.LinkReady()) fb.process();
+        fb.SetHandlers(&bench_handlers_64,&rx);
+        mem.watch = true;
+        for(size_t b=0;b<sizeof(blocks)/sizeof(blocks[0]);b++)
+        {
+            const unsigned frames = 4096;
+            uint8_t wire[FBUS_PAYLOAD_MAX+16];
+            uint64_t t0, ns, sum = 0, least = ~0ULL;
+            size_t n;
+            if(blocks[b] > FBUS_PAYLOAD_MAX - 2) continue;
+            for(unsigned x=0;x<frames;x++)
+            {
+                n = bench_frame(wire,0x10+x%64,blocks[b],0x40|(x&7),false);
+                mem.load(wire,n);
+                mem.first_ns = 0;
+                t0 = now_ns();
+                fb.process();
+                ns = mem.first_ns - t0;
+                sum += ns;
+                if(ns < least) least = ns;
+            }
+            printf("{\"bench\":\"rx_ack_%zu\",\"frames\":%u,\"ns_avg\":%.1f,\"ns_min\":%llu,\"us_avg\":%.3f}\n",
+                   blocks[b],frames,(double)sum/frames,(unsigned long long)least,sum/1000.0/frames);
+            fflush(stdout);
+        }
+        mem.watch = false;
+        fb.SetHandlers(NULL,NULL);
+    }
+
+    // A recorded stream
+    if(file)
+    {
+        FILE * f = fopen(file,"rb");
+        if(f == NULL)
+        {
+            perror(file);
+            return 1;
+        }
+        std::vector<uint8_t> s;
+        int c;
+        while((c = fgetc(f)) != EOF) s.push_back(c);
+        fclose(f);
+        packet_t pkt;
+        unsigned long frames = 0;
+        memset(&pkt,0,sizeof(pkt));
+        if(s.size())
+        {
+            bench_run("rx_parse_file",s.size(),[&]{ FBusBench::parse(fb,s.data(),s.size(),&pkt,&frames); });
+            bench_run("rx_span_file",s.size(),[&]{ FBusBench::parseSpans(fb,s.data(),s.size(),&pkt,&frames); });
+        }
+    }
+
+    // Frame encoder, bytes are wire bytes written
+    for(size_t b=0;b<sizeof(blocks)/sizeof(blocks[0]);b++)
+    {
+        packet_t tmpl;
+        memset(&tmpl,0,sizeof(tmpl));
+        tmpl.FrameID = 0x1E;
+        tmpl.DestDEV = 0x00;
+        tmpl.SrcDEV = 0x0C;
+        tmpl.MsgType = FBUSTYPE_SMS;
+        tmpl.FramesToGo = 0x01;
+        tmpl.FrameLength = blocks[b];
+        for(size_t x=0;x<blocks[b];x++) tmpl.data[x] = x*13;
+        mem.written = 0;
+        FBusBench::send(fb,&tmpl);
+        size_t wire = mem.written;
+        snprintf(name,sizeof(name),"tx_packetSend_%zu",blocks[b]);
+        bench_run(name,wire,[&]{ FBusBench::send(fb,&tmpl); });
+        snprintf(name,sizeof(name),"tx_packetSend_direct_%zu",blocks[b]);
+        bench_run(name,wire,[&]{ FBusBench::send(direct,&tmpl); });
+    }
+
+    // GSM 7-bit codec, bytes are septets.  bitpack_legacy is the packer
+    // the codec replaced, it neither translates nor handles fill bits.
+    static const size_t texts[] = { 16, 70, 160 };
+    for(size_t t=0;t<sizeof(texts)/sizeof(texts[0]);t++)
+    {
+        size_t n = texts[t];
+        uint8_t src[161], buf[162], sep[161], packed[141], back[161];
+        char text[161], utf8[161*3];
+        for(size_t x=0;x<n;x++) text[x] = "Pump station 4 pressure low "[x%28];
+        text[n] = 0;
+        memcpy(src,text,n+1);
+        uint16_t k;
+        gsm7Encode(text,n,sep,sizeof(sep),&k);
+        gsm7Pack(sep,n,packed,0);
+
+        snprintf(name,sizeof(name),"bitpack_legacy_%zu",n);
+        bench_run(name,n,[&]{ memcpy(buf,src,n+1); legacy_bitpack(buf,n); });
+        snprintf(name,sizeof(name),"gsm7_pack_%zu",n);
+        bench_run(name,n,[&]{ gsm7Pack(sep,n,packed,0); });
+        snprintf(name,sizeof(name),"gsm7_pack_fill_%zu",n);
+        bench_run(name,n,[&]{ gsm7Pack(sep,n,packed,1); });
+        snprintf(name,sizeof(name),"gsm7_encode_pack_%zu",n);
+        bench_run(name,n,[&]{ gsm7Encode(text,n,sep,sizeof(sep),&k); gsm7Pack(sep,k,packed,0); });
+        gsm7Pack(sep,n,packed,0);
+        snprintf(name,sizeof(name),"gsm7_unpack_%zu",n);
+        bench_run(name,n,[&]{ gsm7Unpack(packed,n,back,0); });
+        snprintf(name,sizeof(name),"gsm7_unpack_decode_%zu",n);
+        bench_run(name,n,[&]{ gsm7Unpack(packed,n,back,0); gsm7Decode(back,n,utf8,sizeof(utf8)); });
+    }
+
+    // Phone number packing and lookup, bytes are digits
+    {
+        fbus_number_t out;
+        bench_run("octetpack_11",11,[&]{ FBusBench::octetPack(fb,"15622834051",&out); });
+        fb.AddRecipient("15622834051",NUMTYPE_UNKNOWN);
+        bench_run("recipient_find_11",11,[&]{ fb.FindRecipient("15622834051"); });
+    }
+
+    // One alert SMS queued and sent per recipient of an on-call list, bytes
+    // are characters.  repack is what every SendSMS(phonenum,msgcenter,..)
+    // used to cost, packing both numbers each time.
+    {
+        static const char * const oncall[4] = { "15622834051", "15622834052", "15622834053", "15622834054" };
+        char alert[] = "Pump 4 press low";
+        fbus_recipient_t to[4];
+        unsigned r = 0;
+        for(unsigned x=0;x<4;x++) to[x] = fb.AddRecipient(oncall[x],NUMTYPE_UNKNOWN);
+        fb.SetSMSC("8613010888500",NUMTYPE_NATIONAL);
+        bench_run("sms_submit_repack_16",16,[&]{
+            fb.SetSMSC("8613010888500",NUMTYPE_NATIONAL);
+            fb.SetPhoneNumber(oncall[r++&3],NUMTYPE_UNKNOWN);
+            fb.SendSMS(alert);
+            FBusBench::txDrop(fb);
+        });
+        bench_run("sms_submit_number_16",16,[&]{
+            fb.SendSMS((char*)oncall[r++&3],(char*)"8613010888500",alert);
+            FBusBench::txDrop(fb);
+        });
+        bench_run("sms_submit_handle_16",16,[&]{
+            fb.SendSMS(to[r++&3],alert);
+            FBusBench::txDrop(fb);
+        });
+
+        // The same from a template, the pressure in its slot
+        static uint8_t tpl[FBUS_TX_FRAME_MAX];
+        size_t tlen = 0;
+        char templ[] = "Pump 4 press ###";
+        fb.SetSMSC("",NUMTYPE_UNKNOWN);
+        mem.watch = true;
+        mem.last_len = 0;
+        fb.SendSMS(templ);
+        bench_sent(mem,tpl,&tlen);
+        mem.watch = false;
+        FBusBench::txDrop(fb);
+        fb.SetSMSC("8613010888500",NUMTYPE_NATIONAL);
+        const fbus_alert_t press = { tpl, (uint8_t)tlen, 13, 3 };
+        bench_run("alert_send_16",16,[&]{
+            fb.SendAlert(&press,to[r&3],r % 1000);
+            r++;
+            FBusBench::txDrop(fb);
+        });
+
+        // A full 160 character report, whole and written in four pieces
+        // as it would come off a sensor loop
+        char report[161];
+        for(unsigned x=0;x<160;x++) report[x] = 'a' + x%26;
+        report[160] = 0;
+        bench_run("sms_submit_handle_160",160,[&]{
+            fb.SendSMS(to[r++&3],report);
+            FBusBench::txDrop(fb);
+        });
+        bench_run("sms_compose_4x40",160,[&]{
+            fb.SMSBegin(to[r++&3]);
+            for(unsigned x=0;x<4;x++) fb.SMSWrite(&report[x*40],40);
+            fb.SMSEnd();
+            FBusBench::txDrop(fb);
+        });
+    }
+    return 0;
+}
+
+#else   // __AVR__
+
+// The same kernels on the target, printed as "name cycles_per_byte"
+BENCH_CYCLES_ISR
+
+FBus benchPhone(Serial1);
+
+static void bench_print(const char * name, bench_cycles_t cycles, size_t bytes)
+{
+    Serial.print(name);
+    Serial.print(' ');
+    Serial.print((unsigned long)(cycles/bytes));
+    Serial.print('.');
+    Serial.println((unsigned long)((cycles%bytes)*100/bytes));
+}
+
+void setup()
+{
+    static uint8_t stream[161];
+    static packet_t pkt;
+    unsigned long frames = 0;
+    bench_cycles_t c0, c1;
+    size_t len;
+
+    Serial.begin(115200);
+    Serial1.begin(115200);
+    while(!Serial);
+    bench_cycles_init();
+    benchPhone.initialize();
+
+    // RAM of the phone on the target, frames and the rest
+    Serial.print(F("sizes "));
+    Serial.print((unsigned)FBus::RAM_BYTES);
+    Serial.print(' ');
+    Serial.println((unsigned)sizeof(benchPhone));
+
+    len = bench_frame(stream,0x02,64,0x41,false);
+    len += bench_frame(&stream[len],0x02,16,0x42,false);
+    memset(&pkt,0,sizeof(pkt));
+    c0 = bench_cycles();
+    FBusBench::parse(benchPhone,stream,len,&pkt,&frames);
+    c1 = bench_cycles();
+    bench_print("rx_parse_valid",c1-c0,len);
+
+    memset(&pkt,0,sizeof(pkt));
+    pkt.FrameID = 0x1E;
+    pkt.SrcDEV = 0x0C;
+    pkt.MsgType = FBUSTYPE_SMS;
+    pkt.FramesToGo = 0x01;
+    pkt.FrameLength = 64;
+    c0 = bench_cycles();
+    FBusBench::send(benchPhone,&pkt);
+    c1 = bench_cycles();
+    bench_print("tx_packetSend_64",c1-c0,64+12);
+
+    memset(stream,'a',160);
+    c0 = bench_cycles();
+    legacy_bitpack(stream,160);
+    c1 = bench_cycles();
+    bench_print("bitpack_legacy_160",c1-c0,160);
+
+    static uint8_t septets[160];
+    memset(septets,'a',160);
+    c0 = bench_cycles();
+    gsm7Pack(septets,160,stream,0);
+    c1 = bench_cycles();
+    bench_print("gsm7_pack_160",c1-c0,160);
+
+    c0 = bench_cycles();
+    gsm7Unpack(stream,160,septets,0);
+    c1 = bench_cycles();
+    bench_print("gsm7_unpack_160",c1-c0,160);
+
+    static fbus_number_t num;
+    c0 = bench_cycles();
+    FBusBench::octetPack(benchPhone,"15622834051",&num);
+    c1 = bench_cycles();
+    bench_print("octetpack_11",c1-c0,11);
+
+    benchPhone.AddRecipient(num);
+    c0 = bench_cycles();
+    benchPhone.FindRecipient("15622834051");
+    c1 = bench_cycles();
+    bench_print("recipient_find_11",c1-c0,11);
+}
+
+void loop()
+{
+}
+
+#endif
+
+//eof
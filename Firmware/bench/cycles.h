@@ -0,0 +1,96 @@
+/*
+  cycles.h - Cycle counter for the F-Bus benchmarks.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// bench_cycles_init() once, then bench_cycles() around the code under
+// test.  On AVR Timer1 runs at the CPU clock and its overflows are
+// counted in an interrupt, so one count is one CPU cycle.  On Linux the
+// time stamp counter is used where there is one.
+
+#ifndef __BENCH_CYCLES_H__
+#define __BENCH_CYCLES_H__
+
+#include <stdint.h>
+
+#if defined(__AVR__)
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+typedef uint32_t bench_cycles_t;
+
+extern volatile uint16_t bench_t1_overflows;
+
+static inline void bench_cycles_init()
+{
+    cli();
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10);           // clk/1
+    TCNT1 = 0;
+    TIMSK1 |= (1 << TOIE1);
+    sei();
+}
+
+static inline bench_cycles_t bench_cycles()
+{
+    uint16_t hi, lo;
+    uint8_t sreg = SREG;
+    cli();
+    lo = TCNT1;
+    hi = bench_t1_overflows;
+    // An overflow that happened after cli() has not been counted yet
+    if((TIFR1 & (1 << TOV1)) && lo < 0x8000) hi++;
+    SREG = sreg;
+    return ((bench_cycles_t)hi << 16) | lo;
+}
+
+// Define this in exactly one file of the benchmark sketch
+#define BENCH_CYCLES_ISR \
+    volatile uint16_t bench_t1_overflows = 0; \
+    ISR(TIMER1_OVF_vect) { bench_t1_overflows++; }
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+#include <x86intrin.h>
+
+typedef uint64_t bench_cycles_t;
+static inline void bench_cycles_init() {}
+static inline bench_cycles_t bench_cycles() { return __rdtsc(); }
+#define BENCH_CYCLES_ISR
+
+#elif defined(__aarch64__)
+
+typedef uint64_t bench_cycles_t;
+static inline void bench_cycles_init() {}
+// Virtual counter ticks, not core cycles, scale with the CPU clock to compare
+static inline bench_cycles_t bench_cycles()
+{
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+}
+#define BENCH_CYCLES_ISR
+
+#else
+
+#include <time.h>
+
+// No counter, nanoseconds instead
+typedef uint64_t bench_cycles_t;
+static inline void bench_cycles_init() {}
+static inline bench_cycles_t bench_cycles()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+#define BENCH_CYCLES_ISR
+
+#endif
+
+#endif
+
+//eof
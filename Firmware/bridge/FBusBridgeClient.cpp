@@ -0,0 +1,244 @@
+// FBusBridgeClient.cpp - Linux side of the FBusBridge protocol.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+
+#include "FBusBridgeClient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+FBusBridgeClient::FBusBridgeClient()
+: m_fd(-1), m_owned(false), m_inflight(0), m_window(FBUS_BRIDGE_JOBS), m_status_fn(NULL),
+  m_status_ctx(NULL), m_rx_fn(NULL), m_rx_ctx(NULL)
+{
+    memset(&m_stats,0,sizeof(m_stats));
+}
+
+FBusBridgeClient::~FBusBridgeClient()
+{
+    close();
+}
+
+// Open a serial device raw at 115200, false on failure
+bool FBusBridgeClient::open(const char * path)
+{
+    struct termios tio;
+    int fd = ::open(path,O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if(fd < 0) return false;
+    if(tcgetattr(fd,&tio) == 0)
+    {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio,B115200);
+        tcsetattr(fd,TCSANOW,&tio);
+    }
+    close();
+    m_fd = fd;
+    m_owned = true;
+    return true;
+}
+
+// Use an already open descriptor
+void FBusBridgeClient::attach(int fd)
+{
+    close();
+    fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK);
+    m_fd = fd;
+    m_owned = false;
+    return;
+}
+
+void FBusBridgeClient::close()
+{
+    if(m_owned && m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+    m_owned = false;
+    m_in.clear();
+    return;
+}
+
+void FBusBridgeClient::onStatus(fbus_client_status_t fn, void * ctx)
+{
+    m_status_fn = fn;
+    m_status_ctx = ctx;
+    return;
+}
+
+void FBusBridgeClient::onRx(fbus_client_rx_t fn, void * ctx)
+{
+    m_rx_fn = fn;
+    m_rx_ctx = ctx;
+    return;
+}
+
+// Queue an SMS job, id_lo id_hi type number 0 text 0
+bool FBusBridgeClient::submit(uint16_t id, const char * number, const char * text, uint8_t type)
+{
+    size_t nlen = strlen(number), tlen = strlen(text);
+    if(3 + nlen + 1 + tlen + 1 > FBUS_BRIDGE_IN_MAX) return false;
+
+    std::vector<uint8_t> job;
+    job.reserve(3 + nlen + 1 + tlen + 1);
+    job.push_back(id);
+    job.push_back(id >> 8);
+    job.push_back(type);
+    job.insert(job.end(),number,number+nlen+1);
+    job.insert(job.end(),text,text+tlen+1);
+    m_queue.push_back(job);
+    return true;
+}
+
+// Ask for a STATUS
+void FBusBridgeClient::hello()
+{
+    frame(FBUS_BRIDGE_HELLO,NULL,0);
+    return;
+}
+
+// Send, wait, read and handle
+int FBusBridgeClient::poll(int timeout_ms)
+{
+    uint8_t buf[4096];
+    struct pollfd p = { m_fd, POLLIN, 0 };
+    ssize_t n;
+
+    if(m_fd < 0 || !flush()) return -1;
+    if(::poll(&p,1,timeout_ms) < 0 && errno != EINTR) return -1;
+    while((n = ::read(m_fd,buf,sizeof(buf))) > 0)
+        m_in.insert(m_in.end(),buf,buf+n);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return -1;
+    parse();
+
+    // Finished jobs make room for more at once
+    return flush() ? 0 : -1;
+}
+
+// Private functions
+// ---------------------------------
+
+// Write all of buf
+bool FBusBridgeClient::put(const uint8_t * buf, size_t len)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t n = ::write(m_fd,buf+done,len-done);
+        if(n > 0)
+        {
+            done += n;
+        }else if(n < 0 && errno == EAGAIN)
+        {
+            struct pollfd p = { m_fd, POLLOUT, 0 };
+            ::poll(&p,1,100);
+        }else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Send one frame, 'F' 'B' kind len_lo len_hi payload sum
+bool FBusBridgeClient::frame(uint8_t kind, const uint8_t * payload, uint16_t len)
+{
+    std::vector<uint8_t> out;
+    uint8_t sum;
+
+    out.reserve(FBUS_BRIDGE_HDR + len + 1);
+    out.push_back(FBUS_BRIDGE_SYNC0);
+    out.push_back(FBUS_BRIDGE_SYNC1);
+    out.push_back(kind);
+    out.push_back(len);
+    out.push_back(len >> 8);
+    out.insert(out.end(),payload,payload+len);
+    sum = 0;
+    for(size_t x=2;x<out.size();x++) sum += out[x];
+    out.push_back(sum);
+    return put(out.data(),out.size());
+}
+
+// As many jobs in each SUBMIT as fit, while fewer than the window are
+// unfinished
+bool FBusBridgeClient::flush()
+{
+    std::vector<uint8_t> payload;
+    unsigned jobs;
+
+    while(!m_queue.empty() && m_inflight < m_window)
+    {
+        payload.clear();
+        jobs = 0;
+        while(!m_queue.empty() && m_inflight + jobs < m_window &&
+              payload.size() + m_queue.front().size() <= FBUS_BRIDGE_IN_MAX)
+        {
+            payload.insert(payload.end(),m_queue.front().begin(),m_queue.front().end());
+            m_queue.pop_front();
+            jobs++;
+        }
+        if(!frame(FBUS_BRIDGE_SUBMIT,payload.data(),payload.size())) return false;
+        m_inflight += jobs;
+        m_stats.frames_out++;
+        m_stats.jobs_out += jobs;
+    }
+    return true;
+}
+
+// Find the frames in m_in.  Bytes before a sync and frames with a wrong
+// sum are skipped a byte at a time, a frame may start inside them.
+void FBusBridgeClient::parse()
+{
+    size_t x = 0;
+    uint16_t len;
+    uint8_t sum;
+
+    while(x + FBUS_BRIDGE_HDR + 1 <= m_in.size())
+    {
+        if(m_in[x] != FBUS_BRIDGE_SYNC0 || m_in[x+1] != FBUS_BRIDGE_SYNC1)
+        {
+            m_stats.skipped++;
+            x++;
+            continue;
+        }
+        len = m_in[x+3] | ((uint16_t)m_in[x+4] << 8);
+        if(x + FBUS_BRIDGE_HDR + len + 1 > m_in.size()) break;
+        sum = 0;
+        for(size_t k=2;k<(size_t)FBUS_BRIDGE_HDR+len;k++) sum += m_in[x+k];
+        if(sum != m_in[x+FBUS_BRIDGE_HDR+len])
+        {
+            m_stats.bad++;
+            m_stats.skipped++;
+            x++;
+            continue;
+        }
+        m_stats.frames_in++;
+        handle(m_in[x+2],&m_in[x+FBUS_BRIDGE_HDR],len);
+        x += FBUS_BRIDGE_HDR + len + 1;
+    }
+    m_in.erase(m_in.begin(),m_in.begin()+x);
+    return;
+}
+
+void FBusBridgeClient::handle(uint8_t kind, const uint8_t * p, uint16_t len)
+{
+    if(kind == FBUS_BRIDGE_RX && len >= 1)
+    {
+        if(m_rx_fn) m_rx_fn(m_rx_ctx,p[0],p+1,len-1);
+    }else if(kind == FBUS_BRIDGE_STATUS && len >= 2)
+    {
+        if(p[1]) m_window = p[1];
+        for(uint16_t x=2;x+3<=len;x+=3)
+        {
+            uint16_t id = p[x] | ((uint16_t)p[x+1] << 8);
+            if(p[x+2] != FBUS_BRIDGE_QUEUED && m_inflight) m_inflight--;
+            if(m_status_fn) m_status_fn(m_status_ctx,id,p[x+2]);
+        }
+    }
+    return;
+}
+
+//eof
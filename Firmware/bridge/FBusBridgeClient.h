@@ -0,0 +1,112 @@
+/*
+  FBusBridgeClient.h - Linux side of the FBusBridge protocol.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// Talks to a sketch running FBusBridge over its USB serial port, see
+// FBusBridge.h for the frames.  submit() only queues a job, poll() packs
+// as many queued jobs into each SUBMIT frame as fit and keeps no more than
+// the bridge's jobs_max unfinished, so the phone always has the next SMS
+// without a round trip per message:
+//
+//   FBusBridgeClient bridge;
+//   bridge.open("/dev/ttyACM0");
+//   bridge.onStatus(jobState,NULL);
+//   bridge.submit(1,"15622834051","Pump 4 pressure low");
+//   while(bridge.unfinished()) bridge.poll(100);
+
+#ifndef __FBUSBRIDGECLIENT_H__
+#define __FBUSBRIDGECLIENT_H__
+
+#include "Arduino.h"
+#include "FBusBridge.h"
+
+#include <deque>
+#include <vector>
+
+// A job changed state, FBUS_BRIDGE_QUEUED then one final one
+typedef void (*fbus_client_status_t)(void * ctx, uint16_t id, uint8_t state);
+
+// A message from the phone
+typedef void (*fbus_client_rx_t)(void * ctx, uint8_t MsgType, const uint8_t * data, uint16_t len);
+
+typedef struct {
+    unsigned long frames_in;    // Good frames from the bridge
+    unsigned long bad;          // Sync found but the sum was wrong
+    unsigned long skipped;      // Bytes outside frames, text the sketch printed
+    unsigned long frames_out;   // SUBMIT frames sent
+    unsigned long jobs_out;     // Jobs in them
+}fbus_client_stats_t;
+
+class FBusBridgeClient {
+    public:
+        FBusBridgeClient();
+        ~FBusBridgeClient();
+
+        // Open a serial device raw at 115200, false on failure
+        bool open(const char * path);
+
+        // Use an already open descriptor, made non-blocking, the client
+        // does not close it
+        void attach(int fd);
+
+        void close();
+        int fd() { return m_fd; }
+
+        void onStatus(fbus_client_status_t fn, void * ctx);
+        void onRx(fbus_client_rx_t fn, void * ctx);
+
+        // Queue an SMS job.  False if the number and text do not fit one
+        // frame, the bridge checks the rest.
+        bool submit(uint16_t id, const char * number, const char * text,
+                    uint8_t type = NUMTYPE_UNKNOWN);
+
+        // Ask for a STATUS, its jobs_max becomes the window
+        void hello();
+
+        // Send what the window allows, then wait up to timeout_ms for the
+        // bridge and handle everything it sent.  -1 when the port failed.
+        int poll(int timeout_ms);
+
+        // Jobs not sent yet, and sent without a final state
+        unsigned queued() { return m_queue.size(); }
+        unsigned inflight() { return m_inflight; }
+        unsigned unfinished() { return m_queue.size() + m_inflight; }
+
+        // Most jobs unfinished on the bridge, from its last STATUS
+        unsigned window() { return m_window; }
+
+        const fbus_client_stats_t* stats() { return &m_stats; }
+
+    private:
+        // Write all of buf, false if the port failed
+        bool put(const uint8_t * buf, size_t len);
+
+        // Send one frame
+        bool frame(uint8_t kind, const uint8_t * payload, uint16_t len);
+
+        // SUBMIT frames while the window has room
+        bool flush();
+
+        // Find the frames in m_in and handle them
+        void parse();
+        void handle(uint8_t kind, const uint8_t * p, uint16_t len);
+
+        int m_fd;
+        bool m_owned;
+        std::deque<std::vector<uint8_t> > m_queue;  // Encoded jobs not sent
+        std::vector<uint8_t> m_in;      // Bytes from the bridge not parsed yet
+        unsigned m_inflight;
+        unsigned m_window;
+        fbus_client_status_t m_status_fn;
+        void * m_status_ctx;
+        fbus_client_rx_t m_rx_fn;
+        void * m_rx_ctx;
+        fbus_client_stats_t m_stats;
+};
+
+#endif
+
+//eof
@@ -0,0 +1,183 @@
+// fbusbridge.cpp - Send SMS and watch the phone through an FBusBridge sketch.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  Build:
+//    g++ -O2 -I../host -I../nokia-phone-arduino-shield -o fbusbridge fbusbridge.cpp FBusBridgeClient.cpp
+//
+//  Run:
+//    ./fbusbridge /dev/ttyACM0 send 15622834051 "Pump 4 pressure low"
+//    ./fbusbridge /dev/ttyACM0 batch jobs.txt [--timeout s]
+//    ./fbusbridge /dev/ttyACM0 listen
+//
+//  batch reads one job a line, the number, a space and the text, and
+//  keeps the bridge's window of jobs unfinished until all are done.  Every
+//  state is printed as it comes, then a JSON summary.  listen prints each
+//  message from the phone in hex.
+
+#include "FBusBridgeClient.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+
+typedef struct {
+    unsigned long queued;
+    unsigned long sent;
+    unsigned long failed;       // Every other final state
+    unsigned long done;
+}job_count_t;
+
+static const char * state_name(uint8_t state)
+{
+    switch(state)
+    {
+        case FBUS_BRIDGE_QUEUED: return "queued";
+        case FBUS_BRIDGE_SENT: return "sent";
+        case FBUS_BRIDGE_SMS_ERROR: return "sms_error";
+        case FBUS_BRIDGE_FAILED: return "failed";
+        case FBUS_BRIDGE_TIMEOUT: return "timeout";
+        case FBUS_BRIDGE_REJECTED: return "rejected";
+    }
+    return "unknown";
+}
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static void on_status(void * ctx, uint16_t id, uint8_t state)
+{
+    job_count_t * count = (job_count_t*)ctx;
+    printf("job %u %s\n",id,state_name(state));
+    if(state == FBUS_BRIDGE_QUEUED)
+    {
+        count->queued++;
+        return;
+    }
+    count->done++;
+    if(state == FBUS_BRIDGE_SENT) count->sent++;
+    else count->failed++;
+    return;
+}
+
+static void on_rx(void * /*ctx*/, uint8_t MsgType, const uint8_t * data, uint16_t len)
+{
+    printf("rx type=0x%02X len=%u",MsgType,len);
+    for(uint16_t x=0;x<len;x++) printf(" %02X",data[x]);
+    printf("\n");
+    fflush(stdout);
+    return;
+}
+
+// Run until every job is finished or nothing happens for timeout_s
+static int run_jobs(FBusBridgeClient & bridge, job_count_t * count, unsigned long jobs, unsigned timeout_s)
+{
+    uint64_t start = now_ms(), last = start;
+    unsigned long seen = 0;
+
+    while(bridge.unfinished())
+    {
+        if(bridge.poll(100) < 0)
+        {
+            fprintf(stderr,"fbusbridge: port failed\n");
+            return 1;
+        }
+        if(count->done + count->queued != seen)
+        {
+            seen = count->done + count->queued;
+            last = now_ms();
+        }else if(now_ms() - last > timeout_s*1000ULL)
+        {
+            fprintf(stderr,"fbusbridge: no progress for %us\n",timeout_s);
+            break;
+        }
+    }
+    uint64_t took = now_ms() - start;
+    const fbus_client_stats_t * st = bridge.stats();
+    printf("{\"bridge\":\"batch\",\"jobs\":%lu,\"sent\":%lu,\"failed\":%lu,\"unfinished\":%u,"
+           "\"frames_out\":%lu,\"frames_in\":%lu,\"bad\":%lu,\"ms\":%llu,\"jobs_per_s\":%.2f}\n",
+           jobs,count->sent,count->failed,bridge.unfinished(),st->frames_out,st->frames_in,st->bad,
+           (unsigned long long)took,took ? count->done*1000.0/took : 0.0);
+    return (count->failed || bridge.unfinished()) ? 2 : 0;
+}
+
+int main(int argc, char ** argv)
+{
+    FBusBridgeClient bridge;
+    job_count_t count = { 0, 0, 0, 0 };
+    unsigned timeout_s = 60;
+    unsigned long jobs = 0;
+
+    if(argc < 3 || (!strcmp(argv[2],"send") && argc != 5) || (!strcmp(argv[2],"batch") && argc < 4) ||
+       (strcmp(argv[2],"send") && strcmp(argv[2],"batch") && strcmp(argv[2],"listen")))
+    {
+        fprintf(stderr,"usage: %s device send number text\n"
+                       "       %s device batch jobs.txt [--timeout s]\n"
+                       "       %s device listen\n",argv[0],argv[0],argv[0]);
+        return 1;
+    }
+    for(int x=4;x<argc && !strcmp(argv[2],"batch");x++)
+    {
+        if(!strcmp(argv[x],"--timeout") && x+1 < argc) timeout_s = strtoul(argv[++x],NULL,0);
+        else
+        {
+            fprintf(stderr,"%s: unknown option %s\n",argv[0],argv[x]);
+            return 1;
+        }
+    }
+    if(!bridge.open(argv[1]))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    bridge.onStatus(on_status,&count);
+    bridge.onRx(on_rx,NULL);
+    bridge.hello();
+
+    if(!strcmp(argv[2],"listen"))
+    {
+        while(bridge.poll(1000) >= 0) {}
+        fprintf(stderr,"fbusbridge: port failed\n");
+        return 1;
+    }
+    if(!strcmp(argv[2],"send"))
+    {
+        if(!bridge.submit(1,argv[3],argv[4]))
+        {
+            fprintf(stderr,"fbusbridge: text too long\n");
+            return 1;
+        }
+        return run_jobs(bridge,&count,1,timeout_s);
+    }
+
+    FILE * f = fopen(argv[3],"r");
+    if(f == NULL)
+    {
+        perror(argv[3]);
+        return 1;
+    }
+    char line[512];
+    while(fgets(line,sizeof(line),f))
+    {
+        char * text = strchr(line,' ');
+        line[strcspn(line,"\r\n")] = 0;
+        if(text == NULL || text == line) continue;
+        *text++ = 0;
+        if(!bridge.submit(jobs+1,line,text))
+        {
+            fprintf(stderr,"fbusbridge: job %lu too long, skipped\n",jobs+1);
+            continue;
+        }
+        jobs++;
+    }
+    fclose(f);
+    return run_jobs(bridge,&count,jobs,timeout_s);
+}
+
+//eof
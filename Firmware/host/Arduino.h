@@ -0,0 +1,95 @@
+/*
+  Arduino.h - Linux stand-in for the parts of the Arduino core FBus uses.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// Put this directory first on the include path (-I../host) and the
+// library sources in Firmware/nokia-phone-arduino-shield build unmodified
+// on Linux.  Serial ports are HostSerial objects, see HostSerial.h.
+
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef uint8_t byte;
+
+// Program memory is ordinary memory on Linux
+#define PROGMEM
+#define PSTR(s)             (s)
+#define pgm_read_byte(p)    (*(const uint8_t*)(p))
+#define pgm_read_word(p)    (*(const uint16_t*)(p))
+#define pgm_read_dword(p)   (*(const uint32_t*)(p))
+#define pgm_read_ptr(p)     (*(void * const *)(p))
+#define memcpy_P            memcpy
+
+// Interrupts are simulated by threads, these are no-ops
+#define cli()
+#define sei()
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+#define HEX 16
+#define DEC 10
+
+class Print {
+    public:
+        virtual ~Print() {}
+        virtual size_t write(uint8_t b) = 0;
+        virtual size_t write(const uint8_t * buf, size_t len)
+        {
+            size_t n = 0;
+            while(len--) n += write(*buf++);
+            return n;
+        }
+        size_t write(const char * str) { return write((const uint8_t*)str,strlen(str)); }
+        size_t write(const char * buf, size_t len) { return write((const uint8_t*)buf,len); }
+        virtual int availableForWrite() { return 0; }
+        virtual void flush() {}
+
+        size_t print(const char * str) { return write(str); }
+        size_t print(char c) { return write((uint8_t)c); }
+        size_t print(unsigned long v, int base = DEC);
+        size_t print(long v, int base = DEC);
+        size_t print(unsigned int v, int base = DEC) { return print((unsigned long)v,base); }
+        size_t print(int v, int base = DEC) { return print((long)v,base); }
+        size_t println() { return write("\r\n"); }
+        template<typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+        template<typename T> size_t println(T v, int base) { size_t n = print(v,base); return n + println(); }
+};
+
+class Stream : public Print {
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+};
+
+class HardwareSerial : public Stream {
+    public:
+        virtual void begin(unsigned long baud) { (void)baud; }
+        virtual void end() {}
+        virtual int available() { return 0; }
+        virtual int read() { return -1; }
+        virtual int peek() { return -1; }
+        virtual size_t write(uint8_t b) { (void)b; return 1; }
+        using Print::write;
+        size_t write(unsigned long n) { return write((uint8_t)n); }
+        size_t write(long n) { return write((uint8_t)n); }
+        size_t write(unsigned int n) { return write((uint8_t)n); }
+        size_t write(int n) { return write((uint8_t)n); }
+        operator bool() { return true; }
+};
+
+#include "HostSerial.h"
+
+#endif
+
+//eof
@@ -0,0 +1,2 @@
+// HardwareSerial.h - Linux stand-in, the class lives in Arduino.h
+#include "Arduino.h"
@@ -0,0 +1,183 @@
+// HostSerial.cpp - HardwareSerial on a Linux file descriptor.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  Also provides millis(), micros() and the Print helpers of the
+//  Arduino core so library code links on Linux.
+
+#include "Arduino.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+HostSerial Serial;
+HostSerial Serial1;
+
+// Microseconds since the first call
+static uint64_t host_us()
+{
+    static struct timespec start;
+    static bool started = false;
+    struct timespec now;
+    if(!started)
+    {
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        started = true;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (uint64_t)(now.tv_sec-start.tv_sec)*1000000ULL +
+           (now.tv_nsec-start.tv_nsec)/1000;
+}
+
+unsigned long millis()
+{
+    return (unsigned long)(host_us()/1000);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)host_us();
+}
+
+void delay(unsigned long ms)
+{
+    usleep(ms*1000);
+}
+
+size_t Print::print(unsigned long v, int base)
+{
+    char buf[24];
+    snprintf(buf,sizeof(buf),base==HEX?"%lX":"%lu",v);
+    return write(buf);
+}
+
+size_t Print::print(long v, int base)
+{
+    char buf[24];
+    if(base==HEX) snprintf(buf,sizeof(buf),"%lX",(unsigned long)v);
+    else snprintf(buf,sizeof(buf),"%ld",v);
+    return write(buf);
+}
+
+HostSerial::HostSerial()
+: rx_bytes(0), tx_bytes(0), tx_calls(0), m_fd(-1), m_owned(false), m_peek(-1)
+{
+}
+
+HostSerial::~HostSerial()
+{
+    close();
+}
+
+// Open a device path and put it in raw mode, false on failure
+bool HostSerial::open(const char * path)
+{
+    struct termios tio;
+    int fd = ::open(path,O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if(fd < 0) return false;
+    if(tcgetattr(fd,&tio) == 0)
+    {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio,B115200);
+        tcsetattr(fd,TCSANOW,&tio);
+    }
+    close();
+    m_fd = fd;
+    m_owned = true;
+    return true;
+}
+
+// Use an already open descriptor, the port does not close it
+void HostSerial::attach(int fd)
+{
+    close();
+    m_fd = fd;
+    m_owned = false;
+    return;
+}
+
+void HostSerial::close()
+{
+    if(m_owned && m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+    m_owned = false;
+    m_peek = -1;
+    return;
+}
+
+int HostSerial::available()
+{
+    int n = 0;
+    if(m_fd < 0) return 0;
+    if(ioctl(m_fd,FIONREAD,&n) < 0) n = 0;
+    return n + (m_peek >= 0);
+}
+
+int HostSerial::read()
+{
+    uint8_t b;
+    if(m_peek >= 0)
+    {
+        b = m_peek;
+        m_peek = -1;
+        return b;
+    }
+    if(m_fd < 0) return -1;
+    if(::read(m_fd,&b,1) != 1) return -1;
+    rx_bytes++;
+    return b;
+}
+
+int HostSerial::peek()
+{
+    if(m_peek < 0) m_peek = read();
+    return m_peek;
+}
+
+size_t HostSerial::write(uint8_t b)
+{
+    return write(&b,1);
+}
+
+size_t HostSerial::write(const uint8_t * buf, size_t len)
+{
+    size_t done = 0;
+    tx_calls++;
+    if(m_fd < 0) return len;
+    while(done < len)
+    {
+        ssize_t n = ::write(m_fd,buf+done,len-done);
+        if(n > 0)
+        {
+            done += n;
+        }else if(n < 0 && errno == EAGAIN)
+        {
+            struct pollfd p = { m_fd, POLLOUT, 0 };
+            poll(&p,1,100);
+        }else
+        {
+            break;
+        }
+    }
+    tx_bytes += done;
+    return done;
+}
+
+int HostSerial::availableForWrite()
+{
+    return m_fd < 0 ? 0 : 64;
+}
+
+void HostSerial::flush()
+{
+    if(m_fd >= 0) tcdrain(m_fd);
+    return;
+}
+
+//eof
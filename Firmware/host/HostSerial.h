@@ -0,0 +1,54 @@
+/*
+  HostSerial.h - HardwareSerial on a Linux file descriptor.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+#ifndef __HOSTSERIAL_H__
+#define __HOSTSERIAL_H__
+
+// A serial port backed by a tty, pty or pipe.  Reads never block, writes
+// block until the kernel takes the bytes.  An unopened port swallows
+// writes and never has input, which is what Serial is unless the tool
+// attaches it to stdout.
+class HostSerial : public HardwareSerial {
+    public:
+        HostSerial();
+        ~HostSerial();
+
+        // Open a device path and put it in raw mode, false on failure
+        bool open(const char * path);
+
+        // Use an already open descriptor, the port does not close it
+        void attach(int fd);
+
+        void close();
+        int fd() { return m_fd; }
+
+        virtual int available();
+        virtual int read();
+        virtual int peek();
+        virtual size_t write(uint8_t b);
+        virtual size_t write(const uint8_t * buf, size_t len);
+        virtual int availableForWrite();
+        virtual void flush();
+        using HardwareSerial::write;
+
+        // Bytes and write() calls seen by this port
+        unsigned long rx_bytes;
+        unsigned long tx_bytes;
+        unsigned long tx_calls;
+
+    private:
+        int m_fd;
+        bool m_owned;
+        int m_peek;
+};
+
+extern HostSerial Serial;
+extern HostSerial Serial1;
+
+#endif
+
+//eof
@@ -17,8 +17,6 @@
 #include "FBus.h"
 #include "string.h"
 
-#define UINT16_SWAP(V)      do{(V) = ((V)>>8)|((V)<<8);}while(0)
-
 // FrameID values
 #define FBUS_VIA_CABLE      0x1E
 #define FBUS_VIA_IRDA       0x1C
@@ -27,274 +25,999 @@
 #define FBUS_DEV_PHONE      0x00
 #define FBUS_DEV_HOST       0x0C
 
+static uint16_t fbusXorLanes(const uint8_t * p, uint16_t n);
+
+// RX slot index used when no slot is free, and the RX FIFO entry for the
+// reassembled message in m_rx_msg
+#define FBUS_RX_NONE        0xFF
+#define FBUS_RX_MSG         0xFE
+
+// Reassembly states
+#define FBUS_RXM_IDLE       0       // m_rx_msg is free
+#define FBUS_RXM_BUILDING   1       // Frames of a message are arriving
+#define FBUS_RXM_READY      2       // Complete and queued for the sketch
+#define FBUS_RXM_DISCARD    3       // Too long, the rest is ACKed and dropped
+#define FBUS_RXM_DONE       4       // Last frame in, rxDeliver() not yet called
+
+// Share of the fixed ACK bytes in each checksum, sendAck() adds MsgType
+// to the even one and SeqNo to the odd one
+#define FBUS_ACK_EVEN       (FBUS_VIA_CABLE ^ FBUS_DEV_HOST ^ 0x00)
+#define FBUS_ACK_ODD        (FBUS_DEV_PHONE ^ FBUSTYPE_ACK_MSG ^ 0x02)
+
+// Where smsHeader()'s fields land in a first frame on the wire: the SMSC
+// length, the destination digits and the user data.  SendAlert() patches
+// them.
+#define FBUS_WIRE_SMSC      FBUS_SUBMIT_WIRE(FBUS_SUBMIT_SMSC)
+#define FBUS_WIRE_DA        FBUS_SUBMIT_WIRE(FBUS_SUBMIT_DA)
+#define FBUS_WIRE_UD        FBUS_SUBMIT_WIRE(FBUS_SUBMIT_UD)
+
+// Events go to the log only when it is compiled in
+#ifdef FBUS_ENABLE_LOG
+#define FBUS_LOG(event,a,b) logEvent((event),(a),(b))
+#else
+#define FBUS_LOG(event,a,b)
+#endif
 
-// Constructor for FBus class, associates the serial port
-// with the member reference
-FBus::FBus(HardwareSerial & serialPort)
-: _serialPort(serialPort)
+// Bytes moved from the serial port to the parser at a time
+#define FBUS_RX_CHUNK       32
+
+// Transmit slot states
+#define FBUS_TXS_FREE       0       // Empty, or retired but not yet at the head
+#define FBUS_TXS_QUEUED     1       // Waiting for room in the window
+#define FBUS_TXS_SENT       2       // On the wire, waiting for the ACK
+
+// Parser states, the field of the frame expected next.  States below
+// FBUS_RX_BLOCK are header bytes and equal their position on the wire.
+#define FBUS_RX_BLOCK       6
+#define FBUS_RX_FRAMESTOGO  7
+#define FBUS_RX_SEQNO       8
+#define FBUS_RX_PADDING     9
+#define FBUS_RX_CHECKSUM1   10
+#define FBUS_RX_CHECKSUM2   11
+
+
+// Constructor for the engine, takes the transport and the frame storage
+// FBusSized laid out
+FBusCore::FBusCore(const fbus_port_ops_t * port_ops, void * port, const fbus_storage_t & store)
+: m_port_ops(port_ops), m_port(port), m_rx_pool(store.rx_pool), m_rx_fifo(store.rx_fifo),
+  m_rx_slots(store.rx_slots), m_rx_stride(FBUS_RX_SLOT_BYTES(store.payload)), m_payload(store.payload),
+  m_rx_idle(false), m_link_state(FBUS_LINK_DOWN), m_link_ready(NULL), m_link_ready_ctx(NULL),
+  m_rx_last_type(FBUSTYPE_ACK_MSG),
+  m_rx_handlers(NULL), m_rx_handler_ctx(NULL),
+  m_rx_back_count(0), m_tx_pool(store.tx_pool), m_tx_slots(store.tx_slots),
+  m_tx_stride(FBUS_TX_SLOT_BYTES(store.payload)),
+  m_tx_block(store.payload < FBUS_FRAME_BLOCK_MAX ? store.payload : FBUS_FRAME_BLOCK_MAX),
+  m_tx_head(0), m_tx_count(0), m_tx_window(store.tx_slots), m_tx_retries(FBUS_TX_RETRIES), m_tx_timeout(FBUS_TX_TIMEOUT_MS), m_tx_done(NULL),
+  m_tx_done_ctx(NULL), m_sms_udl_slot((fbus_tx_slot_t*)store.tx_pool), m_sms_udl(0), m_lsms_text(NULL), m_lsms_ref(0), m_tx_wire(store.tx_wire),
+  m_tx_handler(NULL), m_tx_ctx(NULL), m_tx_busy(false),
+  m_ack{ FBUS_VIA_CABLE, FBUS_DEV_PHONE, FBUS_DEV_HOST, FBUSTYPE_ACK_MSG, 0x00, 0x02 }
 {
     // Setup things
     return;
 }
 
 // The 'process' routine is used for polling the serial port for data
-// from the phone.  All 'NEW' packets are ACKed and then marked as 'READY'
-void FBus::process()
-{
-    char c;
-    uint8_t count=0;
-    while(_serialPort.available())
-    {
-        c=_serialPort.read();
-        if(c==-1) break;
-        count++;
-        this->processIncomingByte(c,&incomingPacket);
-        if(incomingPacket.packet_state == PACKET_STATE_NEW)
-        {
-            // We have a new packet here!
-            Serial.println("New");
-            // Send the ACK
-            sendAck(incomingPacket.MsgType, incomingPacket.SeqNo);
-
-            // We could have taken a while to send the packet, so we could be
-            // receiving a new packet.  Make sure the packet is not in receiving
-            // and then mark it new
-            if(incomingPacket.packet_state != PACKET_STATE_RECEIVING)
-                incomingPacket.packet_state = PACKET_STATE_READY;
+// from the phone.  All 'NEW' packets are ACKed and then marked as 'READY',
+// or handed to their handler, see SetHandlers().  ACKs from the phone
+// retire queued frames, and frames still waiting for one are sent again.
+void FBusCore::process()
+{
+    uint8_t chunk[FBUS_RX_CHUNK];
+    uint16_t want;
+    uint8_t n;
+    bool back;
+    packet_t * pkt;
+
+    // A frame that stopped part way is dropped once nothing more of it
+    // came for FBUS_RX_GAP_MS.  The line only counts as quiet between two
+    // calls that both found nothing, bytes left waiting by a slow loop
+    // are not a gap.
+    if(m_rx_active != FBUS_RX_NONE && m_rx.input_state != 0 && !rxAvailable())
+    {
+        pkt = rxSlot(m_rx_active);
+        if(!m_rx_idle)
+        {
+            m_rx_idle = true;
+            m_rx_idle_ms = millis();
+        }else if(millis() - m_rx_idle_ms > FBUS_RX_GAP_MS)
+        {
+            m_rx_stats.timeouts++;
+            m_rx.input_state = 0;
+            pkt->packet_state = PACKET_STATE_EMPTY;
+            m_rx_idle = false;
+        }
+    }
+
+    while(m_rx_back_count || rxAvailable())
+    {
+        // Completed frames are never overwritten, if every slot is still
+        // waiting for the sketch leave the bytes in the serial buffer
+        if(m_rx_active == FBUS_RX_NONE)
+        {
+            m_rx_active = rxSlotAlloc();
+            if(m_rx_active == FBUS_RX_NONE)
+            {
+                m_rx_stats.stalls++;
+                break;
+            }
+        }
+
+        // Take what is buffered, up to the end of the current frame.  The
+        // bytes of a dropped frame are parsed again first.
+        pkt = rxSlot(m_rx_active);
+        want = rxWant(pkt);
+        if(want > sizeof(chunk)) want = sizeof(chunk);
+        back = m_rx_back_count != 0;
+        if(back)
+        {
+            n = rxBackRead(chunk,want,m_rx.input_state == 0);
+            if(n == 0) continue;
+        }else
+        {
+            n = rxReadSpan(chunk,want);
+            if(n == 0) break;
+            m_rx_idle = false;
+            #ifdef FBUS_ENABLE_TRACE
+            m_trace.record(0,micros(),chunk,n);
+            #endif
+            #ifdef FBUS_ENABLE_STATS
+            m_link.rx_bytes += n;
+            #endif
+        }
+        this->processIncoming(chunk,n,pkt);
+        if(pkt->packet_state == PACKET_STATE_NEW) m_link_bad = 0;
+        if(back && pkt->packet_state == PACKET_STATE_NEW) m_rx_stats.resyncs++;
+        #ifdef FBUS_ENABLE_STATS
+        if(pkt->packet_state == PACKET_STATE_NEW) m_rx_done_us = micros();
+        #endif
+        if(pkt->packet_state == PACKET_STATE_NEW &&
+           pkt->MsgType == FBUSTYPE_ACK_MSG)
+        {
+            // ACKs carry the MsgType and SeqNo where FramesToGo and SeqNo
+            // normally are.  They are never ACKed back or handed up.
+            txAcked(pkt->FramesToGo,pkt->SeqNo);
+            pkt->packet_state = PACKET_STATE_EMPTY;
+        }else if(pkt->packet_state == PACKET_STATE_NEW &&
+                 pkt->MsgType == m_rx_last_type && pkt->SeqNo == m_rx_last_seq)
+        {
+            // The phone sent the last frame again, our ACK was lost.  ACK
+            // it again but do not hand it up twice.
+            sendAck(pkt->MsgType, pkt->SeqNo);
+            m_rx_stats.dups++;
+            FBUS_LOG(FBUS_LOG_DUP,pkt->MsgType,pkt->SeqNo);
+            pkt->packet_state = PACKET_STATE_EMPTY;
+        }else if(pkt->packet_state == PACKET_STATE_NEW &&
+                 (pkt->FramesToGo > 1 || !(pkt->SeqNo & 0x40)))
+        {
+            // Part of a multi-frame message, copied out to m_rx_msg so
+            // the slot can take the next frame.  Only first frames carry
+            // the 0x40 SeqNo bit.
+            if(rxReassemble(pkt))
+            {
+                sendAck(pkt->MsgType, pkt->SeqNo);
+                m_rx_last_type = pkt->MsgType;
+                m_rx_last_seq = pkt->SeqNo;
+            }
+            pkt->packet_state = PACKET_STATE_EMPTY;
+            if(m_rx_msg_state == FBUS_RXM_DONE)
+                rxDeliver(FBUS_RX_MSG);
+        }else if(pkt->packet_state == PACKET_STATE_NEW)
+        {
+            // We have a new packet here!  ACK it before anything else
+            // looks at it, the phone's resend timer is running.
+            sendAck(pkt->MsgType, pkt->SeqNo);
+            m_rx_last_type = pkt->MsgType;
+            m_rx_last_seq = pkt->SeqNo;
+            FBUS_LOG(FBUS_LOG_NEW,pkt->MsgType,pkt->SeqNo);
+
+            // A message that is one frame ends any multi-frame message
+            // that was being collected
+            if(m_rx_msg_state == FBUS_RXM_BUILDING || m_rx_msg_state == FBUS_RXM_DISCARD)
+            {
+                if(m_rx_msg_state == FBUS_RXM_BUILDING) m_rx_stats.reasm_fail++;
+                m_rx_msg_state = FBUS_RXM_IDLE;
+            }
+
+            // Hand the frame to its handler or queue it for the sketch
+            m_rx_stats.frames++;
+            rxDeliver(m_rx_active);
         }
     }
 
+    // Go on with a bus sync, or start one if the link looks lost
+    linkService();
+
+    // Queue more of a long SMS, then send what the window allows and
+    // resend anything not ACKed in time
+    lsmsService();
+    txService();
+
+    // Give up on a version request nobody answered
+    if(m_hwsw_state == FBUS_HWSW_PENDING && millis() - m_hwsw_start_ms > m_hwsw_timeout)
+        hwswFinish(FBUS_HWSW_TIMEOUT);
+
     return;
 }
 
-// Prepare phone for communication
-void FBus::initialize()
+// Prepare phone for communication.  Returns at once, process() syncs the
+// bus and frames queued meanwhile wait for it.
+void FBusCore::initialize()
 {
-    // Clear the RX
+    // Clear the RX, what arrives after is skipped by the parser
     serialFlush();
 
-    m_smsc_type = NUMTYPE_UNKNOWN;
-    memset(m_smsc,0,sizeof(m_smsc));
-
-    m_pnum_type = NUMTYPE_UNKNOWN;
-    memset(m_phonenumber,0,sizeof(m_phonenumber));
+    octetPack("",NUMTYPE_UNKNOWN,&m_smsc);
+    octetPack("",NUMTYPE_UNKNOWN,&m_phonenumber);
+    memset(m_dir,0,sizeof(m_dir));
 
     m_out_seqnum = 0;
-
-    ResetBus(128);
-
-    incomingPacket.packet_state = PACKET_STATE_EMPTY;
+    m_tx_head = 0;
+    m_tx_count = 0;
+    m_lsms_text = NULL;
+    memset(&m_tx_stats,0,sizeof(m_tx_stats));
+    m_hwsw_valid = false;
+    m_hwsw_state = FBUS_HWSW_IDLE;
+
+    ResetBus(FBUS_SYNC_BYTES);
+
+    for(uint8_t x=0;x<m_rx_slots;x++)
+        rxSlot(x)->packet_state = PACKET_STATE_EMPTY;
+    m_rx.input_state = 0;
+    m_rx_fifo_head = 0;
+    m_rx_fifo_count = 0;
+    m_rx_msg_state = FBUS_RXM_IDLE;
+    memset(&m_rx_stats,0,sizeof(m_rx_stats));
+    m_rx_active = rxSlotAlloc();
+    m_rx_idle = false;
+    m_rx_back_count = 0;
+    #ifdef FBUS_ENABLE_STATS
+    memset(&m_link,0,sizeof(m_link));
+    #endif
 
     // Phone should be in FBus mode now
 
     return;
 }
 
-// This 'resets' the FBus by sending 0x55 to the phone 'count' times
-void FBus::ResetBus(uint8_t count)
+// This 'resets' the FBus by sending 0x55 to the phone 'count' times.
+// Only starts it, linkService() writes them from process().
+void FBusCore::ResetBus(uint8_t count)
 {
     // Send 0x55 to initialize the phone
     // http://www.codeproject.com/Articles/13452/A-Simple-Guide-To-Mobile-Phone-File-Transferring#Nokia_FBUS_File_Transferring
-    for (int i = 0; i < count; i++) {
-        _serialPort.write(0x55);
-    }
-    _serialPort.flush();
+    m_sync_left = count;
+    m_link_state = FBUS_LINK_SYNCING;
+    m_rx_last_type = FBUSTYPE_ACK_MSG;      // The phone may start its SeqNo over
+    m_link_fails = 0;
+    m_link_bad = 0;
+    m_tx_stats.syncs++;
+    FBUS_LOG(FBUS_LOG_SYNC,count,0);
+    return;
+}
+
+// FBUS_LINK_ state of the bus
+uint8_t FBusCore::LinkState()
+{
+    return m_link_state;
+}
+
+// Whether frames go out
+bool FBusCore::LinkReady()
+{
+    return m_link_state == FBUS_LINK_READY;
+}
+
+// Called from process() each time a sync is done
+void FBusCore::SetLinkReadyHandler(fbus_link_ready_t handler, void * ctx)
+{
+    m_link_ready = handler;
+    m_link_ready_ctx = ctx;
     return;
 }
 
 // Returns the current state of the packet,  The states are in the FBus.h header
 // file and represent the current state of the packet, if it is being received, if
 // is new and needs an ACK, or if it is ready to be processed
-uint8_t FBus::GetPacketState()
+uint8_t FBusCore::GetPacketState()
 {
-    return incomingPacket.packet_state;
+    return GetRXPacketPtr()->packet_state;
 }
 
 // Marks a packet as empty
-void FBus::ClearPacket()
+void FBusCore::ClearPacket()
+{
+    rxFifoPop();
+    return;
+}
+
+// Takes the oldest completed frame off the receive FIFO, returns NULL
+// if there is none.  The frame stays valid until the next process().
+// Reassembled messages do not fit a packet_t and are skipped.
+packet_t* FBusCore::PopPacket()
+{
+    packet_t * pkt;
+    while(m_rx_fifo_count && m_rx_fifo[m_rx_fifo_head] == FBUS_RX_MSG)
+        rxFifoPop();
+    if(m_rx_fifo_count == 0) return NULL;
+    pkt = rxSlot(m_rx_fifo[m_rx_fifo_head]);
+    rxFifoPop();
+    return pkt;
+}
+
+// Takes the oldest completed message off the receive FIFO, false if there
+// is none.  msg->data stays valid until the next process().
+bool FBusCore::PopMessage(fbus_msg_t * msg)
+{
+    packet_t * pkt;
+    if(m_rx_fifo_count == 0) return false;
+    if(m_rx_fifo[m_rx_fifo_head] == FBUS_RX_MSG)
+    {
+        msg->MsgType = m_rx_msg_type;
+        msg->frames = m_rx_msg_frames;
+        msg->length = m_rx_msg_len;
+        msg->data = m_rx_msg;
+    }else
+    {
+        pkt = rxSlot(m_rx_fifo[m_rx_fifo_head]);
+        msg->MsgType = pkt->MsgType;
+        msg->frames = 1;
+        msg->length = pkt->FrameLength;
+        msg->data = pkt->data;
+    }
+    rxFifoPop();
+    return true;
+}
+
+// Number of completed frames and messages waiting in the receive FIFO
+uint8_t FBusCore::PacketsWaiting()
+{
+    return m_rx_fifo_count;
+}
+
+// Hand completed messages to a FBUS_HANDLERS table
+void FBusCore::SetHandlers(const fbus_handler_table_t * table, void * ctx)
+{
+    m_rx_handlers = table;
+    m_rx_handler_ctx = ctx;
+    return;
+}
+
+// Receive counters, see fbus_rx_stats_t
+const fbus_rx_stats_t* FBusCore::GetRXStats()
+{
+    #ifdef FBUS_ENABLE_RX_RING
+    m_rx_stats.ring_overflow = m_rx_ring.overflows();
+    #endif
+    return &m_rx_stats;
+}
+
+#ifdef FBUS_ENABLE_STATS
+// Copy the link counters and histograms, and the RX and TX counters with
+// them.  They only change from process(), so the copy is consistent when
+// taken from the loop.
+void FBusCore::GetLinkStats(fbus_link_stats_t * snap, bool clear)
+{
+    GetRXStats();
+    m_link.rx = m_rx_stats;
+    m_link.tx = m_tx_stats;
+    memcpy(snap,&m_link,sizeof(m_link));
+    if(clear)
+    {
+        memset(&m_link,0,sizeof(m_link));
+        memset(&m_rx_stats,0,sizeof(m_rx_stats));
+        memset(&m_tx_stats,0,sizeof(m_tx_stats));
+    }
+    return;
+}
+
+// Count a value into a power of two bucket, see FBUS_HIST_BUCKETS
+void FBusCore::histAdd(fbus_hist_t * hist, uint32_t value, uint8_t shift)
+{
+    uint8_t b = 0;
+    value >>= shift;
+    while(value && b < FBUS_HIST_BUCKETS-1)
+    {
+        value >>= 1;
+        b++;
+    }
+    if(hist->bucket[b] != 0xFFFF) hist->bucket[b]++;
+    return;
+}
+#endif
+
+#ifdef FBUS_ENABLE_TRACE
+// Send a frame of trace records to the PC
+uint16_t FBusCore::TraceDrain(Print & out, uint8_t max)
+{
+    return m_trace.drain(out,max);
+}
+#endif
+
+#ifdef FBUS_ENABLE_LOG
+// Print up to 'max' log events to the PC, a line each: the event letter
+// and its two bytes in hex.  Returns the events still waiting.
+uint8_t FBusCore::LogDrain(Print & out, uint8_t max)
+{
+    while(max-- && m_log.available() >= 3)
+    {
+        out.print((char)m_log.pop());
+        out.print(' ');
+        out.print((unsigned int)m_log.pop(),HEX);
+        out.print(' ');
+        out.println((unsigned int)m_log.pop(),HEX);
+    }
+    return m_log.available()/3;
+}
+#endif
+
+#ifdef FBUS_ENABLE_RX_RING
+// Queue one received byte.  Call this from the UART RX interrupt,
+// it is the only producer of the receive ring.
+void FBusCore::ReceiveByteISR(uint8_t inbyte)
 {
-    if(incomingPacket.packet_state != PACKET_STATE_RECEIVING)
-        incomingPacket.packet_state = PACKET_STATE_EMPTY;
+    m_rx_ring.push(inbyte);
     return;
 }
+#endif
 
 // Set the SMS Center routing number and the type based on
 // GSM 03.40 ­ Technical realization of the Short Message Service (SMS) Point­to­Point (PP).
-void FBus::SetSMSC(char * smsc, fbus_number_type_e type)
+void FBusCore::SetSMSC(const char * smsc, fbus_number_type_e type)
+{
+    octetPack(smsc,type,&m_smsc);
+    return;
+}
+void FBusCore::SetSMSC(const fbus_number_t & smsc)
 {
-    uint8_t c;
-    //pbuf((uint8_t*)smsc,strlen(smsc),true);
-    // TODO: fill might be 0, check
-    c = octetPack(smsc,m_smsc,sizeof(m_smsc),0x00);
-    //pbuf((uint8_t*)m_smsc,sizeof(m_smsc),true);
-    m_smsc_type = type;
+    m_smsc = smsc;
     return;
 }
 
 // Set the phonenumber to use for the recepiant of the SMS
-void FBus::SetPhoneNumber(char * number, fbus_number_type_e type)
+void FBusCore::SetPhoneNumber(const char * number, fbus_number_type_e type)
 {
-    uint8_t c;
-    //pbuf((uint8_t*)number,strlen(number),true);
-    c = octetPack(number,m_phonenumber,sizeof(m_phonenumber),0x00);
-    //pbuf((uint8_t*)m_phonenumber,sizeof(m_phonenumber),true);
-    m_pnum_type = type;
+    octetPack(number,type,&m_phonenumber);
     return;
 }
 
-// Send HWSW request packet
-void FBus::RequestHWSW()
+// Add a number to the recipient directory, packed once
+fbus_recipient_t FBusCore::AddRecipient(const char * number, fbus_number_type_e type)
 {
-    // Send HWSW request packet
-    //packetReset( &outgoingPacket );
-    // Request HWSW information packet
-    outgoingPacket.FrameID = FBUS_VIA_CABLE;
-    outgoingPacket.DestDEV = FBUS_DEV_PHONE;
-    outgoingPacket.SrcDEV = FBUS_DEV_HOST;
-    outgoingPacket.MsgType = FBUSTYPE_REQ_HWSW;
-    uint8_t block[] = { 0x00, 0x03, 0x00 };
-    outgoingPacket.FrameLength = sizeof(block);
-    for (int i=0; i<sizeof(block); i++) {
-        outgoingPacket.data[i] = block[i];
+    fbus_number_t num;
+    octetPack(number,type,&num);
+    return AddRecipient(num);
+}
+fbus_recipient_t FBusCore::AddRecipient(const fbus_number_t & number)
+{
+    fbus_recipient_t x, to = FBUS_RECIPIENT_NONE;
+    uint16_t hash = numberHash(&number);
+
+    if(number.digits == 0) return FBUS_RECIPIENT_NONE;
+    for(x=0;x<FBUS_DIR_SIZE;x++)
+    {
+        if(m_dir[x].digits == 0)
+        {
+            if(to == FBUS_RECIPIENT_NONE) to = x;
+        }else if(m_dir_hash[x] == hash && m_dir[x].digits == number.digits &&
+                 !memcmp(m_dir[x].bcd,number.bcd,sizeof(number.bcd)))
+        {
+            m_dir[x].type = number.type;
+            return x;
+        }
     }
-    outgoingPacket.FramesToGo = 0x01; // Calculated number of remaining frames
+    if(to != FBUS_RECIPIENT_NONE)
+    {
+        m_dir[to] = number;
+        m_dir_hash[to] = hash;
+    }
+    return to;
+}
 
-    packetSend(&outgoingPacket);
+// Look a number up in the directory by the hash of its digits
+fbus_recipient_t FBusCore::FindRecipient(const char * number)
+{
+    uint16_t hash = numberHash(number);
+    for(fbus_recipient_t x=0;x<FBUS_DIR_SIZE;x++)
+    {
+        if(m_dir[x].digits && m_dir_hash[x] == hash && numberEquals(number,&m_dir[x]))
+            return x;
+    }
+    return FBUS_RECIPIENT_NONE;
+}
 
+// Free a directory entry
+void FBusCore::RemoveRecipient(fbus_recipient_t to)
+{
+    if(to < FBUS_DIR_SIZE) m_dir[to].digits = 0;
     return;
 }
 
-// SendSMS functions
-void FBus::SendSMS(char * phonenum,char * msgcenter, char * message)
+// Send HWSW request packet, false if the transmit queue is full or a
+// request is still pending
+bool FBusCore::RequestHWSW()
 {
-    // Set the SMSC and Phone number, then send the msg
-    SetSMSC(msgcenter, NUMTYPE_UNKNOWN);
-    SetPhoneNumber(phonenum, NUMTYPE_UNKNOWN);
-    SendSMS(message);
-    return;
+    return RequestHWSW(FBUS_HWSW_TIMEOUT_MS,NULL,NULL);
 }
-void FBus::SendSMS(char * message)
+bool FBusCore::RequestHWSW(uint16_t timeout_ms, fbus_hwsw_done_t done, void * ctx)
 {
-    int index=0;
-    int x,c,len;
+    // Request HWSW information packet
+    const uint8_t block[] = { 0x00, 0x03, 0x00 };
+    if(m_hwsw_state == FBUS_HWSW_PENDING) return false;
+    if(!txBegin(FBUSTYPE_REQ_HWSW)) return false;
+    txWrite(block,sizeof(block));
+    m_hwsw_state = FBUS_HWSW_PENDING;
+    m_hwsw_timeout = timeout_ms;
+    m_hwsw_start_ms = millis();
+    m_hwsw_done = done;
+    m_hwsw_ctx = ctx;
+    if(txEnd()) return true;
+    m_hwsw_state = FBUS_HWSW_IDLE;
+    return false;
+}
 
-    // Based on Embedtronics testing on a Nokia 3310
-    // http://web.archive.org/web/20120712020156/http://www.embedtronics.com/nokia/fbus.html
+// State of the last HWSW request
+uint8_t FBusCore::HWSWState()
+{
+    return m_hwsw_state;
+}
 
-    outgoingPacket.FrameID = FBUS_VIA_CABLE;
-    outgoingPacket.DestDEV = FBUS_DEV_PHONE;
-    outgoingPacket.SrcDEV = FBUS_DEV_HOST;
-    outgoingPacket.MsgType = FBUSTYPE_SMS;
-    // Add in the boilerplate for this pkt
-    uint8_t block[] = { 0x00, 0x01, 0x02, 0x00 };
-    for (index=0; index<sizeof(block); index++) {
-        outgoingPacket.data[index] = block[index];
+// Version from the last reply
+const fbus_hwsw_t* FBusCore::GetHWSW()
+{
+    return m_hwsw_valid ? &m_hwsw : NULL;
+}
+
+// SendSMS functions, false if the transmit queue is full
+bool FBusCore::SendSMS(char * phonenum,char * msgcenter, char * message)
+{
+    fbus_recipient_t to;
+
+    // Set the SMSC and Phone number, then send the msg.  Numbers are only
+    // packed again when they change.
+    if(!numberEquals(msgcenter,&m_smsc))
+        octetPack(msgcenter,m_smsc.type,&m_smsc);
+    to = FindRecipient(phonenum);
+    if(to != FBUS_RECIPIENT_NONE)
+        return smsSend(&m_dir[to],message);
+    if(!numberEquals(phonenum,&m_phonenumber))
+        octetPack(phonenum,m_phonenumber.type,&m_phonenumber);
+    return smsSend(&m_phonenumber,message);
+}
+bool FBusCore::SendSMS(char * message)
+{
+    return smsSend(&m_phonenumber,message);
+}
+bool FBusCore::SendSMS(fbus_recipient_t to, const char * message)
+{
+    if(to >= FBUS_DIR_SIZE || m_dir[to].digits == 0) return false;
+    return smsSend(&m_dir[to],message);
+}
+
+// Queue one SMS to a packed number.  Longer texts need SendLongSMS(),
+// the length field is one septet count.
+bool FBusCore::smsSend(const fbus_number_t * to, const char * message)
+{
+    // A full 160 character message does not fit one frame, txWrite() carries
+    // on in the next transmit slot.
+    if(!smsBegin(to,NULL)) return false;
+
+    // The SMS message
+    smsText(message,0xFFFF);
+
+    return smsEnd();
+}
+
+// Send a text of any length.  Up to 160 septets it is one SMS, longer
+// texts are split into parts of 153 septets that the receiving phone
+// joins again.  The parts are queued from process() as transmit slots
+// free up, the text must stay untouched until LongSMSPartsLeft() is 0.
+// False if a long SMS is still being queued or the text needs more than
+// 255 parts.
+bool FBusCore::SendLongSMS(const char * message)
+{
+    return lsmsStart(&m_phonenumber,message);
+}
+bool FBusCore::SendLongSMS(fbus_recipient_t to, const char * message)
+{
+    if(to >= FBUS_DIR_SIZE || m_dir[to].digits == 0) return false;
+    return lsmsStart(&m_dir[to],message);
+}
+bool FBusCore::lsmsStart(const fbus_number_t * to, const char * message)
+{
+    uint16_t len, off, septets;
+    uint8_t parts = 0;
+    if(m_lsms_text != NULL) return false;
+
+    // Parts end on character boundaries, an escaped character is never
+    // split from its escape
+    len = strlen(message);
+    if(gsm7Length(message,len) <= FBUS_SMS_SEPTETS)
+        parts = 1;
+    else
+    {
+        for(off=0;off<len;parts++)
+        {
+            if(parts == 255) return false;
+            off += gsm7Encode(message+off,len-off,NULL,FBUS_SMS_PART_SEPTETS,&septets);
+        }
     }
-    outgoingPacket.FrameLength = sizeof(block);
 
-    // Add in the smsc number length (len+type = 7) and SMSC type
-    outgoingPacket.data[index++] = 0x07;
-    outgoingPacket.data[index++] = (uint8_t)m_smsc_type;
-    outgoingPacket.FrameLength+=2;
+    m_lsms_text = message;
+    m_lsms_to = to;
+    m_lsms_len = len;
+    m_lsms_off = 0;
+    m_lsms_parts = parts;
+    m_lsms_next = 0;
+    m_lsms_ref++;
+    lsmsService();
+    return true;
+}
+
+// Parts of the last SendLongSMS() text not queued yet
+uint8_t FBusCore::LongSMSPartsLeft()
+{
+    if(m_lsms_text == NULL) return 0;
+    return m_lsms_parts - m_lsms_next;
+}
 
-    // Add in the SMSC number
-    for(x=0;x<sizeof(m_smsc);x++)
+// Queue an alert from flash.  The slot keeps the recipient and the
+// digits, alertBuild() makes the frame each time it is sent.
+bool FBusCore::SendAlert(const fbus_alert_t * alert, fbus_recipient_t to, uint32_t value)
+{
+    uint8_t digits = pgm_read_byte(&alert->digits);
+    uint8_t len = pgm_read_byte(&alert->len);
+    uint8_t data[1+FBUS_ALERT_DIGITS];
+
+    if(to >= FBUS_DIR_SIZE || m_dir[to].digits == 0 || digits > FBUS_ALERT_DIGITS) return false;
+    // The template is one whole frame, which this FBus must take in one
+    // too, so the fields alertBuild() patches are all in it
+    if(len < FBUS_WIRE_UD + 4 || len > FBUS_TX_WIRE_BYTES(m_tx_block))
+    {
+        m_tx_stats.too_long++;
+        return false;
+    }
+
+    // Digits are their own septets
+    data[0] = to;
+    for(uint8_t x=digits;x>0;x--)
     {
-        outgoingPacket.data[index++]=m_smsc[x];
+        data[x] = '0' + value % 10;
+        value /= 10;
     }
-    outgoingPacket.FrameLength+=sizeof(m_smsc);
+    if(value) return false;
+
+    if(!txBegin(FBUSTYPE_SMS)) return false;
+    memcpy(m_txm_slot->pkt.data,data,1+digits);
+    m_txm_slot->alert = alert;
+    m_tx_stats.alerts++;
+    return txEnd();
+}
+
+// Compose an SMS piece by piece
+bool FBusCore::SMSBegin()
+{
+    return smsBegin(&m_phonenumber,NULL);
+}
+bool FBusCore::SMSBegin(fbus_recipient_t to)
+{
+    if(to >= FBUS_DIR_SIZE || m_dir[to].digits == 0) return false;
+    return smsBegin(&m_dir[to],NULL);
+}
+bool FBusCore::SMSWrite(const char * text, uint16_t len)
+{
+    smsText(text,len);
+    return !m_sms_overflow;
+}
+bool FBusCore::SMSWrite(const char * text)
+{
+    smsText(text,0xFFFF);
+    return !m_sms_overflow;
+}
+bool FBusCore::SMSEnd()
+{
+    return smsEnd();
+}
+
+// Everything of an SMS submit up to the user data.  Based on Embedtronics
+// testing on a Nokia 3310
+// http://web.archive.org/web/20120712020156/http://www.embedtronics.com/nokia/fbus.html
+void FBusCore::smsHeader(uint8_t first_octet, const fbus_number_t * to)
+{
+    uint8_t x;
+
+    // Add in the boilerplate for this pkt
+    const uint8_t block[] = { 0x00, 0x01, 0x02, 0x00 };
+    txWrite(block,sizeof(block));
+
+    // Add in the smsc number length in octets counting the type octet,
+    // and SMSC type
+    txPut(m_smsc.digits ? 1 + (m_smsc.digits+1)/2 : 0);
+    txPut(m_smsc.type);
+
+    // Add in the SMSC number
+    txWrite(m_smsc.bcd,sizeof(m_smsc.bcd));
 
     // Add in magic number for outbound SMS type
-    // The message is SMS Submit, Reject Duplicates, and Validity Indicator present.
-    outgoingPacket.data[index++]=0x15;
-    outgoingPacket.FrameLength++;
+    // 0x15 is SMS Submit, Reject Duplicates, and Validity Indicator present,
+    // 0x40 on top says the user data starts with a header.
+    txPut(first_octet);
 
     // Skip 3 numbers
     for(x=0;x<3;x++)
-        outgoingPacket.data[index++]=0;
-    outgoingPacket.FrameLength+=3;
+        txPut(0);
 
-    // Add in unpacked message size
-    len = strlen(message);
-    outgoingPacket.data[index++]=len;
-    outgoingPacket.FrameLength++;
+    // Add in the user data length in septets, header included.  smsEnd()
+    // fills it in once the text is through.  With small frames the header
+    // runs over into the next ones, so the slot the byte went into is kept
+    // with its index, a full frame puts it first in the next one.
+    if(txPut(0))
+    {
+        m_sms_udl_slot = m_txm_slot;
+        m_sms_udl = m_txm_slot->pkt.FrameLength - 1;
+    }
 
-    // Add dest number length
-    outgoingPacket.data[index++]=sizeof(m_phonenumber);
-    outgoingPacket.FrameLength++;
+    // Add dest number length in digits
+    txPut(to->digits);
 
     // Add number type
-    outgoingPacket.data[index++] = m_pnum_type;
-    outgoingPacket.FrameLength+=2;
+    txPut(to->type);
 
     // Add in 10 bytes for phone number
-    for(x=0;x<sizeof(m_phonenumber);x++)
-    {
-        // Blank for now, TODO: fix this
-        outgoingPacket.data[index++]=m_phonenumber[x];
-    }
-    outgoingPacket.FrameLength+=sizeof(m_phonenumber);
+    txWrite(to->bcd,sizeof(to->bcd));
 
     // Validity period, magic number 0xA7
-    outgoingPacket.data[index++]=0xA7;
-    outgoingPacket.FrameLength++;
+    txPut(0xA7);
 
     // Timestamp? 6 chars, all 0
     for(x=0;x<6;x++)
+        txPut(0);
+
+    return;
+}
+
+// Start a submit.  Six header octets are 48 bits, one fill bit brings
+// the text after them to the septet boundary at 49, see GSM 03.40
+// 9.2.3.24.
+bool FBusCore::smsBegin(const fbus_number_t * to, const uint8_t * udh)
+{
+    if(!txBegin(FBUSTYPE_SMS)) return false;
+    smsHeader(udh ? 0x55 : 0x15,to);
+    m_sms_max = FBUS_SMS_SEPTETS;
+    m_sms_overflow = false;
+    if(udh)
+    {
+        txWrite(udh,6);
+        gsm7PackBegin(&m_sms_pack,1);
+        m_sms_septets = 7;
+    }else
+    {
+        gsm7PackBegin(&m_sms_pack,0);
+        m_sms_septets = 0;
+    }
+    return true;
+}
+
+// Append UTF-8 text as packed septets straight into the frames.  An
+// escaped character goes in as one 14 bit pair so it is never split.
+uint16_t FBusCore::smsText(const char * text, uint16_t len)
+{
+    uint32_t acc = m_sms_pack.acc;
+    uint8_t bits = m_sms_pack.bits;
+    uint16_t pos = 0, pair;
+    uint8_t c, n, used;
+
+    while(pos < len && text[pos])
+    {
+        c = gsm7Char(&text[pos],len-pos,&used);
+        if(c & 0x80)
+        {
+            pair = GSM7_ESC | ((uint16_t)(c & 0x7F) << 7);
+            n = 2;
+        }else
+        {
+            pair = c;
+            n = 1;
+        }
+        if(m_sms_septets + n > m_sms_max)
+        {
+            m_sms_overflow = true;
+            break;
+        }
+        acc |= (uint32_t)pair << bits;
+        bits += 7*n;
+        while(bits >= 8)
+        {
+            txByte(acc & 0xFF);
+            acc >>= 8;
+            bits -= 8;
+        }
+        m_sms_septets += n;
+        pos += used;
+    }
+    m_sms_pack.acc = acc;
+    m_sms_pack.bits = bits;
+    return pos;
+}
+
+// Write the last partial octet, patch in the user data length and queue
+// the submit.  Nothing is queued if the text was too long.
+bool FBusCore::smsEnd()
+{
+    fbus_tx_slot_t * slot = m_sms_udl_slot;
+
+    if(m_sms_overflow) return false;
+    if(m_sms_pack.bits) txByte(m_sms_pack.acc);
+    // A submit that ran out of slots leaves an older message's slot here
+    if(!m_txm_overflow)
     {
-        // Blank for now, TODO: fix this
-        outgoingPacket.data[index++]=0;
+        slot->pkt.data[m_sms_udl] = m_sms_septets;
+        slot->lanes ^= (uint16_t)m_sms_septets << ((m_sms_udl & 1) << 3);
     }
-    outgoingPacket.FrameLength+=6;
+    return txEnd();
+}
+
+// Queue as many parts of the long SMS as the transmit slots take.  Each
+// part is a whole SMS submit with a concatenation header
+// { UDHL 05, IEI 00, IEL 03, ref, parts, part } in front of its text.
+void FBusCore::lsmsService()
+{
+    uint16_t n, septets, udl, bytes;
+    uint8_t frames;
+    uint8_t udh[6];
 
-    // TODO: The SMS message!!!
-    c = BitPack((uint8_t*)message,len);
-    for(x=0;x<c;x++)
+    while(m_lsms_text != NULL)
     {
-        // Blank for now, TODO: fix this
-        outgoingPacket.data[index++]=message[x];
+        // Wait for room without building the part first.  The submit is
+        // the header up to FBUS_SUBMIT_UD and the packed user data.
+        n = gsm7Encode(m_lsms_text+m_lsms_off,m_lsms_len-m_lsms_off,NULL,
+                       m_lsms_parts > 1 ? FBUS_SMS_PART_SEPTETS : FBUS_SMS_SEPTETS,&septets);
+        udl = (m_lsms_parts > 1) ? 7+septets : septets;
+        bytes = FBUS_SUBMIT_UD + (udl*7+7)/8;
+        frames = (bytes + m_tx_block - 1)/m_tx_block;
+        if(frames > m_tx_slots)
+        {
+            m_tx_stats.too_long++;
+            m_lsms_text = NULL;
+            return;
+        }
+        if(frames > m_tx_slots - m_tx_count) return;
+
+        udh[0] = 0x05;
+        udh[1] = 0x00;
+        udh[2] = 0x03;
+        udh[3] = m_lsms_ref;
+        udh[4] = m_lsms_parts;
+        udh[5] = m_lsms_next + 1;
+        if(!smsBegin(m_lsms_to,m_lsms_parts > 1 ? udh : NULL)) return;
+        smsText(m_lsms_text+m_lsms_off,n);
+        if(!smsEnd()) return;
+        m_tx_stats.sms_parts++;
+        m_lsms_off += n;
+        if(++m_lsms_next >= m_lsms_parts)
+            m_lsms_text = NULL;
     }
-    outgoingPacket.FrameLength+=c;
+    return;
+}
+
+// Free transmit queue slots, a send call needs one
+uint8_t FBusCore::TxQueueFree()
+{
+    return m_tx_slots - m_tx_count;
+}
+
+// Transmit queue slots in all
+uint8_t FBusCore::TxSlots()
+{
+    return m_tx_slots;
+}
+
+// Slots an SMS of the text takes, counted the way lsmsService() counts a
+// part: the header up to FBUS_SUBMIT_UD and the packed text
+uint8_t FBusCore::SMSFrames(const char * text)
+{
+    uint16_t len = strlen(text), septets, bytes;
+    uint8_t frames;
+
+    if(gsm7Encode(text,len,NULL,FBUS_SMS_SEPTETS,&septets) != len) return 0;
+    bytes = FBUS_SUBMIT_UD + (septets*7+7)/8;
+    frames = (bytes + m_tx_block - 1)/m_tx_block;
+    return frames > m_tx_slots ? 0 : frames;
+}
+
+// Largest block of a received frame
+uint8_t FBusCore::MaxPayload()
+{
+    return m_payload;
+}
 
-    outgoingPacket.FrameLength--;
+// Frames queued or waiting for an ACK
+uint8_t FBusCore::TxPending()
+{
+    uint8_t n = 0;
+    for(uint8_t x=0;x<m_tx_count;x++)
+        if(txSlot((m_tx_head+x)%m_tx_slots)->state != FBUS_TXS_FREE) n++;
+    return n;
+}
+
+// ACK timeout before the first resend, and the number of resends before
+// a frame is dropped
+void FBusCore::SetTxTimeout(uint16_t timeout_ms, uint8_t retries)
+{
+    m_tx_timeout = timeout_ms;
+    m_tx_retries = retries;
+    return;
+}
 
-    // TODO: This byte is not in the message, it is the FramesToGo
-    // TODO: Always 0? this is byte 93 in the example, the doc says always 0 but the
-    // bytes show 0x01
-    //outgoingPacket.data[index++]=0x01;
-    //outgoingPacket.FrameLength++;
+// Frames on the wire waiting for an ACK at once, 1 is stop-and-wait
+void FBusCore::SetTxWindow(uint8_t window)
+{
+    if(window < 1) window = 1;
+    if(window > m_tx_slots) window = m_tx_slots;
+    m_tx_window = window;
+    return;
+}
 
-    outgoingPacket.FramesToGo = 0x01; // Calculated number of remaining frames
-    //outgoingPacket.SeqNo = m_out_seqnum;
+// Report every ACKed or failed frame to a callback
+void FBusCore::SetTxDoneHandler(fbus_tx_done_t handler, void * ctx)
+{
+    m_tx_done_ctx = ctx;
+    m_tx_done = handler;
+    return;
+}
 
-    //pbuf(outgoingPacket.data,outgoingPacket.FrameLength,true);
+// Transmit counters, see fbus_tx_stats_t
+const fbus_tx_stats_t* FBusCore::GetTXStats()
+{
+    return &m_tx_stats;
+}
 
-    packetSend(&outgoingPacket);
+// Hand finished wire frames to a driver instead of writing them to the
+// serial port.  The driver owns the buffer until it calls TxComplete().
+void FBusCore::SetTxHandler(fbus_tx_handler_t handler, void * ctx)
+{
+    m_tx_ctx = ctx;
+    m_tx_handler = handler;
+    return;
+}
 
+// Called by the TX driver, from its interrupt if need be, once the last
+// frame handed over is on the wire
+void FBusCore::TxComplete()
+{
+    m_tx_busy = false;
     return;
 }
 
-// Return the pointer of the RX packet for processing
-packet_t* FBus::GetRXPacketPtr()
+// Return the pointer of the oldest RX packet for processing.  With nothing
+// queued this is the slot the parser is filling.
+packet_t* FBusCore::GetRXPacketPtr()
 {
-    return &incomingPacket;
+    if(m_rx_fifo_count && m_rx_fifo[m_rx_fifo_head] != FBUS_RX_MSG)
+        return rxSlot(m_rx_fifo[m_rx_fifo_head]);
+    if(m_rx_active == FBUS_RX_NONE)
+        return rxSlot(0);
+    return rxSlot(m_rx_active);
 }
 
 
 #ifdef FBUS_ENABLE_DEBUG
 // Prints a buffer to the PC Serial as hex
-void FBus::pbuf(uint8_t * buf,int len, bool hex)
+void FBusCore::pbuf(uint8_t * buf,int len, bool hex)
 {
-    int x,id;
-    char out[400];
-    id=0;
-    for(x=0;x<len;x++) id+=sprintf(&(out[id]),"x%02X,",buf[x]);
-    //printf("\n");
-    Serial.println(out);
+    static const char digits[] PROGMEM = "0123456789ABCDEF";
+    char out[5] = { 'x', 0, 0, ',', 0 };
+    int x;
+    for(x=0;x<len;x++)
+    {
+        out[1] = pgm_read_byte(&digits[buf[x] >> 4]);
+        out[2] = pgm_read_byte(&digits[buf[x] & 0x0F]);
+        Serial.print(out);
+    }
+    Serial.println();
     return;
 }
 // Receives a single character command for testing
-void FBus::CMD(char c)
+void FBusCore::CMD(char c)
 {
     switch(c){
     case 'D':
@@ -304,7 +1027,7 @@ void FBus::CMD(char c)
         sendAck(0x12, 0x34);
         break;
     case 'P':
-        pbuf((uint8_t*)&incomingPacket,incomingPacket.FrameLength+offsetof(packet_t,data),true);
+        pbuf((uint8_t*)GetRXPacketPtr(),GetRXPacketPtr()->FrameLength+offsetof(packet_t,data),true);
         break;
     default:
        break;
@@ -316,369 +1039,1140 @@ void FBus::CMD(char c)
 // Private functions
 // ------------------------------------------------------
 
-// Empty the serial input buffer
-void FBus::serialFlush()
+// Drop what the serial port holds now.  Bytes still arriving are left to
+// the parser, a phone that never stops talking cannot hold us here.
+void FBusCore::serialFlush()
 {
-    while(_serialPort.available() > 0) {
-        _serialPort.read();
+    uint8_t junk[16];
+    int left = portAvailable();
+    uint8_t n;
+    while(left > 0)
+    {
+        n = portRead(junk,left < (int)sizeof(junk) ? left : sizeof(junk));
+        if(n == 0) break;
+        left -= n;
     }
+    #ifdef FBUS_ENABLE_RX_RING
+    m_rx_ring.clear();
+    #endif
     return;
 }
 
-// Pack a given string into reversed octets Eg: "1234" -> 0x21,0x43
-uint8_t FBus::octetPack(char * instr,uint8_t * outbuf,uint8_t outbuf_size,uint8_t fill)
+// Bytes waiting to be parsed, from the RX ring or the serial port
+int FBusCore::rxAvailable()
 {
-    char c;
-    uint8_t x,i;
-    memset(outbuf,0,outbuf_size);
-    x=0;
-    i=0;
-    while(*instr!=0)
-    {
-        c=*instr;
-        if(c>='0' && c<='9')
-        {
-            //printf("x%02X,",c);
-            outbuf[i]=(outbuf[i]&0xF0)|(c-'0');
-            //outbuf[i]|=(c-'0');
-            if((x&1)==0){
-                outbuf[i]<<=4;
-                outbuf[i]|=(0x0F&fill);
-            }else{
-                i++;
-            }
-            x++;
-        }
-        instr++;
-    }
-    //printf("digits: %d\n",x);
-    for(i=0;i<(x/2);i++) outbuf[i]=((outbuf[i]&0xF)<<4)|(outbuf[i]>>4);
-    return (x/2);
+    #ifdef FBUS_ENABLE_RX_RING
+    return m_rx_ring.available();
+    #else
+    return portAvailable();
+    #endif
 }
 
-// Send a packet, this does all the checksuming and padding, just load up the
-// correct info and call this.
-// DONT ADD ANY EXTRA PADDING TO MSGS, ALL DONE HERE
-void FBus::packetSend(packet_t * packet_ptr)
+// Read up to 'max' bytes that are already waiting, returns how many
+uint8_t FBusCore::rxReadSpan(uint8_t * buf, uint8_t max)
 {
-    int count;
-    uint8_t * data_ptr;
-    uint8_t checksum_odd=0,checksum_even=0;
-    data_ptr = (uint8_t*)&(packet_ptr->FrameID);
+    #ifdef FBUS_ENABLE_RX_RING
+    return m_rx_ring.read(buf,max);
+    #else
+    return portRead(buf,max);
+    #endif
+}
 
-    if(packet_ptr->MsgType == FBUSTYPE_ACK_MSG)
+// Pack a given string into reversed octets Eg: "1234" -> 0x21,0x43.  An
+// odd last digit gets 0xF in the high nibble, non-digits are skipped and
+// digits past FBUS_NUMBER_DIGITS dropped.
+void FBusCore::octetPack(const char * instr, uint8_t type, fbus_number_t * out)
+{
+    uint8_t x = 0;
+
+    memset(out->bcd,0,sizeof(out->bcd));
+    out->type = type;
+    for(;*instr && x < FBUS_NUMBER_DIGITS;instr++)
     {
-        // Send the header
-        count = (offsetof(packet_t,padding16)-offsetof(packet_t,FrameID));
-        UINT16_SWAP(packet_ptr->FrameLength);
-        for(int x=0;x<count;x++)
-        {
-            _serialPort.write(data_ptr[x]);
-            if(x&1)
-                checksum_odd ^= data_ptr[x];
-            else
-                checksum_even ^= data_ptr[x];
-        }
-        _serialPort.write(packet_ptr->data[0]);
-        checksum_even ^= packet_ptr->data[0];
-        _serialPort.write(packet_ptr->data[1]);
-        checksum_odd ^= packet_ptr->data[1];
+        if(*instr < '0' || *instr > '9') continue;
+        if(x & 1)
+            out->bcd[x/2] = (out->bcd[x/2] & 0x0F) | ((*instr - '0') << 4);
+        else
+            out->bcd[x/2] = 0xF0 | (*instr - '0');
+        x++;
+    }
+    out->digits = x;
+    return;
+}
+
+// Whether a number string has the digits of a packed number
+bool FBusCore::numberEquals(const char * instr, const fbus_number_t * num)
+{
+    uint8_t x = 0, d;
+
+    for(;*instr;instr++)
+    {
+        if(*instr < '0' || *instr > '9') continue;
+        if(x >= num->digits) return false;
+        d = (x & 1) ? num->bcd[x/2] >> 4 : num->bcd[x/2] & 0x0F;
+        if(d != *instr - '0') return false;
+        x++;
+    }
+    return x == num->digits;
+}
+
+// Hash of the digits of a number
+uint16_t FBusCore::numberHash(const char * instr)
+{
+    uint16_t h = 5381;
+    uint8_t x = 0;
+
+    for(;*instr && x < FBUS_NUMBER_DIGITS;instr++)
+    {
+        if(*instr < '0' || *instr > '9') continue;
+        h = (h << 5) + h + (*instr - '0');
+        x++;
+    }
+    return h;
+}
+uint16_t FBusCore::numberHash(const fbus_number_t * num)
+{
+    uint16_t h = 5381;
+
+    for(uint8_t x=0;x<num->digits;x++)
+        h = (h << 5) + h + ((x & 1) ? num->bcd[x/2] >> 4 : num->bcd[x/2] & 0x0F);
+    return h;
+}
+
+// Build the complete wire frame for a packet into 'wire', returns its
+// length.  This does all the checksuming and padding, the packet itself
+// is not changed.
+//
+// Frames are { header, 0x00 0x01, data, FramesToGo, SeqNo, padding?,
+// checksums } where FrameLength counts from the 0x00 0x01 to the SeqNo.
+// The 0x00 0x01 starts a message, so later frames of a multi-frame
+// message, the ones without the 0x40 SeqNo bit, go without it.  ACKs are
+// built by sendAck().
+uint16_t FBusCore::frameBuild(const packet_t * packet_ptr, uint8_t seq, uint16_t lanes, uint8_t * wire)
+{
+    uint16_t n = 0;
+    uint16_t flen, tail;
+
+    wire[n++] = packet_ptr->FrameID;
+    wire[n++] = packet_ptr->DestDEV;
+    wire[n++] = packet_ptr->SrcDEV;
+    wire[n++] = packet_ptr->MsgType;
+
+    flen = packet_ptr->FrameLength + ((seq & 0x40) ? 4 : 2);
+    wire[n++] = flen >> 8;
+    wire[n++] = flen & 0xFF;
+    if(seq & 0x40)
+    {
+        wire[n++] = 0x00;
+        wire[n++] = 0x01;
+    }
+    lanes ^= fbusXorLanes(wire,n);
+    memcpy(&wire[n],packet_ptr->data,packet_ptr->FrameLength);
+    n += packet_ptr->FrameLength;
+    tail = n;
+    wire[n++] = packet_ptr->FramesToGo;
+    wire[n++] = seq;
+    // Make sure we send an even number of bytes
+    if(flen & 1) wire[n++] = 0x00;
+
+    // Now the checksums.  The header is even so the data lanes line up,
+    // after an odd number of data bytes the tail ones are swapped.
+    tail = fbusXorLanes(&wire[tail],n-tail);
+    if(packet_ptr->FrameLength & 1) tail = (tail >> 8) | (tail << 8);
+    lanes ^= tail;
+    wire[n++] = lanes & 0xFF;
+    wire[n++] = lanes >> 8;
+    return n;
+}
+
+// Send a packet, this does all the checksuming and padding, just load up the
+// correct info and call this.  'seq' is the SeqNo byte, the transmit
+// queue picks it so a resend goes out with the same one.
+// DONT ADD ANY EXTRA PADDING TO MSGS, ALL DONE HERE
+void FBusCore::packetSend(const packet_t * packet_ptr, uint8_t seq)
+{
+    // A driver may still be sending the last frame out of m_tx_wire
+    while(m_tx_busy) {}
+
+    wireSend(m_tx_wire,frameBuild(packet_ptr,seq,fbusXorLanes(packet_ptr->data,packet_ptr->FrameLength),m_tx_wire));
+
+    return;
+}
+
+// Send a queued frame, its data checksum was kept as it was written
+void FBusCore::slotSend(const fbus_tx_slot_t * slot)
+{
+    while(m_tx_busy) {}
+
+    if(slot->alert)
+        wireSend(m_tx_wire,alertBuild(slot,m_tx_wire));
+    else
+        wireSend(m_tx_wire,frameBuild(&slot->pkt,slot->SeqNo,slot->lanes,m_tx_wire));
+
+    return;
+}
+
+// Write byte 'at' of a frame and keep the XOR of the change in its lane
+static inline void fbusPatch(uint8_t * wire, uint8_t at, uint8_t b, uint16_t * lanes)
+{
+    *lanes ^= (uint16_t)(wire[at] ^ b) << ((at & 1) << 3);
+    wire[at] = b;
+}
+
+// Copy an alert's frame out of flash and patch in the SMSC, the number,
+// the digits and the SeqNo.  The checksums only take the XOR of what
+// changed, the rest of the frame is never read again.
+uint16_t FBusCore::alertBuild(const fbus_tx_slot_t * slot, uint8_t * wire)
+{
+    const fbus_alert_t * alert = slot->alert;
+    const fbus_number_t * to = &m_dir[slot->pkt.data[0]];
+    uint8_t len = pgm_read_byte(&alert->len);
+    uint8_t first = pgm_read_byte(&alert->slot);
+    uint8_t digits = pgm_read_byte(&alert->digits);
+    uint16_t lanes = 0, bit, flen;
+    uint8_t x, at, c;
+
+    memcpy_P(wire,pgm_read_ptr(&alert->wire),len);
+
+    fbusPatch(wire,FBUS_WIRE_SMSC,m_smsc.digits ? 1 + (m_smsc.digits+1)/2 : 0,&lanes);
+    fbusPatch(wire,FBUS_WIRE_SMSC+1,m_smsc.type,&lanes);
+    for(x=0;x<sizeof(m_smsc.bcd);x++)
+        fbusPatch(wire,FBUS_WIRE_SMSC+2+x,m_smsc.bcd[x],&lanes);
+    fbusPatch(wire,FBUS_WIRE_DA,to->digits,&lanes);
+    fbusPatch(wire,FBUS_WIRE_DA+1,to->type,&lanes);
+    for(x=0;x<sizeof(to->bcd);x++)
+        fbusPatch(wire,FBUS_WIRE_DA+2+x,to->bcd[x],&lanes);
+
+    // Each digit is 7 bits from septet first+x on, over one or two octets
+    for(x=0;x<digits;x++)
+    {
+        c = slot->pkt.data[1+x];
+        bit = (uint16_t)(first+x)*7;
+        at = FBUS_WIRE_UD + bit/8;
+        bit &= 7;
+        fbusPatch(wire,at,(wire[at] & ~(0x7F << bit)) | (c << bit),&lanes);
+        if(bit > 1)
+            fbusPatch(wire,at+1,(wire[at+1] & (0xFF << (bit-1))) | (c >> (8-bit)),&lanes);
+    }
+
+    // SeqNo is the last byte of the frame length, before any padding
+    flen = ((uint16_t)wire[4] << 8) | wire[5];
+    fbusPatch(wire,6+flen-1,slot->SeqNo,&lanes);
+
+    wire[len-2] ^= lanes & 0xFF;
+    wire[len-1] ^= lanes >> 8;
+    return len;
+}
+
+// Hand a finished wire frame, m_tx_wire or m_ack, to the driver or
+// serial port
+void FBusCore::wireSend(const uint8_t * wire, uint16_t len)
+{
+    if(m_tx_handler)
+    {
+        m_tx_busy = true;
+        m_tx_handler(m_tx_ctx,wire,len);
     }else{
-        packet_ptr->SeqNo = m_out_seqnum++;
-        count = packet_ptr->FrameLength;
-        count += (offsetof(packet_t,data)-offsetof(packet_t,FrameID));
-        if(count&1) packet_ptr->FrameLength++;
-        // Add 2 to FrameLength for the padding16 bytes
-        // Add 1 to FrameLength for the FramesToGo value
-        packet_ptr->FrameLength+=3;
-        packet_ptr->padding16 = 1;
-        UINT16_SWAP(packet_ptr->FrameLength);
-        UINT16_SWAP(packet_ptr->padding16);
-        for(int x=0;x<count;x++)
-        {
-            _serialPort.write(data_ptr[x]);
-            if(x&1)
-                checksum_odd ^= data_ptr[x];
-            else
-                checksum_even ^= data_ptr[x];
-        }
+        portWrite(wire,len);
+    }
+    #ifdef FBUS_ENABLE_STATS
+    m_link.tx_bytes += len;
+    #endif
+    #ifdef FBUS_ENABLE_TRACE
+    m_trace.record(FBUS_TRACE_TX,micros(),wire,len);
+    #endif
+
+    return;
+}
+
+// Start a message in the free transmit slots, false if there are none.
+// Nothing is queued until txEnd(), so a message that turns out not to fit
+// is simply never committed.
+bool FBusCore::txBegin(uint8_t MsgType)
+{
+    packet_t * pkt;
+    if(m_tx_count >= m_tx_slots)
+    {
+        m_tx_stats.full++;
+        return false;
+    }
+    m_txm_slot = txSlot((m_tx_head+m_tx_count)%m_tx_slots);
+    m_txm_slot->lanes = 0;
+    m_txm_slot->alert = NULL;
+    m_txm_room = m_tx_block - 2;
+    pkt = &m_txm_slot->pkt;
+    pkt->FrameID = FBUS_VIA_CABLE;
+    pkt->DestDEV = FBUS_DEV_PHONE;
+    pkt->SrcDEV = FBUS_DEV_HOST;
+    pkt->MsgType = MsgType;
+    pkt->FrameLength = 0;
+    m_txm_frames = 1;
+    m_txm_overflow = false;
+    return true;
+}
 
-        // Now send the last 2 data bytes
-        _serialPort.write(packet_ptr->FramesToGo);
-        _serialPort.write(packet_ptr->SeqNo);
+// Append to the message being built.  The first frame holds two bytes
+// less because frameBuild() puts the 0x00 0x01 in front of it.  The
+// checksum lanes of each frame's data are kept as the bytes go in.
+bool FBusCore::txWrite(const uint8_t * buf, uint16_t len)
+{
+    packet_t * pkt;
+    fbus_tx_slot_t * next;
+    uint16_t n, lanes;
 
-        if(count&1)
+    while(len && !m_txm_overflow)
+    {
+        if(m_txm_room == 0)
         {
-            checksum_odd ^= packet_ptr->FramesToGo;
-            checksum_even ^= packet_ptr->SeqNo;
-        }else{
-            checksum_even ^= packet_ptr->FramesToGo;
-            checksum_odd ^= packet_ptr->SeqNo;
+            // Frame full, carry on in the next slot
+            if(m_tx_count + m_txm_frames >= m_tx_slots)
+            {
+                m_txm_overflow = true;
+                break;
+            }
+            next = txSlot((m_tx_head+m_tx_count+m_txm_frames)%m_tx_slots);
+            m_txm_frames++;
+            memcpy(&next->pkt,&m_txm_slot->pkt,offsetof(packet_t,FrameLength));
+            next->pkt.FrameLength = 0;
+            next->lanes = 0;
+            next->alert = NULL;
+            m_txm_slot = next;
+            m_txm_room = m_tx_block;
+            continue;
         }
+        pkt = &m_txm_slot->pkt;
+        n = len < m_txm_room ? len : m_txm_room;
+        memcpy(&pkt->data[pkt->FrameLength],buf,n);
+        lanes = fbusXorLanes(buf,n);
+        if(pkt->FrameLength & 1) lanes = (lanes >> 8) | (lanes << 8);
+        m_txm_slot->lanes ^= lanes;
+        pkt->FrameLength += n;
+        m_txm_room -= n;
+        buf += n;
+        len -= n;
+    }
+    return !m_txm_overflow;
+}
+// One byte, the packer and the fixed fields go through here
+inline void FBusCore::txByte(uint8_t b)
+{
+    packet_t * pkt = &m_txm_slot->pkt;
 
-        // Make sure we send an even number of bytes
-        if(count&1) _serialPort.write(0);
+    if(m_txm_room == 0)
+    {
+        txWrite(&b,1);
+        return;
     }
-    // Now send the checksums
-    _serialPort.write(checksum_even);
-    _serialPort.write(checksum_odd);
+    m_txm_slot->lanes ^= (uint16_t)b << ((pkt->FrameLength & 1) << 3);
+    pkt->data[pkt->FrameLength++] = b;
+    m_txm_room--;
+    return;
+}
+bool FBusCore::txPut(uint8_t b)
+{
+    txByte(b);
+    return !m_txm_overflow;
+}
 
+// Number the frames with FramesToGo and queue them.  Only the first frame
+// of a message gets the 0x40 SeqNo bit, txService() adds the sequence
+// number.  False, and nothing queued, if the message did not fit.
+bool FBusCore::txEnd()
+{
+    fbus_tx_slot_t * slot;
+    uint32_t now = millis();
+
+    if(m_txm_overflow)
+    {
+        if(m_tx_count == 0) m_tx_stats.too_long++;
+        else m_tx_stats.full++;
+        return false;
+    }
+    for(uint8_t x=0;x<m_txm_frames;x++)
+    {
+        slot = txSlot((m_tx_head+m_tx_count+x)%m_tx_slots);
+        slot->pkt.FramesToGo = m_txm_frames - x;
+        slot->SeqNo = x == 0 ? 0x40 : 0x00;
+        slot->tries = 0;
+        slot->state = FBUS_TXS_QUEUED;
+        slot->queued_ms = now;
+    }
+    m_tx_count += m_txm_frames;
+    txService();
+    return true;
+}
+
+// Write the next FBUS_SYNC_CHUNK bytes of a sync, and start a sync when
+// messages keep going unACKed or everything from the phone is garbage.
+// Frames wait in txService() until the last byte is written, ACKs for
+// the phone still go out between chunks.
+void FBusCore::linkService()
+{
+    uint8_t sync[FBUS_SYNC_CHUNK];
+    uint8_t n;
+
+    if(m_link_state == FBUS_LINK_READY &&
+       ((FBUS_SYNC_AFTER_FAILS && m_link_fails >= FBUS_SYNC_AFTER_FAILS) ||
+        (FBUS_SYNC_AFTER_BAD && m_link_bad >= FBUS_SYNC_AFTER_BAD)))
+    {
+        ResetBus(FBUS_SYNC_BYTES);
+        m_tx_stats.auto_syncs++;
+    }
+    // The TX driver still owns the line, try again next call
+    if(m_link_state != FBUS_LINK_SYNCING || m_tx_busy) return;
+
+    n = m_sync_left < FBUS_SYNC_CHUNK ? m_sync_left : FBUS_SYNC_CHUNK;
+    if(n)
+    {
+        memset(sync,0x55,n);
+        portWrite(sync,n);
+        #ifdef FBUS_ENABLE_STATS
+        m_link.tx_bytes += n;
+        #endif
+        m_sync_left -= n;
+    }
+    if(m_sync_left == 0)
+    {
+        // The 0x55s leave the UART before the first frame starts, as
+        // ResetBus() always waited for them
+        portFlush();
+        // Garbage received while syncing says nothing about the new sync
+        m_link_bad = 0;
+        m_link_state = FBUS_LINK_READY;
+        if(m_link_ready) m_link_ready(m_link_ready_ctx);
+    }
     return;
 }
 
-// 7bit packing algorithm based on
-// GSM 03.38 ­ Alphabets and language­specific information.
+// Send queued frames that fit in the window, oldest first, and resend the
+// ones whose ACK timed out.  Each frame takes the next SeqNo when it is
+// first sent and keeps it, the phone drops a resend it already has.
 //
-// Improved bit packing algorithm based on Embedtronics page.  This
-// overwrites the same buffer so is more efficient
-// max length is 255
-// http://web.archive.org/web/20120712020156/http://www.embedtronics.com/nokia/fbus.html
-uint8_t FBus::BitPack(uint8_t * buffer,uint8_t length)
-{
-    uint8_t holder;
-    uint8_t bucket;
-    uint8_t x=0,shifted=0,i;
-
-    for(i = 0; i < length; i++ )
-    {
-        holder = buffer[i] & 0x7f;
-        holder >>= shifted;
-        bucket = buffer[i+1] & 0x7f;
-        bucket <<= (7-shifted);
-        shifted += 1;
-        holder = holder | bucket;
-        if (shifted >= 7) {
-            shifted = 0;
-            i++;
+// The phone glues the frames of a message together in the order they
+// arrive, so a frame of a multi-frame message only goes out when nothing
+// else is waiting for an ACK, and nothing passes it while it waits.
+void FBusCore::txService()
+{
+    uint32_t now = millis();
+    uint8_t inflight = 0;
+    bool hold = false;
+    bool multi;
+    uint8_t x;
+    fbus_tx_slot_t * slot;
+
+    // Nothing goes between the 0x55 bytes of a sync
+    if(m_link_state == FBUS_LINK_SYNCING) return;
+
+    for(x=0;x<m_tx_count;x++)
+        if(txSlot((m_tx_head+x)%m_tx_slots)->state == FBUS_TXS_SENT) inflight++;
+
+    for(x=0;x<m_tx_count;x++)
+    {
+        slot = txSlot((m_tx_head+x)%m_tx_slots);
+        multi = slot->pkt.FramesToGo > 1 || !(slot->SeqNo & 0x40);
+        if(slot->state == FBUS_TXS_QUEUED)
+        {
+            if(hold || inflight >= m_tx_window || (multi && inflight))
+            {
+                hold = true;
+                continue;
+            }
+            slot->SeqNo |= m_out_seqnum;
+            m_out_seqnum = (m_out_seqnum+1) & 0x07;
+            slot->state = FBUS_TXS_SENT;
+            slot->tries = 1;
+            slot->timeout_ms = m_tx_timeout;
+            slot->sent_ms = now;
+            slotSend(slot);
+            m_tx_stats.frames++;
+            inflight++;
+            if(inflight > m_tx_stats.inflight_max)
+                m_tx_stats.inflight_max = inflight;
+            if(multi) hold = true;
+            continue;
         }
-        buffer[x] = holder;
-        x++;
+        if(slot->state != FBUS_TXS_SENT) continue;
+        if(multi) hold = true;
+        if((uint32_t)(now - slot->sent_ms) < slot->timeout_ms) continue;
+
+        if(slot->tries > m_tx_retries)
+        {
+            // Give up, with the rest of the message if it had more frames
+            m_tx_stats.failed++;
+            m_link_fails++;
+            FBUS_LOG(FBUS_LOG_TX_FAILED,slot->pkt.MsgType,slot->tries);
+            inflight--;
+            txFinish(slot,FBUS_TX_FAILED);
+            while(x+1 < m_tx_count)
+            {
+                slot = txSlot((m_tx_head+x+1)%m_tx_slots);
+                if(slot->state != FBUS_TXS_QUEUED || (slot->SeqNo & 0x40)) break;
+                m_tx_stats.failed++;
+                txFinish(slot,FBUS_TX_FAILED);
+                x++;
+            }
+            continue;
+        }
+        slot->tries++;
+        slot->sent_ms = now;
+        slot->timeout_ms = (slot->timeout_ms >= FBUS_TX_TIMEOUT_MAX/2) ?
+                            FBUS_TX_TIMEOUT_MAX : slot->timeout_ms*2;
+        slotSend(slot);
+        m_tx_stats.resends++;
+    }
+
+    // Retired slots are reused once everything older is done
+    while(m_tx_count && txSlot(m_tx_head)->state == FBUS_TXS_FREE)
+    {
+        m_tx_head = (m_tx_head+1)%m_tx_slots;
+        m_tx_count--;
     }
 
-    return x;
+    return;
 }
 
-// TODO
-// Unpack a 7bit encoded string
-// We will need (length/7) extra bytes for the message
-//uint8_t decode[128];
-uint8_t FBus::BitUnpack(uint8_t * buffer,uint8_t length)
+// Retire the outstanding frame an ACK from the phone refers to.  The ACK
+// carries the MsgType and the low 3 bits of the SeqNo.
+void FBusCore::txAcked(uint8_t MsgType, uint8_t SeqNo)
 {
-    // TODO
+    fbus_tx_slot_t * slot;
+    uint16_t latency;
+    for(uint8_t x=0;x<m_tx_count;x++)
+    {
+        slot = txSlot((m_tx_head+x)%m_tx_slots);
+        if(slot->state != FBUS_TXS_SENT || slot->pkt.MsgType != MsgType ||
+           (slot->SeqNo & 0x07) != (SeqNo & 0x07))
+            continue;
+
+        latency = millis() - slot->queued_ms;
+        m_link_fails = 0;
+        m_tx_stats.acked++;
+        m_tx_stats.latency_last_ms = latency;
+        m_tx_stats.latency_sum_ms += latency;
+        if(latency > m_tx_stats.latency_max_ms)
+            m_tx_stats.latency_max_ms = latency;
+        if(slot->tries > m_tx_stats.tries_max)
+            m_tx_stats.tries_max = slot->tries;
+        #ifdef FBUS_ENABLE_STATS
+        histAdd(&m_link.tx_ms,latency,FBUS_HIST_TX_SHIFT);
+        #endif
+        txFinish(slot,FBUS_TX_ACKED);
+        return;
+    }
+
+    // Late ACK for a frame that was resent and already ACKed, or noise
+    m_tx_stats.stray_acks++;
+    return;
+}
 
-    return 0;
+// Free a finished slot and report it.  The slot is reused once every
+// older slot is free too, see txService().
+void FBusCore::txFinish(fbus_tx_slot_t * slot, uint8_t status)
+{
+    slot->state = FBUS_TXS_FREE;
+    if(status == FBUS_TX_FAILED && slot->pkt.MsgType == FBUSTYPE_REQ_HWSW &&
+       m_hwsw_state == FBUS_HWSW_PENDING)
+        hwswFinish(FBUS_HWSW_FAILED);
+    if(m_tx_done)
+        m_tx_done(m_tx_done_ctx,slot->pkt.MsgType,status,slot->tries,
+                  (uint16_t)(millis() - slot->queued_ms));
+    return;
 }
 
 // Clear all data in a packet
-void FBus::packetReset(packet_t *packet_ptr)
+void FBusCore::packetReset(packet_t *packet_ptr)
 {
-    memset((uint8_t*)packet_ptr,0,sizeof(packet_t));
+    memset((uint8_t*)packet_ptr,0,FBUS_RX_SLOT_BYTES(m_payload));
     return;
 }
 
-// Byte-wise process the data stream
-void FBus::processIncomingByte(uint8_t inbyte, packet_t * pktptr)
-{
-    // TODO
-    // - Add a watchdog timer to this. Reset fieldIndex to zero if no change after a while
-    // - Put this in the Arduino library
-    // - Make a struct that uses this
-    // - Trigger using a serial input interrupt. See http://stackoverflow.com/questions/10201590/arduino-serial-interrupts
-
-    switch (pktptr->input_state)
-    {
-        case 0x00:  // FrameID
-            if ( inbyte == FBUS_VIA_CABLE) {
-                // This is the start of a new packet
-                pktptr->FrameID = inbyte;
-                pktptr->rx_blockIndex = 0;
-                pktptr->packet_state = PACKET_STATE_RECEIVING;
-                pktptr->input_checksum_odd = 0;
-                pktptr->input_checksum_even = 0;
-                pktptr->input_checksum_odd^=inbyte;
-                pktptr->input_state++;
-            } else {
-                pktptr->input_state=0;
-            }
-            break;
-        case 0x01:  // DestDEV
-            if ( inbyte == FBUS_DEV_HOST) {
-                pktptr->DestDEV = inbyte;
-                pktptr->input_state++;
-                pktptr->input_checksum_even^=inbyte;
-            } else {
-                pktptr->input_state=0;
-            }
-            break;
-        case 0x02:  // SrcDEV
-            if ( inbyte == FBUS_DEV_PHONE) {
-                pktptr->SrcDEV = inbyte;
-                pktptr->input_state++;
-                pktptr->input_checksum_odd^=inbyte;
-            } else {
-                pktptr->input_state=0;
-            }
-            break;
-        case 0x03:  // MsgType
-            pktptr->MsgType = inbyte;
-            pktptr->input_checksum_even^=inbyte;
-            pktptr->input_state++;
-            break;
-        case 0x04:  // FrameLengthMSB
-            pktptr->FrameLength = inbyte;
-            pktptr->FrameLength<<=8;
-            pktptr->input_checksum_odd^=inbyte;
-            pktptr->input_state++;
-            break;
-        case 0x05:  // FrameLengthLSB
-            pktptr->FrameLength += inbyte;
-            // If we don't have data, skip to FramesToGo
-            pktptr->input_checksum_even^=inbyte;
-            if(pktptr->FrameLength<=2)
+// Find an empty RX slot and prepare it for the parser
+uint8_t FBusCore::rxSlotAlloc()
+{
+    for(uint8_t x=0;x<m_rx_slots;x++)
+    {
+        if(rxSlot(x)->packet_state == PACKET_STATE_EMPTY)
+            return x;
+    }
+    return FBUS_RX_NONE;
+}
+
+// Queue a completed slot index or FBUS_RX_MSG for the sketch.  There is
+// room for every slot and the reassembly buffer so this cannot overflow.
+void FBusCore::rxFifoPush(uint8_t entry)
+{
+    m_rx_fifo[(m_rx_fifo_head+m_rx_fifo_count)%(m_rx_slots+1)] = entry;
+    m_rx_fifo_count++;
+    if(m_rx_fifo_count > m_rx_stats.queued_max)
+        m_rx_stats.queued_max = m_rx_fifo_count;
+    return;
+}
+
+// Release the frame at the head of the RX FIFO
+void FBusCore::rxFifoPop()
+{
+    uint8_t entry;
+    if(m_rx_fifo_count == 0) return;
+    entry = m_rx_fifo[m_rx_fifo_head];
+    if(entry == FBUS_RX_MSG)
+        m_rx_msg_state = FBUS_RXM_IDLE;
+    else
+        rxSlot(entry)->packet_state = PACKET_STATE_EMPTY;
+    m_rx_fifo_head = (m_rx_fifo_head+1)%(m_rx_slots+1);
+    m_rx_fifo_count--;
+    return;
+}
+
+// Add a frame of a multi-frame message to m_rx_msg.  The phone numbers
+// the frames of a message one after the other and FramesToGo counts down
+// to 1 on the last.  Returns false when the frame must not be ACKed so the
+// phone sends it again later: the last message is still waiting for the
+// sketch, or an earlier frame of this one went missing.  Resends of frames
+// already taken are ACKed again.  A message too long for m_rx_msg is ACKed
+// and dropped so the phone moves on.
+bool FBusCore::rxReassemble(packet_t * pktptr)
+{
+    uint8_t d;
+
+    if(m_rx_msg_state == FBUS_RXM_READY)
+    {
+        m_rx_stats.stalls++;
+        return false;
+    }
+
+    if(m_rx_msg_state != FBUS_RXM_IDLE && pktptr->MsgType == m_rx_msg_type)
+    {
+        d = (pktptr->SeqNo - m_rx_msg_seq) & 0x07;
+        if(d == 0 || d >= 4)
+            return true;
+        if(d != 1)
+            return false;
+        if(!(pktptr->SeqNo & 0x40) && pktptr->FramesToGo + 1 == m_rx_msg_togo)
+        {
+            m_rx_msg_togo = pktptr->FramesToGo;
+            m_rx_msg_seq = pktptr->SeqNo;
+            if(m_rx_msg_state == FBUS_RXM_DISCARD)
             {
-                pktptr->rx_blockIndex=1;
-                pktptr->input_state+=2;
-            }else{
-                pktptr->input_state++;
+                if(m_rx_msg_togo <= 1) m_rx_msg_state = FBUS_RXM_IDLE;
+                return true;
             }
-            break;
-        case 0x06:  // {block}
-            pktptr->data[pktptr->rx_blockIndex] = inbyte;
+            return rxAppend(pktptr);
+        }
+    }
 
-            if(pktptr->rx_blockIndex&1)
+    // Anything else ends the message being collected
+    if(m_rx_msg_state == FBUS_RXM_BUILDING) m_rx_stats.reasm_fail++;
+    m_rx_msg_state = FBUS_RXM_IDLE;
+
+    // Only the first frame can start a message, the others wait for it
+    if(!(pktptr->SeqNo & 0x40))
+        return false;
+    m_rx_msg_state = FBUS_RXM_BUILDING;
+    m_rx_msg_type = pktptr->MsgType;
+    m_rx_msg_len = 0;
+    m_rx_msg_frames = 0;
+    m_rx_msg_togo = pktptr->FramesToGo;
+    m_rx_msg_seq = pktptr->SeqNo;
+    return rxAppend(pktptr);
+}
+
+// Copy a frame onto the end of m_rx_msg and mark the message done once
+// the last frame is in, always returns true
+bool FBusCore::rxAppend(packet_t * pktptr)
+{
+    if(m_rx_msg_len + pktptr->FrameLength > sizeof(m_rx_msg))
+    {
+        m_rx_stats.reasm_fail++;
+        m_rx_msg_state = (m_rx_msg_togo <= 1) ? FBUS_RXM_IDLE : FBUS_RXM_DISCARD;
+        return true;
+    }
+    memcpy(&m_rx_msg[m_rx_msg_len],pktptr->data,pktptr->FrameLength);
+    m_rx_msg_len += pktptr->FrameLength;
+    m_rx_msg_frames++;
+
+    if(m_rx_msg_togo <= 1)
+    {
+        m_rx_msg_state = FBUS_RXM_DONE;
+        m_rx_stats.messages++;
+    }
+    return true;
+}
+
+// Hand a completed message to the handler for its type, after the ACK
+// so a slow handler does not make the phone send it again.  Without one
+// it is queued for PopMessage(), and a frame keeps its slot until then
+// so the parser moves on to a free one.
+void FBusCore::rxDeliver(uint8_t entry)
+{
+    fbus_handler_t fn = NULL;
+    packet_t * pkt = NULL;
+    fbus_msg_t msg;
+
+    if(entry == FBUS_RX_MSG)
+    {
+        msg.MsgType = m_rx_msg_type;
+        msg.frames = m_rx_msg_frames;
+        msg.length = m_rx_msg_len;
+        msg.data = m_rx_msg;
+    }else
+    {
+        pkt = rxSlot(entry);
+        msg.MsgType = pkt->MsgType;
+        msg.frames = 1;
+        msg.length = pkt->FrameLength;
+        msg.data = pkt->data;
+    }
+    // The version reply answers RequestHWSW(), it still goes on to the
+    // sketch like any other message
+    if(msg.MsgType == FBUSTYPE_HWSW && hwswParse(&msg,&m_hwsw))
+    {
+        m_hwsw_valid = true;
+        if(m_hwsw_state == FBUS_HWSW_PENDING) hwswFinish(FBUS_HWSW_DONE);
+    }
+
+    if(m_rx_handlers)
+        fn = (fbus_handler_t)pgm_read_ptr(&m_rx_handlers->fn[msg.MsgType]);
+
+    if(fn)
+    {
+        fn(m_rx_handler_ctx,&msg);
+        if(entry == FBUS_RX_MSG) m_rx_msg_state = FBUS_RXM_IDLE;
+        else pkt->packet_state = PACKET_STATE_EMPTY;
+    }else if(entry == FBUS_RX_MSG)
+    {
+        m_rx_msg_state = FBUS_RXM_READY;
+        rxFifoPush(FBUS_RX_MSG);
+    }else
+    {
+        pkt->packet_state = PACKET_STATE_READY;
+        rxFifoPush(entry);
+        m_rx_active = rxSlotAlloc();
+    }
+    return;
+}
+
+// XOR a run of bytes into the two checksum lanes.  The low byte of the
+// result is the XOR of p[0],p[2],.. and the high byte of p[1],p[3],..
+// AVR has no wide registers so it takes two bytes per step, bigger CPUs
+// fold four bytes per word and split the lanes at the end.
+static uint16_t fbusXorLanes(const uint8_t * p, uint16_t n)
+{
+    uint8_t lane0 = 0, lane1 = 0;
+    #if !defined(__AVR__)
+    uint32_t acc = 0, w;
+    while(n >= 8)
+    {
+        memcpy(&w,p,4);
+        acc ^= w;
+        memcpy(&w,p+4,4);
+        acc ^= w;
+        p += 8;
+        n -= 8;
+    }
+    acc ^= acc >> 16;
+    #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lane0 = acc >> 8;
+    lane1 = acc;
+    #else
+    lane0 = acc;
+    lane1 = acc >> 8;
+    #endif
+    #endif
+    while(n >= 2)
+    {
+        lane0 ^= p[0];
+        lane1 ^= p[1];
+        p += 2;
+        n -= 2;
+    }
+    if(n) lane0 ^= p[0];
+    return lane0 | ((uint16_t)lane1 << 8);
+}
+
+// Header bytes, checked against the table with (inbyte & mask) == match.
+// FrameID, DestDEV, SrcDEV are fixed, MsgType and FrameLength are not.
+static const uint8_t fbus_rx_match[FBUS_RX_BLOCK] PROGMEM = {
+    FBUS_VIA_CABLE, FBUS_DEV_HOST, FBUS_DEV_PHONE, 0x00, 0x00, 0x00 };
+static const uint8_t fbus_rx_mask[FBUS_RX_BLOCK] PROGMEM = {
+    0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00 };
+
+// Byte-wise process the data stream
+//
+// input_state is the field expected next, see the FBUS_RX_ states.  The
+// checksum lanes follow the wire position: input_checksum_odd collects
+// bytes 0,2,4.. (the first checksum byte) and input_checksum_even bytes
+// 1,3,5.. (the second).  The block starts at wire byte 6 so the parity of
+// rx_blockIndex is the parity on the wire.
+//
+// A frame that fails is not simply skipped: the next frame may already
+// have started inside it, after a frame cut short or noise that looked
+// like a header.  rxResync() keeps its bytes to be parsed again.
+void FBusCore::processIncomingByte(uint8_t inbyte, packet_t * pktptr)
+{
+    uint8_t state = m_rx.input_state;
+
+    if(state < FBUS_RX_BLOCK)
+    {
+        if((inbyte & pgm_read_byte(&fbus_rx_mask[state])) != pgm_read_byte(&fbus_rx_match[state]))
+        {
+            if(state == 0 || inbyte != FBUS_VIA_CABLE)
             {
-                pktptr->input_checksum_even^=inbyte;
-            }else{
-                pktptr->input_checksum_odd^=inbyte;
+                // Not a frame from the phone, wait for the next FrameID
+                #ifdef FBUS_ENABLE_STATS
+                m_link.rx_skipped += state + 1;
+                #endif
+                m_rx.input_state = 0;
+                pktptr->packet_state = PACKET_STATE_EMPTY;
+                return;
             }
+            // The header broke off at a FrameID, which starts the next one.
+            // 1E 0C 00 does not overlap itself so nothing before it can.
+            #ifdef FBUS_ENABLE_STATS
+            m_link.rx_skipped += state;
+            #endif
+            state = 0;
+        }
+        if(state == 0)
+        {
+            // This is the start of a new packet
+            m_rx.rx_blockIndex = 0;
+            pktptr->packet_state = PACKET_STATE_RECEIVING;
+            m_rx.input_checksum_odd = 0;
+            m_rx.input_checksum_even = 0;
+        }
+        if(state & 1)
+            m_rx.input_checksum_even ^= inbyte;
+        else
+            m_rx.input_checksum_odd ^= inbyte;
 
-            pktptr->rx_blockIndex++;
-            if(pktptr->rx_blockIndex >= pktptr->FrameLength - 2 )
+        if(state <= 3)
+        {
+            // FrameID, DestDEV, SrcDEV and MsgType sit together in packet_t
+            (&pktptr->FrameID)[state] = inbyte;
+        }else if(state == 4)
+        {
+            pktptr->FrameLength = (uint16_t)inbyte << 8;
+        }else
+        {
+            pktptr->FrameLength |= inbyte;
+            // FramesToGo and SeqNo are always there, the block must fit
+            if(pktptr->FrameLength < 2 || pktptr->FrameLength - 2 > m_payload)
             {
-                pktptr->rx_blockIndex--;
-                pktptr->input_state++;
+                m_rx_stats.oversize++;
+                m_link_bad++;
+                #ifdef FBUS_ENABLE_STATS
+                m_link.rx_skipped += 3;
+                #endif
+                rxResync(pktptr,inbyte);
+                return;
             }
+            // If we don't have data, skip to FramesToGo
+            if(pktptr->FrameLength == 2) state = FBUS_RX_FRAMESTOGO - 1;
+        }
+        m_rx.input_state = state + 1;
+        return;
+    }
+
+    if(state < FBUS_RX_CHECKSUM1)
+    {
+        if(m_rx.rx_blockIndex & 1)
+            m_rx.input_checksum_even ^= inbyte;
+        else
+            m_rx.input_checksum_odd ^= inbyte;
+    }
+
+    switch(state)
+    {
+        case FBUS_RX_BLOCK:
+        {
+            // The store into the slot may alias m_rx, keep the index local
+            uint8_t index = m_rx.rx_blockIndex;
+            pktptr->data[index++] = inbyte;
+            m_rx.rx_blockIndex = index;
+            if(index >= pktptr->FrameLength - 2)
+                m_rx.input_state = FBUS_RX_FRAMESTOGO;
             break;
-        case 0x07:  // FramesToGo
+        }
+        case FBUS_RX_FRAMESTOGO:
             pktptr->FramesToGo = inbyte;
-            if(pktptr->rx_blockIndex&1)
-            {
-                pktptr->input_checksum_odd^=inbyte;
-            }else{
-                pktptr->input_checksum_even^=inbyte;
-            }
-            pktptr->input_state++;
+            m_rx.rx_blockIndex++;
+            m_rx.input_state = FBUS_RX_SEQNO;
             break;
-        case 0x08:
+        case FBUS_RX_SEQNO:
             pktptr->SeqNo = inbyte;
-            if((pktptr->rx_blockIndex+1)&1)
-            {
-                pktptr->input_checksum_odd^=inbyte;
-            }else{
-                pktptr->input_checksum_even^=inbyte;
-            }
-            pktptr->input_state++;
+            m_rx.rx_blockIndex++;
+            // Frames with an odd length are padded to an even one
+            m_rx.input_state = (pktptr->FrameLength & 1) ? FBUS_RX_PADDING : FBUS_RX_CHECKSUM1;
             break;
-        case 0x09:  // 0x00 or oddChecksum
-            if(pktptr->input_checksum_odd!= inbyte)
-                pktptr->packet_state = PACKET_STATE_CHECKSUM_FAIL;
-            pktptr->input_state++;
+        case FBUS_RX_PADDING:
+            m_rx.rx_tail[0] = inbyte;
+            m_rx.rx_blockIndex++;
+            m_rx.input_state = FBUS_RX_CHECKSUM1;
             break;
-        case 0x0A:// Packet complete
-            if(pktptr->input_checksum_even!= inbyte)
+        case FBUS_RX_CHECKSUM1:
+            m_rx.rx_tail[1] = inbyte;
+            if(m_rx.input_checksum_odd != inbyte)
                 pktptr->packet_state = PACKET_STATE_CHECKSUM_FAIL;
-            // Take 2 off the length because the FramesToGo and SeqNum are removed
-            pktptr->FrameLength -= 2;
-
-            if(pktptr->packet_state != PACKET_STATE_CHECKSUM_FAIL)
+            m_rx.input_state = FBUS_RX_CHECKSUM2;
+            break;
+        case FBUS_RX_CHECKSUM2:// Packet complete
+            if(m_rx.input_checksum_even != inbyte ||
+               pktptr->packet_state == PACKET_STATE_CHECKSUM_FAIL)
             {
-                pktptr->packet_state = PACKET_STATE_NEW;
+                m_rx_stats.checksum_fail++;
+                m_link_bad++;
+                FBUS_LOG(FBUS_LOG_BAD,pktptr->MsgType,0);
+                rxResync(pktptr,inbyte);
+                break;
             }
+            // Take 2 off the length because the FramesToGo and SeqNum are removed
+            pktptr->FrameLength -= 2;
+            pktptr->packet_state = PACKET_STATE_NEW;
 
             // Reset the packet rx state info
-            pktptr->input_state=0;
+            m_rx.input_state = 0;
             break;
-        default: 
+        default:
+            // We should never get here, drop the frame
+            m_rx.input_state = 0;
+            pktptr->packet_state = PACKET_STATE_EMPTY;
             break;
-            // We should never get here. Throw error?
     }
 
     return;
 }
 
-// Send an ACK packet for a given MsgType and SeqNo
-void FBus::sendAck(byte MsgType, byte SeqNo )
+// A frame failed, 'inbyte' being its last byte, which is not stored.
+// Noise with a FrameID in it or a frame cut short may hold the start of
+// the next frames, so its bytes from the MsgType on are parsed again
+// before anything new, see rxBackRead().  That loses one frame instead
+// of every frame it ate.
+//
+// The bytes are read back from the packet itself.  A frame found in them
+// is written behind the read position even into the same packet: it
+// starts 3 bytes in or later and its block byte x lands in data[x-6].
+// MsgType, FrameLength and the trailer are not kept in data and are
+// copied to m_rx_back_edge.  A frame failing again while bytes are still
+// being read back puts its own in front of the rest, as long as there is
+// room for them.
+void FBusCore::rxResync(packet_t * pktptr, uint8_t inbyte)
 {
-    // Acknowledge packet
-    outgoingPacket.FrameID = FBUS_VIA_CABLE;
-    outgoingPacket.DestDEV = FBUS_DEV_PHONE;
-    outgoingPacket.SrcDEV = FBUS_DEV_HOST;
-    outgoingPacket.MsgType = FBUSTYPE_ACK_MSG;
-    outgoingPacket.FrameLength = 0x0002;
-    outgoingPacket.data[0] = MsgType;
-    outgoingPacket.data[1] = SeqNo & 0x07;
-
-    packetSend( &outgoingPacket );
+    fbus_rx_span_t spans[FBUS_RX_BACK_SPANS];
+    uint8_t * edge;
+    uint8_t blk = 0, n = 3, count = 0, x;
 
+    if(m_rx_back_count == 0) m_rx_back_used = 0;
+    edge = &m_rx_back_edge[m_rx_back_used];
+    if(m_rx_back_used + 8 <= FBUS_RX_BACK_EDGE && m_rx_back_count + 3 <= FBUS_RX_BACK_SPANS)
+    {
+        edge[0] = pktptr->MsgType;
+        edge[1] = pktptr->FrameLength >> 8;
+        edge[2] = pktptr->FrameLength;
+        if(m_rx.input_state == FBUS_RX_CHECKSUM2)
+        {
+            blk = pktptr->FrameLength - 2;
+            edge[n++] = pktptr->FramesToGo;
+            edge[n++] = pktptr->SeqNo;
+            if(pktptr->FrameLength & 1) edge[n++] = m_rx.rx_tail[0];
+            edge[n++] = m_rx.rx_tail[1];
+            edge[n++] = inbyte;
+        }
+        spans[count].p = edge;
+        spans[count++].n = 3;
+        if(blk)
+        {
+            spans[count].p = pktptr->data;
+            spans[count++].n = blk;
+        }
+        if(n > 3)
+        {
+            spans[count].p = edge + 3;
+            spans[count++].n = n - 3;
+        }
+        for(x=0;x<m_rx_back_count;x++) spans[count++] = m_rx_back[m_rx_back_head+x];
+        memcpy(m_rx_back,spans,count*sizeof(spans[0]));
+        m_rx_back_head = 0;
+        m_rx_back_count = count;
+        m_rx_back_used += n;
+    }
+    m_rx.input_state = 0;
+    pktptr->packet_state = PACKET_STATE_EMPTY;
     return;
 }
 
+// Read up to 'max' of the bytes rxResync() keeps for parsing again,
+// returns how many.  While the parser is 'hunt'ing for a FrameID the
+// bytes before the next one are skipped here.
+uint8_t FBusCore::rxBackRead(uint8_t * buf, uint8_t max, bool hunt)
+{
+    fbus_rx_span_t * span;
+    const uint8_t * at;
+    uint8_t n = 0, k;
 
-// Old functions
-// TODO: Move them into a higher level phone class
+    while(hunt && m_rx_back_count)
+    {
+        span = &m_rx_back[m_rx_back_head];
+        at = (const uint8_t *)memchr(span->p,FBUS_VIA_CABLE,span->n);
+        k = at ? at - span->p : span->n;
+        #ifdef FBUS_ENABLE_STATS
+        m_link.rx_skipped += k;
+        #endif
+        span->p += k;
+        span->n -= k;
+        if(at) break;
+        m_rx_back_head++;
+        m_rx_back_count--;
+    }
+    while(n < max && m_rx_back_count)
+    {
+        span = &m_rx_back[m_rx_back_head];
+        k = span->n < max - n ? span->n : max - n;
+        memcpy(&buf[n],span->p,k);
+        span->p += k;
+        span->n -= k;
+        n += k;
+        if(span->n == 0)
+        {
+            m_rx_back_head++;
+            m_rx_back_count--;
+        }
+    }
+    return n;
+}
 
-String FBus::versionSW()
+// Number of bytes the parser can take before the end of the current
+// frame.  Spans handed to processIncoming() never go past a frame so the
+// caller can act on each completed frame.
+uint16_t FBusCore::rxWant(packet_t * pktptr)
 {
-    #if 0
-    // Return
-    // TODO
-    // - Seek through block to find software version string
-    String sw_version = "";
-    packet_t* _packet = requestHWSW();
-    for (int i = 4; i < 11; i++) {
-        char j = (byte)_packet->block[i];
-        sw_version = String(sw_version + j);
+    uint8_t state = m_rx.input_state;
+    if(state < FBUS_RX_BLOCK)
+        return FBUS_RX_BLOCK - state;
+    if(state == FBUS_RX_CHECKSUM1)
+        return 2;
+    if(state == FBUS_RX_CHECKSUM2)
+        return 1;
+    // Block, FramesToGo, SeqNo and padding are counted by rx_blockIndex
+    return pktptr->FrameLength + (pktptr->FrameLength & 1) + 2 - m_rx.rx_blockIndex;
+}
+
+// Process a span of received bytes that does not go past the end of the
+// current frame, see rxWant().  Block bytes are copied and checksummed a
+// run at a time, only the header and trailer go through the byte parser.
+void FBusCore::processIncoming(const uint8_t * buf, uint16_t len, packet_t * pktptr)
+{
+    uint16_t lanes;
+    uint8_t n;
+
+    while(len)
+    {
+        if(m_rx.input_state != FBUS_RX_BLOCK)
+        {
+            processIncomingByte(*buf++,pktptr);
+            len--;
+            continue;
+        }
+
+        n = pktptr->FrameLength - 2 - m_rx.rx_blockIndex;
+        if(n > len) n = len;
+        memcpy(&pktptr->data[m_rx.rx_blockIndex],buf,n);
+        lanes = fbusXorLanes(buf,n);
+        if(m_rx.rx_blockIndex & 1)
+        {
+            m_rx.input_checksum_even ^= lanes & 0xFF;
+            m_rx.input_checksum_odd ^= lanes >> 8;
+        }else
+        {
+            m_rx.input_checksum_odd ^= lanes & 0xFF;
+            m_rx.input_checksum_even ^= lanes >> 8;
+        }
+        m_rx.rx_blockIndex += n;
+        if(m_rx.rx_blockIndex >= pktptr->FrameLength - 2)
+            m_rx.input_state = FBUS_RX_FRAMESTOGO;
+        buf += n;
+        len -= n;
     }
 
-    return sw_version;
-    #endif
-    return "0";
+    return;
 }
 
-String FBus::versionDate()
+// Send an ACK packet for a given MsgType and SeqNo
+void FBusCore::sendAck(byte MsgType, byte SeqNo )
 {
-    // Return hardware version
-    // TODO
-    // - Seek through block to find date string
-    #if 0
-    String version_date = "";
-    packet_t* _packet = requestHWSW();
-    for (int i = 17; i < 25; i++) {
-        char j = (byte)_packet->block[i];
-        version_date = String(version_date + j );
-    }
-    
-    return version_date;
+    // Acknowledge packet.  ACKs skip the transmit queue, the phone
+    // never ACKs them.  m_ack holds the fixed bytes, only MsgType, SeqNo
+    // and the checksums are written.
+    while(m_tx_busy) {}
+
+    SeqNo &= 0x07;
+    m_ack[6] = MsgType;
+    m_ack[7] = SeqNo;
+    m_ack[8] = FBUS_ACK_EVEN ^ MsgType;
+    m_ack[9] = FBUS_ACK_ODD ^ SeqNo;
+
+    wireSend(m_ack,FBUS_ACK_BYTES);
+    #ifdef FBUS_ENABLE_STATS
+    m_link.acks_sent++;
+    histAdd(&m_link.ack_us,micros() - m_rx_done_us,FBUS_HIST_ACK_SHIFT);
     #endif
-    return "0";
+
+    return;
 }
 
-String FBus::versionHW()
+
+#ifdef FBUS_ENABLE_LOG
+// Store an event for LogDrain(), the whole event or nothing
+void FBusCore::logEvent(uint8_t event, uint8_t a, uint8_t b)
 {
-    #if 0
-    // Return hardware version
-    // TODO
-    // - Seek through block to find hardware version string
-    String hw_version = "";
-    packet_t* _packet = requestHWSW();
-    for (int i = 26; i < 31; i++) {
-        char j = (byte)_packet->block[i];
-        hw_version = String(hw_version + j );
+    if(FBUS_LOG_SIZE - m_log.available() < 3) return;
+    m_log.push(event);
+    m_log.push(a);
+    m_log.push(b);
+    return;
+}
+#endif
+
+// Take the version out of a HWSW reply.  After the 0x00 0x01 header and
+// 0x00 0x03 0x00 comes "V 05.27\n12-05-03\nNHM-5\n(c) NMP.", software
+// version, date and model one a line.  hwsw is only written when all
+// three are there.
+bool FBusCore::hwswParse(const fbus_msg_t * msg, fbus_hwsw_t * hwsw)
+{
+    const uint8_t * p = msg->data;
+    const uint8_t * end = msg->data + msg->length;
+    const uint8_t * line[3];
+    uint8_t len[3];
+    uint8_t n;
+
+    // Find the "V " the text starts with
+    while(p + 1 < end && !(p[0] == 'V' && p[1] == ' ')) p++;
+    if(p + 1 >= end) return false;
+    p += 2;
+
+    for(n=0;n<3;n++)
+    {
+        line[n] = p;
+        while(p < end && *p != '\n') p++;
+        if(p == end) return false;
+        len[n] = (p - line[n] > FBUS_HWSW_FIELD_MAX) ? FBUS_HWSW_FIELD_MAX : p - line[n];
+        p++;
     }
-    
-    return hw_version;
-    #endif
-    return "0";
+    memcpy(hwsw->sw,line[0],len[0]);
+    hwsw->sw[len[0]] = 0;
+    memcpy(hwsw->date,line[1],len[1]);
+    hwsw->date[len[1]] = 0;
+    memcpy(hwsw->model,line[2],len[2]);
+    hwsw->model[len[2]] = 0;
+    return true;
+}
+
+// End the pending HWSW request and report it
+void FBusCore::hwswFinish(uint8_t state)
+{
+    m_hwsw_state = state;
+    if(m_hwsw_done)
+        m_hwsw_done(m_hwsw_ctx,state,state == FBUS_HWSW_DONE ? &m_hwsw : NULL);
+    return;
 }
 
 // eof
@@ -10,10 +10,143 @@
 
 #include "Arduino.h"
 #include "stdint.h"
+#include "FBusRing.h"
+#include "FBusPort.h"
+#include "FBusGSM.h"
+#include "FBusTrace.h"
 
 // Uncomment this to enable some debug functions inside the class
 //#define FBUS_ENABLE_DEBUG
 
+// The sizes below are the defaults of FBus.  FBusSized<PAYLOAD,RX_SLOTS,
+// TX_SLOTS,PORT> sets them and the transport per object at compile time,
+// see the end of this file and FBusPort.h.
+
+// Number of receive frame slots.  One slot is filled by the parser while
+// the others hold completed frames until the sketch pops them.  Each slot
+// costs FBUS_RX_SLOT_BYTES() of RAM, see FBUS_RX_POOL_BYTES.
+#ifndef FBUS_RX_SLOTS
+#define FBUS_RX_SLOTS   2
+#endif
+
+// Uncomment this to receive through ReceiveByteISR() instead of polling the
+// serial port.  Bytes are queued in a lock-free ring by the UART RX interrupt
+// and process() only parses what the interrupt already captured.
+//#define FBUS_ENABLE_RX_RING
+
+// Uncomment this to keep link statistics and latency histograms, read
+// with GetLinkStats().  Costs 103 bytes of RAM on AVR, fbus_link_stats_t
+// and a timestamp, about 400 bytes of code and a few cycles a byte, see
+// Firmware/bench.
+//#define FBUS_ENABLE_STATS
+
+// Uncomment this to record every byte to and from the phone in a binary
+// trace, sent to the PC with TraceDrain().  See FBusTrace.h.
+//#define FBUS_ENABLE_TRACE
+
+// Size of the trace ring, a power of two from 256 up
+#ifndef FBUS_TRACE_SIZE
+#define FBUS_TRACE_SIZE     256
+#endif
+
+// Uncomment this to keep a log of link events, printed to the PC with
+// LogDrain() from the loop.  process() only stores three bytes an event,
+// nothing is printed between a frame and its ACK.
+//#define FBUS_ENABLE_LOG
+
+// Size of the log ring, a power of two up to 128, 3 bytes an event
+#ifndef FBUS_LOG_SIZE
+#define FBUS_LOG_SIZE       32
+#endif
+
+// Size of the interrupt receive ring, a power of two up to 128
+#ifndef FBUS_RX_RING_SIZE
+#define FBUS_RX_RING_SIZE   64
+#endif
+
+// Number of transmit queue slots.  Every slot can be on the wire at once
+// waiting for its ACK, the 3-bit SeqNo allows no more than 7 outstanding
+// frames.  Each slot costs about sizeof(packet_t) bytes of RAM.
+#ifndef FBUS_TX_SLOTS
+#define FBUS_TX_SLOTS   2
+#endif
+#if FBUS_TX_SLOTS < 1 || FBUS_TX_SLOTS > 7
+#error "FBUS_TX_SLOTS must be 1 to 7"
+#endif
+
+// Time to wait for the phone's ACK before the first resend.  Each resend
+// doubles it, up to FBUS_TX_TIMEOUT_MAX.  SetTxTimeout() changes both
+// the timeout and the resend count at run time.
+#ifndef FBUS_TX_TIMEOUT_MS
+#define FBUS_TX_TIMEOUT_MS      250
+#endif
+#ifndef FBUS_TX_TIMEOUT_MAX
+#define FBUS_TX_TIMEOUT_MAX     2000
+#endif
+#ifndef FBUS_TX_RETRIES
+#define FBUS_TX_RETRIES         3
+#endif
+
+// 0x55 bytes initialize() sends so the phone's UART finds the bit rate,
+// and the most of them process() writes in one call.  A chunk fits the
+// serial driver's transmit buffer, so the loop never waits on the line.
+#ifndef FBUS_SYNC_BYTES
+#define FBUS_SYNC_BYTES         128
+#endif
+#ifndef FBUS_SYNC_CHUNK
+#define FBUS_SYNC_CHUNK         16
+#endif
+
+// The bus is synced again by itself after this many messages in a row
+// were never ACKed, or this many frames in a row from the phone were bad.
+// 0 turns either off.
+#ifndef FBUS_SYNC_AFTER_FAILS
+#define FBUS_SYNC_AFTER_FAILS   2
+#endif
+#ifndef FBUS_SYNC_AFTER_BAD
+#define FBUS_SYNC_AFTER_BAD     8
+#endif
+
+// Time RequestHWSW() waits for the version reply, resends of the request
+// included.  The default outlasts every resend at the default timeouts.
+#ifndef FBUS_HWSW_TIMEOUT_MS
+#define FBUS_HWSW_TIMEOUT_MS    5000
+#endif
+
+// Characters kept of each version field, the NUL not counted
+#ifndef FBUS_HWSW_FIELD_MAX
+#define FBUS_HWSW_FIELD_MAX     11
+#endif
+
+// Largest block in one frame, counting the 0x00 0x01 at the start of a
+// message.  Longer messages are split into several frames, the same way
+// gnokii splits them.  A smaller PAYLOAD lowers it.
+#ifndef FBUS_FRAME_BLOCK_MAX
+#define FBUS_FRAME_BLOCK_MAX    120
+#endif
+
+// A frame from the phone stops arriving part way when the phone resets
+// or the cable is pulled.  process() drops it once the line has been
+// quiet this long, so the next frame is not taken for the rest of it.
+#ifndef FBUS_RX_GAP_MS
+#define FBUS_RX_GAP_MS          10
+#endif
+
+// Size of the buffer multi-frame messages from the phone are reassembled
+// in.  Messages longer than this are dropped.
+#ifndef FBUS_RX_MSG_MAX
+#define FBUS_RX_MSG_MAX         256
+#endif
+
+// Septets in one SMS, and in one part of a concatenated SMS after the
+// 6 octet user data header and its fill bit
+#define FBUS_SMS_SEPTETS        160
+#define FBUS_SMS_PART_SEPTETS   153
+
+// Digits in the numeric slot of an alert, see SendAlert().  They wait in
+// the transmit slot with the recipient, as ASCII.
+#define FBUS_ALERT_DIGITS       7
+
 // The types are defined in
 // GSM 03.40 ­ Technical realization of the Short Message Service (SMS) Point­to­Point (PP).
 typedef enum{
@@ -22,6 +155,98 @@ typedef enum{
     NUMTYPE_NATIONAL = 0xA1,
 }fbus_number_type_e;
 
+// Longest phone number, an SMS submit has 10 octets for it
+#define FBUS_NUMBER_DIGITS  20
+
+// A phone number packed the way an SMS submit carries it, two digits an
+// octet with the first in the low nibble and 0xF after an odd last digit.
+// Octets after the number are 0.
+typedef struct {
+    uint8_t digits;             // Number of digits, 0 for none
+    uint8_t type;               // fbus_number_type_e
+    uint8_t bcd[FBUS_NUMBER_DIGITS/2];
+}fbus_number_t;
+
+// Number of recipients AddRecipient() keeps packed, each costs
+// sizeof(fbus_number_t)+2 bytes of RAM
+#ifndef FBUS_DIR_SIZE
+#define FBUS_DIR_SIZE   8
+#endif
+#if FBUS_DIR_SIZE < 1 || FBUS_DIR_SIZE > 254
+#error "FBUS_DIR_SIZE must be 1 to 254"
+#endif
+
+// Handle of a recipient in the directory
+typedef uint8_t fbus_recipient_t;
+#define FBUS_RECIPIENT_NONE 0xFF
+
+// Numbers known at build time are packed by the compiler, non-digits are
+// skipped as at run time:
+//   static const fbus_number_t oncall = FBUS_NUMBER("15622834051",NUMTYPE_UNKNOWN);
+//   fbus_recipient_t to = myPhone.AddRecipient(oncall);
+#define FBUS_NUMBER(num,numtype) \
+    fbusNumber((num),(numtype),fbus_make_index<FBUS_NUMBER_DIGITS/2>::type())
+
+template<uint8_t... I> struct fbus_index {};
+template<uint8_t N, uint8_t... I> struct fbus_make_index : fbus_make_index<N-1,N-1,I...> {};
+template<uint8_t... I> struct fbus_make_index<0,I...> { typedef fbus_index<I...> type; };
+
+// Digits in a number, at most FBUS_NUMBER_DIGITS
+constexpr uint8_t fbusDigits(const char * s, uint8_t n = 0)
+{
+    return (*s == 0 || n == FBUS_NUMBER_DIGITS) ? n :
+           fbusDigits(s+1,(*s >= '0' && *s <= '9') ? n+1 : n);
+}
+
+// Value of digit k of a number
+constexpr uint8_t fbusDigit(const char * s, uint8_t k)
+{
+    return (*s >= '0' && *s <= '9') ? (k == 0 ? *s - '0' : fbusDigit(s+1,k-1)) :
+           fbusDigit(s+1,k);
+}
+
+// Octet i of a packed number with 'n' digits
+constexpr uint8_t fbusBcd(const char * s, uint8_t n, uint8_t i)
+{
+    return 2*i >= n ? 0 :
+           fbusDigit(s,2*i) | ((2*i+1 < n ? fbusDigit(s,2*i+1) : 0x0F) << 4);
+}
+
+template<uint8_t... I>
+constexpr fbus_number_t fbusNumber(const char * s, uint8_t type, fbus_index<I...>)
+{
+    return fbus_number_t{ fbusDigits(s), type, { fbusBcd(s,fbusDigits(s),I)... } };
+}
+
+// Where smsHeader() puts the fields of a submit, by offset into its block
+// from the frame's 0x00 0x01 on, as in fbus_msg_t::data.  The header is
+// 0x00 0x01 0x00 0x01 0x02 0x00, the SMSC, the first octet, MR, PID, DCS,
+// the user data length, the destination, the validity period and a zero
+// timestamp.  SendAlert() and Firmware/packer read frames by them, a
+// first frame on the wire has them FBUS_SUBMIT_WIRE() bytes in.
+#define FBUS_SUBMIT_SMSC        6       // Octets with the type, type, 10 octets
+#define FBUS_SUBMIT_FIRST       (FBUS_SUBMIT_SMSC+2+FBUS_NUMBER_DIGITS/2)
+#define FBUS_SUBMIT_MR          (FBUS_SUBMIT_FIRST+1)   // Then PID and DCS
+#define FBUS_SUBMIT_UDL         (FBUS_SUBMIT_MR+3)      // User data length in septets
+#define FBUS_SUBMIT_DA          (FBUS_SUBMIT_UDL+1)     // Digits, type, 10 octets
+#define FBUS_SUBMIT_VP          (FBUS_SUBMIT_DA+2+FBUS_NUMBER_DIGITS/2)
+#define FBUS_SUBMIT_UD          (FBUS_SUBMIT_VP+7)      // Packed user data
+#define FBUS_SUBMIT_WIRE(at)    (6+(at))
+
+// An SMS encoded ahead of time into one whole frame, the wire bytes and
+// this both in flash.  The frame has no SMSC and no number, SendAlert()
+// patches them in with the SeqNo and the digits of the numeric slot, a
+// run of septets in the text.  Firmware/packer's fbuspack template builds
+// them with the library itself:
+//   static const uint8_t pumpLow_wire[] PROGMEM = { 0x1E, 0x00, 0x0C, ... };
+//   static const fbus_alert_t pumpLow PROGMEM = { pumpLow_wire, 74, 16, 3 };
+typedef struct {
+    const uint8_t * wire;       // In flash
+    uint8_t len;                // Wire bytes, checksums included
+    uint8_t slot;               // First septet of the slot in the text
+    uint8_t digits;             // Its length, 0 for none
+}fbus_alert_t;
+
 // States used in packet processing
 #define PACKET_STATE_EMPTY          0       // Packet is empty
 #define PACKET_STATE_NEW            1       // Packet just received, not ACKed
@@ -33,47 +258,300 @@ typedef enum{
 
 // MsgTypes as defined in Gnokii Project
 #define FBUSTYPE_REQ_HWSW   0xD1    // Request hardware and software information
+#define FBUSTYPE_HWSW       0xD2    // Hardware and software information reply
 #define FBUSTYPE_ACK_MSG    0x7F    // ACK type
 #define FBUSTYPE_SMS        0x02    // SMS related functions
 
 
-// The ordering of this struct is important, this matches
-// the FBus frame starting with FrameID, this way we can
-// just send the array without extra processing.
-typedef struct {
-    uint8_t input_state;
-    uint8_t input_checksum_odd;
-    uint8_t input_checksum_even;
+// Most block bytes a frame slot can hold, the largest PAYLOAD
+#define FBUS_PAYLOAD_MAX    128
+
+// The ordering of this struct is important, the parser stores FrameID
+// to MsgType by their position in the frame.  Packed so hosts that
+// align uint16_t keep the AVR layout.  On transmit data[] holds the
+// block after the 0x00 0x01 that packetSend() puts in front of it.
+//
+// The slots of an FBus are cut short after PAYLOAD bytes of data[],
+// nothing past that is ever touched.  A packet_t of its own holds the
+// largest frame.
+typedef struct __attribute__((packed)) {
     uint8_t packet_state;
-    uint8_t rx_blockIndex;
     uint8_t FramesToGo;
     uint8_t SeqNo;
-    // NOTE: Start transmit here
     uint8_t FrameID;
     uint8_t DestDEV;
     uint8_t SrcDEV;
     uint8_t MsgType;
     uint16_t FrameLength;
-    uint16_t padding16;
-    uint8_t data[128];
+    uint8_t data[FBUS_PAYLOAD_MAX];
 }packet_t;
 
-class FBus {
+#if FBUS_FRAME_BLOCK_MAX > FBUS_PAYLOAD_MAX
+#error "FBUS_FRAME_BLOCK_MAX must fit packet_t::data"
+#endif
+
+// State of the frame being parsed, one per FBus whatever the number of
+// slots.  The checksum lanes and the block index follow the wire
+// position, see FBusCore::processIncomingByte().
+typedef struct {
+    uint8_t input_state;
+    uint8_t input_checksum_odd;
+    uint8_t input_checksum_even;
+    uint8_t rx_blockIndex;
+    uint8_t rx_tail[2];         // Padding and first checksum byte as received
+}fbus_rx_parser_t;
+
+// A run of bytes of a dropped frame the parser reads again, see
+// FBusCore::rxResync().  Two levels of frames dropped inside a dropped frame
+// fit.
+typedef struct {
+    const uint8_t * p;
+    uint8_t n;
+}fbus_rx_span_t;
+
+#define FBUS_RX_BACK_SPANS  6
+#define FBUS_RX_BACK_EDGE   16
+
+// A complete message from the phone, either one frame or several
+// reassembled.  data starts at the 0x00 0x01 of the first frame.
+typedef struct {
+    uint8_t MsgType;
+    uint8_t frames;             // Frames it arrived in
+    uint16_t length;            // Bytes in data
+    const uint8_t * data;
+}fbus_msg_t;
+
+// Called from process() with each complete message from the phone, after
+// it is ACKed.  The message is only valid during the call.  A handler may
+// queue sends but must not call process().
+typedef void (*fbus_handler_t)(void * ctx, const fbus_msg_t * msg);
+
+// A handler for every MsgType, indexed by it.  Built by the compiler with
+// FBUS_HANDLERS and kept in flash.
+typedef struct {
+    fbus_handler_t fn[256];
+}fbus_handler_table_t;
+
+typedef struct {
+    uint8_t MsgType;
+    fbus_handler_t fn;
+}fbus_handler_entry_t;
+
+// Handler table for SetHandlers().  Types not listed go to 'fallback', or
+// with NULL to the receive FIFO for PopMessage() as before:
+//   FBUS_HANDLERS(phoneHandlers,onOther,
+//       FBUS_ON(FBUSTYPE_SMS,onSMS),
+//       FBUS_ON(FBUSTYPE_HWSW,onHWSW));
+//   myPhone.SetHandlers(&phoneHandlers,NULL);
+#define FBUS_ON(type,fn)    fbus_handler_entry_t{ (type), (fn) }
+#define FBUS_HANDLERS(name,fallback,...) \
+    static constexpr fbus_handler_entry_t name##_on[] = { __VA_ARGS__ }; \
+    static constexpr fbus_handler_table_t name PROGMEM = \
+        fbusHandlerTable(name##_on,sizeof(name##_on)/sizeof(name##_on[0]),(fallback), \
+                         fbus_make_index<128>::type())
+
+// Handler of one MsgType, the last entry listed for it wins
+constexpr fbus_handler_t fbusHandlerFind(uint8_t type, const fbus_handler_entry_t * on,
+                                         uint8_t n, fbus_handler_t fallback)
+{
+    return n == 0 ? fallback :
+           on[n-1].MsgType == type ? on[n-1].fn : fbusHandlerFind(type,on,n-1,fallback);
+}
+
+template<uint8_t... I>
+constexpr fbus_handler_table_t fbusHandlerTable(const fbus_handler_entry_t * on, uint8_t n,
+                                                fbus_handler_t fallback, fbus_index<I...>)
+{
+    return fbus_handler_table_t{ { fbusHandlerFind(I,on,n,fallback)...,
+                                   fbusHandlerFind(I+128,on,n,fallback)... } };
+}
+
+// Version of the phone from the HWSW reply, "V 05.27\n12-05-03\nNHM-5\n"
+// on a 3310.  Longer fields are cut short.
+typedef struct {
+    char sw[FBUS_HWSW_FIELD_MAX+1];     // Software version, "05.27"
+    char date[FBUS_HWSW_FIELD_MAX+1];   // Software date, "12-05-03"
+    char model[FBUS_HWSW_FIELD_MAX+1];  // Hardware model, "NHM-5"
+}fbus_hwsw_t;
+
+// State of the last RequestHWSW(), see HWSWState()
+#define FBUS_HWSW_IDLE      0       // Never requested
+#define FBUS_HWSW_PENDING   1       // Waiting for the reply
+#define FBUS_HWSW_DONE      2       // Reply parsed, GetHWSW() has it
+#define FBUS_HWSW_TIMEOUT   3       // No reply in time
+#define FBUS_HWSW_FAILED    4       // The phone never ACKed the request
+
+// Called once a request is done, timed out or failed.  'hwsw' is the
+// cached version, NULL unless the state is FBUS_HWSW_DONE.
+typedef void (*fbus_hwsw_done_t)(void * ctx, uint8_t state, const fbus_hwsw_t * hwsw);
+
+// Events of the log, each with two bytes, see LogDrain()
+#define FBUS_LOG_NEW        'N'     // Frame handed up: MsgType, SeqNo
+#define FBUS_LOG_DUP        'D'     // Resent frame ACKed again: MsgType, SeqNo
+#define FBUS_LOG_BAD        'C'     // Frame with a bad checksum: MsgType, 0
+#define FBUS_LOG_TX_FAILED  'F'     // Frame never ACKed: MsgType, tries
+#define FBUS_LOG_SYNC       'S'     // Bus sync started: 0x55 bytes, 0
+
+// ACK frame on the wire: header, MsgType, SeqNo and the checksums
+#define FBUS_ACK_BYTES      10
+
+// State of the bus, see LinkState()
+#define FBUS_LINK_DOWN      0       // initialize() not called yet
+#define FBUS_LINK_SYNCING   1       // process() is sending the 0x55 bytes
+#define FBUS_LINK_READY     2       // Frames go out
+
+// Called from process() each time a sync is done and frames go out again
+typedef void (*fbus_link_ready_t)(void * ctx);
+
+// Largest frame on the wire for a payload: header, 0x00 0x01, data,
+// FramesToGo, SeqNo, padding and checksums
+#define FBUS_TX_WIRE_BYTES(payload) (6+2+(payload)+2+1+2)
+#define FBUS_TX_FRAME_MAX   FBUS_TX_WIRE_BYTES(FBUS_PAYLOAD_MAX)
+
+// A driver that sends finished frames, for example from the UART TX
+// interrupt or by DMA.  It must call FBusCore::TxComplete() when done.
+typedef void (*fbus_tx_handler_t)(void * ctx, const uint8_t * wire, uint16_t len);
+
+// RAM used by one receive slot and by the pool of the default FBus
+#define FBUS_RX_SLOT_BYTES(payload) (offsetof(packet_t,data)+(payload))
+#define FBUS_RX_POOL_BYTES  (FBUS_RX_SLOTS*FBUS_RX_SLOT_BYTES(FBUS_PAYLOAD_MAX))
+
+// Outcome of a queued frame, passed to the fbus_tx_done_t callback
+#define FBUS_TX_ACKED       0       // The phone ACKed the frame
+#define FBUS_TX_FAILED      1       // No ACK after all the resends
+
+// Called when a queued frame is ACKed or given up on.  'tries' counts
+// every time the frame went on the wire, 'latency_ms' runs from the
+// send call to the ACK.
+typedef void (*fbus_tx_done_t)(void * ctx, uint8_t MsgType, uint8_t status,
+                               uint8_t tries, uint16_t latency_ms);
+
+// One transmit queue slot
+typedef struct {
+    uint8_t state;              // FBUS_TXS_ state, see FBus.cpp
+    uint8_t SeqNo;              // SeqNo on the wire, kept for resends
+    uint8_t tries;              // Times sent so far
+    uint16_t timeout_ms;        // Current ACK timeout, doubles on resend
+    uint32_t queued_ms;         // When the sketch queued the frame
+    uint32_t sent_ms;           // When it last went on the wire
+    uint16_t lanes;             // XOR of the even data bytes, odd ones << 8
+    const fbus_alert_t * alert; // Frame in flash, pkt.data has the recipient
+                                // and digits, or NULL for the frame in pkt
+    packet_t pkt;
+}fbus_tx_slot_t;
+
+// RAM used by one transmit slot, rounded up so the next stays aligned,
+// and by the queue of the default FBus
+#define FBUS_TX_SLOT_BYTES(payload) \
+    ((offsetof(fbus_tx_slot_t,pkt)+offsetof(packet_t,data)+(payload)+alignof(fbus_tx_slot_t)-1) \
+     / alignof(fbus_tx_slot_t) * alignof(fbus_tx_slot_t))
+#define FBUS_TX_POOL_BYTES  (FBUS_TX_SLOTS*FBUS_TX_SLOT_BYTES(FBUS_PAYLOAD_MAX))
+
+// Transmit counters, read with GetTXStats()
+typedef struct {
+    uint16_t frames;            // Frames sent for the first time
+    uint16_t resends;           // Frames sent again after an ACK timeout
+    uint16_t acked;             // Frames the phone ACKed
+    uint16_t failed;            // Frames dropped after FBUS_TX_RETRIES resends
+    uint16_t full;              // Send calls refused because the queue was full
+    uint16_t too_long;          // Messages needing more frames than there are slots
+    uint16_t sms_parts;         // SendLongSMS() parts queued
+    uint16_t alerts;            // SendAlert() frames queued
+    uint16_t stray_acks;        // ACKs that matched no outstanding frame
+    uint16_t syncs;             // Bus syncs, initialize() and ResetBus() included
+    uint16_t auto_syncs;        // Of which started because the link looked lost
+    uint8_t inflight_max;       // Most frames ever waiting for an ACK
+    uint8_t tries_max;          // Most tries any ACKed frame needed
+    uint16_t latency_last_ms;   // Send call to ACK of the last ACKed frame
+    uint16_t latency_max_ms;
+    uint32_t latency_sum_ms;    // Divide by 'acked' for the mean
+}fbus_tx_stats_t;
+
+// Latency histograms have FBUS_HIST_BUCKETS power of two buckets.  Bucket
+// 0 counts values below 1 << shift, bucket k values from 1 << (shift+k-1)
+// and the last everything above.  Counts stop at 0xFFFF.
+#define FBUS_HIST_BUCKETS   8
+#define FBUS_HIST_ACK_SHIFT 6       // ACK turnaround in us: <64 .. >=4096
+#define FBUS_HIST_TX_SHIFT  4       // Send to ACK in ms: <16 .. >=1024
+
+typedef struct {
+    uint16_t bucket[FBUS_HIST_BUCKETS];
+}fbus_hist_t;
+
+// Receive counters, read with GetRXStats()
+typedef struct {
+    uint16_t frames;            // Frames received and queued or handed to a handler
+    uint16_t checksum_fail;     // Frames dropped because of a bad checksum
+    uint16_t stalls;            // process() calls that found every slot full
+    uint8_t queued_max;         // Most frames ever waiting in the FIFO
+    uint16_t ring_overflow;     // Bytes lost because the RX ring was full, up to 255
+    uint16_t oversize;          // Frames too long for packet_t::data, dropped
+    uint16_t messages;          // Multi-frame messages reassembled
+    uint16_t reasm_fail;        // Multi-frame messages dropped: out of order or too long
+    uint16_t timeouts;          // Frames dropped after FBUS_RX_GAP_MS of silence
+    uint16_t resyncs;           // Frames found inside the bytes of a dropped one
+    uint16_t dups;              // Resent frames ACKed again, not handed up twice
+}fbus_rx_stats_t;
+
+// Everything known about the link, copied out by GetLinkStats()
+typedef struct {
+    fbus_rx_stats_t rx;
+    fbus_tx_stats_t tx;
+    uint32_t rx_bytes;          // Bytes read from the phone
+    uint32_t tx_bytes;          // Bytes written to it, ACKs included
+    uint32_t rx_skipped;        // Bytes thrown away hunting for a frame header
+    uint16_t acks_sent;         // ACKs sent for received frames
+    fbus_hist_t ack_us;         // Last byte of a frame to its ACK written
+    fbus_hist_t tx_ms;          // Send call to the phone's ACK
+}fbus_link_stats_t;
+
+// Where an FBusSized keeps its frames, handed to FBusCore
+typedef struct {
+    uint8_t * rx_pool;          // RX_SLOTS receive slots
+    uint8_t * rx_fifo;          // RX_SLOTS+1 FIFO entries
+    uint8_t * tx_pool;          // TX_SLOTS transmit slots
+    uint8_t * tx_wire;          // FBUS_TX_WIRE_BYTES(PAYLOAD)
+    uint8_t payload;            // PAYLOAD
+    uint8_t rx_slots;
+    uint8_t tx_slots;
+}fbus_storage_t;
+
+// The protocol engine.  Its code is the same for every size, FBusSized
+// only adds the storage, so objects of several sizes share the flash.
+class FBusCore {
+    // Firmware/bench times the private hot paths directly, Firmware/trace
+    // replays captured bytes through the parser
+    friend class FBusBench;
+    friend class FBusTraceReplay;
+
+    protected:
+        // Takes the transport and the storage of the derived class
+        FBusCore(const fbus_port_ops_t * port_ops, void * port, const fbus_storage_t & store);
+
     public:
-        // Constructor for FBus class, associates the serial port
-        // with the member reference
-        FBus(HardwareSerial & serialPort);
 
         // The 'process' routine is used for polling the serial port for data
-        // from the phone.  All 'NEW' packets are ACKed and then marked as 'READY'
+        // from the phone.  All 'NEW' packets are ACKed and then marked as 'READY',
+        // or handed to their handler, see SetHandlers().  ACKs from the phone
+        // retire queued frames, and frames still waiting for one are sent again.
         void process();
 
-        // Prepare phone for communication
+        // Prepare phone for communication.  Returns at once, process()
+        // syncs the bus and frames queued meanwhile wait for it.
         void initialize();
 
-        // This 'resets' the FBus by sending 0x55 to the phone 'count' times
+        // This 'resets' the FBus by sending 0x55 to the phone 'count' times.
+        // Returns at once, process() writes FBUS_SYNC_CHUNK of them a call
+        // and holds queued frames back until all are out.
         void ResetBus(uint8_t count);
 
+        // FBUS_LINK_ state of the bus, and whether frames go out
+        uint8_t LinkState();
+        bool LinkReady();
+
+        // Called from process() each time a sync is done
+        void SetLinkReadyHandler(fbus_link_ready_t handler, void * ctx);
+
         // Returns the current state of the packet,  The states are in the FBus.h header
         // file and represent the current state of the packet, if it is being received, if
         // is new and needs an ACK, or if it is ready to be processed
@@ -82,24 +560,168 @@ class FBus {
         // Marks a packet as empty
         void ClearPacket();
 
+        // Takes the oldest completed frame off the receive FIFO, returns NULL
+        // if there is none.  The frame stays valid until the next process().
+        packet_t* PopPacket();
+
+        // Takes the oldest completed message off the receive FIFO, false if
+        // there is none.  Multi-frame messages are only returned here,
+        // PopPacket() skips them.  msg->data stays valid until the next
+        // process().
+        bool PopMessage(fbus_msg_t * msg);
+
+        // Number of completed frames and messages waiting in the receive FIFO
+        uint8_t PacketsWaiting();
+
+        // Hand completed messages to the handlers of a FBUS_HANDLERS table
+        // instead of the receive FIFO.  A lookup is one read of the table
+        // whatever the number of types.  NULL goes back to the FIFO.
+        void SetHandlers(const fbus_handler_table_t * table, void * ctx);
+
+        // Receive counters, see fbus_rx_stats_t
+        const fbus_rx_stats_t* GetRXStats();
+
+        #ifdef FBUS_ENABLE_STATS
+        // Copy every counter and histogram at once, optionally starting
+        // them over.  Frames are never overwritten, a full pool shows in
+        // rx.stalls and a full RX ring in rx.ring_overflow.
+        void GetLinkStats(fbus_link_stats_t * snap, bool clear = false);
+        #endif
+
+        #ifdef FBUS_ENABLE_RX_RING
+        // Queue one received byte.  Call this from the UART RX interrupt,
+        // it is the only producer of the receive ring.
+        void ReceiveByteISR(uint8_t inbyte);
+        #endif
+
         // Set the SMS Center routing number and the type of the number based on
         // GSM 03.40 ­ Technical realization of the Short Message Service (SMS) Point­to­Point (PP).
-        void SetSMSC(char * smsc, fbus_number_type_e type);
+        void SetSMSC(const char * smsc, fbus_number_type_e type);
+        void SetSMSC(const fbus_number_t & smsc);
 
         // Set the phonenumber to use for the receiver of the SMS and the type for the number bsaed on
         // GSM 03.40 ­ Technical realization of the Short Message Service (SMS) Point­to­Point (PP).
-        void SetPhoneNumber(char * number, fbus_number_type_e type);
+        void SetPhoneNumber(const char * number, fbus_number_type_e type);
+
+        // Recipient directory.  Numbers are packed once when they are added,
+        // sending to a handle only copies the packed octets.  Adding a number
+        // that is already there returns its handle and sets the new type.
+        // FBUS_RECIPIENT_NONE when the directory is full.
+        fbus_recipient_t AddRecipient(const char * number, fbus_number_type_e type);
+        fbus_recipient_t AddRecipient(const fbus_number_t & number);
+
+        // Handle of a number in the directory, FBUS_RECIPIENT_NONE if it is
+        // not there
+        fbus_recipient_t FindRecipient(const char * number);
+
+        // Free a directory entry.  Not while a SendLongSMS() to it is still
+        // being queued.
+        void RemoveRecipient(fbus_recipient_t to);
+
+        // Send HWSW request packet.  The send functions queue the frame and
+        // return false if the transmit queue is full, process() sends it
+        // again until the phone ACKs it.  process() matches the reply to
+        // the request, caches the version and then calls 'done', or when
+        // 'timeout_ms' passes first.  False too while a request is pending.
+        bool RequestHWSW();
+        bool RequestHWSW(uint16_t timeout_ms, fbus_hwsw_done_t done, void * ctx);
 
-        // Send HWSW request packet
-        void RequestHWSW();
+        // FBUS_HWSW_ state of the last request, poll it instead of a callback
+        uint8_t HWSWState();
 
-        // SendSMS functions
-        void SendSMS(char * phonenum,char * msgcenter, char * message);
-        void SendSMS(char * message);
+        // Version from the last reply, NULL if none came yet
+        const fbus_hwsw_t* GetHWSW();
 
-        // Return the pointer of the RX packet for processing
+        // SendSMS functions.  The text is UTF-8 of up to 160 septets, see
+        // FBusGSM.h, and is left as it is.  The three argument form packs
+        // the numbers again only when they change, and keeps the types set
+        // with SetSMSC() and SetPhoneNumber() or in the directory.
+        bool SendSMS(char * phonenum,char * msgcenter, char * message);
+        bool SendSMS(char * message);
+        bool SendSMS(fbus_recipient_t to, const char * message);
+
+        // Send a text of any length, longer than 160 characters it goes as
+        // a concatenated SMS.  The parts are queued from process(), keep the
+        // text until LongSMSPartsLeft() is 0.  False while a long SMS is
+        // still being queued.
+        bool SendLongSMS(const char * message);
+        bool SendLongSMS(fbus_recipient_t to, const char * message);
+
+        // Parts of the last SendLongSMS() text not queued yet
+        uint8_t LongSMSPartsLeft();
+
+        // Queue an alert from flash to a recipient, 'value' right aligned
+        // with leading zeros in its numeric slot.  Only the recipient and
+        // the digits are kept, the frame is copied out of flash when it
+        // goes on the wire and the checksums are patched by what changed.
+        // False if the queue is full, the recipient unknown or the value
+        // has too many digits.  Keep the recipient until the alert is ACKed.
+        bool SendAlert(const fbus_alert_t * alert, fbus_recipient_t to, uint32_t value = 0);
+
+        // Compose an SMS piece by piece.  SMSBegin() starts it to the phone
+        // number or a recipient, SMSWrite() translates UTF-8 text straight
+        // into the transmit frames in as many pieces as needed, split
+        // between characters, and SMSEnd() queues it.  The text is only
+        // read.  SMSBegin() is false when the queue is full, SMSWrite() once
+        // the text passes 160 septets, and SMSEnd() then queues nothing.
+        // Call no other send function and not process() in between.
+        bool SMSBegin();
+        bool SMSBegin(fbus_recipient_t to);
+        bool SMSWrite(const char * text, uint16_t len);
+        bool SMSWrite(const char * text);
+        bool SMSEnd();
+
+        // Free transmit queue slots, a send call needs one
+        uint8_t TxQueueFree();
+
+        // Transmit queue slots in all, and the slots an SMS of the text
+        // takes, 0 if it is longer than one SMS or than the whole queue
+        uint8_t TxSlots();
+        uint8_t SMSFrames(const char * text);
+
+        // Largest block of a received frame, longer ones are dropped
+        uint8_t MaxPayload();
+
+        // Frames queued or waiting for an ACK
+        uint8_t TxPending();
+
+        // ACK timeout before the first resend, and the number of resends
+        // before a frame is dropped
+        void SetTxTimeout(uint16_t timeout_ms, uint8_t retries);
+
+        // Frames on the wire waiting for an ACK at once, 1 is stop-and-wait
+        void SetTxWindow(uint8_t window);
+
+        // Report every ACKed or failed frame to a callback
+        void SetTxDoneHandler(fbus_tx_done_t handler, void * ctx);
+
+        // Transmit counters, see fbus_tx_stats_t
+        const fbus_tx_stats_t* GetTXStats();
+
+        // Return the pointer of the oldest RX packet for processing
         packet_t* GetRXPacketPtr();
 
+        // Hand finished wire frames to a driver instead of writing them to the
+        // serial port.  The driver owns the buffer until it calls TxComplete().
+        void SetTxHandler(fbus_tx_handler_t handler, void * ctx);
+
+        // Called by the TX driver once the last frame is on the wire
+        void TxComplete();
+
+        #ifdef FBUS_ENABLE_TRACE
+        // Send a frame of trace records to the PC, up to 'max' bytes of
+        // them or one record.  Call it from the loop, it returns 0 once the
+        // trace is empty.
+        uint16_t TraceDrain(Print & out, uint8_t max = 64);
+        #endif
+
+        #ifdef FBUS_ENABLE_LOG
+        // Print up to 'max' log events to the PC, a line each: the event
+        // letter and its two bytes in hex.  Call it from the loop, it
+        // returns the events still waiting.
+        uint8_t LogDrain(Print & out, uint8_t max = 4);
+        #endif
+
         #ifdef FBUS_ENABLE_DEBUG
         // Prints a buffer to the PC Serial as hex
         void pbuf(uint8_t * buf,int len, bool hex);
@@ -112,52 +734,354 @@ class FBus {
         // Variables
         // ---------------------------------
 
-        HardwareSerial & _serialPort;   // Serial port attached to phone
-        packet_t incomingPacket;        // Incoming packet buffer
-        packet_t outgoingPacket;        // Outgoing packet buffer
-        fbus_number_type_e m_smsc_type; // SMSC phone number and type
-        uint8_t m_smsc[10];             // Number is always 10!
+        const fbus_port_ops_t * m_port_ops; // Transport attached to phone, in flash
+        void * m_port;
+        uint8_t * m_rx_pool;            // Incoming packet buffers, see rxSlot()
+        uint8_t * m_rx_fifo;            // Completed slot indexes or FBUS_RX_MSG, oldest first
+        uint8_t m_rx_slots;
+        uint8_t m_rx_stride;            // FBUS_RX_SLOT_BYTES(m_payload)
+        uint8_t m_payload;              // Block bytes a slot holds
+        fbus_rx_parser_t m_rx;          // Frame being parsed
+        uint8_t m_rx_fifo_head;         // FIFO read position
+        uint8_t m_rx_fifo_count;        // Frames waiting in the FIFO
+        uint8_t m_rx_active;            // Slot being filled by the parser
+        bool m_rx_idle;                 // Seen nothing more of a frame since m_rx_idle_ms
+        uint32_t m_rx_idle_ms;
+        fbus_rx_stats_t m_rx_stats;     // Receive counters
+        uint8_t m_link_state;           // FBUS_LINK_ state
+        uint8_t m_sync_left;            // 0x55 bytes still to write
+        uint8_t m_link_fails;           // Messages in a row never ACKed
+        uint8_t m_link_bad;             // Bad frames in a row from the phone
+        fbus_link_ready_t m_link_ready; // Optional sync done callback
+        void * m_link_ready_ctx;
+        #ifdef FBUS_ENABLE_TRACE
+        FBusTrace<FBUS_TRACE_SIZE> m_trace;     // Raw bytes both ways
+        #endif
+        #ifdef FBUS_ENABLE_LOG
+        FBusRing<FBUS_LOG_SIZE> m_log;  // Events not printed yet
+        #endif
+        uint8_t m_rx_last_type;         // MsgType and SeqNo of the last frame ACKed,
+        uint8_t m_rx_last_seq;          // a resend of it is not handed up again
+        #ifdef FBUS_ENABLE_STATS
+        fbus_link_stats_t m_link;       // Link counters, its rx and tx are copied in
+        uint32_t m_rx_done_us;          // When the parser finished the last frame
+        #endif
+        uint8_t m_rx_msg[FBUS_RX_MSG_MAX];  // Multi-frame message reassembly
+        uint16_t m_rx_msg_len;
+        uint8_t m_rx_msg_state;         // FBUS_RXM_ state, see FBus.cpp
+        uint8_t m_rx_msg_type;
+        uint8_t m_rx_msg_frames;        // Frames taken so far
+        uint8_t m_rx_msg_togo;          // FramesToGo of the last frame taken
+        uint8_t m_rx_msg_seq;           // SeqNo of the last frame taken, for resends
+        const fbus_handler_table_t * m_rx_handlers; // In flash, NULL for the FIFO only
+        void * m_rx_handler_ctx;
+        #ifdef FBUS_ENABLE_RX_RING
+        FBusRing<FBUS_RX_RING_SIZE> m_rx_ring;  // Bytes captured by the RX interrupt
+        #endif
+        fbus_rx_span_t m_rx_back[FBUS_RX_BACK_SPANS];  // Bytes of dropped frames to parse again
+        uint8_t m_rx_back_head;         // Span read next
+        uint8_t m_rx_back_count;        // Spans left
+        uint8_t m_rx_back_edge[FBUS_RX_BACK_EDGE];  // Their bytes not kept in packet_t::data
+        uint8_t m_rx_back_used;
+        uint8_t * m_tx_pool;            // Transmit queue, oldest first, see txSlot()
+        uint8_t m_tx_slots;
+        uint8_t m_tx_stride;            // FBUS_TX_SLOT_BYTES(m_payload)
+        uint8_t m_tx_block;             // Largest block sent in a frame
+        uint8_t m_tx_head;              // Oldest slot in use
+        uint8_t m_tx_count;             // Slots in use from m_tx_head on
+        uint8_t m_txm_frames;           // Slots used by the message being built
+        bool m_txm_overflow;            // It did not fit in the free slots
+        fbus_tx_slot_t * m_txm_slot;    // Slot being written
+        uint8_t m_txm_room;             // Bytes its frame still takes
+        uint8_t m_tx_window;            // Most frames waiting for an ACK
+        uint8_t m_tx_retries;           // Resends before a frame is dropped
+        uint16_t m_tx_timeout;          // First ACK timeout
+        fbus_tx_done_t m_tx_done;       // Optional completion callback
+        void * m_tx_done_ctx;
+        fbus_tx_stats_t m_tx_stats;     // Transmit counters
+        fbus_number_t m_smsc;           // SMSC phone number and type
+        fbus_number_t m_phonenumber;    // Phone number and type
+
+        fbus_number_t m_dir[FBUS_DIR_SIZE];     // Recipient directory
+        uint16_t m_dir_hash[FBUS_DIR_SIZE];     // numberHash() of each
+
+        fbus_hwsw_t m_hwsw;             // Version from the last reply
+        bool m_hwsw_valid;              // m_hwsw holds one
+        uint8_t m_hwsw_state;           // FBUS_HWSW_ state of the last request
+        uint16_t m_hwsw_timeout;        // Its timeout
+        uint32_t m_hwsw_start_ms;       // When it was queued
+        fbus_hwsw_done_t m_hwsw_done;   // Optional completion callback
+        void * m_hwsw_ctx;
 
-        fbus_number_type_e m_pnum_type; // Phone number and type
-        uint8_t m_phonenumber[10];      // Number is always 10!
+        uint8_t m_out_seqnum;           // This is the next sequence number to use, 0-7
 
-        uint8_t m_out_seqnum;           // This is the next sequence number to use
+        gsm7_pack_t m_sms_pack;         // SMS being composed
+        uint16_t m_sms_septets;         // User data septets so far
+        uint16_t m_sms_max;             // Most it takes
+        fbus_tx_slot_t * m_sms_udl_slot;    // Frame its length is in
+        uint8_t m_sms_udl;              // and the index there
+        bool m_sms_overflow;            // The text went past m_sms_max
+
+        const char * m_lsms_text;       // SendLongSMS() text, NULL when done
+        const fbus_number_t * m_lsms_to;
+        uint16_t m_lsms_len;
+        uint16_t m_lsms_off;            // Text bytes queued so far
+        uint8_t m_lsms_ref;             // Concatenation reference, one per text
+        uint8_t m_lsms_parts;
+        uint8_t m_lsms_next;            // Next part to queue, from 0
+
+        uint8_t * m_tx_wire;            // Frame being sent, as on the wire
+        fbus_tx_handler_t m_tx_handler; // Optional TX driver
+        void * m_tx_ctx;
+        volatile bool m_tx_busy;        // The TX driver still owns m_tx_wire or m_ack
+        uint8_t m_ack[FBUS_ACK_BYTES];  // ACK with MsgType, SeqNo and checksums to patch
 
         // Functions
         // ---------------------------------
 
-        // Empty the serial input buffer
+        // Transport calls, each moves a span of bytes
+        int portAvailable()
+        {
+            return ((int (*)(void*))pgm_read_ptr(&m_port_ops->available))(m_port);
+        }
+        uint8_t portRead(uint8_t * buf, uint8_t max)
+        {
+            return ((uint8_t (*)(void*,uint8_t*,uint8_t))pgm_read_ptr(&m_port_ops->read))(m_port,buf,max);
+        }
+        void portWrite(const uint8_t * buf, uint16_t len)
+        {
+            ((void (*)(void*,const uint8_t*,uint16_t))pgm_read_ptr(&m_port_ops->write))(m_port,buf,len);
+        }
+        void portFlush()
+        {
+            ((void (*)(void*))pgm_read_ptr(&m_port_ops->flush))(m_port);
+        }
+
+        // Slots by index
+        packet_t * rxSlot(uint8_t x)
+        {
+            return (packet_t*)(m_rx_pool + x*m_rx_stride);
+        }
+        fbus_tx_slot_t * txSlot(uint8_t x)
+        {
+            return (fbus_tx_slot_t*)(m_tx_pool + x*m_tx_stride);
+        }
+
+        // Drop what the serial port holds now
         void serialFlush();
 
+        // Bytes waiting to be parsed, and reading up to 'max' of them
+        int rxAvailable();
+        uint8_t rxReadSpan(uint8_t * buf, uint8_t max);
+
         // Pack a given string into reversed octets Eg: "1234" -> 0x21,0x43
-        uint8_t octetPack(char * instr,uint8_t * outbuf,uint8_t outbuf_size,uint8_t fill);
+        void octetPack(const char * instr, uint8_t type, fbus_number_t * out);
+
+        // Whether a number string has the digits of a packed number
+        bool numberEquals(const char * instr, const fbus_number_t * num);
+
+        // Hash of the digits of a number, the same for the string and the
+        // packed form
+        uint16_t numberHash(const char * instr);
+        uint16_t numberHash(const fbus_number_t * num);
+
+        // Build the complete wire frame for a packet, returns its length
+        // 'lanes' is the XOR of the data bytes as fbus_tx_slot_t keeps it.
+        uint16_t frameBuild(const packet_t * packet_ptr, uint8_t seq, uint16_t lanes, uint8_t * wire);
 
         // Send a packet, this does all the checksuming and padding, just load up the
-        // correct info and call this.
-        void packetSend(packet_t * packet_ptr);
+        // correct info and call this.  The packet is not changed.
+        void packetSend(const packet_t * packet_ptr, uint8_t seq);
+
+        // Send a queued frame with the checksum lanes kept in its slot
+        void slotSend(const fbus_tx_slot_t * slot);
+
+        // Hand a finished wire frame, m_tx_wire or m_ack, to the driver or
+        // serial port
+        void wireSend(const uint8_t * wire, uint16_t len);
+
+        // Start a message in the free transmit slots, false if there are none
+        bool txBegin(uint8_t MsgType);
+
+        // Append to the message, spilling into the next free slot when a
+        // frame is full.  False once the message no longer fits.
+        bool txWrite(const uint8_t * buf, uint16_t len);
+        bool txPut(uint8_t b);
+
+        // Append one byte, inline while the frame has room
+        void txByte(uint8_t b);
 
-        // 7bit packing algorithm based on
-        // GSM 03.38 ­ Alphabets and language­specific information.
-        uint8_t BitPack(uint8_t * buffer,uint8_t length);
+        // Number the frames with FramesToGo and queue them, false and nothing
+        // queued if the message did not fit
+        bool txEnd();
 
-        // Unpack a 7bit encoded string
-        uint8_t BitUnpack(uint8_t * buffer,uint8_t length);
+        // Append everything of an SMS submit before the user data
+        void smsHeader(uint8_t first_octet, const fbus_number_t * to);
+
+        // Start a submit to a packed number.  With a 'udh' of 6 octets the
+        // text that follows is a part of a concatenated SMS.
+        bool smsBegin(const fbus_number_t * to, const uint8_t * udh);
+
+        // Append UTF-8 text as packed septets straight into the frames.  It
+        // stops at a NUL, or before a character that would take the user
+        // data past m_sms_max.  Returns the bytes of text used.
+        uint16_t smsText(const char * text, uint16_t len);
+
+        // Patch in the user data length and queue the submit
+        bool smsEnd();
+
+        // Queue an SMS or the first parts of a long SMS to a packed number
+        bool smsSend(const fbus_number_t * to, const char * message);
+        bool lsmsStart(const fbus_number_t * to, const char * message);
+
+        // Queue the next parts of a SendLongSMS() text that fit
+        void lsmsService();
+
+        // Copy a queued alert's frame to 'wire' and patch it, returns its
+        // length
+        uint16_t alertBuild(const fbus_tx_slot_t * slot, uint8_t * wire);
+
+        // Write the next 0x55 bytes of a sync, and start one when the link
+        // looks lost
+        void linkService();
+
+        // Send queued frames that fit in the window and resend timed out ones
+        void txService();
+
+        // Retire the outstanding frame an ACK from the phone refers to
+        void txAcked(uint8_t MsgType, uint8_t SeqNo);
+
+        // Free a finished slot and report it
+        void txFinish(fbus_tx_slot_t * slot, uint8_t status);
 
         // Clear all data in a packet
         void packetReset(packet_t *packet_ptr);
 
+        // Find an empty RX slot and prepare it for the parser
+        uint8_t rxSlotAlloc();
+
+        // Queue a completed slot index or FBUS_RX_MSG for the sketch
+        void rxFifoPush(uint8_t entry);
+
+        // Release the frame at the head of the RX FIFO
+        void rxFifoPop();
+
+        // Add a frame of a multi-frame message to m_rx_msg, returns false
+        // if the frame must not be ACKed so the phone sends it again
+        bool rxReassemble(packet_t * pktptr);
+
+        // Copy a frame onto the end of m_rx_msg, mark it done when complete
+        bool rxAppend(packet_t * pktptr);
+
+        // Hand a completed slot or FBUS_RX_MSG to its handler, or queue it
+        // for the sketch when the type has none
+        void rxDeliver(uint8_t entry);
+
         // Byte-wise process the data stream
         void processIncomingByte(uint8_t inbyte,packet_t * pktptr);
 
+        // Keep the bytes of a dropped frame from its MsgType on to be
+        // parsed again, the next frame may have started inside it
+        void rxResync(packet_t * pktptr, uint8_t inbyte);
+
+        // Read the bytes rxResync() keeps, returns how many
+        uint8_t rxBackRead(uint8_t * buf, uint8_t max, bool hunt);
+
+        // Bytes the parser can take before the end of the current frame
+        uint16_t rxWant(packet_t * pktptr);
+
+        // Process a span of bytes that ends at or before the end of a frame
+        void processIncoming(const uint8_t * buf, uint16_t len, packet_t * pktptr);
+
         // Send an ACK packet for a given MsgType and SeqNo
         void sendAck(byte MsgType, byte SeqNo ); // Acknowledge received packet
 
-        // Old functions
-        String versionHW(); // Return hardware version
-        String versionSW(); // Return software version
-        String versionDate(); // Return software version
+        #ifdef FBUS_ENABLE_LOG
+        // Store an event for LogDrain(), dropped when the log is full
+        void logEvent(uint8_t event, uint8_t a, uint8_t b);
+        #endif
+
+        #ifdef FBUS_ENABLE_STATS
+        // Count a value into a histogram
+        static void histAdd(fbus_hist_t * hist, uint32_t value, uint8_t shift);
+        #endif
+
+        // Take the version out of a HWSW reply, false if it is not one
+        bool hwswParse(const fbus_msg_t * msg, fbus_hwsw_t * hwsw);
+
+        // End the pending request with a FBUS_HWSW_ state
+        void hwswFinish(uint8_t state);
 };
 
+// An FBus with its frames sized at compile time.  PAYLOAD is the
+// largest block a frame slot holds, sent frames are cut to it as well as
+// to FBUS_FRAME_BLOCK_MAX and longer received frames are dropped, so a
+// small one only suits phones whose replies are short.  RX_SLOTS and
+// TX_SLOTS are the frame slots each way.  For example 64 byte frames, one
+// receive slot and three transmit slots, enough for a 160 character SMS:
+//   FBusSized<64,1,3> myPhone(Serial1);
+// RAM_BYTES is what the frames take, FBusCore itself adds the rest.
+//
+// PORT is the transport, see FBusPort.h.  The default takes any serial
+// port as FBus always did.  A concrete one lets the compiler inline its
+// per-byte calls, FBusOn<PORT> is the default sizes with it:
+//   FBusOn<FBusSerialPort<HardwareSerial> > myPhone(Serial1);
+template<uint8_t PAYLOAD = FBUS_PAYLOAD_MAX, uint8_t RX_SLOTS = FBUS_RX_SLOTS,
+         uint8_t TX_SLOTS = FBUS_TX_SLOTS, class PORT = FBusStreamPort>
+class FBusSized : public FBusCore {
+    static_assert(PAYLOAD >= 8 && PAYLOAD <= FBUS_PAYLOAD_MAX,
+                  "FBusSized PAYLOAD must be 8 to FBUS_PAYLOAD_MAX");
+    static_assert(RX_SLOTS >= 1 && RX_SLOTS <= 16, "FBusSized RX_SLOTS must be 1 to 16");
+    static_assert(TX_SLOTS >= 1 && TX_SLOTS <= 7, "FBusSized TX_SLOTS must be 1 to 7");
+
+    public:
+        // The argument goes to the transport's constructor, usually the
+        // serial port
+        template<class ARG>
+        explicit FBusSized(ARG & arg)
+        : FBusCore(&FBusPortOps<PORT>::ops,&m_port,storage()), m_port(arg)
+        {
+            return;
+        }
+
+        // A transport that needs no argument
+        FBusSized()
+        : FBusCore(&FBusPortOps<PORT>::ops,&m_port,storage()), m_port()
+        {
+            return;
+        }
+
+        // The transport, to begin() or attach() it
+        PORT & Port()
+        {
+            return m_port;
+        }
+
+        static constexpr uint16_t RAM_BYTES = RX_SLOTS*FBUS_RX_SLOT_BYTES(PAYLOAD) + RX_SLOTS+1 +
+            TX_SLOTS*FBUS_TX_SLOT_BYTES(PAYLOAD) + FBUS_TX_WIRE_BYTES(PAYLOAD);
+
+    private:
+        fbus_storage_t storage()
+        {
+            return fbus_storage_t{ m_rx_store, m_rx_fifo_store, m_tx_store, m_tx_wire_store,
+                                   PAYLOAD, RX_SLOTS, TX_SLOTS };
+        }
+
+        PORT m_port;
+        uint8_t m_rx_store[RX_SLOTS*FBUS_RX_SLOT_BYTES(PAYLOAD)];
+        uint8_t m_rx_fifo_store[RX_SLOTS+1];
+        alignas(fbus_tx_slot_t) uint8_t m_tx_store[TX_SLOTS*FBUS_TX_SLOT_BYTES(PAYLOAD)];
+        uint8_t m_tx_wire_store[FBUS_TX_WIRE_BYTES(PAYLOAD)];
+};
+
+// The default sizes, as every sketch so far has used:
+//   FBus myPhone(Serial1);
+typedef FBusSized<> FBus;
+
+// The default sizes on another transport
+template<class PORT>
+using FBusOn = FBusSized<FBUS_PAYLOAD_MAX,FBUS_RX_SLOTS,FBUS_TX_SLOTS,PORT>;
+
 #endif
 
 //eof
@@ -0,0 +1,377 @@
+// FBusBridge.cpp - Binary protocol between a PC and a phone over USB Serial.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+
+#include "Arduino.h"
+#include "FBusBridge.h"
+#include "string.h"
+
+// Second byte of an SMS reply after the 0x00 0x01, sent or not
+#define FBUS_BRIDGE_SMS_SENT    0x02
+#define FBUS_BRIDGE_SMS_FAIL    0x03
+
+// m_in_state, header bytes seen
+#define FBUS_BRIDGE_IN_IDLE     0
+#define FBUS_BRIDGE_IN_SYNC1    1
+#define FBUS_BRIDGE_IN_KIND     2
+#define FBUS_BRIDGE_IN_LEN_LO   3
+#define FBUS_BRIDGE_IN_LEN_HI   4
+#define FBUS_BRIDGE_IN_PAYLOAD  5
+#define FBUS_BRIDGE_IN_SUM      6
+#define FBUS_BRIDGE_IN_FULL     7       // Waiting for room on the phone
+
+// Every type the phone sends comes to the bridge first
+FBUS_HANDLERS(fbus_bridge_handlers,fbusBridgeMessage,
+    FBUS_ON(FBUSTYPE_SMS,fbusBridgeMessage));
+
+void fbusBridgeMessage(void * ctx, const fbus_msg_t * msg)
+{
+    ((FBusBridge*)ctx)->message(msg);
+    return;
+}
+
+void fbusBridgeTxDone(void * ctx, uint8_t MsgType, uint8_t status, uint8_t /*tries*/, uint16_t /*latency_ms*/)
+{
+    if(MsgType == FBUSTYPE_SMS) ((FBusBridge*)ctx)->txDone(status);
+    return;
+}
+
+FBusBridge::FBusBridge(Stream & pc, FBusCore & phone)
+: m_pc(pc), m_phone(phone), m_in_state(FBUS_BRIDGE_IN_IDLE), m_jobs(0), m_status_count(0),
+  m_hello(false), m_handlers(NULL), m_handler_ctx(NULL)
+{
+    memset(&m_stats,0,sizeof(m_stats));
+    return;
+}
+
+// Initialize the phone and take over its handlers
+void FBusBridge::initialize()
+{
+    m_phone.initialize();
+    m_phone.SetHandlers(&fbus_bridge_handlers,this);
+    m_phone.SetTxDoneHandler(fbusBridgeTxDone,this);
+    m_in_state = FBUS_BRIDGE_IN_IDLE;
+    m_jobs = 0;
+    m_status_count = 0;
+    m_hello = false;
+    memset(&m_stats,0,sizeof(m_stats));
+    return;
+}
+
+// Run the phone, then read the PC until a terminal byte comes or a
+// SUBMIT has to wait for the phone.  The states of this pass go out in
+// one STATUS frame.
+int FBusBridge::process()
+{
+    int c = -1, b;
+
+    m_phone.process();
+
+    // Reports that never came
+    for(uint8_t x=0;x<m_jobs;)
+    {
+        if(m_job[x].done == m_job[x].frames && !m_job[x].failed &&
+           (uint16_t)millis() - m_job[x].since_ms > FBUS_BRIDGE_REPORT_MS)
+            finish(x,FBUS_BRIDGE_TIMEOUT);
+        else
+            x++;
+    }
+
+    if(m_in_state == FBUS_BRIDGE_IN_FULL && submit())
+        m_in_state = FBUS_BRIDGE_IN_IDLE;
+
+    // A frame the PC stopped sending part way
+    if(m_in_state > FBUS_BRIDGE_IN_SYNC1 && m_in_state < FBUS_BRIDGE_IN_FULL &&
+       !m_pc.available() && (uint16_t)millis() - m_in_ms > FBUS_BRIDGE_GAP_MS)
+    {
+        m_stats.bad_frames++;
+        m_in_state = FBUS_BRIDGE_IN_IDLE;
+    }
+
+    while(c < 0 && m_in_state != FBUS_BRIDGE_IN_FULL && (b = m_pc.read()) >= 0)
+        c = input(b);
+
+    statusFlush();
+    return c;
+}
+
+// Hand the phone's messages on to a FBUS_HANDLERS table too
+void FBusBridge::SetHandlers(const fbus_handler_table_t * table, void * ctx)
+{
+    m_handlers = table;
+    m_handler_ctx = ctx;
+    return;
+}
+
+// Jobs on the phone, not finished yet
+uint8_t FBusBridge::JobsPending()
+{
+    return m_jobs;
+}
+
+const fbus_bridge_stats_t* FBusBridge::GetStats()
+{
+    return &m_stats;
+}
+
+// Private functions
+// ---------------------------------
+
+// Take one byte from the PC.  A sync byte that is not followed by the
+// second one is dropped and the byte after it looked at again.
+int FBusBridge::input(uint8_t b)
+{
+    m_in_ms = millis();
+    switch(m_in_state)
+    {
+        case FBUS_BRIDGE_IN_SYNC1:
+            if(b == FBUS_BRIDGE_SYNC1)
+            {
+                m_in_state = FBUS_BRIDGE_IN_KIND;
+                break;
+            }
+            m_in_state = FBUS_BRIDGE_IN_IDLE;
+            // Fall through
+        case FBUS_BRIDGE_IN_IDLE:
+            if(b != FBUS_BRIDGE_SYNC0) return b;
+            m_in_state = FBUS_BRIDGE_IN_SYNC1;
+            break;
+        case FBUS_BRIDGE_IN_KIND:
+            m_in_kind = b;
+            m_in_sum = b;
+            m_in_state = FBUS_BRIDGE_IN_LEN_LO;
+            break;
+        case FBUS_BRIDGE_IN_LEN_LO:
+            m_in_len = b;
+            m_in_sum += b;
+            m_in_state = FBUS_BRIDGE_IN_LEN_HI;
+            break;
+        case FBUS_BRIDGE_IN_LEN_HI:
+            m_in_len |= (uint16_t)b << 8;
+            m_in_sum += b;
+            m_in_got = 0;
+            if(m_in_len > FBUS_BRIDGE_IN_MAX)
+            {
+                m_stats.bad_frames++;
+                m_in_state = FBUS_BRIDGE_IN_IDLE;
+            }else
+            {
+                m_in_state = m_in_len ? FBUS_BRIDGE_IN_PAYLOAD : FBUS_BRIDGE_IN_SUM;
+            }
+            break;
+        case FBUS_BRIDGE_IN_PAYLOAD:
+            m_in[m_in_got++] = b;
+            m_in_sum += b;
+            if(m_in_got == m_in_len) m_in_state = FBUS_BRIDGE_IN_SUM;
+            break;
+        case FBUS_BRIDGE_IN_SUM:
+            m_in_state = FBUS_BRIDGE_IN_IDLE;
+            if(b != m_in_sum)
+            {
+                m_stats.bad_frames++;
+                break;
+            }
+            m_stats.frames_in++;
+            if(!frame()) m_in_state = FBUS_BRIDGE_IN_FULL;
+            break;
+    }
+    return -1;
+}
+
+// A whole frame came, act on it
+bool FBusBridge::frame()
+{
+    switch(m_in_kind)
+    {
+        case FBUS_BRIDGE_SUBMIT:
+            m_in_pos = 0;
+            return submit();
+        case FBUS_BRIDGE_HELLO:
+            m_hello = true;
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+// Queue the jobs of a SUBMIT from m_in_pos on.  A job the phone has no
+// room for yet is tried again from process(), the ones before it are
+// already queued.
+bool FBusBridge::submit()
+{
+    uint16_t id;
+    uint8_t type, frames;
+    const char * number;
+    const char * text;
+    const uint8_t * end;
+    fbus_recipient_t to;
+    bool added;
+
+    while(m_in_pos < m_in_len)
+    {
+        // id_lo id_hi type number 0 text 0, both strings ending in the frame
+        if(m_in_len - m_in_pos < 5)
+        {
+            m_stats.rejected++;
+            break;
+        }
+        id = m_in[m_in_pos] | ((uint16_t)m_in[m_in_pos+1] << 8);
+        type = m_in[m_in_pos+2];
+        number = (const char*)&m_in[m_in_pos+3];
+        end = (const uint8_t*)memchr(number,0,m_in_len - (m_in_pos+3));
+        text = end ? (const char*)end + 1 : NULL;
+        end = text ? (const uint8_t*)memchr(text,0,&m_in[m_in_len] - (const uint8_t*)text) : NULL;
+        if(end == NULL)
+        {
+            // Nothing after this can be found either
+            status(id,FBUS_BRIDGE_REJECTED);
+            m_stats.rejected++;
+            break;
+        }
+
+        frames = m_phone.SMSFrames(text);
+        if(frames == 0 || *number == 0)
+        {
+            status(id,FBUS_BRIDGE_REJECTED);
+            m_stats.rejected++;
+            m_in_pos = end + 1 - m_in;
+            continue;
+        }
+        if(m_jobs >= FBUS_BRIDGE_JOBS || m_phone.TxQueueFree() < frames) return false;
+
+        // A number the sketch did not add is only in the directory while
+        // the SMS is composed
+        to = m_phone.FindRecipient(number);
+        added = to == FBUS_RECIPIENT_NONE;
+        if(added) to = m_phone.AddRecipient(number,(fbus_number_type_e)type);
+        if(to == FBUS_RECIPIENT_NONE || !m_phone.SendSMS(to,text))
+        {
+            status(id,FBUS_BRIDGE_REJECTED);
+            m_stats.rejected++;
+        }else
+        {
+            m_job[m_jobs].id = id;
+            m_job[m_jobs].frames = frames;
+            m_job[m_jobs].done = 0;
+            m_job[m_jobs].failed = 0;
+            m_job[m_jobs].since_ms = millis();
+            m_jobs++;
+            m_stats.jobs++;
+            status(id,FBUS_BRIDGE_QUEUED);
+        }
+        if(added && to != FBUS_RECIPIENT_NONE) m_phone.RemoveRecipient(to);
+        m_in_pos = end + 1 - m_in;
+    }
+    return true;
+}
+
+// A job state for the next STATUS frame
+void FBusBridge::status(uint16_t id, uint8_t state)
+{
+    if(m_status_count == FBUS_BRIDGE_STATUS_MAX) statusFlush();
+    m_status[m_status_count*3] = id;
+    m_status[m_status_count*3+1] = id >> 8;
+    m_status[m_status_count*3+2] = state;
+    m_status_count++;
+    return;
+}
+
+// Take job x off the list with a final state
+void FBusBridge::finish(uint8_t x, uint8_t state)
+{
+    status(m_job[x].id,state);
+    if(state == FBUS_BRIDGE_SENT) m_stats.sent++;
+    else m_stats.failed++;
+    m_jobs--;
+    memmove(&m_job[x],&m_job[x+1],(m_jobs - x)*sizeof(m_job[0]));
+    return;
+}
+
+// Send the STATUS frame, if there is anything to say
+void FBusBridge::statusFlush()
+{
+    uint8_t head[2];
+
+    if(m_status_count == 0 && !m_hello) return;
+    head[0] = FBUS_BRIDGE_JOBS - m_jobs;
+    head[1] = FBUS_BRIDGE_JOBS;
+    send(FBUS_BRIDGE_STATUS,head,2,m_status,m_status_count*3);
+    m_status_count = 0;
+    m_hello = false;
+    return;
+}
+
+// Send a frame to the PC, its payload in two pieces
+void FBusBridge::send(uint8_t kind, const uint8_t * a, uint16_t alen, const uint8_t * b, uint16_t blen)
+{
+    uint8_t head[FBUS_BRIDGE_HDR];
+    uint16_t len = alen + blen, x;
+    uint8_t sum;
+
+    head[0] = FBUS_BRIDGE_SYNC0;
+    head[1] = FBUS_BRIDGE_SYNC1;
+    head[2] = kind;
+    head[3] = len;
+    head[4] = len >> 8;
+    sum = head[2] + head[3] + head[4];
+    for(x=0;x<alen;x++) sum += a[x];
+    for(x=0;x<blen;x++) sum += b[x];
+    m_pc.write(head,FBUS_BRIDGE_HDR);
+    if(alen) m_pc.write(a,alen);
+    if(blen) m_pc.write(b,blen);
+    m_pc.write(&sum,1);
+    return;
+}
+
+// Match sent reports to the oldest job with every frame ACKed, send the
+// message to the PC and pass it on
+void FBusBridge::message(const fbus_msg_t * msg)
+{
+    fbus_handler_t fn = NULL;
+    uint8_t x;
+
+    if(msg->MsgType == FBUSTYPE_SMS && msg->length >= 4 &&
+       (msg->data[3] == FBUS_BRIDGE_SMS_SENT || msg->data[3] == FBUS_BRIDGE_SMS_FAIL))
+    {
+        for(x=0;x<m_jobs;x++)
+            if(m_job[x].done == m_job[x].frames && !m_job[x].failed) break;
+        if(x < m_jobs)
+            finish(x,msg->data[3] == FBUS_BRIDGE_SMS_SENT ? FBUS_BRIDGE_SENT : FBUS_BRIDGE_SMS_ERROR);
+        else
+            m_stats.stray_reports++;
+    }
+
+    send(FBUS_BRIDGE_RX,&msg->MsgType,1,msg->data,msg->length);
+    m_stats.rx_frames++;
+
+    if(m_handlers)
+        fn = (fbus_handler_t)pgm_read_ptr(&m_handlers->fn[msg->MsgType]);
+    if(fn) fn(m_handler_ctx,msg);
+    return;
+}
+
+// Counted against the oldest job with frames still out.  With a window
+// over one frame ACKs may come out of order, the counts still add up and
+// only a failed frame can be blamed on the job next to its own.  A job
+// fails once all its frames are done.
+void FBusBridge::txDone(uint8_t status)
+{
+    uint8_t x;
+
+    for(x=0;x<m_jobs;x++)
+        if(m_job[x].done < m_job[x].frames) break;
+    if(x == m_jobs) return;
+
+    m_job[x].done++;
+    if(status == FBUS_TX_FAILED) m_job[x].failed = 1;
+    if(m_job[x].done < m_job[x].frames) return;
+    if(m_job[x].failed) finish(x,FBUS_BRIDGE_FAILED);
+    else m_job[x].since_ms = millis();
+    return;
+}
+
+//eof
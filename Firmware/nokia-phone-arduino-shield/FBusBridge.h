@@ -0,0 +1,215 @@
+/*
+  FBusBridge.h - Binary protocol between a PC and a phone over USB Serial.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// The bridge lets software on the PC send SMS through the phone and see
+// everything the phone sends, without text on the serial link:
+//
+//   FBus myPhone(Serial1);
+//   FBusBridge bridge(Serial,myPhone);
+//   bridge.initialize();
+//   ...
+//   int c = bridge.process();     // from loop(), instead of myPhone.process()
+//   if(c == 'C') ...              // bytes outside frames, the old terminal
+//
+// Frames are built like the trace's, so both can share the link and text
+// printed in between is skipped by the PC:
+//
+//   'F' 'B' kind len_lo len_hi payload[len] sum
+//
+// sum is the 8-bit sum of kind, both length bytes and the payload.
+//
+// From the PC:
+//   FBUS_BRIDGE_SUBMIT  SMS jobs, as many as fit, each
+//                       id_lo id_hi type number 0 text 0
+//                       type is a fbus_number_type_e, the text UTF-8
+//   FBUS_BRIDGE_HELLO   no payload, answered with a STATUS
+//
+// To the PC:
+//   FBUS_BRIDGE_RX      a message from the phone, MsgType then its data
+//   FBUS_BRIDGE_STATUS  free jobs_max, then id_lo id_hi status for each
+//                       job whose state changed since the last one
+//
+// A job gets FBUS_BRIDGE_QUEUED once its frames are in the phone's queue
+// and then one final state.  Up to FBUS_BRIDGE_JOBS jobs are tracked, a
+// PC that keeps no more than jobs_max unfinished never makes the bridge
+// wait, and with that many the phone always has the next SMS queued.
+// Otherwise the bridge stops reading the PC until a job finishes.
+//
+// The bridge sends every SMS of the phone, the sketch must not call its
+// send functions, and takes over its handlers as FBusGateway does.
+// Messages are passed on to the sketch's table set with SetHandlers().
+// Sent reports are matched to jobs in order, a report the phone repeats
+// after a lost ACK may finish the next job early but never a wrong one
+// as failed.
+
+#ifndef __FBUSBRIDGE_H__
+#define __FBUSBRIDGE_H__
+
+#include "FBus.h"
+
+// Jobs between the PC and the phone's sent report, each costs 7 bytes of
+// RAM on AVR
+#ifndef FBUS_BRIDGE_JOBS
+#define FBUS_BRIDGE_JOBS        8
+#endif
+#if FBUS_BRIDGE_JOBS < 1 || FBUS_BRIDGE_JOBS > 32
+#error "FBUS_BRIDGE_JOBS must be 1 to 32"
+#endif
+
+// Longest frame taken from the PC, one job of a full SMS with a number
+#ifndef FBUS_BRIDGE_IN_MAX
+#define FBUS_BRIDGE_IN_MAX      192
+#endif
+
+// Job states sent in one STATUS frame at most
+#ifndef FBUS_BRIDGE_STATUS_MAX
+#define FBUS_BRIDGE_STATUS_MAX  16
+#endif
+
+// Time the phone has to report an SMS sent, from its last frame ACKed
+#ifndef FBUS_BRIDGE_REPORT_MS
+#define FBUS_BRIDGE_REPORT_MS   30000
+#endif
+
+// A frame from the PC that stops for this long is dropped
+#ifndef FBUS_BRIDGE_GAP_MS
+#define FBUS_BRIDGE_GAP_MS      100
+#endif
+
+// Frame start, the trace's is 'F' 'T'
+#define FBUS_BRIDGE_SYNC0       'F'
+#define FBUS_BRIDGE_SYNC1       'B'
+#define FBUS_BRIDGE_HDR         5       // Sync, kind and length
+
+// Frame kinds, from the PC and to it
+#define FBUS_BRIDGE_SUBMIT      0x01
+#define FBUS_BRIDGE_HELLO       0x02
+#define FBUS_BRIDGE_RX          0x81
+#define FBUS_BRIDGE_STATUS      0x82
+
+// Job states
+#define FBUS_BRIDGE_QUEUED      0x00    // In the phone's transmit queue
+#define FBUS_BRIDGE_SENT        0x01    // The phone reported it sent
+#define FBUS_BRIDGE_SMS_ERROR   0x02    // The phone reported an error
+#define FBUS_BRIDGE_FAILED      0x03    // A frame was never ACKed
+#define FBUS_BRIDGE_TIMEOUT     0x04    // No report in FBUS_BRIDGE_REPORT_MS
+#define FBUS_BRIDGE_REJECTED    0x05    // Malformed, too long or no room for the number
+
+// Counters, read with GetStats()
+typedef struct {
+    uint16_t frames_in;         // Good frames from the PC
+    uint16_t bad_frames;        // Frames with a wrong sum, too long or cut off
+    uint16_t jobs;              // Jobs queued on the phone
+    uint16_t rejected;
+    uint16_t sent;              // Jobs the phone reported sent
+    uint16_t failed;            // Jobs failed, SMS errors and timeouts
+    uint16_t stray_reports;     // Sent reports with no job waiting for one
+    uint16_t rx_frames;         // Messages sent on to the PC
+}fbus_bridge_stats_t;
+
+// A job on the phone
+typedef struct {
+    uint16_t id;
+    uint8_t frames;             // Its frames in the transmit queue
+    uint8_t done;               // Of which ACKed or failed
+    uint8_t failed;             // A frame was not ACKed
+    uint16_t since_ms;          // When the last frame was ACKed
+}fbus_bridge_job_t;
+
+class FBusBridge;
+
+// The handlers the phone reports to, ctx is the bridge
+void fbusBridgeMessage(void * ctx, const fbus_msg_t * msg);
+void fbusBridgeTxDone(void * ctx, uint8_t MsgType, uint8_t status, uint8_t tries, uint16_t latency_ms);
+
+class FBusBridge {
+    friend void fbusBridgeMessage(void * ctx, const fbus_msg_t * msg);
+    friend void fbusBridgeTxDone(void * ctx, uint8_t MsgType, uint8_t status, uint8_t tries, uint16_t latency_ms);
+
+    public:
+        FBusBridge(Stream & pc, FBusCore & phone);
+
+        // Initialize the phone and take over its handlers
+        void initialize();
+
+        // Run the phone's process(), take frames from the PC and send it
+        // the job states and the phone's messages.  Returns a byte the PC
+        // sent outside a frame, the sketch's terminal, or -1.
+        int process();
+
+        // Hand the phone's messages on to a FBUS_HANDLERS table too
+        void SetHandlers(const fbus_handler_table_t * table, void * ctx);
+
+        // Jobs on the phone, not finished yet
+        uint8_t JobsPending();
+
+        const fbus_bridge_stats_t* GetStats();
+
+    private:
+
+        // Variables
+        // ---------------------------------
+
+        Stream & m_pc;
+        FBusCore & m_phone;
+
+        uint8_t m_in[FBUS_BRIDGE_IN_MAX];   // Frame from the PC
+        uint8_t m_in_state;             // Bytes of the header seen, see FBusBridge.cpp
+        uint8_t m_in_kind;
+        uint16_t m_in_len;              // Payload length
+        uint16_t m_in_got;              // Payload bytes read
+        uint8_t m_in_sum;               // Sum so far
+        uint16_t m_in_pos;              // Next job in a SUBMIT being taken
+        uint16_t m_in_ms;               // Last byte of the frame
+
+        fbus_bridge_job_t m_job[FBUS_BRIDGE_JOBS];  // Oldest first
+        uint8_t m_jobs;
+
+        uint8_t m_status[FBUS_BRIDGE_STATUS_MAX*3]; // States not sent yet
+        uint8_t m_status_count;
+        bool m_hello;                   // A STATUS is owed even with none
+
+        const fbus_handler_table_t * m_handlers;    // In flash, NULL for none
+        void * m_handler_ctx;
+
+        fbus_bridge_stats_t m_stats;
+
+        // Functions
+        // ---------------------------------
+
+        // Take one byte from the PC, returns it if it is outside a frame
+        int input(uint8_t b);
+
+        // A whole frame came, act on it.  False while a SUBMIT still has
+        // jobs waiting for room on the phone.
+        bool frame();
+
+        // Queue the jobs of a SUBMIT from m_in_pos on, as long as they fit
+        bool submit();
+
+        // A job state for the next STATUS frame
+        void status(uint16_t id, uint8_t state);
+
+        // Take job x off the list with a final state
+        void finish(uint8_t x, uint8_t state);
+
+        // Send the STATUS frame, if there is anything to say
+        void statusFlush();
+
+        // Send a frame to the PC, its payload in two pieces
+        void send(uint8_t kind, const uint8_t * a, uint16_t alen, const uint8_t * b, uint16_t blen);
+
+        // A message from the phone
+        void message(const fbus_msg_t * msg);
+
+        // A frame of an SMS ACKed or given up on
+        void txDone(uint8_t status);
+};
+
+#endif
+
+//eof
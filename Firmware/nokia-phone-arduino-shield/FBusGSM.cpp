@@ -0,0 +1,387 @@
+// FBusGSM.cpp - GSM 03.38 default alphabet and 7-bit packing for F-Bus.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  GSM 03.38 - Alphabets and language-specific information, 6.2.1
+//  GSM 03.40 - Technical realization of SMS, 9.2.3.24
+//
+
+#include "Arduino.h"
+#include "FBusGSM.h"
+#include "string.h"
+
+// Code point of the escape septet, it has no character of its own
+#define GSM7_NONE       0xFFFF
+
+// The default alphabet, septet to Unicode code point.  Everything else in
+// this file is derived from this list and GSM7_EXT_*.
+#define GSM7_ALPHABET \
+    0x0040,0x00A3,0x0024,0x00A5,0x00E8,0x00E9,0x00F9,0x00EC, \
+    0x00F2,0x00C7,0x000A,0x00D8,0x00F8,0x000D,0x00C5,0x00E5, \
+    0x0394,0x005F,0x03A6,0x0393,0x039B,0x03A9,0x03A0,0x03A8, \
+    0x03A3,0x0398,0x039E,GSM7_NONE,0x00C6,0x00E6,0x00DF,0x00C9, \
+    0x0020,0x0021,0x0022,0x0023,0x00A4,0x0025,0x0026,0x0027, \
+    0x0028,0x0029,0x002A,0x002B,0x002C,0x002D,0x002E,0x002F, \
+    0x0030,0x0031,0x0032,0x0033,0x0034,0x0035,0x0036,0x0037, \
+    0x0038,0x0039,0x003A,0x003B,0x003C,0x003D,0x003E,0x003F, \
+    0x00A1,0x0041,0x0042,0x0043,0x0044,0x0045,0x0046,0x0047, \
+    0x0048,0x0049,0x004A,0x004B,0x004C,0x004D,0x004E,0x004F, \
+    0x0050,0x0051,0x0052,0x0053,0x0054,0x0055,0x0056,0x0057, \
+    0x0058,0x0059,0x005A,0x00C4,0x00D6,0x00D1,0x00DC,0x00A7, \
+    0x00BF,0x0061,0x0062,0x0063,0x0064,0x0065,0x0066,0x0067, \
+    0x0068,0x0069,0x006A,0x006B,0x006C,0x006D,0x006E,0x006F, \
+    0x0070,0x0071,0x0072,0x0073,0x0074,0x0075,0x0076,0x0077, \
+    0x0078,0x0079,0x007A,0x00E4,0x00F6,0x00F1,0x00FC,0x00E0
+
+// The extension table, the septet after GSM7_ESC and its code point
+#define GSM7_EXT_COUNT  10
+#define GSM7_EXT_CODE \
+    0x0A,0x14,0x28,0x29,0x2F,0x3C,0x3D,0x3E,0x40,0x65
+#define GSM7_EXT_UCS \
+    0x000C,0x005E,0x007B,0x007D,0x005C,0x005B,0x007E,0x005D,0x007C,0x20AC
+
+// Compile time copies.  They are only read in constant expressions so no
+// storage is emitted for them.
+static constexpr uint16_t gsm7_alphabet[128] = { GSM7_ALPHABET };
+static constexpr uint8_t gsm7_ext_code[GSM7_EXT_COUNT] = { GSM7_EXT_CODE };
+static constexpr uint16_t gsm7_ext_ucs[GSM7_EXT_COUNT] = { GSM7_EXT_UCS };
+
+// Run time copies
+static const uint16_t gsm7_alphabet_P[128] PROGMEM = { GSM7_ALPHABET };
+static const uint8_t gsm7_ext_code_P[GSM7_EXT_COUNT] PROGMEM = { GSM7_EXT_CODE };
+static const uint16_t gsm7_ext_ucs_P[GSM7_EXT_COUNT] PROGMEM = { GSM7_EXT_UCS };
+
+// Septet of a code point at compile time: the default alphabet position,
+// 0x80 | the extension code, or GSM7_UNKNOWN
+static constexpr uint8_t gsm7FindExt(uint16_t ucs, uint8_t i)
+{
+    return i >= GSM7_EXT_COUNT ? GSM7_UNKNOWN :
+           gsm7_ext_ucs[i] == ucs ? (0x80 | gsm7_ext_code[i]) : gsm7FindExt(ucs,i+1);
+}
+static constexpr uint8_t gsm7Find(uint16_t ucs, uint8_t i)
+{
+    return i >= 128 ? gsm7FindExt(ucs,0) :
+           gsm7_alphabet[i] == ucs ? i : gsm7Find(ucs,i+1);
+}
+
+static_assert(gsm7Find('@',0) == 0x00 && gsm7Find('A',0) == 0x41 && gsm7Find('_',0) == 0x11,
+              "GSM 03.38 default alphabet");
+static_assert(gsm7Find('{',0) == 0xA8 && gsm7Find(0x20AC,0) == 0xE5 && gsm7Find('`',0) == GSM7_UNKNOWN,
+              "GSM 03.38 extension table");
+
+#define GSM7_F(c)       gsm7Find((c),0)
+#define GSM7_F8(c)      GSM7_F(c),GSM7_F(c+1),GSM7_F(c+2),GSM7_F(c+3), \
+                        GSM7_F(c+4),GSM7_F(c+5),GSM7_F(c+6),GSM7_F(c+7)
+#define GSM7_F32(c)     GSM7_F8(c),GSM7_F8(c+8),GSM7_F8(c+16),GSM7_F8(c+24)
+
+// ASCII and Latin-1 to septet, most of what is ever sent.  The few Greek
+// capitals and the euro sign are searched for.
+static const uint8_t gsm7_from_ascii[128] PROGMEM = {
+    GSM7_F32(0x00), GSM7_F32(0x20), GSM7_F32(0x40), GSM7_F32(0x60) };
+static const uint8_t gsm7_from_latin1[96] PROGMEM = {
+    GSM7_F32(0xA0), GSM7_F32(0xC0), GSM7_F32(0xE0) };
+
+// Next UTF-8 character as a code point, *used is set to its bytes.  Broken
+// sequences give GSM7_NONE and use one byte.
+static uint32_t gsm7Utf8(const uint8_t * p, uint16_t len, uint8_t * used)
+{
+    uint32_t ucs;
+    uint8_t n, x;
+
+    *used = 1;
+    if(p[0] < 0x80) return p[0];
+    if((p[0] & 0xE0) == 0xC0) { n = 1; ucs = p[0] & 0x1F; }
+    else if((p[0] & 0xF0) == 0xE0) { n = 2; ucs = p[0] & 0x0F; }
+    else if((p[0] & 0xF8) == 0xF0) { n = 3; ucs = p[0] & 0x07; }
+    else return GSM7_NONE;
+    if(n >= len) return GSM7_NONE;
+    for(x=1;x<=n;x++)
+    {
+        if((p[x] & 0xC0) != 0x80) return GSM7_NONE;
+        ucs = (ucs << 6) | (p[x] & 0x3F);
+    }
+    *used = n + 1;
+    return ucs;
+}
+
+// Septet of a code point at run time, as gsm7Find()
+static uint8_t gsm7FromUcs(uint32_t ucs)
+{
+    uint8_t x;
+
+    if(ucs < 0x80) return pgm_read_byte(&gsm7_from_ascii[ucs]);
+    if(ucs >= 0xA0 && ucs < 0x100) return pgm_read_byte(&gsm7_from_latin1[ucs-0xA0]);
+    if(ucs >= GSM7_NONE) return GSM7_UNKNOWN;
+    for(x=0;x<128;x++)
+        if(pgm_read_word(&gsm7_alphabet_P[x]) == ucs) return x;
+    for(x=0;x<GSM7_EXT_COUNT;x++)
+        if(pgm_read_word(&gsm7_ext_ucs_P[x]) == ucs) return 0x80 | pgm_read_byte(&gsm7_ext_code_P[x]);
+    return GSM7_UNKNOWN;
+}
+
+// Code point of an extension septet.  Codes the table does not have read
+// as the default alphabet character, 03.38 6.2.1.1.
+static uint16_t gsm7ExtUcs(uint8_t c)
+{
+    uint16_t ucs;
+    uint8_t x;
+
+    for(x=0;x<GSM7_EXT_COUNT;x++)
+        if(pgm_read_byte(&gsm7_ext_code_P[x]) == c) return pgm_read_word(&gsm7_ext_ucs_P[x]);
+    ucs = pgm_read_word(&gsm7_alphabet_P[c]);
+    return ucs == GSM7_NONE ? ' ' : ucs;
+}
+
+// Septet of the next UTF-8 character
+uint8_t gsm7Char(const char * text, uint16_t len, uint8_t * used)
+{
+    uint8_t c = text[0];
+
+    *used = 1;
+    if(c < 0x80) return pgm_read_byte(&gsm7_from_ascii[c]);
+    return gsm7FromUcs(gsm7Utf8((const uint8_t*)text,len,used));
+}
+
+// Septets of the UTF-8 text, escapes counted
+uint16_t gsm7Length(const char * text, uint16_t len)
+{
+    uint16_t n;
+    gsm7Encode(text,len,NULL,0xFFFF,&n);
+    return n;
+}
+
+// Translate UTF-8 text to septets, never splitting an escape
+uint16_t gsm7Encode(const char * text, uint16_t len, uint8_t * out, uint16_t max, uint16_t * septets)
+{
+    const uint8_t * p = (const uint8_t*)text;
+    uint16_t pos = 0, n = 0;
+    uint8_t c, used;
+
+    while(pos < len)
+    {
+        // Plain ASCII is nearly all of it
+        used = 1;
+        c = p[pos];
+        if(c < 0x80)
+            c = pgm_read_byte(&gsm7_from_ascii[c]);
+        else
+            c = gsm7FromUcs(gsm7Utf8(p+pos,len-pos,&used));
+
+        if(c & 0x80)
+        {
+            if(n + 2 > max) break;
+            if(out)
+            {
+                out[n] = GSM7_ESC;
+                out[n+1] = c & 0x7F;
+            }
+            n += 2;
+        }else
+        {
+            if(n >= max) break;
+            if(out) out[n] = c;
+            n++;
+        }
+        pos += used;
+    }
+    *septets = n;
+    return pos;
+}
+
+// Translate septets to UTF-8, never writing a partial character
+uint16_t gsm7Decode(const uint8_t * septets, uint16_t n, char * out, uint16_t max)
+{
+    uint16_t x, w = 0, ucs;
+    uint8_t c, k;
+
+    for(x=0;x<n;x++)
+    {
+        c = septets[x] & 0x7F;
+        if(c != GSM7_ESC)
+            ucs = pgm_read_word(&gsm7_alphabet_P[c]);
+        else if(x+1 < n)
+            ucs = gsm7ExtUcs(septets[++x] & 0x7F);
+        else
+            ucs = ' ';      // An escape at the very end reads as a space
+
+        k = ucs < 0x80 ? 1 : ucs < 0x800 ? 2 : 3;
+        if(w + k > max) break;
+        if(k == 1)
+            out[w++] = ucs;
+        else if(k == 2)
+        {
+            out[w++] = 0xC0 | (ucs >> 6);
+            out[w++] = 0x80 | (ucs & 0x3F);
+        }else
+        {
+            out[w++] = 0xE0 | (ucs >> 12);
+            out[w++] = 0x80 | ((ucs >> 6) & 0x3F);
+            out[w++] = 0x80 | (ucs & 0x3F);
+        }
+    }
+    if(w < max) out[w] = 0;
+    return w;
+}
+
+#if !defined(__AVR__)
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define GSM7_SWAR   0
+#else
+#define GSM7_SWAR   1
+#endif
+
+// Eight septets, one per byte, squeezed into the low 56 bits of a word
+static inline uint64_t gsm7Gather(const uint8_t * s)
+{
+    uint64_t v;
+    #if GSM7_SWAR
+    memcpy(&v,s,8);
+    v &= 0x7F7F7F7F7F7F7F7FULL;
+    v = (v & 0x007F007F007F007FULL) | ((v & 0x7F007F007F007F00ULL) >> 1);
+    v = (v & 0x00003FFF00003FFFULL) | ((v & 0x3FFF00003FFF0000ULL) >> 2);
+    v = (v & 0x000000000FFFFFFFULL) | ((v & 0x0FFFFFFF00000000ULL) >> 4);
+    #else
+    v = 0;
+    for(uint8_t k=0;k<8;k++) v |= (uint64_t)(s[k] & 0x7F) << (7*k);
+    #endif
+    return v;
+}
+
+// The low 56 bits of a word spread back out to eight septets
+static inline void gsm7Scatter(uint64_t v, uint8_t * s)
+{
+    #if GSM7_SWAR
+    v &= 0x00FFFFFFFFFFFFFFULL;
+    v = (v & 0x000000000FFFFFFFULL) | ((v << 4) & 0x0FFFFFFF00000000ULL);
+    v = (v & 0x00003FFF00003FFFULL) | ((v << 2) & 0x3FFF00003FFF0000ULL);
+    v = (v & 0x007F007F007F007FULL) | ((v << 1) & 0x7F007F007F007F00ULL);
+    memcpy(s,&v,8);
+    #else
+    for(uint8_t k=0;k<8;k++) s[k] = (v >> (7*k)) & 0x7F;
+    #endif
+    return;
+}
+
+// Octets of a word in wire order, least significant first
+static inline void gsm7Store7(uint64_t w, uint8_t * o)
+{
+    #if GSM7_SWAR
+    memcpy(o,&w,7);
+    #else
+    for(uint8_t k=0;k<7;k++) o[k] = w >> (8*k);
+    #endif
+    return;
+}
+static inline uint64_t gsm7Load8(const uint8_t * p)
+{
+    uint64_t w;
+    #if GSM7_SWAR
+    memcpy(&w,p,8);
+    #else
+    w = 0;
+    for(uint8_t k=0;k<8;k++) w |= (uint64_t)p[k] << (8*k);
+    #endif
+    return w;
+}
+#endif
+
+// Start packing after 'fill' zero bits
+void gsm7PackBegin(gsm7_pack_t * st, uint8_t fill)
+{
+    st->acc = 0;
+    st->bits = fill & 7;
+    return;
+}
+
+// Pack septets, returns the octets written
+uint16_t gsm7PackWrite(gsm7_pack_t * st, const uint8_t * septets, uint16_t n, uint8_t * out)
+{
+    uint8_t * o = out;
+    uint16_t acc = st->acc;
+    uint8_t bits = st->bits;
+
+    #if !defined(__AVR__)
+    // Eight septets are 56 bits, seven whole octets, so the bits carried
+    // from block to block stay the same.  AVR has no barrel shifter and
+    // takes the loop below.
+    uint64_t w;
+    while(n >= 8)
+    {
+        w = acc | (gsm7Gather(septets) << bits);
+        gsm7Store7(w,o);
+        acc = (uint8_t)(w >> 56);
+        septets += 8;
+        n -= 8;
+        o += 7;
+    }
+    #endif
+    while(n--)
+    {
+        acc |= (uint16_t)(*septets++ & 0x7F) << bits;
+        bits += 7;
+        if(bits >= 8)
+        {
+            *o++ = acc & 0xFF;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    st->acc = acc;
+    st->bits = bits;
+    return o - out;
+}
+
+// Write the last partial octet
+uint8_t gsm7PackEnd(gsm7_pack_t * st, uint8_t * out)
+{
+    if(st->bits == 0) return 0;
+    out[0] = st->acc;
+    st->acc = 0;
+    st->bits = 0;
+    return 1;
+}
+
+// Pack n septets after 'fill' zero bits in one go
+uint16_t gsm7Pack(const uint8_t * septets, uint16_t n, uint8_t * out, uint8_t fill)
+{
+    gsm7_pack_t st;
+    uint16_t c;
+
+    gsm7PackBegin(&st,fill);
+    c = gsm7PackWrite(&st,septets,n,out);
+    return c + gsm7PackEnd(&st,&out[c]);
+}
+
+// Unpack n septets that start 'fill' bits into 'in'
+void gsm7Unpack(const uint8_t * in, uint16_t n, uint8_t * septets, uint8_t fill)
+{
+    const uint8_t * p;
+    uint32_t pos = fill & 7;
+    uint16_t x = 0;
+    uint8_t k, c;
+
+    #if !defined(__AVR__)
+    // The eighth octet loaded holds the start of septet x+8, so it is
+    // only read while that septet is part of the input
+    while(n - x >= 9)
+    {
+        gsm7Scatter(gsm7Load8(&in[pos >> 3]) >> (pos & 7),&septets[x]);
+        x += 8;
+        pos += 56;
+    }
+    #endif
+    for(;x<n;x++)
+    {
+        p = &in[pos >> 3];
+        k = pos & 7;
+        c = p[0] >> k;
+        if(k > 1) c |= p[1] << (8 - k);
+        septets[x] = c & 0x7F;
+        pos += 7;
+    }
+    return;
+}
+
+//eof
@@ -0,0 +1,75 @@
+/*
+  FBusGSM.h - GSM 03.38 default alphabet and 7-bit packing for F-Bus.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// SMS text travels as septets of the GSM 03.38 default alphabet, packed
+// eight to seven octets.  Texts come in as UTF-8, plain ASCII included.
+// Characters of the extension table ({ } [ ] ~ \ | ^ € and form feed)
+// take two septets, an escape and the code.  Characters the alphabet
+// does not have become '?'.
+//
+// The translation tables are built at compile time from the alphabet
+// table in FBusGSM.cpp and live in PROGMEM on AVR.
+//
+// This header has no Arduino dependencies so it builds on Linux too.
+
+#ifndef __FBUSGSM_H__
+#define __FBUSGSM_H__
+
+#include "stdint.h"
+
+// Escape to the extension table
+#define GSM7_ESC        0x1B
+
+// Septet sent for characters the alphabet does not have, '?'
+#define GSM7_UNKNOWN    0x3F
+
+// Bytes of UTF-8 one septet can decode to
+#define GSM7_UTF8_MAX   3
+
+// Packer state carried between calls, so a text can be packed in pieces
+typedef struct {
+    uint8_t acc;                // Low bits of the next octet
+    uint8_t bits;               // Number of them, 0 to 7
+}gsm7_pack_t;
+
+// Septet of the next UTF-8 character, 0x80 | the extension code for the
+// ones that take an escape.  *used is set to the bytes of text it took.
+uint8_t gsm7Char(const char * text, uint16_t len, uint8_t * used);
+
+// Septets of the UTF-8 text, escapes counted
+uint16_t gsm7Length(const char * text, uint16_t len);
+
+// Translate UTF-8 text to septets, stopping before a character that would
+// take the count past 'max' so an escape is never split.  'out' may be
+// NULL to only count.  Returns the bytes of text used, *septets is set to
+// the number of septets.
+uint16_t gsm7Encode(const char * text, uint16_t len, uint8_t * out, uint16_t max, uint16_t * septets);
+
+// Translate septets to UTF-8.  Writes at most 'max' bytes and a NUL when
+// there is room, never a partial character.  Returns the bytes written.
+uint16_t gsm7Decode(const uint8_t * septets, uint16_t n, char * out, uint16_t max);
+
+// Start packing after 'fill' zero bits, see GSM 03.40 9.2.3.24 for the
+// fill bits that follow a user data header
+void gsm7PackBegin(gsm7_pack_t * st, uint8_t fill);
+
+// Pack septets, returns the octets written to 'out'.  Up to (n*7+7)/8.
+uint16_t gsm7PackWrite(gsm7_pack_t * st, const uint8_t * septets, uint16_t n, uint8_t * out);
+
+// Write the last partial octet, returns 0 or 1
+uint8_t gsm7PackEnd(gsm7_pack_t * st, uint8_t * out);
+
+// Pack n septets after 'fill' zero bits in one go, returns the octets
+// written, (fill + n*7 + 7)/8
+uint16_t gsm7Pack(const uint8_t * septets, uint16_t n, uint8_t * out, uint8_t fill);
+
+// Unpack n septets that start 'fill' bits into 'in'
+void gsm7Unpack(const uint8_t * in, uint16_t n, uint8_t * septets, uint8_t fill);
+
+#endif
+
+//eof
@@ -0,0 +1,295 @@
+// FBusGateway.cpp - SMS gateway over several phones on their own UARTs.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+
+#include "Arduino.h"
+#include "FBusGateway.h"
+#include "string.h"
+
+// Second byte of an SMS reply after the 0x00 0x01, sent or not
+#define FBUS_GW_SMS_SENT    0x02
+#define FBUS_GW_SMS_ERROR   0x03
+
+// Every type of every phone comes to the gateway first
+FBUS_HANDLERS(fbus_gw_handlers,fbusGwMessage,
+    FBUS_ON(FBUSTYPE_SMS,fbusGwMessage));
+
+// A message from a phone, ctx is its link
+void fbusGwMessage(void * ctx, const fbus_msg_t * msg)
+{
+    fbus_gw_link_t * link = (fbus_gw_link_t*)ctx;
+    link->gw->message(link,msg);
+    return;
+}
+
+// A submit the phone never ACKed will not be reported either.  Its frames
+// finish in order, the submit is done with its last one and frees its
+// place once, however many of them failed.
+void fbusGwTxDone(void * ctx, uint8_t MsgType, uint8_t status, uint8_t /*tries*/, uint16_t /*latency_ms*/)
+{
+    fbus_gw_link_t * link = (fbus_gw_link_t*)ctx;
+    if(MsgType != FBUSTYPE_SMS || link->subs == 0) return;
+    if(status == FBUS_TX_FAILED) link->sub_failed = true;
+    if(++link->sub_done < link->sub_frames[0]) return;
+
+    if(link->sub_failed)
+    {
+        link->stats.failed++;
+        if(link->outstanding) link->outstanding--;
+    }
+    link->subs--;
+    memmove(link->sub_frames,link->sub_frames+1,link->subs);
+    link->sub_done = 0;
+    link->sub_failed = false;
+    return;
+}
+
+FBusGateway::FBusGateway(uint8_t policy)
+: m_phones(0), m_policy(policy), m_outstanding(FBUS_GW_OUTSTANDING), m_next(0),
+  m_current(FBUS_GW_NONE), m_job_head(0), m_job_count(0), m_handlers(NULL), m_handler_ctx(NULL)
+{
+    return;
+}
+
+// Add a phone, returns its index
+uint8_t FBusGateway::AddPhone(FBusCore & phone)
+{
+    fbus_gw_link_t * link;
+    if(m_phones >= FBUS_GW_PHONES) return FBUS_GW_NONE;
+    link = &m_link[m_phones];
+    link->phone = &phone;
+    link->gw = this;
+    link->index = m_phones;
+    link->outstanding = 0;
+    link->subs = 0;
+    link->sub_done = 0;
+    link->sub_failed = false;
+    memset(&link->stats,0,sizeof(link->stats));
+    return m_phones++;
+}
+
+// Initialize every phone and take over their handlers
+void FBusGateway::initialize()
+{
+    for(uint8_t x=0;x<m_phones;x++)
+    {
+        m_link[x].phone->initialize();
+        m_link[x].phone->SetHandlers(&fbus_gw_handlers,&m_link[x]);
+        m_link[x].phone->SetTxDoneHandler(fbusGwTxDone,&m_link[x]);
+        m_link[x].outstanding = 0;
+        m_link[x].subs = 0;
+        m_link[x].sub_done = 0;
+        m_link[x].sub_failed = false;
+        memset(&m_link[x].stats,0,sizeof(m_link[x].stats));
+    }
+    m_job_head = 0;
+    m_job_count = 0;
+    m_next = 0;
+    return;
+}
+
+// Run every phone, then hand out jobs in the order they were queued.  A
+// job that fits no phone now waits and holds back the ones behind it.
+void FBusGateway::process()
+{
+    fbus_gw_job_t * job;
+    fbus_gw_link_t * link;
+    uint8_t x, pending;
+
+    for(x=0;x<m_phones;x++)
+        m_link[x].phone->process();
+
+    while(m_job_count)
+    {
+        job = &m_job[m_job_head];
+        x = pick(job->frames);
+        if(x == FBUS_GW_NONE) break;
+        link = &m_link[x];
+        pending = link->phone->TxPending();
+        if(!link->phone->SendSMS(job->to,job->text)) break;
+        link->sub_frames[link->subs++] = link->phone->TxPending() - pending;
+        link->stats.jobs++;
+        if(++link->outstanding > link->stats.outstanding_max)
+            link->stats.outstanding_max = link->outstanding;
+        m_job_head = (m_job_head + 1) % FBUS_GW_JOBS;
+        m_job_count--;
+    }
+    return;
+}
+
+// FBUS_GW_ROUND_ROBIN or FBUS_GW_LEAST_LOADED
+void FBusGateway::SetPolicy(uint8_t policy)
+{
+    m_policy = policy;
+    return;
+}
+
+// Submits a phone may hold without a sent report
+void FBusGateway::SetOutstanding(uint8_t outstanding)
+{
+    m_outstanding = outstanding < 1 ? 1 : outstanding;
+    return;
+}
+
+// The same SMSC on every phone
+void FBusGateway::SetSMSC(const fbus_number_t & smsc)
+{
+    for(uint8_t x=0;x<m_phones;x++)
+        m_link[x].phone->SetSMSC(smsc);
+    return;
+}
+
+// Add a number to the directory of every phone.  They all start empty
+// and get the same numbers in the same order, so the handles agree.
+fbus_recipient_t FBusGateway::AddRecipient(const char * number, fbus_number_type_e type)
+{
+    fbus_recipient_t to = FBUS_RECIPIENT_NONE;
+    for(uint8_t x=0;x<m_phones;x++)
+        to = m_link[x].phone->AddRecipient(number,type);
+    return to;
+}
+fbus_recipient_t FBusGateway::AddRecipient(const fbus_number_t & number)
+{
+    fbus_recipient_t to = FBUS_RECIPIENT_NONE;
+    for(uint8_t x=0;x<m_phones;x++)
+        to = m_link[x].phone->AddRecipient(number);
+    return to;
+}
+
+// Queue an SMS in the pool.  The frames it takes are counted here once,
+// the most any phone needs as they may be sized differently.
+bool FBusGateway::SendSMS(fbus_recipient_t to, const char * message)
+{
+    fbus_gw_job_t * job;
+    uint8_t frames = 0, n;
+
+    if(m_job_count >= FBUS_GW_JOBS || to == FBUS_RECIPIENT_NONE || m_phones == 0) return false;
+    for(uint8_t x=0;x<m_phones;x++)
+    {
+        n = m_link[x].phone->SMSFrames(message);
+        if(n == 0) return false;
+        if(n > frames) frames = n;
+    }
+    job = &m_job[(m_job_head + m_job_count) % FBUS_GW_JOBS];
+    job->frames = frames;
+    job->text = message;
+    job->to = to;
+    m_job_count++;
+    return true;
+}
+
+// Jobs not handed to a phone yet
+uint8_t FBusGateway::JobsWaiting()
+{
+    return m_job_count;
+}
+
+// Free places in the pool
+uint8_t FBusGateway::JobsFree()
+{
+    return FBUS_GW_JOBS - m_job_count;
+}
+
+// Messages of every phone go on to this table
+void FBusGateway::SetHandlers(const fbus_handler_table_t * table, void * ctx)
+{
+    m_handlers = table;
+    m_handler_ctx = ctx;
+    return;
+}
+
+// Phone whose message is being handled
+uint8_t FBusGateway::CurrentPhone()
+{
+    return m_current;
+}
+
+// Number of phones
+uint8_t FBusGateway::Phones()
+{
+    return m_phones;
+}
+
+// A phone by index
+FBusCore & FBusGateway::Phone(uint8_t index)
+{
+    return *m_link[index].phone;
+}
+
+// Counters of a phone
+const fbus_gw_stats_t* FBusGateway::GetStats(uint8_t index)
+{
+    return &m_link[index].stats;
+}
+
+// Submits a phone holds now
+uint8_t FBusGateway::Outstanding(uint8_t index)
+{
+    return m_link[index].outstanding;
+}
+
+// Private functions
+// ---------------------------------
+
+// Whether a phone has room for a job of 'frames'
+bool FBusGateway::room(const fbus_gw_link_t * link, uint8_t frames)
+{
+    return link->outstanding < m_outstanding && link->subs < FBUS_GW_SUBMITS &&
+           link->phone->TxQueueFree() >= frames;
+}
+
+// Phone that takes the next job.  Round robin starts after the phone
+// that took the last one.  Least loaded counts the submits waiting for a
+// report and the frames waiting for an ACK, a tie goes to the next in
+// turn so idle phones share the work.
+uint8_t FBusGateway::pick(uint8_t frames)
+{
+    uint8_t best = FBUS_GW_NONE, load, best_load = 0xFF, x, k;
+
+    for(k=0;k<m_phones;k++)
+    {
+        x = (m_next + k) % m_phones;
+        if(!room(&m_link[x],frames)) continue;
+        if(m_policy == FBUS_GW_ROUND_ROBIN)
+        {
+            best = x;
+            break;
+        }
+        load = m_link[x].outstanding + m_link[x].phone->TxPending();
+        if(load < best_load)
+        {
+            best = x;
+            best_load = load;
+        }
+    }
+    if(best != FBUS_GW_NONE) m_next = (best + 1) % m_phones;
+    return best;
+}
+
+// Count the phone's sent reports and pass every message on
+void FBusGateway::message(fbus_gw_link_t * link, const fbus_msg_t * msg)
+{
+    fbus_handler_t fn = NULL;
+
+    if(msg->MsgType == FBUSTYPE_SMS && msg->length >= 4 &&
+       (msg->data[3] == FBUS_GW_SMS_SENT || msg->data[3] == FBUS_GW_SMS_ERROR))
+    {
+        link->stats.reports++;
+        if(link->outstanding) link->outstanding--;
+    }
+
+    if(m_handlers)
+        fn = (fbus_handler_t)pgm_read_ptr(&m_handlers->fn[msg->MsgType]);
+    if(fn)
+    {
+        m_current = link->index;
+        fn(m_handler_ctx,msg);
+        m_current = FBUS_GW_NONE;
+    }
+    return;
+}
+
+//eof
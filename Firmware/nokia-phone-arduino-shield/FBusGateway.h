@@ -0,0 +1,197 @@
+/*
+  FBusGateway.h - SMS gateway over several phones on their own UARTs.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// A phone takes seconds to send each SMS, so a gateway that has to get
+// many out spreads them over several phones:
+//
+//   FBus phoneA(Serial1);
+//   FBusSized<64,1,3> phoneB(Serial2);
+//   FBusGateway gateway;
+//   gateway.AddPhone(phoneA);
+//   gateway.AddPhone(phoneB);
+//   gateway.initialize();
+//   oncallTo = gateway.AddRecipient(oncall);
+//   gateway.SendSMS(oncallTo,"Pump 4 pressure low");
+//   ...
+//   gateway.process();          // from loop()
+//
+// SendSMS() only takes a place in the job pool, one pool shared by all
+// the phones.  process() runs every phone and hands the oldest job to the
+// phone the policy picks once that phone has both a free transmit slot
+// for each frame of the submit and fewer than the outstanding limit of
+// submits still waiting for their sent report.  The phone composes the
+// frames straight into its own slots then, a job is never built twice.
+// The text must stay untouched until the job is handed out, see
+// JobsWaiting().
+//
+// The gateway handles every message of every phone, SetHandlers() on a
+// phone would take them away from it.  Messages are passed on to the
+// gateway's own handler table, CurrentPhone() tells which phone sent one.
+
+#ifndef __FBUSGATEWAY_H__
+#define __FBUSGATEWAY_H__
+
+#include "FBus.h"
+
+// Most phones a gateway runs
+#ifndef FBUS_GW_PHONES
+#define FBUS_GW_PHONES      4
+#endif
+#if FBUS_GW_PHONES < 1 || FBUS_GW_PHONES > 254
+#error "FBUS_GW_PHONES must be 1 to 254"
+#endif
+
+// SMS waiting in the shared job pool, each costs 4 bytes of RAM on AVR
+#ifndef FBUS_GW_JOBS
+#define FBUS_GW_JOBS        8
+#endif
+#if FBUS_GW_JOBS < 1 || FBUS_GW_JOBS > 255
+#error "FBUS_GW_JOBS must be 1 to 255"
+#endif
+
+// Submits a phone holds before its sent reports come back, a real phone
+// only takes a few at once
+#ifndef FBUS_GW_OUTSTANDING
+#define FBUS_GW_OUTSTANDING 2
+#endif
+
+// Submits with frames in one phone's transmit queue, one a slot at most
+#define FBUS_GW_SUBMITS     7
+
+// How process() picks the phone for the next job
+#define FBUS_GW_ROUND_ROBIN     0   // The next phone in turn that has room
+#define FBUS_GW_LEAST_LOADED    1   // The phone with the fewest submits and frames waiting
+
+// Returned by AddPhone() and CurrentPhone() for no phone
+#define FBUS_GW_NONE        0xFF
+
+// One SMS waiting in the pool
+typedef struct {
+    const char * text;          // The sketch's, read when the job is handed out
+    fbus_recipient_t to;
+    uint8_t frames;             // Transmit slots the submit takes
+}fbus_gw_job_t;
+
+// Counters of one phone, read with GetStats()
+typedef struct {
+    uint16_t jobs;              // Submits handed to the phone
+    uint16_t reports;           // SMS replies from it, sent reports and errors
+    uint16_t failed;            // Submits with a frame it never ACKed
+    uint8_t outstanding_max;    // Most submits ever waiting for a report
+}fbus_gw_stats_t;
+
+class FBusGateway;
+
+// One phone of the gateway, the ctx of its handlers
+typedef struct {
+    FBusCore * phone;
+    FBusGateway * gw;
+    uint8_t index;
+    uint8_t outstanding;        // Submits with no report yet
+    uint8_t sub_frames[FBUS_GW_SUBMITS];    // Frames of each submit not all ACKed, oldest first
+    uint8_t subs;
+    uint8_t sub_done;           // Frames of the oldest ACKed or failed
+    bool sub_failed;            // Of which one failed
+    fbus_gw_stats_t stats;
+}fbus_gw_link_t;
+
+// The handlers every phone reports to, ctx is its link
+void fbusGwMessage(void * ctx, const fbus_msg_t * msg);
+void fbusGwTxDone(void * ctx, uint8_t MsgType, uint8_t status, uint8_t tries, uint16_t latency_ms);
+
+class FBusGateway {
+    friend void fbusGwMessage(void * ctx, const fbus_msg_t * msg);
+
+    public:
+        FBusGateway(uint8_t policy = FBUS_GW_LEAST_LOADED);
+
+        // Add a phone, returns its index or FBUS_GW_NONE when the gateway
+        // already has FBUS_GW_PHONES
+        uint8_t AddPhone(FBusCore & phone);
+
+        // Initialize every phone and take over their handlers
+        void initialize();
+
+        // Run every phone's process(), then hand waiting jobs to phones
+        // that have room, oldest first
+        void process();
+
+        // FBUS_GW_ROUND_ROBIN or FBUS_GW_LEAST_LOADED
+        void SetPolicy(uint8_t policy);
+
+        // Submits a phone may hold without a sent report, 1 or more
+        void SetOutstanding(uint8_t outstanding);
+
+        // The same SMSC and directory on every phone, so a recipient handle
+        // is good on all of them
+        void SetSMSC(const fbus_number_t & smsc);
+        fbus_recipient_t AddRecipient(const char * number, fbus_number_type_e type);
+        fbus_recipient_t AddRecipient(const fbus_number_t & number);
+
+        // Queue an SMS of up to 160 septets for the next phone with room.
+        // False when the pool is full, the recipient is unknown or the
+        // text does not fit one SMS.
+        bool SendSMS(fbus_recipient_t to, const char * message);
+
+        // Jobs not handed to a phone yet
+        uint8_t JobsWaiting();
+
+        // Free places in the pool
+        uint8_t JobsFree();
+
+        // Hand the messages of every phone to a FBUS_HANDLERS table.  Types
+        // it has no handler for are dropped.
+        void SetHandlers(const fbus_handler_table_t * table, void * ctx);
+
+        // Phone whose message is being handled, FBUS_GW_NONE outside a
+        // handler
+        uint8_t CurrentPhone();
+
+        // A phone added with AddPhone() and its counters
+        uint8_t Phones();
+        FBusCore & Phone(uint8_t index);
+        const fbus_gw_stats_t* GetStats(uint8_t index);
+
+        // Submits a phone holds now
+        uint8_t Outstanding(uint8_t index);
+
+    private:
+
+        // Variables
+        // ---------------------------------
+
+        fbus_gw_link_t m_link[FBUS_GW_PHONES];
+        uint8_t m_phones;
+        uint8_t m_policy;
+        uint8_t m_outstanding;          // Limit of submits per phone
+        uint8_t m_next;                 // Round robin, phone tried first
+        uint8_t m_current;              // Phone in a handler, FBUS_GW_NONE outside
+
+        fbus_gw_job_t m_job[FBUS_GW_JOBS];  // Job pool, a FIFO
+        uint8_t m_job_head;             // Oldest job
+        uint8_t m_job_count;
+
+        const fbus_handler_table_t * m_handlers;    // In flash, NULL for none
+        void * m_handler_ctx;
+
+        // Functions
+        // ---------------------------------
+
+        // Phone that takes a job of 'frames' now, FBUS_GW_NONE if none has
+        // room
+        uint8_t pick(uint8_t frames);
+
+        // Whether a phone has room for a job of 'frames'
+        bool room(const fbus_gw_link_t * link, uint8_t frames);
+
+        // A message from one of the phones
+        void message(fbus_gw_link_t * link, const fbus_msg_t * msg);
+};
+
+#endif
+
+//eof
@@ -0,0 +1,288 @@
+/*
+  FBusPort.h - Transports an FBus talks to its phone through.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// A transport is any class with these four, FBusSized<...,PORT> takes one
+// as its last parameter:
+//
+//   int available();                                bytes waiting
+//   int read();                                     next byte, -1 if none
+//   size_t write(const uint8_t * buf, size_t len);  blocks until taken
+//   void flush();                                   wait until all is out
+//
+// They are called on the class itself, never through Stream, so they
+// inline into the loops below.  FBusCore calls those loops through one
+// table per transport, once for a span of bytes instead of once a byte.
+//
+//   FBusStreamPort         any HardwareSerial&, virtual calls as before.
+//                          The default, FBus myPhone(Serial1) uses it.
+//   FBusSerialPort<S>      a port of concrete class S, called directly:
+//                          HardwareSerial on AVR, SoftwareSerial, the USB
+//                          CDC Serial_, HostSerial on Linux.
+//   FBusAvrUart<BASE>      AVR USART registers with an RX interrupt ring,
+//                          nothing of the Arduino core, see below.
+//   FBusFdPort             a Linux file descriptor, tty, pty or pipe.
+
+#ifndef __FBUSPORT_H__
+#define __FBUSPORT_H__
+
+#include "Arduino.h"
+#include "stdint.h"
+#include "FBusRing.h"
+
+#ifdef __unix__
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+// The span calls FBusCore makes, in flash
+typedef struct {
+    int (*available)(void * port);
+    uint8_t (*read)(void * port, uint8_t * buf, uint8_t max);
+    void (*write)(void * port, const uint8_t * buf, uint16_t len);
+    void (*flush)(void * port);
+}fbus_port_ops_t;
+
+// The table of one transport, the per-byte calls inline into it
+template<class PORT>
+struct FBusPortOps {
+    static int available(void * port)
+    {
+        return ((PORT*)port)->available();
+    }
+
+    // What is waiting, up to 'max' bytes
+    static uint8_t read(void * port, uint8_t * buf, uint8_t max)
+    {
+        PORT & p = *(PORT*)port;
+        int avail = p.available();
+        uint8_t n;
+        if(avail < max) max = avail;
+        for(n=0;n<max;n++)
+        {
+            int c = p.read();
+            if(c == -1) break;
+            buf[n] = c;
+        }
+        return n;
+    }
+
+    static void write(void * port, const uint8_t * buf, uint16_t len)
+    {
+        ((PORT*)port)->write(buf,len);
+        return;
+    }
+
+    static void flush(void * port)
+    {
+        ((PORT*)port)->flush();
+        return;
+    }
+
+    static const fbus_port_ops_t ops;
+};
+
+template<class PORT>
+const fbus_port_ops_t FBusPortOps<PORT>::ops PROGMEM = {
+    FBusPortOps<PORT>::available, FBusPortOps<PORT>::read,
+    FBusPortOps<PORT>::write, FBusPortOps<PORT>::flush
+};
+
+// Any serial port through its Stream, what FBus always did
+class FBusStreamPort {
+    public:
+        FBusStreamPort(HardwareSerial & serial) : m_serial(serial) {}
+
+        int available() { return m_serial.available(); }
+        int read() { return m_serial.read(); }
+        size_t write(const uint8_t * buf, size_t len) { return m_serial.write(buf,len); }
+        void flush() { m_serial.flush(); }
+
+    private:
+        HardwareSerial & m_serial;
+};
+
+// A serial port of a known class, its functions called without the
+// vtable and inlined where the class defines them in its header
+template<class SERIAL_CLASS>
+class FBusSerialPort {
+    public:
+        FBusSerialPort(SERIAL_CLASS & serial) : m_serial(serial) {}
+
+        int available() { return m_serial.SERIAL_CLASS::available(); }
+        int read() { return m_serial.SERIAL_CLASS::read(); }
+        size_t write(const uint8_t * buf, size_t len) { return m_serial.SERIAL_CLASS::write(buf,len); }
+        void flush() { m_serial.SERIAL_CLASS::flush(); }
+
+    private:
+        SERIAL_CLASS & m_serial;
+};
+
+#ifdef __AVR__
+// Size of the FBusAvrUart receive ring, a power of two up to 128
+#ifndef FBUS_AVR_UART_RING
+#define FBUS_AVR_UART_RING  64
+#endif
+
+// USART register blocks, BASE of FBusAvrUart
+#define FBUS_AVR_USART0     0xC0
+#define FBUS_AVR_USART1     0xC8
+#define FBUS_AVR_USART2     0xD0
+#define FBUS_AVR_USART3     0x130
+
+// A USART driven through its registers.  Received bytes go into a ring
+// from the RX interrupt, which the sketch hooks up with
+// FBUS_AVR_UART_ISR(); that UART's HardwareSerial must not be used, or
+// the core's interrupt clashes with this one.  Writes wait on the data
+// register, a frame leaves the UART before write() returns.
+//
+//   FBusOn<FBusAvrUart<FBUS_AVR_USART1> > myPhone;
+//   FBUS_AVR_UART_ISR(USART1_RX_vect,myPhone)
+//   ...
+//   myPhone.Port().begin(115200);
+template<uint16_t BASE>
+class FBusAvrUart {
+    public:
+        FBusAvrUart() : m_written(false) {}
+
+        void begin(unsigned long baud)
+        {
+            // Double speed, as the Arduino core sets it
+            uint16_t ubrr = (F_CPU / 4 / baud - 1) / 2;
+            reg(0) = _BV(1);                    // U2X
+            reg(5) = ubrr >> 8;
+            reg(4) = ubrr;
+            reg(2) = _BV(2) | _BV(1);           // 8N1
+            reg(1) = _BV(7) | _BV(4) | _BV(3);  // RXCIE, RXEN, TXEN
+            return;
+        }
+
+        int available() { return m_rx.available(); }
+        int read() { return m_rx.pop(); }
+
+        size_t write(const uint8_t * buf, size_t len)
+        {
+            for(size_t x=0;x<len;x++)
+            {
+                while(!(reg(0) & _BV(5))) {}    // UDRE
+                reg(0) = (reg(0) & _BV(1)) | _BV(6);    // Clear TXC, keep U2X
+                reg(6) = buf[x];
+            }
+            if(len) m_written = true;
+            return len;
+        }
+
+        // Wait for the last byte to leave the shift register.  TXC is
+        // only ever set by a byte going out, so with none written yet
+        // there is nothing to wait for, as in the Arduino core.
+        void flush()
+        {
+            if(m_written && (reg(1) & _BV(3)))
+                while(!(reg(0) & _BV(6))) {}    // TXC
+            return;
+        }
+
+        // From the RX interrupt only
+        void receive()
+        {
+            m_rx.push(reg(6));
+            return;
+        }
+
+        // Bytes lost to a full ring
+        uint16_t overflows() { return m_rx.overflows(); }
+
+    private:
+        static volatile uint8_t & reg(uint8_t x) { return *(volatile uint8_t*)(uintptr_t)(BASE + x); }
+
+        FBusRing<FBUS_AVR_UART_RING> m_rx;
+        bool m_written;                 // Any byte written yet
+};
+
+// The RX interrupt of an FBusAvrUart phone
+#define FBUS_AVR_UART_ISR(vect,phone) \
+    ISR(vect) { (phone).Port().receive(); }
+#endif
+
+#ifdef __unix__
+// A file descriptor set to non-blocking, read through a small buffer so a
+// span of bytes costs one read(2).  The port never closes it.
+class FBusFdPort {
+    public:
+        FBusFdPort(int fd = -1) : rx_bytes(0), tx_bytes(0), m_fd(fd), m_pos(0), m_len(0) {}
+
+        void attach(int fd)
+        {
+            m_fd = fd;
+            m_pos = m_len = 0;
+            return;
+        }
+        int fd() { return m_fd; }
+
+        int available()
+        {
+            if(m_pos == m_len && m_fd >= 0)
+            {
+                ssize_t n = ::read(m_fd,m_buf,sizeof(m_buf));
+                m_pos = 0;
+                m_len = n > 0 ? n : 0;
+                rx_bytes += m_len;
+            }
+            return m_len - m_pos;
+        }
+
+        int read()
+        {
+            if(m_pos == m_len && available() == 0) return -1;
+            return m_buf[m_pos++];
+        }
+
+        size_t write(const uint8_t * buf, size_t len)
+        {
+            size_t done = 0;
+            if(m_fd < 0) return len;
+            while(done < len)
+            {
+                ssize_t n = ::write(m_fd,buf+done,len-done);
+                if(n > 0)
+                {
+                    done += n;
+                }else if(n < 0 && errno == EAGAIN)
+                {
+                    struct pollfd p = { m_fd, POLLOUT, 0 };
+                    poll(&p,1,100);
+                }else
+                {
+                    break;
+                }
+            }
+            tx_bytes += done;
+            return done;
+        }
+
+        void flush()
+        {
+            if(m_fd >= 0) tcdrain(m_fd);
+            return;
+        }
+
+        // Bytes each way
+        unsigned long rx_bytes;
+        unsigned long tx_bytes;
+
+    private:
+        int m_fd;
+        uint8_t m_buf[64];
+        uint8_t m_pos;
+        uint8_t m_len;
+};
+#endif
+
+#endif
+
+//eof
@@ -0,0 +1,98 @@
+/*
+  FBusRing.h - Single producer / single consumer byte ring for F-Bus.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// The producer is the UART RX interrupt (or a thread on Linux) and the
+// consumer is FBus::process().  Each side only writes its own index so
+// no locking is needed.  The indexes run freely from 0 to 255 and are
+// masked on access, SIZE must be a power of two no larger than 128.
+//
+// This header has no Arduino dependencies so it builds on Linux too.
+
+#ifndef __FBUSRING_H__
+#define __FBUSRING_H__
+
+#include "stdint.h"
+
+template<uint8_t SIZE>
+class FBusRing {
+    public:
+        FBusRing() : m_head(0), m_tail(0), m_overflows(0) {}
+
+        // Producer side.  No room for another byte.
+        bool full()
+        {
+            return (uint8_t)(m_head - __atomic_load_n(&m_tail,__ATOMIC_ACQUIRE)) >= SIZE;
+        }
+
+        // Producer side.  Returns false and counts an overflow when full.
+        bool push(uint8_t b)
+        {
+            uint8_t head = m_head;
+            if(full())
+            {
+                if(m_overflows != 0xFF) m_overflows++;
+                return false;
+            }
+            m_buf[head & (SIZE-1)] = b;
+            __atomic_store_n(&m_head,(uint8_t)(head+1),__ATOMIC_RELEASE);
+            return true;
+        }
+
+        // Consumer side.  Returns -1 when empty.
+        int pop()
+        {
+            uint8_t tail = m_tail;
+            if(tail == __atomic_load_n(&m_head,__ATOMIC_ACQUIRE))
+                return -1;
+            uint8_t b = m_buf[tail & (SIZE-1)];
+            __atomic_store_n(&m_tail,(uint8_t)(tail+1),__ATOMIC_RELEASE);
+            return b;
+        }
+
+        // Consumer side.  Copy up to 'max' bytes out, returns how many.
+        uint8_t read(uint8_t * buf, uint8_t max)
+        {
+            uint8_t tail = m_tail;
+            uint8_t n = (uint8_t)(__atomic_load_n(&m_head,__ATOMIC_ACQUIRE) - tail);
+            if(n > max) n = max;
+            for(uint8_t x=0;x<n;x++) buf[x] = m_buf[(uint8_t)(tail+x) & (SIZE-1)];
+            __atomic_store_n(&m_tail,(uint8_t)(tail+n),__ATOMIC_RELEASE);
+            return n;
+        }
+
+        // Consumer side.  Number of bytes waiting.
+        uint8_t available()
+        {
+            return (uint8_t)(__atomic_load_n(&m_head,__ATOMIC_ACQUIRE) - m_tail);
+        }
+
+        // Consumer side.  Drop everything waiting.
+        void clear()
+        {
+            __atomic_store_n(&m_tail,__atomic_load_n(&m_head,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+        }
+
+        // Bytes the producer had to throw away, up to 255.  A single byte
+        // so the consumer never reads it half written on AVR.
+        uint8_t overflows()
+        {
+            return m_overflows;
+        }
+
+    private:
+        static_assert(SIZE && SIZE <= 128 && (SIZE & (SIZE-1)) == 0,
+                      "FBusRing SIZE must be a power of two up to 128");
+
+        uint8_t m_buf[SIZE];
+        uint8_t m_head;             // Written by the producer only
+        uint8_t m_tail;             // Written by the consumer only
+        volatile uint8_t m_overflows;
+};
+
+#endif
+
+//eof
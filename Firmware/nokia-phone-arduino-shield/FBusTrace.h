@@ -0,0 +1,149 @@
+/*
+  FBusTrace.h - Binary trace of the raw F-Bus bytes.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+// Bytes read from and written to the phone are kept as records in a ring:
+//
+//   tag, micros() as 4 bytes little endian, up to 127 bytes
+//
+// The low 7 bits of the tag count the bytes, FBUS_TRACE_TX is set for
+// bytes sent to the phone.  A record that does not fit is dropped, the
+// next one that fits is preceded by a FBUS_TRACE_LOST record whose
+// timestamp holds the number dropped.
+//
+// drain() sends whole records to the PC in frames the decoder can find
+// among text printed on the same port:
+//
+//   'F' 'T' seq len records[len] sum
+//
+// seq counts frames so lost ones show, sum is the 8-bit sum of seq, len
+// and the records.  Firmware/trace decodes and replays them.
+//
+// Records are written and drained from the loop only, process() and the
+// send functions, so the ring needs no locking.
+//
+// This header has no Arduino dependencies so it builds on Linux too.
+
+#ifndef __FBUSTRACE_H__
+#define __FBUSTRACE_H__
+
+#include "stdint.h"
+
+#define FBUS_TRACE_TX       0x80    // Tag bit, bytes sent to the phone
+#define FBUS_TRACE_COUNT    0x7F    // Tag bits, bytes in the record
+#define FBUS_TRACE_LOST     0x00    // Tag of a record of dropped records
+#define FBUS_TRACE_HDR      5       // Tag and timestamp
+#define FBUS_TRACE_SYNC0    'F'
+#define FBUS_TRACE_SYNC1    'T'
+
+template<uint16_t SIZE>
+class FBusTrace {
+    public:
+        FBusTrace() : m_head(0), m_tail(0), m_lost(0), m_seq(0) {}
+
+        // Record 'n' bytes in records of up to 127
+        void record(uint8_t dir, uint32_t us, const uint8_t * buf, uint16_t n)
+        {
+            uint8_t k;
+            while(n)
+            {
+                k = n > FBUS_TRACE_COUNT ? FBUS_TRACE_COUNT : n;
+                if(m_lost && free() >= 2*FBUS_TRACE_HDR + k)
+                {
+                    put(FBUS_TRACE_LOST,m_lost,0,0);
+                    m_lost = 0;
+                }
+                if(m_lost || free() < FBUS_TRACE_HDR + k) m_lost++;
+                else put(dir | k,us,buf,k);
+                buf += k;
+                n -= k;
+            }
+            return;
+        }
+
+        // Bytes of records waiting
+        uint16_t available()
+        {
+            return (uint16_t)(m_head - m_tail);
+        }
+
+        // Send one frame of whole records, up to 'max' bytes of them but
+        // always at least one, to anything with write(const uint8_t *,
+        // size_t).  Returns the bytes of records sent, 0 when there are none.
+        template<class OUT>
+        uint16_t drain(OUT & out, uint8_t max)
+        {
+            uint16_t n = 0, len;
+            uint16_t at, run;
+            uint8_t head[4];
+            uint8_t sum;
+
+            // Whole records that fit
+            while(n < available())
+            {
+                len = FBUS_TRACE_HDR + (m_buf[(m_tail+n) & (SIZE-1)] & FBUS_TRACE_COUNT);
+                if(n && n + len > max) break;
+                n += len;
+            }
+            if(n == 0) return 0;
+
+            head[0] = FBUS_TRACE_SYNC0;
+            head[1] = FBUS_TRACE_SYNC1;
+            head[2] = m_seq++;
+            head[3] = n;
+            sum = head[2] + head[3];
+            out.write(head,4);
+
+            // The records straight from the ring, in two runs if it wraps
+            for(len=0;len<n;len+=run)
+            {
+                at = (m_tail+len) & (SIZE-1);
+                run = (SIZE - at < n - len) ? SIZE - at : n - len;
+                for(uint16_t x=0;x<run;x++) sum += m_buf[at+x];
+                out.write(&m_buf[at],run);
+            }
+            out.write(&sum,1);
+            m_tail += n;
+            return n;
+        }
+
+        // Forget every record
+        void clear()
+        {
+            m_tail = m_head;
+            m_lost = 0;
+            return;
+        }
+
+    private:
+        static_assert(SIZE >= 256 && SIZE <= 32768 && (SIZE & (SIZE-1)) == 0,
+                      "FBusTrace SIZE must be a power of two from 256 to 32768");
+
+        uint16_t free()
+        {
+            return SIZE - available();
+        }
+
+        void put(uint8_t tag, uint32_t us, const uint8_t * buf, uint8_t n)
+        {
+            m_buf[m_head++ & (SIZE-1)] = tag;
+            for(uint8_t x=0;x<4;x++)
+                m_buf[m_head++ & (SIZE-1)] = us >> (8*x);
+            for(uint8_t x=0;x<n;x++)
+                m_buf[m_head++ & (SIZE-1)] = buf[x];
+            return;
+        }
+
+        uint8_t m_buf[SIZE];
+        uint16_t m_head;            // Free running, masked on access
+        uint16_t m_tail;
+        uint32_t m_lost;            // Records dropped since the last LOST record
+        uint8_t m_seq;              // Next frame number
+};
+
+#endif
+
+//eof
@@ -17,9 +17,61 @@
 // For reference on structs see https://github.com/davidcranor/MCP2035/blob/master/MCP2035.h
 
 #include "FBus.h"
+#include "FBusBridge.h"
 
 FBus myPhone(Serial1);
 
+// Software on the PC sends SMS and sees the phone's messages through the
+// bridge, see Firmware/bridge.  Single characters still reach the terminal.
+FBusBridge bridge(Serial,myPhone);
+
+// Numbers known at build time are packed by the compiler.  Sending to a
+// recipient handle, myPhone.SendSMS(oncallTo,"text"), only copies them.
+static const fbus_number_t smsc = FBUS_NUMBER("8613010888500",NUMTYPE_NATIONAL);
+static const fbus_number_t oncall = FBUS_NUMBER("15622834051",NUMTYPE_UNKNOWN);
+fbus_recipient_t oncallTo;
+
+// Replies from the phone go straight to a handler for their MsgType, the
+// table is built by the compiler and kept in flash
+void onSMS(void * ctx, const fbus_msg_t * msg)
+{
+    Serial.println("SMS reply");
+    return;
+}
+
+void onOther(void * ctx, const fbus_msg_t * msg)
+{
+    Serial.print("Got new packet! Type 0x");
+    Serial.println(msg->MsgType,HEX);
+    return;
+}
+
+FBUS_HANDLERS(phoneHandlers,onOther,
+    FBUS_ON(FBUSTYPE_SMS,onSMS));
+
+// The version request completes here, the reply itself also reaches
+// onOther
+void onVersion(void * ctx, uint8_t state, const fbus_hwsw_t * hwsw)
+{
+    if(hwsw == NULL)
+    {
+        Serial.println("No hardware info");
+        return;
+    }
+    Serial.print("HW: ");
+    Serial.println(hwsw->model);
+    Serial.print("SW: ");
+    Serial.print(hwsw->sw);
+    Serial.print(" ");
+    Serial.println(hwsw->date);
+    return;
+}
+
+// With FBUS_ENABLE_RX_RING the phone UART receive interrupt feeds the
+// parser by calling myPhone.ReceiveByteISR(UDR1).  That interrupt belongs
+// to the core's Serial1 driver, so the UART must be driven by a driver
+// that leaves USART1_RX_vect free.
+
 void setup()
 {
     // Start PC serial link
@@ -32,54 +84,48 @@ void setup()
     // will block until we connect a serial terminal
     //while(!Serial);
 
-    // Setup the phone interface
-    myPhone.initialize();
+    // Setup the phone interface, the bridge takes over its handlers
+    bridge.initialize();
 
     // Set our SMSC and the target phone number
-    myPhone.SetSMSC("8613010888500",NUMTYPE_NATIONAL);
+    myPhone.SetSMSC(smsc);
     myPhone.SetPhoneNumber("15622834051",NUMTYPE_UNKNOWN);
+    oncallTo = myPhone.AddRecipient(oncall);
+
+    // Everything the phone sends is passed on from process()
+    bridge.SetHandlers(&phoneHandlers,NULL);
 
 }
     
 void loop()
 {
     // The phone needs to poll for RX butes from the serial port
-    // in the 'process' routine.
-    myPhone.process();
-
-    // After the process routine we could have a packet marked as
-    // 'READY', if we do then we should process it.
-    if(myPhone.GetPacketState() == PACKET_STATE_READY)
-    {
-        // If we have a packet that's ready, do something
-        Serial.println("Got new packet!");
+    // in the 'process' routine.  The bridge runs it, sends the PC its
+    // messages and job states, and hands them to phoneHandlers.  Bytes
+    // the PC sends outside a frame come back for the terminal.
+    int c = bridge.process();
 
-        packet_t* pkt = myPhone.GetRXPacketPtr();
+    #ifdef FBUS_ENABLE_TRACE
+    // Send the trace to the PC a frame per loop, see Firmware/trace
+    myPhone.TraceDrain(Serial);
+    #endif
 
-        // Example:
-        if(pkt->MsgType == FBUSTYPE_REQ_HWSW)
-        {
-            Serial.println("We got hardware info!");
-            //Serial.print("HW: ");
-            //Serial.print("SW: ");
-        }
-
-        // Clear the packet so we don't process it again
-        myPhone.ClearPacket();
-    }
+    #ifdef FBUS_ENABLE_LOG
+    // Print what happened on the link, never from inside process()
+    myPhone.LogDrain(Serial);
+    #endif
 
     // Simple single character terminal
-    if(Serial.available())
+    if(c >= 0)
     {
-        char c;
-        c = Serial.read();
         switch(c){
         case 'C':
+            // Sync the bus again, process() sends the 0x55 bytes
             myPhone.ResetBus(128);
             break;
         case 'I':
             Serial.println("Req info");
-            myPhone.RequestHWSW();
+            myPhone.RequestHWSW(FBUS_HWSW_TIMEOUT_MS,onVersion,NULL);
             break;
         default:
             #ifdef FBUS_ENABLE_DEBUG
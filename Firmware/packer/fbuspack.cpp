@@ -0,0 +1,693 @@
+// fbuspack.cpp - Encode SMS to SMS-SUBMIT PDUs or F-Bus frames offline, and back.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  Build:
+//    g++ -O2 -pthread -I../host -I../nokia-phone-arduino-shield -o fbuspack fbuspack.cpp ../host/HostSerial.cpp ../nokia-phone-arduino-shield/FBus.cpp ../nokia-phone-arduino-shield/FBusGSM.cpp
+//
+//  Run:
+//    ./fbuspack encode [alerts.txt] [--frames] [--smsc number] [--verify] [--threads n]
+//    ./fbuspack decode [alerts.pdu] [--threads n]
+//    ./fbuspack template [alerts.txt] > alerts.h
+//
+//  encode reads one message a line, the number, a space and the text, as
+//  fbusbridge batch does, and writes one line for each: the SMS-SUBMIT
+//  PDUs of its parts in hex, SMSC first as AT+CMGS takes them, or with
+//  --frames the F-Bus frames the sketch puts on the wire.  A number that
+//  starts with '+' is international.  Every message is sent by a freshly
+//  initialized FBus of the library into a transport that ACKs each frame,
+//  so the bytes are the firmware's own and do not depend on the threads.
+//  Texts over 160 characters are split as SendLongSMS() splits them.
+//
+//  decode takes either kind back to number and text, frames through the
+//  library's parser with their checksums.  --verify decodes every encoded
+//  line again and compares it with the input.
+//
+//  template reads a name and a text a line and writes C for each, the
+//  frame in PROGMEM and its fbus_alert_t for SendAlert().  The first run
+//  of '#' in the text is the numeric slot.  An alert must fit one frame,
+//  about 90 characters.
+//
+//  The input is the file or stdin, read in blocks that are spread over
+//  all cores.  A line that fails gives an empty line out and a message on
+//  stderr, the summary with the throughput goes to stderr as JSON and the
+//  exit code is 2 if any line failed.
+
+#include "Arduino.h"
+#include "FBus.h"
+#include "FBusGSM.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+// Lines read and encoded at once, and taken by a worker at a time
+#define PACK_BLOCK_LINES    16384
+#define PACK_CHUNK_LINES    64
+
+// process() calls a message may take, a long SMS needs a few per part
+#define PACK_SPINS          10000
+
+typedef struct {
+    bool decode;
+    bool frames;                // F-Bus frames out instead of PDUs
+    bool verify;
+    const char * smsc;          // NULL for none
+    unsigned threads;
+}pack_opts_t;
+
+typedef struct {
+    unsigned long messages;     // Lines encoded or decoded
+    unsigned long sms;          // SMS of them, parts counted
+    unsigned long frames;       // F-Bus frames
+    unsigned long errors;       // Lines that failed
+    unsigned long verified;     // Encoded lines decoded again and equal
+}pack_count_t;
+
+// A line and what became of it
+typedef struct {
+    std::string in;
+    std::string out;
+    const char * err;           // NULL if it worked
+}pack_line_t;
+
+// The phone of an offline FBus.  Frames written are kept and ACKed at
+// once, as by a phone on a perfect line.  Sync bytes and our own ACKs are
+// dropped.  Bytes loaded are what the phone sent.
+class FBusPackPort {
+    public:
+        FBusPackPort() : frames(NULL), m_pos(0) {}
+
+        int available() { return m_in.size() - m_pos; }
+
+        int read()
+        {
+            if(m_pos == m_in.size()) return -1;
+            return m_in[m_pos++];
+        }
+
+        size_t write(const uint8_t * buf, size_t len)
+        {
+            uint16_t flen;
+            if(frames == NULL || len < 10 || buf[0] != 0x1E || buf[3] == FBUSTYPE_ACK_MSG) return len;
+            flen = (buf[4] << 8) | buf[5];
+            if(6u + flen > len) return len;
+            frames->push_back(std::vector<uint8_t>(buf,buf+len));
+
+            // 1E 0C 00 7F 00 02 MsgType SeqNo&7, then the checksums
+            uint8_t ack[10] = { 0x1E, 0x0C, 0x00, FBUSTYPE_ACK_MSG, 0x00, 0x02,
+                                buf[3], (uint8_t)(buf[6+flen-1] & 0x07), 0x00, 0x00 };
+            for(uint8_t x=0;x<8;x++) ack[8 + (x & 1)] ^= ack[x];
+            load(ack,sizeof(ack));
+            return len;
+        }
+
+        void flush() {}
+
+        // Queue bytes from the phone
+        void load(const uint8_t * buf, size_t len)
+        {
+            if(m_pos == m_in.size())
+            {
+                m_in.clear();
+                m_pos = 0;
+            }
+            m_in.insert(m_in.end(),buf,buf+len);
+            return;
+        }
+
+        // Frames sent are appended here, NULL to drop them
+        std::vector<std::vector<uint8_t> > * frames;
+
+    private:
+        std::vector<uint8_t> m_in;
+        size_t m_pos;
+};
+
+typedef FBusOn<FBusPackPort> FBusPack;
+
+// Variables
+// ---------------------------------
+
+static const char g_hex[] = "0123456789ABCDEF";
+
+// Functions
+// ---------------------------------
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static void hex_append(std::string & out, const uint8_t * p, size_t len)
+{
+    for(size_t x=0;x<len;x++)
+    {
+        out += g_hex[p[x] >> 4];
+        out += g_hex[p[x] & 0x0F];
+    }
+    return;
+}
+
+static int hex_nibble(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Bytes of one hex token, false if it is not whole bytes of hex
+static bool hex_parse(const char * s, size_t len, std::vector<uint8_t> & out)
+{
+    out.clear();
+    if(len & 1) return false;
+    for(size_t x=0;x<len;x+=2)
+    {
+        int hi = hex_nibble(s[x]), lo = hex_nibble(s[x+1]);
+        if(hi < 0 || lo < 0) return false;
+        out.push_back((hi << 4) | lo);
+    }
+    return true;
+}
+
+// Block of a wire frame, from the 0x00 0x01 of a first frame up to
+// FramesToGo
+static void frame_block(const std::vector<uint8_t> & wire, std::vector<uint8_t> & msg)
+{
+    uint16_t flen = (wire[4] << 8) | wire[5];
+    msg.insert(msg.end(),wire.begin()+6,wire.begin()+6+flen-2);
+    return;
+}
+
+// The SMS-SUBMIT PDU of a submit as the library lays it out, with the
+// SMSC in front and the numbers cut to their digits.  False if it is not
+// a whole submit.
+static bool submit_pdu(const uint8_t * d, uint16_t len, std::vector<uint8_t> & pdu)
+{
+    uint8_t smsc, digits;
+    if(len < FBUS_SUBMIT_UD) return false;
+    smsc = d[FBUS_SUBMIT_SMSC];
+    digits = d[FBUS_SUBMIT_DA];
+    if(smsc > 11 || digits > FBUS_NUMBER_DIGITS || len - FBUS_SUBMIT_UD != (d[FBUS_SUBMIT_UDL]*7 + 7)/8)
+        return false;
+
+    pdu.push_back(smsc);
+    pdu.insert(pdu.end(),d+FBUS_SUBMIT_SMSC+1,d+FBUS_SUBMIT_SMSC+1+smsc);
+    pdu.push_back(d[FBUS_SUBMIT_FIRST]);
+    pdu.push_back(d[FBUS_SUBMIT_MR]);
+    pdu.insert(pdu.end(),d+FBUS_SUBMIT_DA,d+FBUS_SUBMIT_DA+2+(digits+1)/2);
+    pdu.push_back(d[FBUS_SUBMIT_MR+1]);     // PID
+    pdu.push_back(d[FBUS_SUBMIT_MR+2]);     // DCS
+    if((d[FBUS_SUBMIT_FIRST] & 0x18) == 0x10) pdu.push_back(d[FBUS_SUBMIT_VP]);
+    pdu.push_back(d[FBUS_SUBMIT_UDL]);
+    pdu.insert(pdu.end(),d+FBUS_SUBMIT_UD,d+len);
+    return true;
+}
+
+// Number and text of an SMS-SUBMIT PDU, the text is appended.  Returns
+// what is wrong with it or NULL.
+static const char * pdu_decode(const uint8_t * p, size_t len, std::string & number, std::string & text)
+{
+    size_t i = 0, udlen;
+    uint8_t first, digits, type, dcs, udl, skip = 0;
+    std::string num;
+
+    if(len < 1 || (i = 1 + p[0]) + 4 > len) return "PDU too short";
+    first = p[i++];
+    if((first & 0x03) != 0x01) return "not an SMS-SUBMIT";
+    i++;
+    digits = p[i++];
+    type = p[i++];
+    if(digits > FBUS_NUMBER_DIGITS || i + (digits+1)/2 + 3 > len) return "PDU too short";
+    if(type == NUMTYPE_INTERNATIONAL) num += '+';
+    for(uint8_t x=0;x<digits;x++)
+    {
+        uint8_t nib = (x & 1) ? (p[i+x/2] >> 4) : (p[i+x/2] & 0x0F);
+        if(nib > 9) return "number not in digits";
+        num += '0' + nib;
+    }
+    i += (digits+1)/2 + 1;
+    dcs = p[i++];
+    if(dcs != 0x00) return "not the GSM 7-bit alphabet";
+    if((first & 0x18) == 0x10) i += 1;
+    else if(first & 0x18) i += 7;
+    if(i >= len) return "PDU too short";
+    udl = p[i++];
+    udlen = len - i;
+    if(udlen != (udl*7u + 7)/8) return "user data length wrong";
+
+    // Septets taken by a user data header and its fill bits
+    if(first & 0x40)
+    {
+        if(udlen == 0 || p[i] + 1u > udlen) return "user data header too long";
+        skip = ((p[i] + 1)*8 + 6)/7;
+        if(skip > udl) return "user data header too long";
+    }
+
+    uint8_t septets[255];
+    char out[255*GSM7_UTF8_MAX + 1];
+    gsm7Unpack(p+i,udl,septets,0);
+    gsm7Decode(septets+skip,udl-skip,out,sizeof(out));
+
+    // The parts of a long SMS go to one number
+    if(number.empty()) number = num;
+    else if(number != num) return "parts to different numbers";
+    text += out;
+    return NULL;
+}
+
+// Send one message with the library, the wire frames are appended.
+// Returns what went wrong or NULL.
+static const char * encode_frames(const pack_opts_t * opt, const char * number, const char * text,
+                                  std::vector<std::vector<uint8_t> > * frames)
+{
+    FBusPack phone;
+    fbus_recipient_t to;
+    unsigned spins;
+
+    phone.initialize();
+    while(!phone.LinkReady()) phone.process();
+    phone.Port().frames = frames;
+    if(opt->smsc)
+        phone.SetSMSC(opt->smsc,opt->smsc[0] == '+' ? NUMTYPE_INTERNATIONAL : NUMTYPE_UNKNOWN);
+    to = phone.AddRecipient(number,number[0] == '+' ? NUMTYPE_INTERNATIONAL : NUMTYPE_UNKNOWN);
+    if(to == FBUS_RECIPIENT_NONE) return "no digits in the number";
+    if(!phone.SendLongSMS(to,text)) return "text needs more than 255 parts";
+    for(spins=0;spins<PACK_SPINS && (phone.TxPending() || phone.LongSMSPartsLeft());spins++)
+        phone.process();
+    if(phone.GetTXStats()->too_long) return "text too long";
+    if(phone.TxPending() || phone.LongSMSPartsLeft() || phone.GetTXStats()->failed)
+        return "frames not sent";
+    return NULL;
+}
+
+// Decode a line of frames or PDUs, hex separated by spaces
+static const char * decode_line(const std::string & line, std::string & number, std::string & text,
+                                pack_count_t * count)
+{
+    FBusPack phone;
+    fbus_msg_t msg;
+    std::vector<uint8_t> bytes, pdu;
+    const char * err;
+    size_t pos = 0, end;
+    bool started = false;
+    unsigned sms = 0;
+
+    number.clear();
+    text.clear();
+    while(pos < line.size())
+    {
+        if(line[pos] == ' ')
+        {
+            pos++;
+            continue;
+        }
+        end = line.find(' ',pos);
+        if(end == std::string::npos) end = line.size();
+        if(!hex_parse(&line[pos],end-pos,bytes) || bytes.empty()) return "not hex";
+        pos = end;
+
+        // A PDU starts with the SMSC length, 0 to 11
+        if(bytes[0] != 0x1E)
+        {
+            if((err = pdu_decode(bytes.data(),bytes.size(),number,text)) != NULL) return err;
+            sms++;
+            continue;
+        }
+
+        // Frames go through the library's parser one at a time, it takes
+        // every byte at once.  It only takes frames from the phone, so
+        // ours get 1E 0C 00: the 0x0C moves from the odd checksum lane to
+        // the even one.
+        if(bytes.size() >= 10 && bytes[1] == 0x00 && bytes[2] == 0x0C)
+        {
+            bytes[1] = 0x0C;
+            bytes[2] = 0x00;
+            bytes[bytes.size()-2] ^= 0x0C;
+            bytes[bytes.size()-1] ^= 0x0C;
+        }
+        if(!started)
+        {
+            phone.initialize();
+            started = true;
+        }
+        phone.Port().load(bytes.data(),bytes.size());
+        phone.process();
+        count->frames++;
+        if(phone.GetRXStats()->checksum_fail || phone.GetRXStats()->oversize)
+            return "bad frame";
+        while(phone.PopMessage(&msg))
+        {
+            pdu.clear();
+            if(msg.MsgType != FBUSTYPE_SMS || !submit_pdu(msg.data,msg.length,pdu))
+                return "frame is not an SMS submit";
+            if((err = pdu_decode(pdu.data(),pdu.size(),number,text)) != NULL) return err;
+            sms++;
+        }
+    }
+    if(sms == 0) return "no SMS in the line";
+    if(started && phone.GetRXStats()->reasm_fail) return "frames missing";
+    count->sms += sms;
+    return NULL;
+}
+
+// What decoding an encoded line must give back: the number's digits and
+// the text through the alphabet
+static void expected(const char * number, const char * text, std::string & enumber, std::string & etext)
+{
+    uint16_t len = strlen(text), septets;
+    unsigned digits = 0;
+
+    enumber.clear();
+    if(number[0] == '+') enumber += '+';
+    for(;*number && digits < FBUS_NUMBER_DIGITS;number++)
+    {
+        if(*number < '0' || *number > '9') continue;
+        enumber += *number;
+        digits++;
+    }
+    std::vector<uint8_t> sep(gsm7Length(text,len) + 1);
+    gsm7Encode(text,len,sep.data(),sep.size(),&septets);
+    std::vector<char> out(septets*GSM7_UTF8_MAX + 1);
+    gsm7Decode(sep.data(),septets,out.data(),out.size());
+    etext = out.data();
+    return;
+}
+
+// Encode one line, "number text"
+static const char * encode_line(const pack_opts_t * opt, pack_line_t * line, pack_count_t * count)
+{
+    std::vector<std::vector<uint8_t> > frames;
+    std::vector<uint8_t> msg, pdu;
+    std::string number;
+    const char * text;
+    const char * err;
+    size_t sp = line->in.find(' ');
+
+    if(sp == 0 || sp == std::string::npos) return "no number and text";
+    if(line->in.size() > 0xFFFF) return "text too long";
+    number.assign(line->in,0,sp);
+    text = line->in.c_str() + sp + 1;
+    if((err = encode_frames(opt,number.c_str(),text,&frames)) != NULL) return err;
+
+    // The last frame of each SMS has FramesToGo 1
+    for(size_t x=0;x<frames.size();x++)
+    {
+        uint8_t togo = frames[x][6 + ((frames[x][4] << 8) | frames[x][5]) - 2];
+        if(togo == 1) count->sms++;
+        if(opt->frames)
+        {
+            if(x) line->out += ' ';
+            hex_append(line->out,frames[x].data(),frames[x].size());
+            continue;
+        }
+        frame_block(frames[x],msg);
+        if(togo > 1) continue;
+        pdu.clear();
+        if(!submit_pdu(msg.data(),msg.size(),pdu)) return "submit not understood";
+        if(!line->out.empty()) line->out += ' ';
+        hex_append(line->out,pdu.data(),pdu.size());
+        msg.clear();
+    }
+    count->frames += frames.size();
+
+    if(opt->verify)
+    {
+        std::string dnum, dtext, enumber, etext;
+        pack_count_t scratch = { 0, 0, 0, 0, 0 };
+        if((err = decode_line(line->out,dnum,dtext,&scratch)) != NULL) return err;
+        expected(number.c_str(),text,enumber,etext);
+        if(dnum != enumber || dtext != etext) return "decoded differently";
+        count->verified++;
+    }
+    return NULL;
+}
+
+// A worker's share of a block
+typedef struct {
+    const pack_opts_t * opt;
+    std::vector<pack_line_t> * lines;
+    size_t * next;
+    pthread_mutex_t * lock;
+    pack_count_t count;
+}pack_worker_t;
+
+static void * pack_worker(void * arg)
+{
+    pack_worker_t * w = (pack_worker_t*)arg;
+    std::vector<pack_line_t> & lines = *w->lines;
+    std::string number, text;
+    size_t x, end;
+
+    for(;;)
+    {
+        pthread_mutex_lock(w->lock);
+        x = *w->next;
+        *w->next += PACK_CHUNK_LINES;
+        pthread_mutex_unlock(w->lock);
+        if(x >= lines.size()) break;
+        end = x + PACK_CHUNK_LINES < lines.size() ? x + PACK_CHUNK_LINES : lines.size();
+        for(;x<end;x++)
+        {
+            pack_line_t & line = lines[x];
+            line.out.clear();
+            line.err = NULL;
+            if(line.in.empty()) continue;
+            if(w->opt->decode)
+            {
+                line.err = decode_line(line.in,number,text,&w->count);
+                if(line.err == NULL)
+                {
+                    line.out = number;
+                    line.out += ' ';
+                    line.out += text;
+                }
+            }else
+            {
+                line.err = encode_line(w->opt,&line,&w->count);
+            }
+            if(line.err)
+            {
+                line.out.clear();
+                w->count.errors++;
+            }else
+            {
+                w->count.messages++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Run a block of lines on every thread, the counts are added up
+static void pack_block(const pack_opts_t * opt, std::vector<pack_line_t> * lines, pack_count_t * count)
+{
+    std::vector<pthread_t> tid(opt->threads);
+    std::vector<pack_worker_t> work(opt->threads);
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    size_t next = 0;
+
+    for(unsigned x=0;x<opt->threads;x++)
+    {
+        work[x].opt = opt;
+        work[x].lines = lines;
+        work[x].next = &next;
+        work[x].lock = &lock;
+        memset(&work[x].count,0,sizeof(work[x].count));
+        pthread_create(&tid[x],NULL,pack_worker,&work[x]);
+    }
+    for(unsigned x=0;x<opt->threads;x++)
+    {
+        pthread_join(tid[x],NULL);
+        count->messages += work[x].count.messages;
+        count->sms += work[x].count.sms;
+        count->frames += work[x].count.frames;
+        count->errors += work[x].count.errors;
+        count->verified += work[x].count.verified;
+    }
+    return;
+}
+
+// The frame of one alert, sent to no number by a fresh FBus.  Returns
+// what went wrong or NULL.
+static const char * template_frame(const char * text, std::vector<uint8_t> & wire)
+{
+    FBusPack phone;
+    std::vector<std::vector<uint8_t> > frames;
+    std::vector<char> copy(text,text+strlen(text)+1);
+    unsigned spins;
+
+    phone.initialize();
+    while(!phone.LinkReady()) phone.process();
+    phone.Port().frames = &frames;
+    if(gsm7Length(text,strlen(text)) > FBUS_SMS_SEPTETS) return "text too long";
+    if(!phone.SendSMS(copy.data())) return "text too long for the frames";
+    for(spins=0;spins<PACK_SPINS && phone.TxPending();spins++)
+        phone.process();
+    if(frames.size() != 1) return "more than one frame";
+    wire = frames[0];
+    return NULL;
+}
+
+// Write the alerts of "name text" lines as C
+static int cmd_template(FILE * in, const char * path)
+{
+    std::vector<uint8_t> wire;
+    unsigned long lineno = 0, alerts = 0, errors = 0;
+    char * buf = NULL;
+    size_t size = 0, hash, run;
+    ssize_t n;
+
+    printf("// Alerts for FBusCore::SendAlert(), made by fbuspack template from %s\n",
+           path ? path : "stdin");
+    while((n = getline(&buf,&size,in)) >= 0)
+    {
+        lineno++;
+        while(n && (buf[n-1] == '\n' || buf[n-1] == '\r')) buf[--n] = 0;
+        if(n == 0) continue;
+
+        char * text = strchr(buf,' ');
+        const char * err = NULL;
+        if(text == NULL || text == buf) err = "no name and text";
+        else
+        {
+            *text++ = 0;
+            for(char * c = buf;*c && err == NULL;c++)
+                if(!isalnum((unsigned char)*c) && *c != '_') err = "name is not an identifier";
+        }
+        hash = text ? strcspn(text,"#") : 0;
+        run = text ? strspn(text+hash,"#") : 0;
+        if(err == NULL && run > FBUS_ALERT_DIGITS) err = "numeric slot too long";
+        if(err == NULL) err = template_frame(text,wire);
+        if(err)
+        {
+            fprintf(stderr,"fbuspack: line %lu: %s\n",lineno,err);
+            errors++;
+            continue;
+        }
+
+        printf("\n// %s\nstatic const uint8_t %s_wire[] PROGMEM = {",text,buf);
+        for(size_t x=0;x<wire.size();x++)
+            printf("%s0x%02X",x == 0 ? "\n    " : (x % 12 == 0 ? ",\n    " : ","),wire[x]);
+        printf("\n};\nstatic const fbus_alert_t %s PROGMEM = { %s_wire, %zu, %u, %zu };\n",
+               buf,buf,wire.size(),run ? gsm7Length(text,hash) : 0,run);
+        alerts++;
+    }
+    free(buf);
+    fprintf(stderr,"{\"pack\":\"template\",\"lines\":%lu,\"alerts\":%lu,\"errors\":%lu}\n",
+            lineno,alerts,errors);
+    return errors ? 2 : 0;
+}
+
+int main(int argc, char ** argv)
+{
+    pack_opts_t opt = { false, false, false, NULL, 0 };
+    pack_count_t count = { 0, 0, 0, 0, 0 };
+    const char * path = NULL;
+    std::vector<pack_line_t> lines;
+    unsigned long lineno = 0, bytes_in = 0, bytes_out = 0;
+    char * buf = NULL;
+    size_t size = 0;
+    ssize_t n;
+    FILE * in = stdin;
+
+    if(argc < 2 || (strcmp(argv[1],"encode") && strcmp(argv[1],"decode") && strcmp(argv[1],"template")))
+    {
+        fprintf(stderr,"usage: %s encode [file] [--frames] [--smsc number] [--verify] [--threads n]\n"
+                       "       %s decode [file] [--threads n]\n"
+                       "       %s template [file]\n",argv[0],argv[0],argv[0]);
+        return 1;
+    }
+    if(!strcmp(argv[1],"template"))
+    {
+        if(argc > 3 || (argc == 3 && argv[2][0] == '-'))
+        {
+            fprintf(stderr,"usage: %s template [file]\n",argv[0]);
+            return 1;
+        }
+        if(argc == 3 && (in = fopen(argv[2],"r")) == NULL)
+        {
+            perror(argv[2]);
+            return 1;
+        }
+        int rc = cmd_template(in,argc == 3 ? argv[2] : NULL);
+        if(in != stdin) fclose(in);
+        return rc;
+    }
+    opt.decode = !strcmp(argv[1],"decode");
+    for(int x=2;x<argc;x++)
+    {
+        if(!strcmp(argv[x],"--frames") && !opt.decode) opt.frames = true;
+        else if(!strcmp(argv[x],"--verify") && !opt.decode) opt.verify = true;
+        else if(!strcmp(argv[x],"--smsc") && !opt.decode && x+1 < argc) opt.smsc = argv[++x];
+        else if(!strcmp(argv[x],"--threads") && x+1 < argc) opt.threads = strtoul(argv[++x],NULL,0);
+        else if(argv[x][0] != '-' && path == NULL) path = argv[x];
+        else
+        {
+            fprintf(stderr,"%s: unknown option %s\n",argv[0],argv[x]);
+            return 1;
+        }
+    }
+    if(opt.threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opt.threads = cpus > 0 ? cpus : 1;
+    }
+    if(path && (in = fopen(path,"r")) == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    // The host clock starts on its first call, before the threads
+    uint64_t start = now_ms();
+    millis();
+
+    lines.reserve(PACK_BLOCK_LINES);
+    for(;;)
+    {
+        lines.clear();
+        while(lines.size() < PACK_BLOCK_LINES && (n = getline(&buf,&size,in)) >= 0)
+        {
+            bytes_in += n;
+            while(n && (buf[n-1] == '\n' || buf[n-1] == '\r')) n--;
+            lines.push_back(pack_line_t());
+            lines.back().in.assign(buf,n);
+        }
+        if(lines.empty()) break;
+        pack_block(&opt,&lines,&count);
+        for(size_t x=0;x<lines.size();x++)
+        {
+            lineno++;
+            if(lines[x].err)
+                fprintf(stderr,"fbuspack: line %lu: %s\n",lineno,lines[x].err);
+            fwrite(lines[x].out.data(),1,lines[x].out.size(),stdout);
+            fputc('\n',stdout);
+            bytes_out += lines[x].out.size() + 1;
+        }
+    }
+    fflush(stdout);
+    free(buf);
+    if(in != stdin) fclose(in);
+
+    uint64_t took = now_ms() - start;
+    fprintf(stderr,"{\"pack\":\"%s\",\"format\":\"%s\",\"threads\":%u,\"lines\":%lu,\"messages\":%lu,"
+                   "\"sms\":%lu,\"frames\":%lu,\"errors\":%lu,\"verified\":%lu,\"bytes_in\":%lu,"
+                   "\"bytes_out\":%lu,\"ms\":%llu,\"msgs_per_s\":%.0f,\"mb_per_s\":%.2f}\n",
+            argv[1],opt.decode ? "text" : (opt.frames ? "frames" : "pdu"),opt.threads,lineno,
+            count.messages,count.sms,count.frames,count.errors,count.verified,bytes_in,bytes_out,
+            (unsigned long long)took,took ? count.messages*1000.0/took : 0.0,
+            took ? (bytes_in + bytes_out)/1000.0/took : 0.0);
+    return count.errors ? 2 : 0;
+}
+
+//eof
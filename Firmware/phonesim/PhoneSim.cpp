@@ -0,0 +1,548 @@
+// PhoneSim.cpp - Virtual Nokia phone speaking F-Bus on a Linux pty.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  The phone side of the protocol as seen on a Nokia 3310:
+//  - every good host frame is ACKed with { MsgType, SeqNo & 0x07 }
+//  - FBUSTYPE_REQ_HWSW (0xD1) is answered with a 0xD2 version frame
+//  - FBUSTYPE_SMS (0x02) submits are decoded and answered with a
+//    "message sent" frame
+//  - phone frames are resent until the host ACKs them
+//
+//  Delays, dropped host frames, corrupted checksums and a flood of
+//  unsolicited frames can be switched on in phonesim_config_t.
+
+#define _GNU_SOURCE 1
+#include "PhoneSim.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// FrameID and device values
+#define SIM_VIA_CABLE       0x1E
+#define SIM_DEV_PHONE       0x00
+#define SIM_DEV_HOST        0x0C
+
+// Version reply from a 3310, after the 0x00 0x01 block header
+static const char sim_hwsw[] = "V 05.27\n12-05-03\nNHM-5\n(c) NMP.";
+
+// GSM 03.38 default alphabet as UTF-8, for printing decoded messages
+static const char * const sim_gsm[128] = {
+    "@","\xC2\xA3","$","\xC2\xA5","\xC3\xA8","\xC3\xA9","\xC3\xB9","\xC3\xAC",
+    "\xC3\xB2","\xC3\x87","\n","\xC3\x98","\xC3\xB8","\r","\xC3\x85","\xC3\xA5",
+    "\xCE\x94","_","\xCE\xA6","\xCE\x93","\xCE\x9B","\xCE\xA9","\xCE\xA0","\xCE\xA8",
+    "\xCE\xA3","\xCE\x98","\xCE\x9E","","\xC3\x86","\xC3\xA6","\xC3\x9F","\xC3\x89",
+    " ","!","\"","#","\xC2\xA4","%","&","'","(",")","*","+",",","-",".","/",
+    "0","1","2","3","4","5","6","7","8","9",":",";","<","=",">","?",
+    "\xC2\xA1","A","B","C","D","E","F","G","H","I","J","K","L","M","N","O",
+    "P","Q","R","S","T","U","V","W","X","Y","Z","\xC3\x84","\xC3\x96","\xC3\x91","\xC3\x9C","\xC2\xA7",
+    "\xC2\xBF","a","b","c","d","e","f","g","h","i","j","k","l","m","n","o",
+    "p","q","r","s","t","u","v","w","x","y","z","\xC3\xA4","\xC3\xB6","\xC3\xB1","\xC3\xBC","\xC3\xA0",
+};
+
+// Milliseconds on the monotonic clock
+static unsigned long sim_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (unsigned long)ts.tv_sec*1000UL + ts.tv_nsec/1000000UL;
+}
+
+// Fill in the odd/even checksums of a wire frame of len bytes, the last
+// two of which are the checksums
+static void sim_checksum(uint8_t * wire, size_t len)
+{
+    uint8_t even = 0, odd = 0;
+    for(size_t x=0;x<len-2;x++)
+    {
+        if(x&1) odd ^= wire[x];
+        else even ^= wire[x];
+    }
+    wire[len-2] = even;
+    wire[len-1] = odd;
+    return;
+}
+
+// Build a frame from the phone, returns the wire length
+size_t phonesim_build(uint8_t * wire, uint8_t type, const uint8_t * data,
+                      size_t len, uint8_t framestogo, uint8_t seq)
+{
+    size_t n = 0;
+    size_t flen = len + 2;
+    wire[n++] = SIM_VIA_CABLE;
+    wire[n++] = SIM_DEV_HOST;
+    wire[n++] = SIM_DEV_PHONE;
+    wire[n++] = type;
+    wire[n++] = flen >> 8;
+    wire[n++] = flen & 0xFF;
+    memcpy(&wire[n],data,len);
+    n += len;
+    wire[n++] = framestogo;
+    wire[n++] = seq;
+    if(flen&1) wire[n++] = 0x00;
+    n += 2;
+    sim_checksum(wire,n);
+    return n;
+}
+
+PhoneSim::PhoneSim()
+: onSMS(NULL), onSMSctx(NULL), m_master(-1), m_slave(-1)
+{
+    defaults(&m_cfg);
+    memset(&m_stats,0,sizeof(m_stats));
+    memset(m_out,0,sizeof(m_out));
+    m_slave_path[0] = 0;
+    m_rx_len = 0;
+    m_msg_len = 0;
+    m_last_type = -1;
+    m_last_seq = -1;
+    m_seq = 0;
+    m_order = 0;
+    m_next_flood_ms = 0;
+    m_rand = 1;
+}
+
+PhoneSim::~PhoneSim()
+{
+    if(m_slave >= 0) close(m_slave);
+    if(m_master >= 0) close(m_master);
+}
+
+// Fill in the defaults: no faults, no delay, no flood
+void PhoneSim::defaults(phonesim_config_t * cfg)
+{
+    memset(cfg,0,sizeof(*cfg));
+    cfg->ack_timeout_ms = 250;
+    cfg->retries = 3;
+    cfg->frame_max = 120;
+    cfg->seed = 1;
+    return;
+}
+
+// Create the pty, false on failure
+bool PhoneSim::open(const phonesim_config_t * cfg)
+{
+    struct termios tio;
+    m_cfg = *cfg;
+    if(m_cfg.frame_max == 0 || m_cfg.frame_max > SIM_MSG_MAX) m_cfg.frame_max = SIM_MSG_MAX;
+    m_rand = m_cfg.seed ? m_cfg.seed : 1;
+
+    m_master = posix_openpt(O_RDWR|O_NOCTTY);
+    if(m_master < 0) return false;
+    if(grantpt(m_master) || unlockpt(m_master)) return false;
+    if(ptsname_r(m_master,m_slave_path,sizeof(m_slave_path))) return false;
+
+    m_slave = ::open(m_slave_path,O_RDWR|O_NOCTTY);
+    if(m_slave < 0) return false;
+    if(tcgetattr(m_slave,&tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(m_slave,TCSANOW,&tio);
+    }
+    fcntl(m_master,F_SETFL,fcntl(m_master,F_GETFL)|O_NONBLOCK);
+    m_next_flood_ms = sim_ms();
+    return true;
+}
+
+// Serve the host until *stop becomes true
+void PhoneSim::run(volatile bool * stop)
+{
+    while(!*stop) step(5);
+    return;
+}
+
+// Wait up to timeout_ms for traffic and handle it
+void PhoneSim::step(int timeout_ms)
+{
+    uint8_t buf[512];
+    struct pollfd p = { m_master, POLLIN, 0 };
+    ssize_t n;
+
+    if(poll(&p,1,timeout_ms) > 0 && (p.revents & POLLIN))
+    {
+        while((n = read(m_master,buf,sizeof(buf))) > 0)
+        {
+            for(ssize_t x=0;x<n;x++) feed(buf[x]);
+        }
+    }
+    service();
+
+    if(m_cfg.flood_hz)
+    {
+        static const uint8_t netstat[] = { 0x00, 0x01, 0x00, 0x71, 0x01, 0x00,
+                                           0x01, 0x0B, 0x00, 0x02, 0x04, 0x60 };
+        unsigned long now = sim_ms();
+        while((long)(now - m_next_flood_ms) >= 0)
+        {
+            queueFrame(SIM_TYPE_NETSTAT,netstat,sizeof(netstat),true);
+            m_next_flood_ms += 1000/m_cfg.flood_hz ? 1000/m_cfg.flood_hz : 1;
+        }
+    }
+    return;
+}
+
+// Print the counters on one line
+void PhoneSim::printStats(FILE * out)
+{
+    fprintf(out,"phone rx_frames=%lu rx_acks=%lu rx_bad=%lu rx_dropped=%lu rx_dups=%lu "
+                "tx_frames=%lu tx_resends=%lu tx_corrupt=%lu sms=%lu sms_parts=%lu hwsw=%lu\n",
+            m_stats.rx_frames,m_stats.rx_acks,m_stats.rx_bad,m_stats.rx_dropped,
+            m_stats.rx_dups,m_stats.tx_frames,m_stats.tx_resends,m_stats.tx_corrupt,
+            m_stats.sms,m_stats.sms_parts,m_stats.hwsw);
+    return;
+}
+
+// Private functions
+// ------------------------------------------------------
+
+// Percent chance helper, a small LCG so runs repeat with the same seed
+unsigned PhoneSim::rnd(unsigned mod)
+{
+    m_rand = m_rand*1103515245u + 12345u;
+    return ((m_rand >> 16) & 0x7FFF) % mod;
+}
+
+// Collect host bytes into frames.  Anything before a FrameID, including
+// the 0x55 sync bytes, is skipped.
+void PhoneSim::feed(uint8_t b)
+{
+    size_t flen, total;
+
+    if(m_rx_len == 0 && b != SIM_VIA_CABLE) return;
+    m_rx[m_rx_len++] = b;
+
+    if((m_rx_len == 2 && b != SIM_DEV_PHONE) || (m_rx_len == 3 && b != SIM_DEV_HOST))
+    {
+        m_rx_len = 0;
+        if(b == SIM_VIA_CABLE) m_rx[m_rx_len++] = b;
+        return;
+    }
+    if(m_rx_len < 6) return;
+
+    flen = ((size_t)m_rx[4] << 8) | m_rx[5];
+    if(flen < 2 || flen > SIM_MSG_MAX)
+    {
+        m_rx_len = 0;
+        return;
+    }
+    total = 6 + flen + (flen&1) + 2;
+    if(m_rx_len < total) return;
+
+    frameIn(m_rx,total);
+    m_rx_len = 0;
+    return;
+}
+
+// A complete frame from the host
+void PhoneSim::frameIn(const uint8_t * f, size_t len)
+{
+    uint8_t even = 0, odd = 0;
+    uint8_t type = f[3];
+    size_t flen = ((size_t)f[4] << 8) | f[5];
+
+    for(size_t x=0;x<len-2;x++)
+    {
+        if(x&1) odd ^= f[x];
+        else even ^= f[x];
+    }
+    if(even != f[len-2] || odd != f[len-1])
+    {
+        m_stats.rx_bad++;
+        if(m_cfg.verbose) fprintf(stderr,"phone: bad checksum type 0x%02X\n",type);
+        return;
+    }
+    if(m_cfg.drop_pct && rnd(100) < m_cfg.drop_pct)
+    {
+        m_stats.rx_dropped++;
+        return;
+    }
+
+    if(type == SIM_TYPE_ACK)
+    {
+        for(int x=0;x<OUT_SLOTS;x++)
+        {
+            if(m_out[x].used && m_out[x].MsgType == f[6] && (m_out[x].SeqNo & 0x07) == (f[7] & 0x07))
+            {
+                m_out[x].used = false;
+                m_stats.rx_acks++;
+                break;
+            }
+        }
+        return;
+    }
+
+    uint8_t framestogo = f[6+flen-2];
+    uint8_t seq = f[6+flen-1];
+    m_stats.rx_frames++;
+    if(m_cfg.verbose) fprintf(stderr,"phone: rx type 0x%02X len %u ftg %u seq 0x%02X\n",
+                              type,(unsigned)flen,framestogo,seq);
+
+    sendAck(type,seq);
+
+    // A resend of the frame we just took, the ACK went missing
+    if(type == m_last_type && seq == m_last_seq)
+    {
+        m_stats.rx_dups++;
+        return;
+    }
+    m_last_type = type;
+    m_last_seq = seq;
+
+    if(m_msg_len + flen - 2 > sizeof(m_msg))
+    {
+        m_msg_len = 0;
+        return;
+    }
+    memcpy(&m_msg[m_msg_len],&f[6],flen-2);
+    m_msg_len += flen-2;
+    if(framestogo <= 1)
+    {
+        message(type,m_msg,m_msg_len);
+        m_msg_len = 0;
+    }
+    return;
+}
+
+// A complete, reassembled message from the host
+void PhoneSim::message(uint8_t type, const uint8_t * data, size_t len)
+{
+    uint8_t reply[64];
+    size_t n;
+
+    if(type == SIM_TYPE_REQ_HWSW)
+    {
+        m_stats.hwsw++;
+        // 0x00 0x01 header, 0x00 0x03 0x00, then the version text
+        n = 0;
+        reply[n++] = 0x00;
+        reply[n++] = 0x01;
+        reply[n++] = 0x00;
+        reply[n++] = 0x03;
+        reply[n++] = 0x00;
+        memcpy(&reply[n],sim_hwsw,sizeof(sim_hwsw)-1);
+        n += sizeof(sim_hwsw)-1;
+        queueFrame(SIM_TYPE_HWSW,reply,n,true);
+    }else if(type == SIM_TYPE_SMS && len > 6 && data[2] == 0x00 && data[3] == 0x01 && data[4] == 0x02)
+    {
+        decodeSMS(data,len);
+        // 0x00 0x01 header, 0x00 0x02 message sent, message reference
+        const uint8_t sent[] = { 0x00, 0x01, 0x00, 0x02, (uint8_t)m_stats.sms, 0x00 };
+        queueFrame(SIM_TYPE_SMS,sent,sizeof(sent),true);
+    }
+    return;
+}
+
+// Decode an SMS submit laid out as FBus::SendSMS builds it:
+//  [0]  0x00 0x01 0x00 0x01 0x02 0x00 header
+//  [6]  SMSC length, [7] SMSC type, [8..17] SMSC
+//  [18] first octet, [19..21] reference, PID, DCS
+//  [22] user data length in septets
+//  [23] destination digits, [24] type, [25..34] destination
+//  [35] validity, [36..41] zero
+//  [42] packed user data
+void PhoneSim::decodeSMS(const uint8_t * data, size_t len)
+{
+    char number[24];
+    char text[1024];
+    size_t n = 0, t = 0;
+    uint8_t ref = 0, part = 1, parts = 1;
+    unsigned udl, digits, start = 0;
+    const uint8_t * ud;
+    size_t udlen;
+    bool esc = false;
+
+    if(len < 42) return;
+    m_stats.sms++;
+
+    digits = data[23];
+    if(digits > 20) digits = 20;
+    for(unsigned x=0;x<digits;x++)
+    {
+        uint8_t nib = (x&1) ? (data[25+x/2] >> 4) : (data[25+x/2] & 0x0F);
+        if(nib > 9) break;
+        number[n++] = '0' + nib;
+    }
+    number[n] = 0;
+
+    udl = data[22];
+    ud = &data[42];
+    udlen = len - 42;
+
+    // User data header, only the concatenation elements are understood
+    if((data[18] & 0x40) && udlen)
+    {
+        unsigned udhl = ud[0];
+        for(unsigned x=1;x+1<=udhl && x+1<udlen;)
+        {
+            uint8_t iei = ud[x], iel = ud[x+1];
+            if(iei == 0x00 && iel == 3 && x+4 < udlen)
+            {
+                ref = ud[x+2]; parts = ud[x+3]; part = ud[x+4];
+            }else if(iei == 0x08 && iel == 4 && x+5 < udlen)
+            {
+                ref = ud[x+3]; parts = ud[x+4]; part = ud[x+5];
+            }
+            x += 2 + iel;
+        }
+        start = ((udhl+1)*8 + 6)/7;
+        m_stats.sms_parts++;
+    }
+
+    for(unsigned s=start;s<udl && t+4<sizeof(text);s++)
+    {
+        unsigned bit = s*7;
+        unsigned byte = bit/8;
+        unsigned shift = bit%8;
+        if(byte >= udlen) break;
+        unsigned v = ud[byte] >> shift;
+        if(shift > 1 && byte+1 < udlen) v |= ud[byte+1] << (8-shift);
+        v &= 0x7F;
+
+        const char * out;
+        if(esc)
+        {
+            esc = false;
+            switch(v){
+            case 0x0A: out = "\f"; break;
+            case 0x14: out = "^"; break;
+            case 0x28: out = "{"; break;
+            case 0x29: out = "}"; break;
+            case 0x2F: out = "\\"; break;
+            case 0x3C: out = "["; break;
+            case 0x3D: out = "~"; break;
+            case 0x3E: out = "]"; break;
+            case 0x40: out = "|"; break;
+            case 0x65: out = "\xE2\x82\xAC"; break;
+            default: out = " "; break;
+            }
+        }else if(v == 0x1B)
+        {
+            esc = true;
+            continue;
+        }else
+        {
+            out = sim_gsm[v];
+        }
+        while(*out && t+1<sizeof(text)) text[t++] = *out++;
+    }
+    text[t] = 0;
+
+    if(m_cfg.verbose)
+        fprintf(stderr,"phone: SMS to %s part %u/%u ref %u: %s\n",number,part,parts,ref,text);
+    if(onSMS) onSMS(onSMSctx,number,text,ref,part,parts);
+    return;
+}
+
+// Queue a message from the phone, split into frames of at most frame_max
+// block bytes.  Reliable frames are resent until ACKed.
+void PhoneSim::queueFrame(uint8_t type, const uint8_t * data, size_t len, bool reliable)
+{
+    size_t frames = (len + m_cfg.frame_max - 1)/m_cfg.frame_max;
+    unsigned long now = sim_ms();
+    if(frames == 0) frames = 1;
+
+    for(size_t f=0;f<frames;f++)
+    {
+        size_t off = f*m_cfg.frame_max;
+        size_t chunk = len - off < m_cfg.frame_max ? len - off : m_cfg.frame_max;
+        uint8_t seq = (f == 0 ? 0x40 : 0x00) | (m_seq++ & 0x07);
+        int slot = -1;
+
+        for(int x=0;x<OUT_SLOTS;x++)
+        {
+            if(!m_out[x].used) { slot = x; break; }
+        }
+        if(slot < 0) return;    // Phone is saturated, drop like a real one would
+
+        outframe_t * o = &m_out[slot];
+        o->len = phonesim_build(o->wire,type,data+off,chunk,frames-f,seq);
+        o->MsgType = type;
+        o->SeqNo = seq;
+        o->tries = 0;
+        o->order = m_order++;
+        o->due_ms = now + m_cfg.delay_ms;
+        o->used = reliable;
+        if(!reliable) writeWire(o->wire,o->len);
+    }
+    return;
+}
+
+// ACK a host frame
+void PhoneSim::sendAck(uint8_t type, uint8_t seq)
+{
+    uint8_t wire[10] = { SIM_VIA_CABLE, SIM_DEV_HOST, SIM_DEV_PHONE, SIM_TYPE_ACK,
+                         0x00, 0x02, type, (uint8_t)(seq & 0x07), 0, 0 };
+    sim_checksum(wire,sizeof(wire));
+    writeWire(wire,sizeof(wire));
+    return;
+}
+
+// Put bytes on the line, with checksum faults and UART pacing
+void PhoneSim::writeWire(const uint8_t * buf, size_t len)
+{
+    uint8_t tmp[SIM_MSG_MAX+16];
+    size_t done = 0;
+
+    if(m_cfg.corrupt_pct && rnd(100) < m_cfg.corrupt_pct)
+    {
+        memcpy(tmp,buf,len);
+        tmp[len-1] ^= 0x5A;
+        buf = tmp;
+        m_stats.tx_corrupt++;
+    }
+    while(done < len)
+    {
+        ssize_t n = write(m_master,buf+done,len-done);
+        if(n > 0)
+        {
+            done += n;
+        }else if(n < 0 && errno == EAGAIN)
+        {
+            struct pollfd p = { m_master, POLLOUT, 0 };
+            poll(&p,1,10);
+        }else
+        {
+            break;
+        }
+    }
+    m_stats.tx_frames++;
+    if(m_cfg.baud) usleep((useconds_t)(len*10ULL*1000000ULL/m_cfg.baud));
+    return;
+}
+
+// Send due frames oldest first and resend unACKed ones
+void PhoneSim::service()
+{
+    unsigned long now = sim_ms();
+    for(;;)
+    {
+        outframe_t * next = NULL;
+        for(int x=0;x<OUT_SLOTS;x++)
+        {
+            outframe_t * o = &m_out[x];
+            if(!o->used || (long)(now - o->due_ms) < 0) continue;
+            if(next == NULL || o->order < next->order) next = o;
+        }
+        if(next == NULL) break;
+
+        if(next->tries > m_cfg.retries)
+        {
+            next->used = false;
+            continue;
+        }
+        if(next->tries) m_stats.tx_resends++;
+        next->tries++;
+        next->due_ms = now + m_cfg.ack_timeout_ms;
+        writeWire(next->wire,next->len);
+    }
+    return;
+}
+
+//eof
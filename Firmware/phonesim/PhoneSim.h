@@ -0,0 +1,134 @@
+/*
+  PhoneSim.h - Virtual Nokia phone speaking F-Bus on a Linux pty.
+  Created by Charles Pax for Pax Instruments, 2015-05-23
+  Please visit http://paxinstruments.com/products/
+  Released into the Public Domain
+*/
+
+#ifndef __PHONESIM_H__
+#define __PHONESIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// MsgTypes the phone answers
+#define SIM_TYPE_SMS        0x02    // SMS submit in, SMS sent report out
+#define SIM_TYPE_NETSTAT    0x0A    // Network status, used for flood frames
+#define SIM_TYPE_ACK        0x7F    // ACK type
+#define SIM_TYPE_REQ_HWSW   0xD1    // Request hardware and software information
+#define SIM_TYPE_HWSW       0xD2    // Hardware and software information reply
+
+// Largest message the phone reassembles from several frames
+#define SIM_MSG_MAX         1024
+
+typedef struct {
+    unsigned delay_ms;          // Time from request to reply
+    unsigned ack_timeout_ms;    // Resend a phone frame that was not ACKed
+    unsigned retries;           // Resends before the phone gives up
+    unsigned drop_pct;          // Chance of ignoring a received frame
+    unsigned corrupt_pct;       // Chance of a bad checksum on a sent frame
+    unsigned flood_hz;          // Unsolicited frames sent per second
+    unsigned baud;              // Pace output like a UART, 0 for no limit
+    unsigned frame_max;         // Largest block per phone frame, longer replies are split
+    unsigned seed;              // Random seed for the faults
+    bool verbose;               // Print every frame on stderr
+}phonesim_config_t;
+
+typedef struct {
+    unsigned long rx_frames;    // Good frames from the host
+    unsigned long rx_acks;      // Host ACKs that matched a phone frame
+    unsigned long rx_bad;       // Host frames with a bad checksum
+    unsigned long rx_dropped;   // Host frames ignored on purpose
+    unsigned long rx_dups;      // Host frames seen twice
+    unsigned long tx_frames;    // Phone frames sent, ACKs included
+    unsigned long tx_resends;   // Phone frames sent again
+    unsigned long tx_corrupt;   // Phone frames sent with a bad checksum
+    unsigned long sms;          // SMS submits decoded
+    unsigned long sms_parts;    // Of which were parts of a concatenated SMS
+    unsigned long hwsw;         // HWSW requests answered
+}phonesim_stats_t;
+
+class PhoneSim {
+    public:
+        PhoneSim();
+        ~PhoneSim();
+
+        // Fill in the defaults: no faults, no delay, no flood
+        static void defaults(phonesim_config_t * cfg);
+
+        // Create the pty, false on failure
+        bool open(const phonesim_config_t * cfg);
+
+        // The path the host side opens
+        const char * slavePath() { return m_slave_path; }
+
+        // Serve the host until *stop becomes true
+        void run(volatile bool * stop);
+
+        // Wait up to timeout_ms for traffic and handle it
+        void step(int timeout_ms);
+
+        const phonesim_stats_t * stats() { return &m_stats; }
+
+        // Print the counters on one line
+        void printStats(FILE * out);
+
+        // Callback for every decoded SMS, text is NUL terminated
+        void (*onSMS)(void * ctx, const char * number, const char * text,
+                      uint8_t ref, uint8_t part, uint8_t parts);
+        void * onSMSctx;
+
+    private:
+        typedef struct {
+            bool used;
+            uint8_t MsgType;
+            uint8_t SeqNo;
+            uint8_t tries;
+            unsigned long order;    // Frames go out in the order they were queued
+            unsigned long due_ms;   // Send, or resend, at this time
+            size_t len;
+            uint8_t wire[SIM_MSG_MAX+16];
+        }outframe_t;
+
+        enum { OUT_SLOTS = 16 };
+
+        phonesim_config_t m_cfg;
+        phonesim_stats_t m_stats;
+        int m_master;
+        int m_slave;                // Held open so the master never sees EOF
+        char m_slave_path[64];
+        unsigned m_rand;
+
+        // Receive side
+        uint8_t m_rx[SIM_MSG_MAX+16];
+        size_t m_rx_len;
+        uint8_t m_msg[SIM_MSG_MAX];     // Reassembled message
+        size_t m_msg_len;
+        int m_last_type;                // Last delivered MsgType/SeqNo, for dups
+        int m_last_seq;
+
+        // Send side
+        outframe_t m_out[OUT_SLOTS];
+        uint8_t m_seq;
+        unsigned long m_order;
+        unsigned long m_next_flood_ms;
+
+        unsigned rnd(unsigned mod);
+        void feed(uint8_t b);
+        void frameIn(const uint8_t * f, size_t len);
+        void message(uint8_t type, const uint8_t * data, size_t len);
+        void decodeSMS(const uint8_t * data, size_t len);
+        void queueFrame(uint8_t type, const uint8_t * data, size_t len, bool reliable);
+        void sendAck(uint8_t type, uint8_t seq);
+        void writeWire(const uint8_t * buf, size_t len);
+        void service();
+};
+
+// Build a frame from the phone, returns the wire length
+size_t phonesim_build(uint8_t * wire, uint8_t type, const uint8_t * data,
+                      size_t len, uint8_t framestogo, uint8_t seq);
+
+#endif
+
+//eof
@@ -0,0 +1,674 @@
+// loadtest.cpp - Drive the unmodified FBus library against the phone simulator.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  Build:
+//    g++ -O2 -pthread -DPHONESIM_NO_MAIN -I../host -I../nokia-phone-arduino-shield -I../bridge -o loadtest loadtest.cpp PhoneSim.cpp phonesim.cpp ../host/HostSerial.cpp ../nokia-phone-arduino-shield/FBus.cpp ../nokia-phone-arduino-shield/FBusGSM.cpp ../nokia-phone-arduino-shield/FBusGateway.cpp ../nokia-phone-arduino-shield/FBusBridge.cpp ../bridge/FBusBridgeClient.cpp
+//
+//  The phone runs in a thread on its own pty, FBus talks to it through
+//  HostSerial exactly as it would through Serial1.  Any phonesim option
+//  is accepted, for example line rate with faults:
+//    ./loadtest --sms 200 --baud 115200 --drop 2 --corrupt 2 --flood 50
+//
+//  --text n sets the SMS length, over about 80 characters an SMS takes two
+//  frames.  --frame-max makes the phone split its replies so multi-frame
+//  reassembly is exercised too.
+//
+//  --long n sends every SMS as an n character text through SendLongSMS,
+//  split into concatenated parts.  phonesim decodes each part and it is
+//  checked against the text, throughput is reported in parts per minute.
+//
+//  --recipients n adds n numbers to the FBus recipient directory and sends
+//  the SMS to them in turn.  The number and text of every SMS phonesim
+//  decodes are checked.
+//
+//  Built with -DFBUS_ENABLE_STATS it also prints the FBus link statistics,
+//  byte counts and the ACK latency histograms.  Built with
+//  -DFBUS_ENABLE_TRACE, --trace file saves the FBus binary trace the way
+//  a sketch sends it to the PC, for Firmware/trace.  The host sends faster
+//  than the drain keeps up with, -DFBUS_TRACE_SIZE=4096 loses fewer records.
+//
+//  SMS are pipelined through the FBus transmit queue with up to --window
+//  frames waiting for an ACK and up to --outstanding SMS waiting for their
+//  sent report.  "--window 1 --outstanding 1" is stop-and-wait.
+//
+//  --phones n runs n simulated phones, each in its own thread on its own
+//  pty, behind an FBusGateway.  The SMS go into its shared pool and it
+//  hands them to the phones with --policy rr or least, --outstanding
+//  submits per phone.  A real phone takes seconds to send an SMS, --delay
+//  ms makes the simulated ones slow too, and sms_per_s then grows with the
+//  number of phones:
+//    ./loadtest --phones 4 --sms 400 --delay 50 --baud 115200
+//  The gateway's phones read their ptys through FBusFdPort, not HostSerial.
+//
+//  --bridge sends every SMS as a job from FBusBridgeClient through an
+//  FBusBridge, the sketch's PC link being a socketpair, and checks each
+//  job's final state as well as the texts.
+
+#include "Arduino.h"
+#include "FBus.h"
+#include "FBusGateway.h"
+#include "FBusBridge.h"
+#include "FBusBridgeClient.h"
+#include "PhoneSim.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+int phonesim_option(phonesim_config_t * cfg, int argc, char ** argv);
+
+static volatile bool g_stop = false;
+
+// Longest --long text
+#define LONG_MAX_TEXT   2000
+
+static void * phone_thread(void * arg)
+{
+    ((PhoneSim*)arg)->run(&g_stop);
+    return NULL;
+}
+
+typedef struct {
+    unsigned long frames;       // Messages popped from FBus
+    unsigned long multi;        // Of which arrived in several frames
+    unsigned long bad;          // Replies that did not decode
+    unsigned long hwsw;         // Version replies
+    unsigned long hwsw_done;    // RequestHWSW() completions, timeouts included
+    unsigned long hwsw_late;    // Of which timed out or failed
+    unsigned long hwsw_bad;     // Of which parsed wrong
+    unsigned long sent;         // SMS sent reports
+    unsigned long flood;        // Unsolicited frames
+}host_count_t;
+
+// RequestHWSW() completion, the parsed version must be the simulator's
+static void hwsw_done(void * ctx, uint8_t state, const fbus_hwsw_t * hwsw)
+{
+    host_count_t * count = (host_count_t*)ctx;
+    count->hwsw_done++;
+    if(state != FBUS_HWSW_DONE) count->hwsw_late++;
+    else if(strcmp(hwsw->sw,"05.27") || strcmp(hwsw->date,"12-05-03") ||
+            strcmp(hwsw->model,"NHM-5")) count->hwsw_bad++;
+    return;
+}
+
+#ifdef FBUS_ENABLE_TRACE
+// --trace file, as the PC serial port would capture it
+static HostSerial g_trace;
+#endif
+
+// Run process() once and count what comes out
+static void poll(FBus & phone, host_count_t * count)
+{
+    fbus_msg_t msg;
+    phone.process();
+    #ifdef FBUS_ENABLE_TRACE
+    while(phone.TraceDrain(g_trace)) {}
+    #endif
+    while(phone.PopMessage(&msg))
+    {
+        count->frames++;
+        if(msg.frames > 1) count->multi++;
+        if(msg.MsgType == SIM_TYPE_HWSW)
+        {
+            count->hwsw++;
+            if(msg.length < 5+5 || memcmp(&msg.data[5],"V 05.",5) ||
+               memmem(msg.data,msg.length,"NHM-5",5) == NULL) count->bad++;
+        }
+        else if(msg.MsgType == SIM_TYPE_SMS) count->sent++;
+        else if(msg.MsgType == SIM_TYPE_NETSTAT) count->flood++;
+    }
+    return;
+}
+
+// Poll until *watch reaches target, and with 'drain' until every queued
+// frame is ACKed or given up on, or the timeout passes.  Returns false on
+// timeout.
+static bool pump(FBus & phone, host_count_t * count, unsigned long * watch,
+                 unsigned long target, unsigned long timeout_ms, bool drain)
+{
+    unsigned long start = millis();
+    while(*watch < target || (drain && phone.TxPending()))
+    {
+        poll(phone,count);
+        if(millis() - start > timeout_ms) return false;
+    }
+    return true;
+}
+
+// Alert text for SMS x, padded out to len characters, text must hold
+// len+1
+static void alert_text(char * text, unsigned len, unsigned x)
+{
+    unsigned n;
+    n = snprintf(text,len+1,"Alert %u: pump station 4 pressure low",x);
+    if(n > len) n = len;
+    for(;n<len;n++) text[n] = "0123456789 "[n%11];
+    text[len] = 0;
+    return;
+}
+
+// Number of recipient x
+static void recipient_number(char * number, size_t size, unsigned x)
+{
+    snprintf(number,size,"156228340%02u",51+x);
+    return;
+}
+
+// Check each SMS or concatenated part phonesim decodes against the text it
+// was cut from.  Runs in the phone thread, main only reads it after the join.
+typedef struct {
+    unsigned len;               // Length of every text
+    unsigned recipients;        // Texts go to the recipients in turn
+    unsigned texts;             // Texts that may be sent
+    unsigned spread;            // Texts that may be in flight at once
+    unsigned next;              // Text expected next
+    uint8_t (*seen)[32];        // Parts decoded of each text, a bit per part
+    unsigned long parts;        // Parts decoded
+    unsigned long dups;         // Parts decoded again
+    unsigned long bad;          // Parts that matched no text
+}sms_check_t;
+
+// Whether a part is part 'part' of text 'msg'
+static bool part_matches(sms_check_t * c, unsigned msg, const char * number,
+                         const char * text, uint8_t part, uint8_t parts)
+{
+    char full[LONG_MAX_TEXT+1];
+    char to[24];
+    unsigned off, n;
+
+    alert_text(full,c->len,msg);
+    recipient_number(to,sizeof(to),msg % c->recipients);
+    off = (part-1)*FBUS_SMS_PART_SEPTETS;
+    n = (parts == 1) ? c->len : c->len - off;
+    if(n > FBUS_SMS_PART_SEPTETS && parts > 1) n = FBUS_SMS_PART_SEPTETS;
+    return off <= c->len && strlen(text) == n && !memcmp(text,full+off,n) && !strcmp(number,to);
+}
+
+// With a window over one frame a resent submit can reach the phone after
+// the next one, and phonesim decodes a submit again when the host resends
+// it after a lost ACK.  So parts are matched against the texts around the
+// one expected, concatenated parts by their reference too, and repeats
+// are counted apart.
+static void on_sms(void * ctx, const char * number, const char * text,
+                   uint8_t ref, uint8_t part, uint8_t parts)
+{
+    sms_check_t * c = (sms_check_t*)ctx;
+    unsigned msg, near = c->next;
+    int dup = -1;
+
+    // A text that still starts with its number is looked for there first
+    if(parts == 1 && sscanf(text,"Alert %u:",&msg) == 1 && msg < c->texts) near = msg;
+
+    // Nearest first, 0 +1 -1 +2 -2 ..
+    for(int k=0;k<=2*(int)c->spread;k++)
+    {
+        int d = (k&1) ? (k+1)/2 : -(k/2);
+        if((int)near + d < 0 || near + d >= c->texts) continue;
+        msg = near + d;
+        if(parts > 1 && (uint8_t)(msg+1) != ref) continue;
+        if(!part_matches(c,msg,number,text,part,parts)) continue;
+        if(c->seen[msg][part/8] & (1 << (part&7)))
+        {
+            if(dup < 0) dup = msg;
+            continue;
+        }
+        c->seen[msg][part/8] |= 1 << (part&7);
+        c->parts++;
+        if(part >= parts && msg >= c->next) c->next = msg + 1;
+        return;
+    }
+    if(dup >= 0) c->dups++;
+    else c->bad++;
+    return;
+}
+
+// Texts with every part decoded
+static unsigned long sms_complete(sms_check_t * c, unsigned parts)
+{
+    unsigned long n = 0;
+    for(unsigned x=0;x<c->texts;x++)
+    {
+        unsigned p = 0;
+        for(unsigned k=1;k<=parts;k++) p += (c->seen[x][k/8] >> (k&7)) & 1;
+        if(p == parts) n++;
+    }
+    return n;
+}
+
+// Several phones decode SMS at once
+static pthread_mutex_t g_check_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void on_sms_locked(void * ctx, const char * number, const char * text,
+                          uint8_t ref, uint8_t part, uint8_t parts)
+{
+    pthread_mutex_lock(&g_check_lock);
+    on_sms(ctx,number,text,ref,part,parts);
+    pthread_mutex_unlock(&g_check_lock);
+    return;
+}
+
+// Messages the gateway passes on from its phones
+static void gw_sms(void * ctx, const fbus_msg_t * msg)
+{
+    host_count_t * count = (host_count_t*)ctx;
+    count->frames++;
+    if(msg->frames > 1) count->multi++;
+    if(msg->length >= 4 && msg->data[3] == 0x02) count->sent++;
+    else count->bad++;
+    return;
+}
+
+static void gw_other(void * ctx, const fbus_msg_t * msg)
+{
+    host_count_t * count = (host_count_t*)ctx;
+    count->frames++;
+    if(msg->frames > 1) count->multi++;
+    if(msg->MsgType == SIM_TYPE_NETSTAT) count->flood++;
+    return;
+}
+
+FBUS_HANDLERS(gw_handlers,gw_other,
+    FBUS_ON(SIM_TYPE_SMS,gw_sms));
+
+// Every job handed out, reported and its frames ACKed
+static bool gateway_idle(FBusGateway & gateway)
+{
+    if(gateway.JobsWaiting()) return false;
+    for(uint8_t x=0;x<gateway.Phones();x++)
+        if(gateway.Outstanding(x) || gateway.Phone(x).TxPending()) return false;
+    return true;
+}
+
+// --phones n, every SMS through an FBusGateway over n simulated phones
+static int gateway_main(phonesim_config_t * cfg, unsigned phones, uint8_t policy, unsigned sms,
+                        unsigned textlen, unsigned recipients, unsigned window,
+                        unsigned outstanding, unsigned timeout_ms, sms_check_t * check)
+{
+    PhoneSim * sim[FBUS_GW_PHONES];
+    HostSerial * port[FBUS_GW_PHONES];
+    FBusOn<FBusFdPort> * phone[FBUS_GW_PHONES];
+    pthread_t thread[FBUS_GW_PHONES];
+    FBusGateway gateway(policy);
+    host_count_t count = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    fbus_recipient_t to[FBUS_DIR_SIZE];
+    char number[24];
+    unsigned long timeouts = 0;
+
+    // Every text stays put until the gateway hands it out
+    char (*text)[161] = (char(*)[161])calloc(sms ? sms : 1,161);
+    for(unsigned x=0;x<sms;x++) alert_text(text[x],textlen,x);
+
+    for(unsigned x=0;x<phones;x++)
+    {
+        phonesim_config_t c = *cfg;
+        c.seed = cfg->seed + x;
+        sim[x] = new PhoneSim();
+        sim[x]->onSMS = on_sms_locked;
+        sim[x]->onSMSctx = check;
+        port[x] = new HostSerial();
+        if(!sim[x]->open(&c) || !port[x]->open(sim[x]->slavePath()))
+        {
+            perror("loadtest: pty");
+            return 1;
+        }
+        pthread_create(&thread[x],NULL,phone_thread,sim[x]);
+        phone[x] = new FBusOn<FBusFdPort>();
+        phone[x]->Port().attach(port[x]->fd());
+        gateway.AddPhone(*phone[x]);
+    }
+    gateway.initialize();
+    gateway.SetOutstanding(outstanding);
+    gateway.SetHandlers(&gw_handlers,&count);
+    gateway.SetSMSC(FBUS_NUMBER("8613010888500",NUMTYPE_NATIONAL));
+    for(unsigned x=0;x<phones;x++) phone[x]->SetTxWindow(window);
+    for(unsigned x=0;x<recipients;x++)
+    {
+        recipient_number(number,sizeof(number),x);
+        to[x] = gateway.AddRecipient(number,NUMTYPE_UNKNOWN);
+    }
+
+    // Keep the pool full until every submit is reported and ACKed, give
+    // up once nothing is reported for a timeout.  A resent submit can be
+    // reported twice, so the reports are not simply counted up to 'sms'.
+    unsigned long start = micros();
+    unsigned long last = millis(), seen = 0;
+    unsigned next = 0;
+    while(!gateway_idle(gateway) || next < sms)
+    {
+        while(next < sms && gateway.SendSMS(to[next%recipients],text[next])) next++;
+        gateway.process();
+        if(count.sent != seen)
+        {
+            seen = count.sent;
+            last = millis();
+        }else if(millis() - last > timeout_ms)
+        {
+            timeouts++;
+            break;
+        }
+    }
+    unsigned long sms_us = micros() - start;
+
+    g_stop = true;
+    for(unsigned x=0;x<phones;x++) pthread_join(thread[x],NULL);
+
+    unsigned long complete = sms_complete(check,1);
+    printf("host phones=%u policy=%s sms=%u sms_sent=%lu sms_us=%lu sms_per_s=%.1f timeouts=%lu\n",
+           phones,policy == FBUS_GW_ROUND_ROBIN ? "rr" : "least",sms,count.sent,sms_us,
+           sms_us ? count.sent*1e6/sms_us : 0.0,timeouts);
+    printf("host texts=%lu parts=%lu parts_dup=%lu parts_bad=%lu msgs=%lu bad=%lu flood=%lu recipients=%u\n",
+           complete,check->parts,check->dups,check->bad,count.frames,count.bad,count.flood,recipients);
+    for(unsigned x=0;x<phones;x++)
+    {
+        const fbus_gw_stats_t * gs = gateway.GetStats(x);
+        const fbus_rx_stats_t * rx = phone[x]->GetRXStats();
+        const fbus_tx_stats_t * tx = phone[x]->GetTXStats();
+        printf("gw%u jobs=%u reports=%u failed=%u outstanding_max=%u tx_frames=%u resends=%u "
+               "rx_frames=%u checksum_fail=%u resyncs=%u line_tx=%lu\n",
+               x,gs->jobs,gs->reports,gs->failed,gs->outstanding_max,tx->frames,tx->resends,
+               rx->frames,rx->checksum_fail,rx->resyncs,phone[x]->Port().tx_bytes);
+        sim[x]->printStats(stdout);
+    }
+    return (timeouts || count.bad || check->bad || complete != check->texts) ? 2 : 0;
+}
+
+// Job states as FBusBridgeClient reports them
+typedef struct {
+    unsigned long queued;
+    unsigned long sent;
+    unsigned long failed;       // Every other final state
+}bridge_count_t;
+
+static void bridge_status(void * ctx, uint16_t /*id*/, uint8_t state)
+{
+    bridge_count_t * count = (bridge_count_t*)ctx;
+    if(state == FBUS_BRIDGE_QUEUED) count->queued++;
+    else if(state == FBUS_BRIDGE_SENT) count->sent++;
+    else count->failed++;
+    return;
+}
+
+static void bridge_rx(void * ctx, uint8_t MsgType, const uint8_t * /*data*/, uint16_t /*len*/)
+{
+    host_count_t * count = (host_count_t*)ctx;
+    count->frames++;
+    if(MsgType == SIM_TYPE_NETSTAT) count->flood++;
+    return;
+}
+
+// --bridge, every SMS a job from the client through the sketch's bridge
+static int bridge_main(phonesim_config_t * cfg, unsigned sms, unsigned textlen, unsigned recipients,
+                       unsigned window, unsigned timeout_ms, sms_check_t * check)
+{
+    PhoneSim sim;
+    pthread_t thread;
+    HostSerial pc;
+    FBus phone(Serial1);
+    FBusBridge bridge(pc,phone);
+    FBusBridgeClient client;
+    host_count_t count = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    bridge_count_t jobs = { 0, 0, 0 };
+    unsigned long timeouts = 0;
+    char number[24], text[161];
+    int sv[2];
+
+    sim.onSMS = on_sms;
+    sim.onSMSctx = check;
+    if(!sim.open(cfg) || !Serial1.open(sim.slavePath()) || socketpair(AF_UNIX,SOCK_STREAM,0,sv) < 0)
+    {
+        perror("loadtest: pty");
+        return 1;
+    }
+    pthread_create(&thread,NULL,phone_thread,&sim);
+    fcntl(sv[0],F_SETFL,fcntl(sv[0],F_GETFL) | O_NONBLOCK);
+    pc.attach(sv[0]);
+    client.attach(sv[1]);
+    client.onStatus(bridge_status,&jobs);
+    client.onRx(bridge_rx,&count);
+
+    bridge.initialize();
+    phone.SetTxWindow(window);
+    phone.SetSMSC(FBUS_NUMBER("8613010888500",NUMTYPE_NATIONAL));
+    for(unsigned x=0;x<sms;x++)
+    {
+        alert_text(text,textlen,x);
+        recipient_number(number,sizeof(number),x % recipients);
+        client.submit(x,number,text);
+    }
+
+    // The sketch's loop and the PC's in turns, the client keeps the
+    // bridge's window of jobs unfinished
+    unsigned long start = micros();
+    unsigned long last = millis(), seen = 0;
+    client.hello();
+    while(client.unfinished())
+    {
+        bridge.process();
+        if(client.poll(0) < 0) break;
+        if(jobs.sent + jobs.failed != seen)
+        {
+            seen = jobs.sent + jobs.failed;
+            last = millis();
+        }else if(millis() - last > timeout_ms + FBUS_TX_TIMEOUT_MAX)
+        {
+            timeouts++;
+            break;
+        }
+    }
+    unsigned long sms_us = micros() - start;
+
+    g_stop = true;
+    pthread_join(thread,NULL);
+
+    const fbus_bridge_stats_t * bs = bridge.GetStats();
+    const fbus_client_stats_t * cs = client.stats();
+    unsigned long complete = sms_complete(check,1);
+    printf("host bridge sms=%u queued=%lu sent=%lu failed=%lu sms_us=%lu sms_per_s=%.1f timeouts=%lu\n",
+           sms,jobs.queued,jobs.sent,jobs.failed,sms_us,sms_us ? jobs.sent*1e6/sms_us : 0.0,timeouts);
+    printf("host texts=%lu parts=%lu parts_dup=%lu parts_bad=%lu msgs=%lu flood=%lu\n",
+           complete,check->parts,check->dups,check->bad,count.frames,count.flood);
+    printf("bridge frames_in=%u bad_frames=%u jobs=%u rejected=%u sent=%u failed=%u stray_reports=%u "
+           "rx_frames=%u client_frames_out=%lu client_jobs_out=%lu client_window=%u client_bad=%lu\n",
+           bs->frames_in,bs->bad_frames,bs->jobs,bs->rejected,bs->sent,bs->failed,bs->stray_reports,
+           bs->rx_frames,cs->frames_out,cs->jobs_out,client.window(),cs->bad);
+    sim.printStats(stdout);
+    return (timeouts || jobs.failed || jobs.sent != sms || check->bad || complete != check->texts) ? 2 : 0;
+}
+
+int main(int argc, char ** argv)
+{
+    phonesim_config_t cfg;
+    PhoneSim sim;
+    pthread_t thread;
+    host_count_t count = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    unsigned sms = 100, hwsw = 1, timeout_ms = 1000, window = FBUS_TX_SLOTS, outstanding = 4;
+    unsigned textlen = 37, longlen = 0, recipients = 1, phones = 0;
+    bool use_bridge = false;
+    uint8_t policy = FBUS_GW_LEAST_LOADED;
+    sms_check_t check;
+    fbus_recipient_t to[FBUS_DIR_SIZE];
+    char number[24];
+    static char ltext[2][LONG_MAX_TEXT+1];
+    unsigned long timeouts = 0;
+    char text[161];
+
+    PhoneSim::defaults(&cfg);
+    for(int x=1;x<argc;)
+    {
+        int used = phonesim_option(&cfg,argc-x,&argv[x]);
+        if(used == 0 && !strcmp(argv[x],"--bridge")) use_bridge = true, used = 1;
+        if(used == 0 && x+1 < argc)
+        {
+            if(!strcmp(argv[x],"--sms")) sms = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--hwsw")) hwsw = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--timeout")) timeout_ms = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--window")) window = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--outstanding")) outstanding = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--text")) textlen = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--long")) longlen = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--recipients")) recipients = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--phones")) phones = strtoul(argv[x+1],NULL,0), used = 2;
+            else if(!strcmp(argv[x],"--policy") && (!strcmp(argv[x+1],"rr") || !strcmp(argv[x+1],"least")))
+                policy = strcmp(argv[x+1],"rr") ? FBUS_GW_LEAST_LOADED : FBUS_GW_ROUND_ROBIN, used = 2;
+            #ifdef FBUS_ENABLE_TRACE
+            else if(!strcmp(argv[x],"--trace"))
+            {
+                int fd = ::open(argv[x+1],O_WRONLY|O_CREAT|O_TRUNC,0644);
+                if(fd < 0)
+                {
+                    perror(argv[x+1]);
+                    return 1;
+                }
+                g_trace.attach(fd);
+                used = 2;
+            }
+            #endif
+        }
+        if(used == 0)
+        {
+            fprintf(stderr,"usage: %s [--sms n] [--hwsw n] [--timeout ms] [--window n]\n"
+                           "       [--outstanding n] [--text n] [--long n] [--recipients n]\n"
+                           "       [--phones n] [--policy rr|least] [--bridge]\n"
+                           "       [phonesim options]\n",argv[0]);
+            return 1;
+        }
+        x += used;
+    }
+    if(textlen > 160) textlen = 160;
+    if(longlen > LONG_MAX_TEXT) longlen = LONG_MAX_TEXT;
+    if(recipients < 1) recipients = 1;
+    if(recipients > FBUS_DIR_SIZE) recipients = FBUS_DIR_SIZE;
+    memset(&check,0,sizeof(check));
+    check.len = longlen ? longlen : textlen;
+    check.recipients = recipients;
+    check.texts = sms;
+    check.spread = 8;
+    check.seen = (uint8_t(*)[32])calloc(sms ? sms : 1,32);
+    if(phones)
+    {
+        if(phones > FBUS_GW_PHONES) phones = FBUS_GW_PHONES;
+        check.len = textlen;        // The gateway sends single SMS, --long is ignored
+        check.spread = phones*outstanding + 8;
+        return gateway_main(&cfg,phones,policy,sms,textlen,recipients,window,outstanding,
+                            timeout_ms,&check);
+    }
+    if(use_bridge)
+    {
+        check.len = textlen;
+        check.spread = FBUS_BRIDGE_JOBS + 8;
+        return bridge_main(&cfg,sms,textlen,recipients,window,timeout_ms,&check);
+    }
+    sim.onSMS = on_sms;
+    sim.onSMSctx = &check;
+
+    if(!sim.open(&cfg) || !Serial1.open(sim.slavePath()))
+    {
+        perror("loadtest: pty");
+        return 1;
+    }
+    pthread_create(&thread,NULL,phone_thread,&sim);
+
+    FBus phone(Serial1);
+    phone.initialize();
+    phone.SetTxWindow(window);
+
+    // The bus sync runs from process(), the loop must not stall on it
+    unsigned long sync_us = micros(), call_us_max = 0;
+    while(!phone.LinkReady())
+    {
+        unsigned long t = micros();
+        phone.process();
+        if(micros() - t > call_us_max) call_us_max = micros() - t;
+    }
+    sync_us = micros() - sync_us;
+    phone.SetSMSC((char*)"8613010888500",NUMTYPE_NATIONAL);
+    for(unsigned x=0;x<recipients;x++)
+    {
+        recipient_number(number,sizeof(number),x);
+        to[x] = phone.AddRecipient(number,NUMTYPE_UNKNOWN);
+    }
+
+    unsigned long start = micros();
+    for(unsigned x=0;x<hwsw;x++)
+    {
+        unsigned long want = count.hwsw_done+1;
+        while(!phone.RequestHWSW(FBUS_HWSW_TIMEOUT_MS,hwsw_done,&count)) poll(phone,&count);
+        if(!pump(phone,&count,&count.hwsw_done,want,FBUS_HWSW_TIMEOUT_MS+timeout_ms,true)) timeouts++;
+    }
+    unsigned long hwsw_us = micros() - start;
+
+    // Keep the transmit queue full, the phone's sent reports trail behind
+    start = micros();
+    unsigned long base = count.sent;
+    for(unsigned x=0;x<sms && longlen;x++)
+    {
+        // SendLongSMS reads the text until its last part is queued and
+        // refuses the next text until then, so two buffers are enough
+        unsigned long queued = phone.GetTXStats()->sms_parts;
+        if(queued > outstanding &&
+           !pump(phone,&count,&count.sent,base+queued-outstanding,timeout_ms,false)) timeouts++;
+        alert_text(ltext[x&1],longlen,x);
+        while(!phone.SendLongSMS(to[x%recipients],ltext[x&1])) poll(phone,&count);
+    }
+    while(longlen && phone.LongSMSPartsLeft()) poll(phone,&count);
+    if(longlen) sms = phone.GetTXStats()->sms_parts;
+    for(unsigned x=0;x<sms && !longlen;x++)
+    {
+        // The phone only holds a few submits at once, like a real one
+        if(x >= outstanding &&
+           !pump(phone,&count,&count.sent,base+x+1-outstanding,timeout_ms,false)) timeouts++;
+        alert_text(text,textlen,x);
+        while(!phone.SendSMS(to[x%recipients],text)) poll(phone,&count);
+    }
+    if(!pump(phone,&count,&count.sent,base+sms,timeout_ms,true)) timeouts++;
+    unsigned long sms_us = micros() - start;
+
+    g_stop = true;
+    pthread_join(thread,NULL);
+
+    const fbus_rx_stats_t * rx = phone.GetRXStats();
+    const fbus_tx_stats_t * tx = phone.GetTXStats();
+    printf("host hwsw=%lu hwsw_done=%lu hwsw_late=%lu hwsw_bad=%lu hwsw_us=%lu "
+           "sms=%u sms_sent=%lu sms_us=%lu sms_per_s=%.1f timeouts=%lu\n",
+           count.hwsw,count.hwsw_done,count.hwsw_late,count.hwsw_bad,hwsw_us,sms,count.sent,sms_us,
+           sms_us ? count.sent*1e6/sms_us : 0.0,timeouts);
+    unsigned text_parts = 1;
+    if(longlen > FBUS_SMS_SEPTETS)
+        text_parts = (longlen + FBUS_SMS_PART_SEPTETS - 1)/FBUS_SMS_PART_SEPTETS;
+    unsigned long complete = sms_complete(&check,text_parts);
+    printf("host texts=%lu parts=%lu parts_dup=%lu parts_bad=%lu parts_per_min=%.0f recipients=%u\n",
+           complete,check.parts,check.dups,check.bad,
+           sms_us ? check.parts*60e6/sms_us : 0.0,recipients);
+    printf("host msgs=%lu multi=%lu bad=%lu flood=%lu rx_frames=%u checksum_fail=%u stalls=%u "
+           "queued_max=%u reassembled=%u reasm_fail=%u oversize=%u rx_timeouts=%u resyncs=%u dups=%u "
+           "line_rx=%lu line_tx=%lu tx_calls=%lu\n",
+           count.frames,count.multi,count.bad,count.flood,rx->frames,rx->checksum_fail,rx->stalls,
+           rx->queued_max,rx->messages,rx->reasm_fail,rx->oversize,rx->timeouts,rx->resyncs,rx->dups,
+           Serial1.rx_bytes,Serial1.tx_bytes,Serial1.tx_calls);
+    printf("host tx_frames=%u acked=%u resends=%u failed=%u stray_acks=%u inflight_max=%u "
+           "tries_max=%u latency_avg_ms=%.1f latency_max_ms=%u\n",
+           tx->frames,tx->acked,tx->resends,tx->failed,tx->stray_acks,tx->inflight_max,
+           tx->tries_max,tx->acked ? (double)tx->latency_sum_ms/tx->acked : 0.0,
+           tx->latency_max_ms);
+    printf("host syncs=%u auto_syncs=%u sync_us=%lu sync_call_us_max=%lu\n",
+           tx->syncs,tx->auto_syncs,sync_us,call_us_max);
+    #ifdef FBUS_ENABLE_STATS
+    fbus_link_stats_t link;
+    phone.GetLinkStats(&link);
+    printf("host rx_bytes=%lu tx_bytes=%lu rx_skipped=%lu acks_sent=%u ack_us=",
+           (unsigned long)link.rx_bytes,(unsigned long)link.tx_bytes,
+           (unsigned long)link.rx_skipped,link.acks_sent);
+    for(unsigned x=0;x<FBUS_HIST_BUCKETS;x++) printf("%s%u",x ? "/" : "",link.ack_us.bucket[x]);
+    printf(" tx_ms=");
+    for(unsigned x=0;x<FBUS_HIST_BUCKETS;x++) printf("%s%u",x ? "/" : "",link.tx_ms.bucket[x]);
+    printf("\n");
+    #endif
+    sim.printStats(stdout);
+    return (timeouts || count.bad || count.hwsw_late || count.hwsw_bad || check.bad ||
+            complete != check.texts) ? 2 : 0;
+}
+
+//eof
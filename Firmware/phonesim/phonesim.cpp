@@ -0,0 +1,83 @@
+// phonesim.cpp - Run a virtual Nokia phone on a pty.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  Build:
+//    g++ -O2 -o phonesim phonesim.cpp PhoneSim.cpp
+//
+//  Run it and point anything that talks F-Bus at the printed pty, for
+//  example gnokii or the loadtest tool in this directory:
+//    ./phonesim -v --delay 20 --drop 5 --corrupt 5
+
+#include "PhoneSim.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parse the fault and timing options shared with loadtest, returns the
+// number of arguments used or 0 if argv[0] is not one of them
+int phonesim_option(phonesim_config_t * cfg, int argc, char ** argv)
+{
+    if(!strcmp(argv[0],"-v")) { cfg->verbose = true; return 1; }
+    if(argc < 2) return 0;
+    unsigned v = strtoul(argv[1],NULL,0);
+    if(!strcmp(argv[0],"--delay")) cfg->delay_ms = v;
+    else if(!strcmp(argv[0],"--ack-timeout")) cfg->ack_timeout_ms = v;
+    else if(!strcmp(argv[0],"--retries")) cfg->retries = v;
+    else if(!strcmp(argv[0],"--drop")) cfg->drop_pct = v;
+    else if(!strcmp(argv[0],"--corrupt")) cfg->corrupt_pct = v;
+    else if(!strcmp(argv[0],"--flood")) cfg->flood_hz = v;
+    else if(!strcmp(argv[0],"--baud")) cfg->baud = v;
+    else if(!strcmp(argv[0],"--frame-max")) cfg->frame_max = v;
+    else if(!strcmp(argv[0],"--seed")) cfg->seed = v;
+    else return 0;
+    return 2;
+}
+
+#ifndef PHONESIM_NO_MAIN
+static volatile bool g_stop = false;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    g_stop = true;
+}
+
+int main(int argc, char ** argv)
+{
+    phonesim_config_t cfg;
+    PhoneSim phone;
+
+    PhoneSim::defaults(&cfg);
+    for(int x=1;x<argc;)
+    {
+        int used = phonesim_option(&cfg,argc-x,&argv[x]);
+        if(used == 0)
+        {
+            fprintf(stderr,"usage: %s [-v] [--delay ms] [--ack-timeout ms] [--retries n]\n"
+                           "       [--drop pct] [--corrupt pct] [--flood hz] [--baud bps]\n"
+                           "       [--frame-max bytes] [--seed n]\n",argv[0]);
+            return 1;
+        }
+        x += used;
+    }
+
+    if(!phone.open(&cfg))
+    {
+        perror("phonesim: pty");
+        return 1;
+    }
+    printf("%s\n",phone.slavePath());
+    fflush(stdout);
+
+    signal(SIGINT,on_signal);
+    signal(SIGTERM,on_signal);
+    phone.run(&g_stop);
+    phone.printStats(stderr);
+    return 0;
+}
+#endif
+
+//eof
@@ -0,0 +1,321 @@
+// fbustrace.cpp - Decode and replay FBus binary traces on Linux.
+//
+//  Created by Charles Pax for Pax Instruments, 2015-05-23
+//  Please visit http://paxinstruments.com/products/
+//  Released into the Public Domain
+//
+//  Build:
+//    g++ -O2 -I../host -I../nokia-phone-arduino-shield -o fbustrace fbustrace.cpp ../host/HostSerial.cpp ../nokia-phone-arduino-shield/FBus.cpp ../nokia-phone-arduino-shield/FBusGSM.cpp
+//
+//  A sketch built with FBUS_ENABLE_TRACE sends trace frames over its PC
+//  serial port with TraceDrain(), see FBusTrace.h.  Capture the port raw,
+//  text the sketch prints in between is skipped:
+//    stty -F /dev/ttyACM0 raw 115200 && cat /dev/ttyACM0 > capture.bin
+//
+//  Run:
+//    ./fbustrace decode capture.bin        every record, time and hex
+//    ./fbustrace rx capture.bin rx.bin     the bytes from the phone, for
+//                                          bench --file
+//    ./fbustrace replay capture.bin [--speed x] [--repeat n] [--frames]
+//
+//  replay feeds the bytes from the phone through the library's own
+//  processIncomingByte() and counts the frames it finds.  --speed 1 keeps
+//  the recorded timing, 10 is ten times faster, 0 (the default) runs flat
+//  out and reports how many times real time that is.  --frames prints
+//  every frame with the time it completed.
+
+#include "Arduino.h"
+#include "FBus.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+// One trace record, timestamps unwrapped to 64 bits
+typedef struct {
+    uint8_t tag;
+    uint64_t us;
+    std::vector<uint8_t> bytes;
+}trace_rec_t;
+
+typedef struct {
+    unsigned long frames;       // Trace frames with a good sum
+    unsigned long bad;          // Sync found but the sum was wrong
+    unsigned long gaps;         // Trace frames missing by seq
+    unsigned long lost;         // Records the sketch dropped
+    unsigned long skipped;      // Bytes between frames, text and noise
+}trace_stats_t;
+
+// Find the trace frames in a raw capture and split them into records
+static bool trace_load(const char * path, std::vector<trace_rec_t> * recs, trace_stats_t * st)
+{
+    std::vector<uint8_t> raw;
+    uint8_t buf[4096];
+    size_t n, x = 0;
+    uint32_t last_us = 0;
+    uint64_t high = 0;
+    int seq = -1;
+
+    FILE * f = fopen(path,"rb");
+    if(f == NULL)
+    {
+        perror(path);
+        return false;
+    }
+    while((n = fread(buf,1,sizeof(buf),f)) > 0) raw.insert(raw.end(),buf,buf+n);
+    fclose(f);
+    memset(st,0,sizeof(*st));
+
+    while(x + 5 <= raw.size())
+    {
+        if(raw[x] != FBUS_TRACE_SYNC0 || raw[x+1] != FBUS_TRACE_SYNC1)
+        {
+            st->skipped++;
+            x++;
+            continue;
+        }
+        // A length past the end is text that happened to hold the sync,
+        // or the file was cut, either way frames may follow inside it
+        uint8_t len = raw[x+3];
+        if(x + 5 + len > raw.size())
+        {
+            st->skipped++;
+            x++;
+            continue;
+        }
+        uint8_t sum = raw[x+2] + len;
+        for(unsigned k=0;k<len;k++) sum += raw[x+4+k];
+        if(sum != raw[x+4+len])
+        {
+            st->bad++;
+            st->skipped++;
+            x++;
+            continue;
+        }
+        if(seq >= 0 && raw[x+2] != (uint8_t)(seq+1)) st->gaps++;
+        seq = raw[x+2];
+        st->frames++;
+
+        // Records, the frame holds whole ones
+        const uint8_t * p = &raw[x+4];
+        const uint8_t * end = p + len;
+        while(p + FBUS_TRACE_HDR <= end)
+        {
+            trace_rec_t r;
+            uint32_t us = p[1] | (p[2] << 8) | (p[3] << 16) | ((uint32_t)p[4] << 24);
+            unsigned count = p[0] & FBUS_TRACE_COUNT;
+            if(p + FBUS_TRACE_HDR + count > end) break;
+            r.tag = p[0];
+            if(r.tag == FBUS_TRACE_LOST)
+            {
+                st->lost += us;
+                r.us = high | last_us;
+            }else
+            {
+                if(us < last_us) high += 1ULL << 32;
+                last_us = us;
+                r.us = high | us;
+            }
+            r.bytes.assign(p+FBUS_TRACE_HDR,p+FBUS_TRACE_HDR+count);
+            recs->push_back(r);
+            p += FBUS_TRACE_HDR + count;
+        }
+        x += 5 + len;
+    }
+    st->skipped += raw.size() - x;
+    return true;
+}
+
+static void print_stats(const char * path, const std::vector<trace_rec_t> & recs, const trace_stats_t & st)
+{
+    uint64_t span = recs.empty() ? 0 : recs.back().us - recs.front().us;
+    fprintf(stderr,"%s: records=%zu frames=%lu bad=%lu gaps=%lu lost=%lu skipped=%lu span_ms=%.1f\n",
+            path,recs.size(),st.frames,st.bad,st.gaps,st.lost,st.skipped,span/1000.0);
+    return;
+}
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// Feeds bytes to the parser of an FBus, a friend so it can
+class FBusTraceReplay {
+    public:
+        FBusTraceReplay(FBusCore & fb) : m_fb(fb), m_fails(0), frames(0), checksum_fail(0), resyncs(0)
+        {
+            memset(&m_pkt,0,sizeof(m_pkt));
+        }
+
+        // Parse one record's bytes, 'us' is printed with each frame.  The
+        // bytes of a frame that fails are parsed again as process() does,
+        // the next frame may have started inside it.
+        void feed(const std::vector<uint8_t> & bytes, uint64_t us, bool print)
+        {
+            uint8_t back[32];
+            uint16_t want;
+            uint8_t n;
+            for(size_t x=0;x<bytes.size();x++)
+            {
+                m_fb.processIncomingByte(bytes[x],&m_pkt);
+                done(us,print);
+                while(m_fb.m_rx_back_count)
+                {
+                    want = m_fb.rxWant(&m_pkt);
+                    if(want > sizeof(back)) want = sizeof(back);
+                    n = m_fb.rxBackRead(back,want,m_fb.m_rx.input_state == 0);
+                    m_fb.processIncoming(back,n,&m_pkt);
+                    if(done(us,print)) resyncs++;
+                }
+            }
+            return;
+        }
+
+        // Frames the parser dropped as too long
+        unsigned oversize()
+        {
+            return m_fb.m_rx_stats.oversize;
+        }
+
+
+    private:
+        // Count a frame the parser finished, true if it was good
+        bool done(uint64_t us, bool print)
+        {
+            // The parser counts failed frames itself
+            if(m_fb.m_rx_stats.checksum_fail != m_fails)
+            {
+                checksum_fail += (uint16_t)(m_fb.m_rx_stats.checksum_fail - m_fails);
+                m_fails = m_fb.m_rx_stats.checksum_fail;
+                if(print) printf("%12.6f checksum fail\n",us/1e6);
+            }
+            if(m_fb.m_rx.input_state != 0 || m_pkt.packet_state != PACKET_STATE_NEW) return false;
+            frames++;
+            if(print)
+                printf("%12.6f type=0x%02X len=%u togo=%u seq=0x%02X\n",us/1e6,m_pkt.MsgType,
+                       m_pkt.FrameLength,m_pkt.FramesToGo,m_pkt.SeqNo);
+            m_pkt.packet_state = PACKET_STATE_EMPTY;
+            return true;
+        }
+
+        FBusCore & m_fb;
+        packet_t m_pkt;
+        uint16_t m_fails;
+
+    public:
+        unsigned long frames;
+        unsigned long checksum_fail;
+        unsigned long resyncs;          // Frames found inside a dropped one
+};
+
+static int cmd_decode(const std::vector<trace_rec_t> & recs)
+{
+    for(size_t x=0;x<recs.size();x++)
+    {
+        const trace_rec_t & r = recs[x];
+        if(r.tag == FBUS_TRACE_LOST)
+        {
+            printf("%12.6f lost records\n",r.us/1e6);
+            continue;
+        }
+        printf("%12.6f %s",r.us/1e6,(r.tag & FBUS_TRACE_TX) ? "TX" : "RX");
+        for(size_t k=0;k<r.bytes.size();k++) printf(" %02X",r.bytes[k]);
+        printf("\n");
+    }
+    return 0;
+}
+
+static int cmd_rx(const std::vector<trace_rec_t> & recs, const char * out)
+{
+    FILE * f = fopen(out,"wb");
+    if(f == NULL)
+    {
+        perror(out);
+        return 1;
+    }
+    for(size_t x=0;x<recs.size();x++)
+        if(recs[x].tag != FBUS_TRACE_LOST && !(recs[x].tag & FBUS_TRACE_TX))
+            fwrite(recs[x].bytes.data(),1,recs[x].bytes.size(),f);
+    fclose(f);
+    return 0;
+}
+
+static int cmd_replay(const std::vector<trace_rec_t> & recs, double speed, unsigned repeat, bool print)
+{
+    FBus fb(Serial1);
+    FBusTraceReplay replay(fb);
+    unsigned long bytes = 0;
+    fb.initialize();
+
+    uint64_t first = recs.empty() ? 0 : recs.front().us;
+    uint64_t span = recs.empty() ? 0 : recs.back().us - first;
+    uint64_t start = now_us();
+    for(unsigned r=0;r<repeat;r++)
+    {
+        uint64_t t0 = now_us();
+        for(size_t x=0;x<recs.size();x++)
+        {
+            if(recs[x].tag == FBUS_TRACE_LOST || (recs[x].tag & FBUS_TRACE_TX)) continue;
+            if(speed > 0)
+            {
+                uint64_t due = t0 + (uint64_t)((recs[x].us - first)/speed);
+                uint64_t now = now_us();
+                if(due > now)
+                {
+                    struct timespec ts = { (time_t)((due-now)/1000000), (long)((due-now)%1000000)*1000 };
+                    nanosleep(&ts,NULL);
+                }
+            }
+            replay.feed(recs[x].bytes,recs[x].us,print && r == 0);
+            bytes += recs[x].bytes.size();
+        }
+    }
+    uint64_t took = now_us() - start;
+
+    printf("{\"replay\":\"rx\",\"bytes\":%lu,\"frames\":%lu,\"checksum_fail\":%lu,\"oversize\":%u,\"resyncs\":%lu,"
+           "\"trace_ms\":%.1f,\"replay_ms\":%.3f,\"x_realtime\":%.1f,\"ns_per_byte\":%.2f}\n",
+           bytes,replay.frames,replay.checksum_fail,replay.oversize(),replay.resyncs,span*repeat/1000.0,took/1000.0,
+           took ? (double)span*repeat/took : 0.0,bytes ? took*1000.0/bytes : 0.0);
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    std::vector<trace_rec_t> recs;
+    trace_stats_t st;
+    double speed = 0;
+    unsigned repeat = 1;
+    bool frames = false;
+
+    if(argc < 3 || (strcmp(argv[1],"decode") && strcmp(argv[1],"rx") && strcmp(argv[1],"replay")) ||
+       (!strcmp(argv[1],"rx") && argc != 4))
+    {
+        fprintf(stderr,"usage: %s decode capture.bin\n"
+                       "       %s rx capture.bin rx.bin\n"
+                       "       %s replay capture.bin [--speed x] [--repeat n] [--frames]\n",
+                argv[0],argv[0],argv[0]);
+        return 1;
+    }
+    for(int x=3;x<argc && !strcmp(argv[1],"replay");x++)
+    {
+        if(!strcmp(argv[x],"--speed") && x+1 < argc) speed = atof(argv[++x]);
+        else if(!strcmp(argv[x],"--repeat") && x+1 < argc) repeat = strtoul(argv[++x],NULL,0);
+        else if(!strcmp(argv[x],"--frames")) frames = true;
+        else
+        {
+            fprintf(stderr,"%s: unknown option %s\n",argv[0],argv[x]);
+            return 1;
+        }
+    }
+    if(repeat < 1) repeat = 1;
+
+    if(!trace_load(argv[2],&recs,&st)) return 1;
+    print_stats(argv[2],recs,st);
+    if(!strcmp(argv[1],"decode")) return cmd_decode(recs);
+    if(!strcmp(argv[1],"rx")) return cmd_rx(recs,argv[3]);
+    return cmd_replay(recs,speed,repeat,frames);
+}
+
+//eof